@@ -22,43 +22,677 @@ THE SOFTWARE.
 
 /*
 A Python extension that provides the GapBuffer type, a mutable sequence of
-characters, Unicode characters or integers. It implements Python's buffer and
+characters, Unicode characters or numbers. It implements Python's buffer and
 sequence protocols.
 */
 
+#define PY_SSIZE_T_CLEAN
 #include <Python.h>
 #include "structmember.h"
 
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#ifdef HAVE_FCNTL_H
+#include <fcntl.h>
+#endif
+#ifdef HAVE_MMAP
+#include <sys/mman.h>
+#endif
+#ifdef HAVE_WRITEV
+#include <sys/uio.h>
+#endif
+#ifdef MS_WINDOWS
+#include <io.h>
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <time.h>
+#endif
+#include "pythread.h"
+
+// Growth strategies used by _GapBuffer_RoomFor
+#define GROWTH_DEFAULT 0	// Add growSize which doubles as the buffer becomes larger
+#define GROWTH_GEOMETRIC 1	// Multiply the size by growthFactor
+#define GROWTH_FIXED 2	// Add growSize which stays constant
+
+// Allocators for the body used by _GapBuffer_ReAllocate
+#define ALLOC_AUTO 0	// realloc below GAPBUFFER_MAP_THRESHOLD and mmap above
+#define ALLOC_COPY 1	// Allocate a new body, copy everything and free the old body
+#define ALLOC_REALLOC 2	// Always realloc
+#define ALLOC_MMAP 3	// Always mmap, growing with mremap where available
+
+// Bodies at least this large are mapped when the allocator is ALLOC_AUTO
+#define GAPBUFFER_MAP_THRESHOLD (16 * 1024 * 1024)
+
+// Gap given to a loaded file beyond an eighth of its length
+#define GAPBUFFER_FILE_GAP (1024 * 1024)
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+// Moves, copies and searches of at least this many bytes release the GIL
+#define GAPBUFFER_NOGIL_THRESHOLD (256 * 1024)
+
+// Kinds of undo action
+#define UNDO_INSERT 0
+#define UNDO_DELETE 1
+
+// Items are characters ('c'), Unicode characters ('u') or numbers with the
+// type codes of the array module. Line indexes hold Py_ssize_t ('n').
+#define GAPBUFFER_NUMBER_TYPES "bBhHiIlLqQfd"
+#define GAPBUFFER_TEXT(t) (((t) == 'c') || ((t) == 'u'))
+#define GAPBUFFER_FLOAT(t) (((t) == 'f') || ((t) == 'd'))
+#define GAPBUFFER_SIGNED(t) (strchr("bhilqn", (t)) != NULL)
+
+typedef struct {
+	Py_ssize_t position;	// bytes
+	Py_ssize_t length;	// bytes
+	Py_ssize_t text;	// offset of the text in the arena
+	char type;
+	char startsGroup;	// undo and redo stop at group boundaries
+	char mayCoalesce;	// single item typing that following typing may extend
+}
+GapBufferAction;
+
+// Actions before current have been performed and those from current onwards
+// have been undone and may be redone. The text of every action is kept in one
+// arena so recording does not allocate for each action.
+typedef struct {
+	GapBufferAction *actions;
+	Py_ssize_t count;
+	Py_ssize_t allocated;
+	Py_ssize_t current;
+	char *arena;
+	Py_ssize_t arenaLength;
+	Py_ssize_t arenaAllocated;
+	Py_ssize_t limit;	// bytes of memory to use or -1 for no limit
+	int groupDepth;
+	int groupStart;	// the next action starts a group
+	int coalesce;	// the next action may be merged into the last
+	int applying;	// undo or redo is changing the buffer so do not record
+}
+GapBufferUndo;
+
+// Counters for the costly paths, kept once track_stats() is called so a
+// buffer without them only tests a pointer. Times are in seconds and the
+// time of an export includes moving the gap for it. Building with
+// GAPBUFFER_STATS defined as 0 removes the counting altogether.
+#ifndef GAPBUFFER_STATS
+#define GAPBUFFER_STATS 1
+#endif
+
+typedef struct {
+	Py_ssize_t gapMoves;
+	Py_ssize_t gapBytes;	// Bytes memmoved by gap moves
+	double gapTime;
+	Py_ssize_t reallocations;
+	double reallocationTime;
+	Py_ssize_t peakSize;
+	Py_ssize_t exports;
+	Py_ssize_t exportCollapses;	// Exports that moved the gap to the end
+	double exportTime;
+}
+GapBufferStats;
+
+#if GAPBUFFER_STATS
+#define _GapBuffer_Counting(self) ((self)->stats != NULL)
+#else
+#define _GapBuffer_Counting(self) 0
+#endif
+
+// Chunked storage keeps the items in a B+ tree whose leaves are small gap
+// buffers, so an edit anywhere moves at most one chunk of bytes. Interior
+// nodes record how many bytes lie under each of their children.
+#define CHUNK_BYTES 4096
+#define CHUNK_FILL (CHUNK_BYTES - CHUNK_BYTES / 8)	// Bytes put in a new chunk
+#define CHUNK_FANOUT 32
+#define CHUNK_DEPTH 32	// Filling a tree this deep would take 16 ** 31 chunks
+#define CHUNK_SPARES 64	// Freed chunks and nodes kept for reuse
+
+typedef struct {
+	Py_ssize_t length;
+	Py_ssize_t part1Length;	// The gap is CHUNK_BYTES - length bytes long
+	char body[CHUNK_BYTES];
+}
+GapBufferChunk;
+
+typedef struct {
+	int count;
+	int height;	// 0 when the children are chunks
+	Py_ssize_t lengths[CHUNK_FANOUT];
+	void *children[CHUNK_FANOUT];
+}
+GapBufferNode;
+
+// The nodes from the root down to a chunk and the index taken in each
+typedef struct {
+	GapBufferNode *nodes[CHUNK_DEPTH];
+	int indexes[CHUNK_DEPTH];
+	int depth;
+	Py_ssize_t start;	// Byte position of the chunk
+}
+GapBufferPath;
+
 typedef struct {
 	PyObject_HEAD
 	/* Type-specific fields go here. */
 	char *body;
-	int size;
-	int lengthBody;
-	int part1Length;
-	int gapLength;	/// invariant: gapLength == size - lengthBody
-	int growSize;
+	Py_ssize_t size;
+	Py_ssize_t lengthBody;
+	Py_ssize_t part1Length;
+	Py_ssize_t gapLength;	/// invariant: gapLength == size - lengthBody
+	Py_ssize_t growSize;
+	Py_ssize_t exportShape[1];	// shape of buffer protocol exports
+	int growthStrategy;
+	double growthFactor;
+	Py_ssize_t reallocations;
+	int allocator;
+	int bodyMapped;	// body was allocated by mmap rather than PyMem
+	int bodyFile;	// body is a private mapping of a file after an anonymous gap
 	int itemSize;
 	int bufferAppearence;
 	char itemType;
-	int lock;
+	int lock;	// Number of buffer exports, which stop the length changing
+	// Threads that work on the body without holding the GIL register first
+	// as one of any number of readers or as the single writer. Other threads
+	// wait for conflicting registrations to end before touching the buffer.
+	// These fields only change while holding the GIL.
+	Py_ssize_t readers;
+	unsigned long writer;	// Thread ident of the writer or 0
+	int writerDepth;	// The writer may register again
+	// Writers waiting for readers to finish. New readers wait behind them so
+	// that overlapping reads can not keep a writer out forever.
+	Py_ssize_t writersWaiting;
+	// Partitioned integer buffers defer suffix increments as a pending step
+	// in the manner of Scintilla's Partitioning class: items from stepStart
+	// onwards still have stepLength to be added to them.
+	int partitioned;
+	Py_ssize_t stepStart;
+	Py_ssize_t stepLength;
+	// Optional line index for text buffers: a partitioned GapBuffer holding
+	// the item position at which each line starts.
+	PyObject *lines;
+	PyObject *styles;	// Optional RunStyles kept the same length as the buffer
+	GapBufferUndo *undo;	// Optional undo history for text buffers
+	GapBufferStats *stats;	// Optional counters for tuning
+	struct _GapBufferSnapshot *snapshots;	// Attached copy-on-write snapshots
+	// Buffers constructed with backend="chunked" move their items into a tree
+	// of chunks on insertion. While root is set the body is not allocated and
+	// only lengthBody is meaningful. Operations that need every item in one
+	// block gather the tree back into the body.
+	int chunked;
+	GapBufferNode *root;
+	// Chunks and nodes allocated before an edit so that it can not fail,
+	// each linked to the next through its first bytes
+	void *spareChunks;
+	void *spareNodes;
+	Py_ssize_t spareChunkCount;
+	Py_ssize_t spareNodeCount;
+	// Compact Unicode buffers store each character in 1, 2 or 4 bytes, the
+	// narrowest that holds every character so far, as PEP 393 strings do.
+	// itemSize grows when a wider character is added.
+	int compact;
+	// Leading bytes of a UTF-8 sequence split across calls to feed_utf8
+	unsigned char pendingUtf8[4];
+	int pendingLength;
 }
 GapBuffer;
 
+// Copy-on-write snapshots share the body of their owner. Before the owner
+// writes to a range of its body, each attached snapshot saves its own copy of
+// the chunks that overlap the range. A snapshot is detached with a private
+// copy of its text when the owner reallocates or exports its body.
+#define SNAPSHOT_CHUNK (64 * 1024)
+
+typedef struct _GapBufferSnapshot {
+	PyObject_HEAD
+	GapBuffer *owner;	// NULL once detached
+	struct _GapBufferSnapshot *next;	// Next snapshot of the same owner
+	char *body;	// Owner's body, or a private copy once detached
+	Py_ssize_t size;
+	Py_ssize_t start;	// Logical byte offset of the view in the captured text
+	Py_ssize_t lengthBody;
+	Py_ssize_t part1Length;
+	Py_ssize_t gapLength;
+	int itemSize;
+	char itemType;
+	int compact;
+	char **chunks;	// Saved chunks of body, allocated on the first write
+	Py_ssize_t chunkCount;
+}
+GapBufferSnapshot;
+
+// Find the chunk holding byte position, recording the path to it. When before is
+// set a position at the end of a chunk is taken to be in that chunk rather
+// than the next, as is wanted for inserting.
+static GapBufferChunk *
+_GapBuffer_ChunkAt(GapBuffer* self, Py_ssize_t position, int before, GapBufferPath *path) {
+	GapBufferNode *node = self->root;
+	path->depth = 0;
+	path->start = 0;
+	for (;;) {
+		int i = 0;
+		while ((i < node->count - 1) &&
+		        ((position > node->lengths[i]) || (!before && (position == node->lengths[i])))) {
+			position -= node->lengths[i];
+			path->start += node->lengths[i];
+			i++;
+		}
+		path->nodes[path->depth] = node;
+		path->indexes[path->depth] = i;
+		path->depth++;
+		if (node->height == 0)
+			return (GapBufferChunk *)node->children[i];
+		node = (GapBufferNode *)node->children[i];
+	}
+}
+
 static char *
-_GapBuffer_at(GapBuffer* self, int position) {
-	if (position < self->part1Length) {
+_GapBuffer_at(GapBuffer* self, Py_ssize_t position) {
+	if (self->root) {
+		GapBufferPath path;
+		GapBufferChunk *chunk = _GapBuffer_ChunkAt(self, position, 0, &path);
+		position -= path.start;
+		if (position >= chunk->part1Length)
+			position += CHUNK_BYTES - chunk->length;
+		return chunk->body + position;
+	} else if (position < self->part1Length) {
 		return self->body + position;
 	} else {
 		return self->body + self->gapLength + position;
 	}
 }
 
+// Find the contiguous run of bytes that starts at position, returning its
+// length and setting *ptr to its first byte.
+static Py_ssize_t
+_GapBuffer_segment(GapBuffer* self, Py_ssize_t position, char **ptr) {
+	if (self->root) {
+		GapBufferPath path;
+		GapBufferChunk *chunk = _GapBuffer_ChunkAt(self, position, 0, &path);
+		position -= path.start;
+		if (position < chunk->part1Length) {
+			*ptr = chunk->body + position;
+			return chunk->part1Length - position;
+		}
+		*ptr = chunk->body + CHUNK_BYTES - chunk->length + position;
+		return chunk->length - position;
+	} else if (position < self->part1Length) {
+		*ptr = self->body + position;
+		return self->part1Length - position;
+	} else {
+		*ptr = self->body + self->gapLength + position;
+		return self->lengthBody - position;
+	}
+}
+
+// Find the contiguous run of bytes that ends at position, returning its
+// length and setting *ptr to its first byte.
+static Py_ssize_t
+_GapBuffer_segmentBefore(GapBuffer* self, Py_ssize_t position, char **ptr) {
+	if (self->root) {
+		GapBufferPath path;
+		GapBufferChunk *chunk = _GapBuffer_ChunkAt(self, position, 1, &path);
+		position -= path.start;
+		if (position <= chunk->part1Length) {
+			*ptr = chunk->body;
+			return position;
+		}
+		*ptr = chunk->body + chunk->part1Length + CHUNK_BYTES - chunk->length;
+		return position - chunk->part1Length;
+	} else if (position <= self->part1Length) {
+		*ptr = self->body;
+		return position;
+	} else {
+		*ptr = self->body + self->part1Length + self->gapLength;
+		return position - self->part1Length;
+	}
+}
+
+// Copy length bytes starting at position into destination
+static void
+_GapBuffer_copyout(GapBuffer* self, Py_ssize_t position, Py_ssize_t length, char *destination) {
+	while (length > 0) {
+		char *ptr;
+		Py_ssize_t run = _GapBuffer_segment(self, position, &ptr);
+		if (run > length)
+			run = length;
+		memcpy(destination, ptr, run);
+		destination += run;
+		position += run;
+		length -= run;
+	}
+}
+
+// Threads
+
+#ifdef MS_WINDOWS
+static SRWLOCK waitLock = SRWLOCK_INIT;
+static CONDITION_VARIABLE waitCondition = CONDITION_VARIABLE_INIT;
+#else
+static pthread_mutex_t waitLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t waitCondition = PTHREAD_COND_INITIALIZER;
+#endif
+static Py_ssize_t waiters = 0;	// Threads in _GapBuffer_Sleep, changed while holding the GIL
+
+// Whether another thread is registered in a way that stops the current thread
+// reading the buffer, or writing it if write is set. Reading also waits for
+// any writer that is waiting.
+static int
+_GapBuffer_Busy(GapBuffer *self, int write) {
+	if (self->writer != 0)
+		return self->writer != (unsigned long)PyThread_get_thread_ident();
+	if (write)
+		return self->readers > 0;
+	return self->writersWaiting > 0;
+}
+
+// Sleep without the GIL until some registration ends. The wait lock is taken
+// before the GIL is released so the wake up can not be missed.
+static void
+_GapBuffer_Sleep(void) {
+	PyThreadState *state;
+	waiters++;
+#ifdef MS_WINDOWS
+	AcquireSRWLockExclusive(&waitLock);
+	state = PyEval_SaveThread();
+	SleepConditionVariableSRW(&waitCondition, &waitLock, INFINITE, 0);
+	ReleaseSRWLockExclusive(&waitLock);
+#else
+	pthread_mutex_lock(&waitLock);
+	state = PyEval_SaveThread();
+	pthread_cond_wait(&waitCondition, &waitLock);
+	pthread_mutex_unlock(&waitLock);
+#endif
+	PyEval_RestoreThread(state);
+	waiters--;
+}
+
+static void
+_GapBuffer_Wake(void) {
+	if (waiters > 0) {
+#ifdef MS_WINDOWS
+		AcquireSRWLockExclusive(&waitLock);
+		WakeAllConditionVariable(&waitCondition);
+		ReleaseSRWLockExclusive(&waitLock);
+#else
+		pthread_mutex_lock(&waitLock);
+		pthread_cond_broadcast(&waitCondition);
+		pthread_mutex_unlock(&waitLock);
+#endif
+	}
+}
+
+// Wait until no other thread is registered in a conflicting way. Operations that
+// keep the GIL throughout call this before touching the buffer.
+static void
+_GapBuffer_Wait(GapBuffer *self, int write) {
+	if (!_GapBuffer_Busy(self, write))
+		return;
+	if (!write) {
+		while (_GapBuffer_Busy(self, 0))
+			_GapBuffer_Sleep();
+		return;
+	}
+	self->writersWaiting++;
+	while (_GapBuffer_Busy(self, 1))
+		_GapBuffer_Sleep();
+	// Wake the readers held back for this writer
+	if (--self->writersWaiting == 0)
+		_GapBuffer_Wake();
+}
+
+// Register the current thread as a reader or writer of the buffer after waiting
+// for conflicting registrations. Every _GapBuffer_Acquire is paired with a
+// _GapBuffer_Release. Readers must not register as writers of the same buffer.
+static void
+_GapBuffer_Acquire(GapBuffer *self, int write) {
+	unsigned long thread = (unsigned long)PyThread_get_thread_ident();
+	if (self->writer == thread) {
+		self->writerDepth++;
+		return;
+	}
+	_GapBuffer_Wait(self, write);
+	if (write) {
+		self->writer = thread;
+		self->writerDepth = 1;
+	} else {
+		self->readers++;
+	}
+}
+
+static void
+_GapBuffer_Release(GapBuffer *self) {
+	if (self->writer == (unsigned long)PyThread_get_thread_ident()) {
+		if (--self->writerDepth > 0)
+			return;
+		self->writer = 0;
+	} else if (--self->readers > 0) {
+		return;
+	}
+	_GapBuffer_Wake();
+}
+
+// Register with two buffers in address order so that threads working on the
+// same pair can not each wait for the other
+static void
+_GapBuffer_AcquirePair(GapBuffer *self, int write, GapBuffer *other, int otherWrite) {
+	if (self < other) {
+		_GapBuffer_Acquire(self, write);
+		_GapBuffer_Acquire(other, otherWrite);
+	} else {
+		_GapBuffer_Acquire(other, otherWrite);
+		_GapBuffer_Acquire(self, write);
+	}
+}
+
+// Release the GIL for work on bytes bytes of the body when that is large and the
+// current thread is registered with the buffer: as the writer, or as a reader
+// when the work only reads. Returns the state for _GapBuffer_Block or NULL.
+static PyThreadState *
+_GapBuffer_Unblock(GapBuffer *self, Py_ssize_t bytes, int write) {
+	if ((bytes >= GAPBUFFER_NOGIL_THRESHOLD) &&
+	        ((self->writer == (unsigned long)PyThread_get_thread_ident()) ||
+	         (!write && (self->writer == 0) && (self->readers > 0))))
+		return PyEval_SaveThread();
+	return NULL;
+}
+
+static void
+_GapBuffer_Block(PyThreadState *state) {
+	if (state != NULL)
+		PyEval_RestoreThread(state);
+}
+
 static PyTypeObject gapbuffer_GapBufferType;
+static PyTypeObject gapbuffer_GapBufferIteratorType;
+
+// Copy length bytes starting at logical byte position of a snapshot, taking
+// each chunk from its saved copy if the owner has since written to it.
+static void
+_GapBuffer_SnapshotCopyout(GapBufferSnapshot *snapshot, Py_ssize_t position, Py_ssize_t length, char *destination) {
+	position += snapshot->start;
+	while (length > 0) {
+		Py_ssize_t physical = position;
+		Py_ssize_t run = snapshot->part1Length - position;
+		Py_ssize_t chunk, offset;
+		const char *ptr;
+		if (position >= snapshot->part1Length) {
+			physical += snapshot->gapLength;
+			run = snapshot->size - physical;
+		}
+		chunk = physical / SNAPSHOT_CHUNK;
+		offset = physical % SNAPSHOT_CHUNK;
+		if (run > SNAPSHOT_CHUNK - offset)
+			run = SNAPSHOT_CHUNK - offset;
+		if (run > length)
+			run = length;
+		if (snapshot->chunks && snapshot->chunks[chunk])
+			ptr = snapshot->chunks[chunk] + offset;
+		else
+			ptr = snapshot->body + physical;
+		memcpy(destination, ptr, run);
+		destination += run;
+		position += run;
+		length -= run;
+	}
+}
+
+static void
+_GapBuffer_SnapshotFreeChunks(GapBufferSnapshot *snapshot) {
+	if (snapshot->chunks != NULL) {
+		Py_ssize_t chunk;
+		for (chunk = 0; chunk < snapshot->chunkCount; chunk++)
+			PyMem_Free(snapshot->chunks[chunk]);
+		PyMem_Free(snapshot->chunks);
+		snapshot->chunks = NULL;
+	}
+}
+
+// Remove a snapshot from its owner's list and drop the reference to the owner
+static void
+_GapBuffer_SnapshotUnlink(GapBufferSnapshot *snapshot) {
+	GapBuffer *owner = snapshot->owner;
+	GapBufferSnapshot **link = &owner->snapshots;
+	while (*link != NULL) {
+		if (*link == snapshot) {
+			*link = snapshot->next;
+			break;
+		}
+		link = &(*link)->next;
+	}
+	snapshot->next = NULL;
+	snapshot->owner = NULL;
+	Py_DECREF(owner);
+}
+
+// Give a snapshot a private contiguous copy of its text so that it no longer
+// depends on its owner's body. If that copy can not be allocated the snapshot
+// is left with a NULL body and raises MemoryError when read.
+static void
+_GapBuffer_SnapshotDetach(GapBufferSnapshot *snapshot) {
+	char *copy = PyMem_New(char, snapshot->lengthBody + 1);
+	if (copy != NULL)
+		_GapBuffer_SnapshotCopyout(snapshot, 0, snapshot->lengthBody, copy);
+	_GapBuffer_SnapshotFreeChunks(snapshot);
+	snapshot->body = copy;
+	snapshot->size = snapshot->lengthBody;
+	snapshot->start = 0;
+	snapshot->part1Length = snapshot->lengthBody;
+	snapshot->gapLength = 0;
+	_GapBuffer_SnapshotUnlink(snapshot);
+}
+
+static void
+_GapBuffer_DetachSnapshots(GapBuffer *self) {
+	while (self->snapshots != NULL)
+		_GapBuffer_SnapshotDetach(self->snapshots);
+}
+
+// Whether any of the physical bytes [from, to) of the captured body are part
+// of the range a snapshot shows.
+static int
+_GapBuffer_SnapshotSees(const GapBufferSnapshot *snapshot, Py_ssize_t from, Py_ssize_t to) {
+	Py_ssize_t first = snapshot->start;
+	Py_ssize_t last = snapshot->start + snapshot->lengthBody;
+	if (first < snapshot->part1Length) {
+		Py_ssize_t end = (last < snapshot->part1Length) ? last : snapshot->part1Length;
+		if ((from < end) && (to > first))
+			return 1;
+	}
+	if (last > snapshot->part1Length) {
+		Py_ssize_t begin = (first > snapshot->part1Length) ? first : snapshot->part1Length;
+		if ((from < last + snapshot->gapLength) && (to > begin + snapshot->gapLength))
+			return 1;
+	}
+	return 0;
+}
+
+// Called before bytes [start, end) of the body are overwritten: each attached
+// snapshot saves the chunks overlapping the range that it can still see.
+static void
+_GapBuffer_Touch(GapBuffer *self, Py_ssize_t start, Py_ssize_t end) {
+	GapBufferSnapshot *snapshot = self->snapshots;
+	while (snapshot != NULL) {
+		GapBufferSnapshot *next = snapshot->next;
+		Py_ssize_t limit = (end < snapshot->size) ? end : snapshot->size;
+		Py_ssize_t chunk;
+		if ((start >= limit) || !_GapBuffer_SnapshotSees(snapshot, start, limit)) {
+			snapshot = next;
+			continue;
+		}
+		// Copying a view shorter than a chunk costs less than saving a chunk
+		if ((snapshot->lengthBody <= SNAPSHOT_CHUNK) &&
+		        (snapshot->lengthBody < snapshot->size - snapshot->gapLength)) {
+			_GapBuffer_SnapshotDetach(snapshot);
+			snapshot = next;
+			continue;
+		}
+		if (snapshot->chunks == NULL) {
+			snapshot->chunks = PyMem_New(char *, snapshot->chunkCount);
+			if (snapshot->chunks == NULL) {
+				_GapBuffer_SnapshotDetach(snapshot);
+				snapshot = next;
+				continue;
+			}
+			memset(snapshot->chunks, 0, snapshot->chunkCount * sizeof(char *));
+		}
+		for (chunk = start / SNAPSHOT_CHUNK; chunk * SNAPSHOT_CHUNK < limit; chunk++) {
+			Py_ssize_t chunkStart = chunk * SNAPSHOT_CHUNK;
+			Py_ssize_t chunkLength = snapshot->size - chunkStart;
+			if (chunkLength > SNAPSHOT_CHUNK)
+				chunkLength = SNAPSHOT_CHUNK;
+			// Chunks wholly outside the snapshot's range hold nothing it can see
+			if ((snapshot->chunks[chunk] != NULL) ||
+			        !_GapBuffer_SnapshotSees(snapshot, chunkStart, chunkStart + chunkLength))
+				continue;
+			snapshot->chunks[chunk] = PyMem_New(char, chunkLength);
+			if (snapshot->chunks[chunk] == NULL) {
+				_GapBuffer_SnapshotDetach(snapshot);
+				break;
+			}
+			memcpy(snapshot->chunks[chunk], snapshot->body + chunkStart, chunkLength);
+		}
+		snapshot = next;
+	}
+}
+
+static void
+_GapBuffer_FreeBody(GapBuffer *self) {
+#ifdef HAVE_MMAP
+	if (self->bodyMapped) {
+		munmap(self->body, self->size);
+	} else
+#endif
+		PyMem_Del(self->body);
+	self->body = NULL;
+	self->bodyMapped = 0;
+	self->bodyFile = 0;
+}
+
+static void
+_GapBuffer_UndoFree(GapBuffer *self) {
+	if (self->undo != NULL) {
+		PyMem_Free(self->undo->actions);
+		PyMem_Free(self->undo->arena);
+		PyMem_Free(self->undo);
+		self->undo = NULL;
+	}
+}
+
+static void _GapBuffer_FreeChunks(GapBuffer *self);
+static void _GapBuffer_StylesFree(GapBuffer *self);
 
 static void
 GapBuffer_dealloc(GapBuffer* self) {
-	PyMem_Del(self->body);
+	_GapBuffer_FreeBody(self);
+	_GapBuffer_FreeChunks(self);
+	Py_XDECREF(self->lines);
+	_GapBuffer_StylesFree(self);
+	_GapBuffer_UndoFree(self);
+	PyMem_Free(self->stats);
 	Py_TYPE(self)->tp_free((PyObject*)self);
 }
 
@@ -67,6 +701,12 @@ _GapBuffer_InitFields(GapBuffer *self) {
 	if (self != NULL) {
 		self->body = NULL;
 		self->growSize = 8;
+		self->growthStrategy = GROWTH_DEFAULT;
+		self->growthFactor = 2.0;
+		self->reallocations = 0;
+		self->allocator = ALLOC_AUTO;
+		self->bodyMapped = 0;
+		self->bodyFile = 0;
 		self->size = 0;
 		self->lengthBody = 0;
 		self->part1Length = 0;
@@ -75,6 +715,26 @@ _GapBuffer_InitFields(GapBuffer *self) {
 		self->itemType = 'c';
 		self->bufferAppearence = 0;
 		self->lock = 0;
+		self->readers = 0;
+		self->writer = 0;
+		self->writerDepth = 0;
+		self->writersWaiting = 0;
+		self->partitioned = 0;
+		self->stepStart = 0;
+		self->stepLength = 0;
+		self->lines = NULL;
+		self->styles = NULL;
+		self->undo = NULL;
+		self->stats = NULL;
+		self->snapshots = NULL;
+		self->chunked = 0;
+		self->root = NULL;
+		self->spareChunks = NULL;
+		self->spareNodes = NULL;
+		self->spareChunkCount = 0;
+		self->spareNodeCount = 0;
+		self->compact = 0;
+		self->pendingLength = 0;
 	}
 }
 
@@ -89,463 +749,6743 @@ GapBuffer_new(PyTypeObject *type, PyObject *args, PyObject *kwds) {
 	return (PyObject *)self;
 }
 
-static void _GapBuffer_GapTo(GapBuffer *self, int position) {
+// Monotonic time in seconds for the statistics
+static double
+_GapBuffer_Clock(void) {
+#ifdef MS_WINDOWS
+	LARGE_INTEGER count;
+	LARGE_INTEGER frequency;
+	QueryPerformanceCounter(&count);
+	QueryPerformanceFrequency(&frequency);
+	return (double)count.QuadPart / (double)frequency.QuadPart;
+#else
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec + now.tv_nsec * 1e-9;
+#endif
+}
+
+static void _GapBuffer_GapTo(GapBuffer *self, Py_ssize_t position) {
+	PyThreadState *state;
+	double started = 0.0;
 	if (position != self->part1Length) {
+		if (_GapBuffer_Counting(self))
+			started = _GapBuffer_Clock();
 		if (position < self->part1Length) {
+			if (self->snapshots)
+				_GapBuffer_Touch(self, position + self->gapLength, self->part1Length + self->gapLength);
+			state = _GapBuffer_Unblock(self, self->part1Length - position, 1);
 			memmove(
 			    self->body + position + self->gapLength,
 			    self->body + position,
 			    self->part1Length - position);
+			_GapBuffer_Block(state);
 		} else {	// position > part1Length
+			if (self->snapshots)
+				_GapBuffer_Touch(self, self->part1Length, position);
+			state = _GapBuffer_Unblock(self, position - self->part1Length, 1);
 			memmove(
 			    self->body + self->part1Length,
 			    self->body + self->part1Length + self->gapLength,
 			    position - self->part1Length);
+			_GapBuffer_Block(state);
+		}
+		if (_GapBuffer_Counting(self)) {
+			self->stats->gapMoves++;
+			self->stats->gapBytes += (position < self->part1Length) ?
+			        self->part1Length - position : position - self->part1Length;
+			self->stats->gapTime += _GapBuffer_Clock() - started;
 		}
 		self->part1Length = position;
 	}
 }
 
-static void _GapBuffer_ReAllocate(GapBuffer *self, int newSize) {
-	// Move the gap to the end
-	char *newBody = NULL;
-	_GapBuffer_GapTo(self, self->lengthBody);
-	newBody = PyMem_New(char, newSize);
-	if ((self->size != 0) && (self->body != NULL)) {
-		memmove(newBody, self->body, self->lengthBody);
-		PyMem_Del(self->body);
-	}
-	self->body = newBody;
-	self->gapLength += newSize - self->size;
-	self->size = newSize;
-}
+static int _GapBuffer_Flatten(GapBuffer *self);
 
-static void _GapBuffer_RoomFor(GapBuffer *self, int insertionLength) {
-	if (self->gapLength <= insertionLength) {
-		if (self->growSize * 6 < self->size)
-			self->growSize *= 2;
-		_GapBuffer_ReAllocate(self, self->size + insertionLength + self->growSize);
+// Move the gap to the end so the items are contiguous. Fails with BufferError if
+// the gap can not move because segments of the buffer are exported.
+static int _GapBuffer_Contiguous(GapBuffer *self) {
+	if (self->root)
+		return _GapBuffer_Flatten(self);
+	if (self->part1Length != self->lengthBody) {
+		if (self->lock) {
+			PyErr_SetString(PyExc_BufferError, "Object is locked.");
+			return -1;
+		}
+		_GapBuffer_GapTo(self, self->lengthBody);
 	}
+	return 0;
 }
 
-static void
-_GapBuffer_insertarray(GapBuffer* self, int position, const char *text, int insertLength) {
-	_GapBuffer_RoomFor(self, insertLength);
-	_GapBuffer_GapTo(self, position);
-	memmove(self->body + self->part1Length, text, insertLength);
-	self->lengthBody += insertLength;
-	self->part1Length += insertLength;
-	self->gapLength -= insertLength;
+#ifdef HAVE_MMAP
+
+static Py_ssize_t _GapBuffer_PageRound(Py_ssize_t size) {
+	Py_ssize_t pageSize = (Py_ssize_t)sysconf(_SC_PAGESIZE);
+	if (size > PY_SSIZE_T_MAX - pageSize)
+		return size;
+	return (size + pageSize - 1) / pageSize * pageSize;
 }
 
-static int
-_GapBuffer_insertiter(GapBuffer* self, int position, PyObject *sequence) {
-	PyObject *value;
-	PyObject *iter;
-	iter = PyObject_GetIter(sequence);
-	if (iter == NULL) {
-		PyErr_SetString(PyExc_TypeError, "GapBuffer: argument not iterable");
-		return 1;
+// Move the body into a mapping of newSize bytes, preserving the first
+// min(size, newSize) bytes. Mapped bodies are grown with mremap so the kernel
+// moves pages rather than copying their contents.
+static char *_GapBuffer_MapBlock(GapBuffer *self, Py_ssize_t newSize) {
+	char *newBody;
+	PyThreadState *state;
+#if defined(HAVE_MREMAP) && defined(MREMAP_MAYMOVE)
+	// A loaded file is two mappings which mremap can not move together
+	if (self->bodyMapped && !self->bodyFile) {
+		state = _GapBuffer_Unblock(self, newSize, 1);
+		newBody = mremap(self->body, self->size, newSize, MREMAP_MAYMOVE);
+		_GapBuffer_Block(state);
+		return (newBody == MAP_FAILED) ? NULL : newBody;
 	}
-	while ((value = PyIter_Next(iter)) != NULL) {
-		int ival = PyLong_AsLong(value);
-		if ((ival == -1) && PyErr_Occurred()) {
-			PyErr_SetString(PyExc_TypeError, "GapBuffer: argument wrong type");
-			return 1;
+#endif
+	newBody = mmap(NULL, newSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (newBody == MAP_FAILED)
+		return NULL;
+	if (self->body != NULL) {
+		state = _GapBuffer_Unblock(self, self->size, 1);
+		memcpy(newBody, self->body, (self->size < newSize) ? self->size : newSize);
+		_GapBuffer_Block(state);
+	}
+	_GapBuffer_FreeBody(self);
+	self->bodyMapped = 1;
+	return newBody;
+}
+
+#endif
+
+// Resize the allocation to newSize bytes, preserving the first min(size, newSize)
+// bytes. Returns NULL on failure with the old body still valid.
+static char *_GapBuffer_ResizeBlock(GapBuffer *self, Py_ssize_t newSize, int map) {
+	char *newBody;
+#ifdef HAVE_MMAP
+	if (map)
+		return _GapBuffer_MapBlock(self, newSize);
+	if (self->bodyMapped) {
+		newBody = PyMem_New(char, newSize);
+		if (newBody != NULL) {
+			PyThreadState *state = _GapBuffer_Unblock(self, self->size, 1);
+			memcpy(newBody, self->body, (self->size < newSize) ? self->size : newSize);
+			_GapBuffer_Block(state);
+			_GapBuffer_FreeBody(self);
 		}
-		_GapBuffer_insertarray(self, position * self->itemSize, (const char *)&ival, self->itemSize);
-		Py_DECREF(value);
-		position++;
+		return newBody;
 	}
-	Py_DECREF(iter);
-	return 0;
+#endif
+	return (char *)PyMem_Realloc(self->body, newSize);
 }
 
-static int
-GapBuffer_init(GapBuffer *self, PyObject *args, PyObject *kwds) {
-	PyObject *value;
+// Move bytes of the body between allocations, releasing the GIL if there are many
+static void _GapBuffer_MoveBytes(GapBuffer *self, char *destination, const char *source, Py_ssize_t length) {
+	PyThreadState *state = _GapBuffer_Unblock(self, length, 1);
+	memmove(destination, source, length);
+	_GapBuffer_Block(state);
+}
 
-	_GapBuffer_InitFields(self);
+// Returns -1 with MemoryError set if the new body can not be allocated,
+// leaving the buffer contents intact. The new body must leave room for a gap.
+static int _GapBuffer_ReAllocate(GapBuffer *self, Py_ssize_t newSize) {
+	char *newBody = NULL;
+	Py_ssize_t lengthPart2 = self->lengthBody - self->part1Length;
+	int map = 0;
+	double started = _GapBuffer_Counting(self) ? _GapBuffer_Clock() : 0.0;
 
-	if (!PyArg_ParseTuple(args, "|O:GapBuffer", &value)) {
+	if (newSize <= self->lengthBody) {
+		PyErr_SetString(PyExc_SystemError, "GapBuffer: new size does not hold the items");
 		return -1;
 	}
-
-	if (value && PyUnicode_Check(value)) {
-		self->itemType = 'u';
-		self->itemSize = sizeof(Py_UNICODE);
-		_GapBuffer_insertarray(self, 0, (char *)PyUnicode_AS_UNICODE(value),
-		        PyUnicode_GET_SIZE(value) * self->itemSize);
-	} else if (!value || PyBytes_Check(value)) {
-		self->itemType = 'c';
-		self->itemSize = 1;
-		if (value) {
-			_GapBuffer_insertarray(self, 0, PyBytes_AS_STRING(value),
-			        PyBytes_GET_SIZE(value));
+	_GapBuffer_Acquire(self, 1);
+	_GapBuffer_DetachSnapshots(self);
+	if (self->allocator == ALLOC_COPY) {
+		newBody = PyMem_New(char, newSize);
+		if (newBody == NULL) {
+			_GapBuffer_Release(self);
+			PyErr_NoMemory();
+			return -1;
+		}
+		// Move the gap to the end
+		_GapBuffer_GapTo(self, self->lengthBody);
+		if ((self->size != 0) && (self->body != NULL)) {
+			_GapBuffer_MoveBytes(self, newBody, self->body, self->lengthBody);
 		}
+		_GapBuffer_FreeBody(self);
 	} else {
-		// Assume iterable
-		self->itemType = 'i';
-		self->itemSize = sizeof(int);
-		_GapBuffer_insertiter(self, 0, value);
+#ifdef HAVE_MMAP
+		map = (self->allocator == ALLOC_MMAP) ||
+		        ((self->allocator == ALLOC_AUTO) && (newSize >= GAPBUFFER_MAP_THRESHOLD));
+		if (map)
+			newSize = _GapBuffer_PageRound(newSize);
+#endif
+		// Rather than moving the gap to the end, only part2 is moved so that
+		// it finishes at the end of the allocation.
+		if (newSize < self->size) {
+			_GapBuffer_MoveBytes(self, self->body + newSize - lengthPart2,
+			        self->body + self->size - lengthPart2, lengthPart2);
+		}
+		newBody = _GapBuffer_ResizeBlock(self, newSize, map);
+		if (newBody == NULL) {
+			if (newSize < self->size) {
+				_GapBuffer_MoveBytes(self, self->body + self->size - lengthPart2,
+				        self->body + newSize - lengthPart2, lengthPart2);
+			}
+			_GapBuffer_Release(self);
+			PyErr_NoMemory();
+			return -1;
+		}
+		if (newSize > self->size) {
+			_GapBuffer_MoveBytes(self, newBody + newSize - lengthPart2,
+			        newBody + self->size - lengthPart2, lengthPart2);
+		}
 	}
-
+	self->body = newBody;
+	self->gapLength += newSize - self->size;
+	self->size = newSize;
+	self->reallocations++;
+	if (_GapBuffer_Counting(self)) {
+		self->stats->reallocations++;
+		self->stats->reallocationTime += _GapBuffer_Clock() - started;
+		if (self->stats->peakSize < newSize)
+			self->stats->peakSize = newSize;
+	}
+	_GapBuffer_Release(self);
 	return 0;
 }
 
-// TODO stop exposing these - they are only for debugging
-static PyMemberDef GapBuffer_members[] = {
-            {"size", T_INT, offsetof(GapBuffer, size), READONLY, "Allocated size"},
-            {"part1Length", T_INT, offsetof(GapBuffer, part1Length), READONLY, "Length before gap"},
-            {"gapLength", T_INT, offsetof(GapBuffer, gapLength), READONLY, "Length of gap"},
-            {"growSize", T_INT, offsetof(GapBuffer, growSize), READONLY, "Size to grow"},
-            {"itemsize", T_INT, offsetof(GapBuffer, itemSize), READONLY, "Size of each item"},
-            {"typecode", T_CHAR, offsetof(GapBuffer, itemType), READONLY, "Type code of each item"},
-            {"bufferAppearence", T_INT, offsetof(GapBuffer, bufferAppearence), 0, "Single or multiple segments"},
-            {NULL}  /* Sentinel */
-        };
+// Returns -1 with an exception set if the buffer can not be grown to
+// accommodate insertionLength more bytes.
+static int _GapBuffer_RoomFor(GapBuffer *self, Py_ssize_t insertionLength) {
+	Py_ssize_t newSize;
+	if (self->gapLength <= insertionLength) {
+		if ((self->growthStrategy == GROWTH_DEFAULT) && (self->growSize * 6 < self->size))
+			self->growSize *= 2;
+		if (insertionLength > PY_SSIZE_T_MAX - self->size - self->growSize) {
+			PyErr_SetString(PyExc_OverflowError, "GapBuffer: size would overflow");
+			return -1;
+		}
+		newSize = self->size + insertionLength + self->growSize;
+		if (self->growthStrategy == GROWTH_GEOMETRIC) {
+			double scaled = self->size * self->growthFactor;
+			if (scaled >= (double)PY_SSIZE_T_MAX)
+				scaled = (double)PY_SSIZE_T_MAX;
+			if (newSize < (Py_ssize_t)scaled)
+				newSize = (Py_ssize_t)scaled;
+		}
+		return _GapBuffer_ReAllocate(self, newSize);
+	}
+	return 0;
+}
 
-static PyObject *
-GapBuffer_insert(GapBuffer* self, PyObject *args) {
-	char *data;
-	int positionToInsert;
-	Py_ssize_t insertLength;
-	PyObject *sequence = NULL;
+// Chunked storage
 
-	if (self->lock) {
-		PyErr_SetString(PyExc_BufferError, "Object is locked.");
-		return NULL;
+static void
+_GapBuffer_ChunkGapTo(GapBufferChunk *chunk, Py_ssize_t position) {
+	Py_ssize_t gapLength = CHUNK_BYTES - chunk->length;
+	if (position < chunk->part1Length) {
+		memmove(chunk->body + position + gapLength, chunk->body + position,
+		        chunk->part1Length - position);
+	} else if (position > chunk->part1Length) {
+		memmove(chunk->body + chunk->part1Length, chunk->body + chunk->part1Length + gapLength,
+		        position - chunk->part1Length);
 	}
+	chunk->part1Length = position;
+}
 
-	if (self->itemType == 'c') {
-		if (!PyArg_ParseTuple(args, "is#:insert", &positionToInsert, &data, &insertLength)) {
-			return NULL;
-		}
-	} else if (self->itemType == 'u') {
-		if (!PyArg_ParseTuple(args, "iu#:insert", &positionToInsert, &data, &insertLength)) {
+// Add delta bytes to the lengths recorded for the chunk at the end of path
+static void
+_GapBuffer_PathAdd(GapBufferPath *path, Py_ssize_t delta) {
+	int depth;
+	for (depth = 0; depth < path->depth; depth++)
+		path->nodes[depth]->lengths[path->indexes[depth]] += delta;
+}
+
+static Py_ssize_t
+_GapBuffer_NodeLength(GapBufferNode *node) {
+	Py_ssize_t length = 0;
+	int i;
+	for (i = 0; i < node->count; i++)
+		length += node->lengths[i];
+	return length;
+}
+
+static void *
+_GapBuffer_TakeSpare(void **spares, Py_ssize_t *count) {
+	void *item = *spares;
+	*spares = *(void **)item;
+	(*count)--;
+	return item;
+}
+
+static void
+_GapBuffer_PutSpare(void **spares, Py_ssize_t *count, void *item) {
+	if (*count >= CHUNK_SPARES) {
+		PyMem_Free(item);
+	} else {
+		*(void **)item = *spares;
+		*spares = item;
+		(*count)++;
+	}
+}
+
+static void
+_GapBuffer_FreeSpares(void **spares, Py_ssize_t *count, Py_ssize_t keep) {
+	while (*count > keep)
+		PyMem_Free(_GapBuffer_TakeSpare(spares, count));
+}
+
+// Allocate the chunks and nodes that inserting length bytes at edits places
+// could need, so that the insertions can not fail. Each insertion may split the
+// chunk it lands in and every full node above it.
+static int
+_GapBuffer_ChunksFor(GapBuffer *self, Py_ssize_t length, Py_ssize_t edits) {
+	Py_ssize_t chunks = length / CHUNK_FILL + 3 * edits;
+	Py_ssize_t nodes = chunks / (CHUNK_FANOUT / 2 - 1) + (self->root->height + 3) * edits;
+	while (self->spareChunkCount < chunks) {
+		void *chunk = PyMem_Malloc(sizeof(GapBufferChunk));
+		if (chunk == NULL) {
+			PyErr_NoMemory();
+			return -1;
+		}
+		*(void **)chunk = self->spareChunks;
+		self->spareChunks = chunk;
+		self->spareChunkCount++;
+	}
+	while (self->spareNodeCount < nodes) {
+		void *node = PyMem_Malloc(sizeof(GapBufferNode));
+		if (node == NULL) {
+			PyErr_NoMemory();
+			return -1;
+		}
+		*(void **)node = self->spareNodes;
+		self->spareNodes = node;
+		self->spareNodeCount++;
+	}
+	return 0;
+}
+
+// Insert child, holding length bytes, at index in the node at depth of path,
+// splitting that node and its ancestors when full. The ancestors' lengths must
+// already include length.
+static void
+_GapBuffer_NodeInsert(GapBuffer *self, GapBufferPath *path, int depth, int index,
+        void *child, Py_ssize_t length) {
+	GapBufferNode *node = path->nodes[depth];
+	GapBufferNode *sibling;
+	int half = CHUNK_FANOUT / 2;
+
+	if (node->count == CHUNK_FANOUT) {
+		sibling = (GapBufferNode *)_GapBuffer_TakeSpare(&self->spareNodes, &self->spareNodeCount);
+		sibling->height = node->height;
+		sibling->count = CHUNK_FANOUT - half;
+		memcpy(sibling->lengths, node->lengths + half, sibling->count * sizeof(Py_ssize_t));
+		memcpy(sibling->children, node->children + half, sibling->count * sizeof(void *));
+		node->count = half;
+		if (index > half) {
+			path->nodes[depth] = sibling;
+			_GapBuffer_NodeInsert(self, path, depth, index - half, child, length);
+		} else {
+			_GapBuffer_NodeInsert(self, path, depth, index, child, length);
+		}
+		if (depth == 0) {
+			GapBufferNode *root = (GapBufferNode *)_GapBuffer_TakeSpare(
+			        &self->spareNodes, &self->spareNodeCount);
+			root->height = node->height + 1;
+			root->count = 2;
+			root->lengths[0] = _GapBuffer_NodeLength(node);
+			root->children[0] = node;
+			root->lengths[1] = _GapBuffer_NodeLength(sibling);
+			root->children[1] = sibling;
+			self->root = root;
+		} else {
+			GapBufferNode *parent = path->nodes[depth - 1];
+			int parentIndex = path->indexes[depth - 1];
+			Py_ssize_t siblingLength = _GapBuffer_NodeLength(sibling);
+			parent->lengths[parentIndex] -= siblingLength;
+			_GapBuffer_NodeInsert(self, path, depth - 1, parentIndex + 1, sibling, siblingLength);
+		}
+		return;
+	}
+	memmove(node->lengths + index + 1, node->lengths + index, (node->count - index) * sizeof(Py_ssize_t));
+	memmove(node->children + index + 1, node->children + index, (node->count - index) * sizeof(void *));
+	node->lengths[index] = length;
+	node->children[index] = child;
+	node->count++;
+}
+
+// Remove the empty child at the end of path, then any nodes left empty
+static void
+_GapBuffer_NodeRemove(GapBuffer *self, GapBufferPath *path, int depth) {
+	GapBufferNode *node = path->nodes[depth];
+	int index = path->indexes[depth];
+	if (node->height == 0)
+		_GapBuffer_PutSpare(&self->spareChunks, &self->spareChunkCount, node->children[index]);
+	else
+		_GapBuffer_PutSpare(&self->spareNodes, &self->spareNodeCount, node->children[index]);
+	node->count--;
+	memmove(node->lengths + index, node->lengths + index + 1, (node->count - index) * sizeof(Py_ssize_t));
+	memmove(node->children + index, node->children + index + 1, (node->count - index) * sizeof(void *));
+	if ((node->count == 0) && (depth > 0)) {
+		_GapBuffer_NodeRemove(self, path, depth - 1);
+		return;
+	}
+	// A root with a single child is not needed
+	while ((self->root->height > 0) && (self->root->count == 1)) {
+		GapBufferNode *root = self->root;
+		self->root = (GapBufferNode *)root->children[0];
+		_GapBuffer_PutSpare(&self->spareNodes, &self->spareNodeCount, root);
+	}
+}
+
+// Append length bytes at position, which is the end of a chunk: first into that
+// chunk until it holds CHUNK_FILL bytes, then into new chunks that follow it.
+// The chunks must have been reserved by _GapBuffer_ChunksFor.
+static void
+_GapBuffer_TreeAppend(GapBuffer *self, Py_ssize_t position, const char *text, Py_ssize_t length) {
+	GapBufferPath path;
+	GapBufferChunk *chunk = _GapBuffer_ChunkAt(self, position, 1, &path);
+	Py_ssize_t run = CHUNK_FILL - chunk->length;
+	int depth;
+
+	if (run > length)
+		run = length;
+	if (run > 0) {
+		_GapBuffer_ChunkGapTo(chunk, chunk->length);
+		memcpy(chunk->body + chunk->length, text, run);
+		chunk->length += run;
+		chunk->part1Length += run;
+		_GapBuffer_PathAdd(&path, run);
+		position += run;
+		text += run;
+		length -= run;
+	}
+	while (length > 0) {
+		run = (length < CHUNK_FILL) ? length : CHUNK_FILL;
+		chunk = (GapBufferChunk *)_GapBuffer_TakeSpare(&self->spareChunks, &self->spareChunkCount);
+		memcpy(chunk->body, text, run);
+		chunk->length = run;
+		chunk->part1Length = run;
+		_GapBuffer_ChunkAt(self, position, 1, &path);
+		for (depth = 0; depth < path.depth - 1; depth++)
+			path.nodes[depth]->lengths[path.indexes[depth]] += run;
+		_GapBuffer_NodeInsert(self, &path, path.depth - 1, path.indexes[path.depth - 1] + 1, chunk, run);
+		position += run;
+		text += run;
+		length -= run;
+	}
+}
+
+static void
+_GapBuffer_TreeInsert(GapBuffer *self, Py_ssize_t position, const char *text, Py_ssize_t length) {
+	GapBufferPath path;
+	GapBufferChunk *chunk = _GapBuffer_ChunkAt(self, position, 1, &path);
+	Py_ssize_t offset = position - path.start;
+	Py_ssize_t tailLength;
+	char tail[CHUNK_BYTES];
+
+	if ((offset == 0) && (path.start > 0)) {
+		// Append to the previous chunk rather than splitting this one
+		_GapBuffer_TreeAppend(self, position, text, length);
+		return;
+	}
+	_GapBuffer_ChunkGapTo(chunk, offset);
+	if (length <= CHUNK_BYTES - chunk->length) {
+		memcpy(chunk->body + offset, text, length);
+		chunk->length += length;
+		chunk->part1Length += length;
+		_GapBuffer_PathAdd(&path, length);
+		return;
+	}
+	// Split the chunk at offset and append the text then the chunk's tail
+	tailLength = chunk->length - offset;
+	memcpy(tail, chunk->body + CHUNK_BYTES - tailLength, tailLength);
+	chunk->length = offset;
+	_GapBuffer_PathAdd(&path, -tailLength);
+	_GapBuffer_TreeAppend(self, position, text, length);
+	_GapBuffer_TreeAppend(self, position + length, tail, tailLength);
+}
+
+// Remove a chunk left empty, or merge a small chunk into a neighbour
+static void
+_GapBuffer_ChunkShrunk(GapBuffer *self, GapBufferPath *path, GapBufferChunk *chunk) {
+	GapBufferNode *node = path->nodes[path->depth - 1];
+	int index = path->indexes[path->depth - 1];
+	int target;
+	GapBufferChunk *neighbour;
+
+	if ((chunk->length == 0) && ((self->root->count > 1) || (self->root->height > 0))) {
+		_GapBuffer_NodeRemove(self, path, path->depth - 1);
+	} else if (chunk->length < CHUNK_BYTES / 4) {
+		_GapBuffer_ChunkGapTo(chunk, chunk->length);
+		if ((index + 1 < node->count) &&
+		        (chunk->length + node->lengths[index + 1] <= CHUNK_FILL)) {
+			target = index + 1;
+			neighbour = (GapBufferChunk *)node->children[target];
+			_GapBuffer_ChunkGapTo(neighbour, 0);
+			memcpy(neighbour->body, chunk->body, chunk->length);
+			neighbour->part1Length = chunk->length;
+		} else if ((index > 0) &&
+		        (chunk->length + node->lengths[index - 1] <= CHUNK_FILL)) {
+			target = index - 1;
+			neighbour = (GapBufferChunk *)node->children[target];
+			_GapBuffer_ChunkGapTo(neighbour, neighbour->length);
+			memcpy(neighbour->body + neighbour->length, chunk->body, chunk->length);
+			neighbour->part1Length += chunk->length;
+		} else {
+			return;
+		}
+		neighbour->length += chunk->length;
+		node->lengths[target] += chunk->length;
+		node->lengths[index] = 0;
+		_GapBuffer_NodeRemove(self, path, path->depth - 1);
+	}
+}
+
+static void
+_GapBuffer_TreeDelete(GapBuffer *self, Py_ssize_t position, Py_ssize_t length) {
+	while (length > 0) {
+		GapBufferPath path;
+		GapBufferChunk *chunk = _GapBuffer_ChunkAt(self, position, 0, &path);
+		Py_ssize_t offset = position - path.start;
+		Py_ssize_t run = chunk->length - offset;
+		if (run > length)
+			run = length;
+		_GapBuffer_ChunkGapTo(chunk, offset);
+		chunk->length -= run;
+		_GapBuffer_PathAdd(&path, -run);
+		length -= run;
+		_GapBuffer_ChunkShrunk(self, &path, chunk);
+	}
+}
+
+static void
+_GapBuffer_NodeFree(GapBufferNode *node) {
+	int i;
+	for (i = 0; i < node->count; i++) {
+		if (node->height > 0)
+			_GapBuffer_NodeFree((GapBufferNode *)node->children[i]);
+		else
+			PyMem_Free(node->children[i]);
+	}
+	PyMem_Free(node);
+}
+
+static void
+_GapBuffer_FreeChunks(GapBuffer *self) {
+	if (self->root != NULL)
+		_GapBuffer_NodeFree(self->root);
+	self->root = NULL;
+	_GapBuffer_FreeSpares(&self->spareChunks, &self->spareChunkCount, 0);
+	_GapBuffer_FreeSpares(&self->spareNodes, &self->spareNodeCount, 0);
+}
+
+// Move the items from the body into a tree of chunks
+static int
+_GapBuffer_Chunk(GapBuffer *self) {
+	GapBufferNode *root;
+	GapBufferChunk *chunk;
+
+	if (self->lock) {
+		PyErr_SetString(PyExc_BufferError, "Object is locked.");
+		return -1;
+	}
+	root = (GapBufferNode *)PyMem_Malloc(sizeof(GapBufferNode));
+	chunk = (GapBufferChunk *)PyMem_Malloc(sizeof(GapBufferChunk));
+	if ((root == NULL) || (chunk == NULL)) {
+		PyMem_Free(root);
+		PyMem_Free(chunk);
+		PyErr_NoMemory();
+		return -1;
+	}
+	chunk->length = 0;
+	chunk->part1Length = 0;
+	root->count = 1;
+	root->height = 0;
+	root->lengths[0] = 0;
+	root->children[0] = chunk;
+	self->root = root;
+	if (_GapBuffer_ChunksFor(self, self->lengthBody, 2) < 0) {
+		_GapBuffer_FreeChunks(self);
+		return -1;
+	}
+	_GapBuffer_DetachSnapshots(self);
+	_GapBuffer_TreeAppend(self, 0, self->body, self->part1Length);
+	_GapBuffer_TreeAppend(self, self->part1Length, self->body + self->part1Length + self->gapLength,
+	        self->lengthBody - self->part1Length);
+	_GapBuffer_FreeBody(self);
+	self->size = 0;
+	self->part1Length = 0;
+	self->gapLength = 0;
+	return 0;
+}
+
+static char *
+_GapBuffer_NodeCopy(GapBufferNode *node, char *destination) {
+	int i;
+	for (i = 0; i < node->count; i++) {
+		if (node->height > 0) {
+			destination = _GapBuffer_NodeCopy((GapBufferNode *)node->children[i], destination);
+		} else {
+			GapBufferChunk *chunk = (GapBufferChunk *)node->children[i];
+			Py_ssize_t length2 = chunk->length - chunk->part1Length;
+			memcpy(destination, chunk->body, chunk->part1Length);
+			memcpy(destination + chunk->part1Length, chunk->body + CHUNK_BYTES - length2, length2);
+			destination += chunk->length;
+		}
+	}
+	return destination;
+}
+
+// Gather the tree of chunks back into the body, leaving the gap at the end. The
+// next insertion moves the items into chunks again.
+static int
+_GapBuffer_Flatten(GapBuffer *self) {
+	Py_ssize_t length = self->lengthBody;
+	if (self->root == NULL)
+		return 0;
+	self->lengthBody = 0;
+	if (_GapBuffer_ReAllocate(self, length + self->growSize) < 0) {
+		self->lengthBody = length;
+		return -1;
+	}
+	_GapBuffer_NodeCopy(self->root, self->body);
+	_GapBuffer_FreeChunks(self);
+	self->lengthBody = length;
+	self->part1Length = length;
+	self->gapLength = self->size - length;
+	return 0;
+}
+
+// Make room to insert length bytes at edits places in either kind of storage
+static int
+_GapBuffer_RoomForEdits(GapBuffer *self, Py_ssize_t length, Py_ssize_t edits) {
+	if (self->chunked) {
+		if ((self->root == NULL) && (_GapBuffer_Chunk(self) < 0))
+			return -1;
+		return _GapBuffer_ChunksFor(self, length, edits);
+	}
+	return _GapBuffer_RoomFor(self, length);
+}
+
+// Compact text
+
+// Copy n character items between sizes. Works backwards so that items can be
+// widened in place when to and from start at the same address.
+static void
+_GapBuffer_ConvertItems(const char *from, int fromSize, char *to, int toSize, Py_ssize_t n) {
+	if (fromSize == toSize) {
+		if (from != to)
+			memmove(to, from, n * toSize);
+		return;
+	}
+	while (n-- > 0) {
+		unsigned int c;
+		if (fromSize == 1)
+			c = ((const unsigned char *)from)[n];
+		else if (fromSize == 2)
+			c = ((const unsigned short *)from)[n];
+		else
+			c = ((const unsigned int *)from)[n];
+		if (toSize == 1)
+			((unsigned char *)to)[n] = (unsigned char)c;
+		else if (toSize == 2)
+			((unsigned short *)to)[n] = (unsigned short)c;
+		else
+			((unsigned int *)to)[n] = c;
+	}
+}
+
+#if PY_MAJOR_VERSION < 3
+
+// The narrowest item size that holds each of n items of itemSize bytes
+static int
+_GapBuffer_WidthOf(const char *items, Py_ssize_t n, int itemSize) {
+	unsigned int highest = 0;
+	Py_ssize_t i;
+	if (itemSize == 1)
+		return 1;
+	for (i = 0; i < n; i++) {
+		unsigned int c = (itemSize == 2) ?
+		        ((const unsigned short *)items)[i] : ((const unsigned int *)items)[i];
+		if (c > highest)
+			highest = c;
+	}
+	return (highest < 0x100) ? 1 : (highest < 0x10000) ? 2 : 4;
+}
+
+#endif
+
+// Store the items of a compact buffer in width bytes each. The undo history is
+// widened too while snapshots are detached with the narrower text.
+static int
+_GapBuffer_Widen(GapBuffer *self, int width) {
+	Py_ssize_t items;
+	char *arena = NULL;
+	int itemSize = self->itemSize;
+	if (width <= itemSize)
+		return 0;
+	if (self->lock) {
+		PyErr_SetString(PyExc_BufferError, "Object is locked.");
+		return -1;
+	}
+	if (_GapBuffer_Flatten(self) < 0)
+		return -1;
+	items = self->lengthBody / itemSize;
+	if (items > (PY_SSIZE_T_MAX - self->growSize) / width) {
+		PyErr_SetString(PyExc_OverflowError, "GapBuffer: size would overflow");
+		return -1;
+	}
+	if (self->undo) {
+		arena = PyMem_Malloc(self->undo->arenaAllocated / itemSize * width + 1);
+		if (arena == NULL) {
+			PyErr_NoMemory();
+			return -1;
+		}
+	}
+	_GapBuffer_Acquire(self, 1);
+	_GapBuffer_GapTo(self, self->lengthBody);
+	if ((items * width >= self->size) &&
+	        (_GapBuffer_ReAllocate(self, items * width + self->growSize) < 0)) {
+		_GapBuffer_Release(self);
+		PyMem_Free(arena);
+		return -1;
+	}
+	// Snapshots share the body so they must be detached before it is rewritten
+	_GapBuffer_DetachSnapshots(self);
+	_GapBuffer_ConvertItems(self->body, itemSize, self->body, width, items);
+	self->lengthBody = items * width;
+	self->part1Length = self->lengthBody;
+	self->gapLength = self->size - self->lengthBody;
+	self->itemSize = width;
+	_GapBuffer_Release(self);
+
+	if (self->undo) {
+		GapBufferUndo *undo = self->undo;
+		Py_ssize_t i;
+		_GapBuffer_ConvertItems(undo->arena, itemSize, arena, width, undo->arenaLength / itemSize);
+		PyMem_Free(undo->arena);
+		undo->arena = arena;
+		undo->arenaLength = undo->arenaLength / itemSize * width;
+		undo->arenaAllocated = undo->arenaAllocated / itemSize * width;
+		for (i = 0; i < undo->count; i++) {
+			undo->actions[i].position = undo->actions[i].position / itemSize * width;
+			undo->actions[i].length = undo->actions[i].length / itemSize * width;
+			undo->actions[i].text = undo->actions[i].text / itemSize * width;
+		}
+	}
+	return 0;
+}
+
+// Find the items of a Unicode value as this buffer stores them, setting *length
+// to their number. A compact buffer is first widened to hold every character
+// of value unless widen is clear, when 1 is returned for a value that can not
+// occur in the buffer. The items are either borrowed from value or, when *owned
+// is set, allocated and to be freed with PyMem_Free.
+static int
+_GapBuffer_UnicodeItems(GapBuffer *self, PyObject *value, int widen,
+        const char **data, Py_ssize_t *length, char **owned) {
+	const char *source;
+	int sourceSize;
+	int width;
+	*owned = NULL;
+	if (!self->compact) {
+		*data = (const char *)PyUnicode_AS_UNICODE(value);
+		if (*data == NULL)
+			return -1;
+		*length = PyUnicode_GET_SIZE(value);
+		return 0;
+	}
+#if PY_MAJOR_VERSION >= 3
+	if (PyUnicode_READY(value) < 0)
+		return -1;
+	source = (const char *)PyUnicode_DATA(value);
+	sourceSize = width = PyUnicode_KIND(value);
+	*length = PyUnicode_GET_LENGTH(value);
+#else
+	source = (const char *)PyUnicode_AS_UNICODE(value);
+	sourceSize = sizeof(Py_UNICODE);
+	*length = PyUnicode_GET_SIZE(value);
+	width = _GapBuffer_WidthOf(source, *length, sourceSize);
+#endif
+	if (width > self->itemSize) {
+		if (!widen)
+			return 1;
+		if (_GapBuffer_Widen(self, width) < 0)
+			return -1;
+	}
+	if (sourceSize == self->itemSize) {
+		*data = source;
+		return 0;
+	}
+	*owned = PyMem_Malloc(*length * self->itemSize + 1);
+	if (*owned == NULL) {
+		PyErr_NoMemory();
+		return -1;
+	}
+	_GapBuffer_ConvertItems(source, sourceSize, *owned, self->itemSize, *length);
+	*data = *owned;
+	return 0;
+}
+
+// A Unicode string from length items of itemSize bytes
+static PyObject *
+_GapBuffer_UnicodeFromItems(const char *items, Py_ssize_t length, int itemSize) {
+#if PY_MAJOR_VERSION >= 3
+	if (itemSize == sizeof(wchar_t))
+		return PyUnicode_FromWideChar((const wchar_t *)items, length);
+	return PyUnicode_FromKindAndData(itemSize, items, length);
+#else
+	PyObject *result;
+	if (itemSize == sizeof(Py_UNICODE))
+		return PyUnicode_FromUnicode((const Py_UNICODE *)items, length);
+	result = PyUnicode_FromUnicode(NULL, length);
+	if (result != NULL)
+		_GapBuffer_ConvertItems(items, itemSize, (char *)PyUnicode_AS_UNICODE(result),
+		        sizeof(Py_UNICODE), length);
+	return result;
+#endif
+}
+
+static void _GapBuffer_ApplyStep(GapBuffer *self, Py_ssize_t upTo);
+static int _GapBuffer_LinesInserted(GapBuffer *self, Py_ssize_t position, const char *text, Py_ssize_t insertLength);
+static void _GapBuffer_StylesInserted(GapBuffer *self, Py_ssize_t position, Py_ssize_t insertLength);
+static void _GapBuffer_UndoRecord(GapBuffer *self, int type, Py_ssize_t position, const char *text, Py_ssize_t length);
+
+static int
+_GapBuffer_insertarray(GapBuffer* self, Py_ssize_t position, const char *text, Py_ssize_t insertLength) {
+	PyThreadState *state;
+	_GapBuffer_Acquire(self, 1);
+	if ((_GapBuffer_RoomForEdits(self, insertLength, 1) < 0) ||
+	        (self->lines && (_GapBuffer_LinesInserted(self, position, text, insertLength) < 0))) {
+		_GapBuffer_Release(self);
+		return -1;
+	}
+	if (self->styles)
+		_GapBuffer_StylesInserted(self, position, insertLength);
+	if (self->undo)
+		_GapBuffer_UndoRecord(self, UNDO_INSERT, position, text, insertLength);
+	if (self->stepLength != 0) {
+		// Inserted items are final values so the step must not cover them
+		Py_ssize_t item = position / self->itemSize;
+		if (item > self->stepStart)
+			_GapBuffer_ApplyStep(self, item);
+		self->stepStart += insertLength / self->itemSize;
+	}
+	if (self->root) {
+		_GapBuffer_TreeInsert(self, position, text, insertLength);
+		self->lengthBody += insertLength;
+		_GapBuffer_Release(self);
+		return 0;
+	}
+	_GapBuffer_GapTo(self, position);
+	if (self->snapshots)
+		_GapBuffer_Touch(self, self->part1Length, self->part1Length + insertLength);
+	state = _GapBuffer_Unblock(self, insertLength, 1);
+	memmove(self->body + self->part1Length, text, insertLength);
+	_GapBuffer_Block(state);
+	self->lengthBody += insertLength;
+	self->part1Length += insertLength;
+	self->gapLength -= insertLength;
+	_GapBuffer_Release(self);
+	return 0;
+}
+
+// Numbers
+
+// Size of an item of a number type code or 0 for other codes
+static int
+_GapBuffer_NumberSize(char typecode) {
+	switch (typecode) {
+	case 'b':
+	case 'B':
+		return 1;
+	case 'h':
+	case 'H':
+		return sizeof(short);
+	case 'i':
+	case 'I':
+		return sizeof(int);
+	case 'l':
+	case 'L':
+		return sizeof(long);
+	case 'q':
+	case 'Q':
+		return sizeof(PY_LONG_LONG);
+	case 'n':
+		return sizeof(Py_ssize_t);
+	case 'f':
+		return sizeof(float);
+	case 'd':
+		return sizeof(double);
+	}
+	return 0;
+}
+
+// Store a Python number as an item of a number buffer. Integers that do not
+// fit the item raise OverflowError rather than being truncated.
+static int
+_GapBuffer_PackNumber(char typecode, int itemSize, PyObject *value, char *item) {
+	PyObject *number;
+	PyObject *integer;
+
+	if (GAPBUFFER_FLOAT(typecode)) {
+		double real = PyFloat_AsDouble(value);
+		if ((real == -1.0) && PyErr_Occurred())
+			return -1;
+		if (itemSize == sizeof(float)) {
+			float narrow = (float)real;
+			memcpy(item, &narrow, sizeof(narrow));
+		} else {
+			memcpy(item, &real, sizeof(real));
+		}
+		return 0;
+	}
+
+	if (PyLong_CheckExact(value)) {
+		Py_INCREF(value);
+		integer = value;
+	} else {
+		number = PyNumber_Index(value);
+		if (number == NULL) {
+			PyErr_SetString(PyExc_TypeError, "GapBuffer: argument wrong type");
+			return -1;
+		}
+		integer = PyNumber_Long(number);
+		Py_DECREF(number);
+		if (integer == NULL)
+			return -1;
+	}
+	if (GAPBUFFER_SIGNED(typecode)) {
+		PY_LONG_LONG v = PyLong_AsLongLong(integer);
+		PY_LONG_LONG limit = (itemSize < 8) ? ((PY_LONG_LONG)1 << (itemSize * 8 - 1)) : 0;
+		Py_DECREF(integer);
+		if ((v == -1) && PyErr_Occurred())
+			goto range;
+		if ((itemSize < 8) && ((v < -limit) || (v >= limit))) {
+			PyErr_SetString(PyExc_OverflowError, "GapBuffer: value out of range");
+			return -1;
+		}
+		switch (itemSize) {
+		case 1: {
+				signed char narrow = (signed char)v;
+				memcpy(item, &narrow, 1);
+				break;
+			}
+		case 2: {
+				short narrow = (short)v;
+				memcpy(item, &narrow, 2);
+				break;
+			}
+		case 4: {
+				int narrow = (int)v;
+				memcpy(item, &narrow, 4);
+				break;
+			}
+		default:
+			memcpy(item, &v, 8);
+		}
+	} else {
+		unsigned PY_LONG_LONG v = PyLong_AsUnsignedLongLong(integer);
+		Py_DECREF(integer);
+		if ((v == (unsigned PY_LONG_LONG)-1) && PyErr_Occurred())
+			goto range;
+		if ((itemSize < 8) && ((v >> (itemSize * 8)) != 0)) {
+			PyErr_SetString(PyExc_OverflowError, "GapBuffer: value out of range");
+			return -1;
+		}
+		switch (itemSize) {
+		case 1: {
+				unsigned char narrow = (unsigned char)v;
+				memcpy(item, &narrow, 1);
+				break;
+			}
+		case 2: {
+				unsigned short narrow = (unsigned short)v;
+				memcpy(item, &narrow, 2);
+				break;
+			}
+		case 4: {
+				unsigned int narrow = (unsigned int)v;
+				memcpy(item, &narrow, 4);
+				break;
+			}
+		default:
+			memcpy(item, &v, 8);
+		}
+	}
+	return 0;
+range:
+	if (PyErr_ExceptionMatches(PyExc_OverflowError))
+		PyErr_SetString(PyExc_OverflowError, "GapBuffer: value out of range");
+	return -1;
+}
+
+// Python number for an item of a number buffer with step added to integers,
+// wrapping at the width of the item
+static PyObject *
+_GapBuffer_UnpackNumber(char typecode, int itemSize, const char *item, Py_ssize_t step) {
+	unsigned PY_LONG_LONG bits;
+
+	if (GAPBUFFER_FLOAT(typecode)) {
+		if (itemSize == sizeof(float)) {
+			float narrow;
+			memcpy(&narrow, item, sizeof(narrow));
+			return PyFloat_FromDouble(narrow);
+		} else {
+			double real;
+			memcpy(&real, item, sizeof(real));
+			return PyFloat_FromDouble(real);
+		}
+	}
+
+	switch (itemSize) {
+	case 1:
+		bits = *(const unsigned char *)item;
+		break;
+	case 2: {
+			unsigned short narrow;
+			memcpy(&narrow, item, 2);
+			bits = narrow;
+			break;
+		}
+	case 4: {
+			unsigned int narrow;
+			memcpy(&narrow, item, 4);
+			bits = narrow;
+			break;
+		}
+	default:
+		memcpy(&bits, item, 8);
+	}
+	bits += (unsigned PY_LONG_LONG)(PY_LONG_LONG)step;
+	if (itemSize < 8) {
+		unsigned PY_LONG_LONG mask = ((unsigned PY_LONG_LONG)1 << (itemSize * 8)) - 1;
+		bits &= mask;
+		if (GAPBUFFER_SIGNED(typecode) && (bits >> (itemSize * 8 - 1)))
+			bits |= ~mask;
+	}
+#if PY_MAJOR_VERSION < 3
+	// Python 2 ints as the array module returns
+	if (GAPBUFFER_SIGNED(typecode) ? (((PY_LONG_LONG)bits >= LONG_MIN) && ((PY_LONG_LONG)bits <= LONG_MAX)) :
+	        (bits <= LONG_MAX))
+		return PyInt_FromLong((long)(PY_LONG_LONG)bits);
+#endif
+	if (GAPBUFFER_SIGNED(typecode))
+		return PyLong_FromLongLong((PY_LONG_LONG)bits);
+	return PyLong_FromUnsignedLongLong(bits);
+}
+
+// Kind of number for a type code or buffer format character: 'f' for floating
+// point, 's' for signed, 'u' for unsigned or 0 for anything else
+static char
+_GapBuffer_NumberKind(char code) {
+	if ((code == 'f') || (code == 'd'))
+		return 'f';
+	if (code && strchr("bhilqn", code))
+		return 's';
+	if (code && strchr("BHILQN", code))
+		return 'u';
+	return 0;
+}
+
+// The item format of an exported buffer when it is a single item in native
+// byte order, or 0. Sizes come from itemsize.
+static char
+_GapBuffer_BufferFormat(const Py_buffer *view) {
+	const char *format = view->format ? view->format : "B";
+#ifdef WORDS_BIGENDIAN
+	if ((*format == '@') || (*format == '=') || (*format == '>') || (*format == '!'))
+#else
+	if ((*format == '@') || (*format == '=') || (*format == '<'))
+#endif
+		format++;
+	if ((format[0] == '\0') || (format[1] != '\0'))
+		return 0;
+	return format[0];
+}
+
+static void _GapBuffer_AcquireRead(GapBuffer *self);
+static void _GapBuffer_copyoutBulk(GapBuffer* self, Py_ssize_t position, Py_ssize_t length, char *destination);
+
+// Copy the items of an object exporting the buffer protocol when they are
+// numbers of the same kind and size as the buffer's. Returns 1 when the object
+// can not be copied this way and should be iterated instead.
+static int
+_GapBuffer_insertbuffer(GapBuffer* self, Py_ssize_t position, PyObject *sequence) {
+	Py_buffer view;
+	int result;
+
+	if (PyObject_TypeCheck(sequence, &gapbuffer_GapBufferType)) {
+		// Copied out first as it may be this buffer
+		GapBuffer *psv = (GapBuffer *)sequence;
+		char *items;
+		Py_ssize_t length;
+		if ((_GapBuffer_NumberKind(psv->itemType) != _GapBuffer_NumberKind(self->itemType)) ||
+		        (psv->itemSize != self->itemSize))
+			return 1;
+		_GapBuffer_AcquireRead(psv);
+		length = psv->lengthBody;
+		items = PyMem_Malloc(length + 1);
+		if (items != NULL)
+			_GapBuffer_copyoutBulk(psv, 0, length, items);
+		_GapBuffer_Release(psv);
+		if (items == NULL) {
+			PyErr_NoMemory();
+			return -1;
+		}
+		_GapBuffer_Wait(self, 1);
+		result = _GapBuffer_insertarray(self, position * self->itemSize, items, length);
+		PyMem_Free(items);
+		return result;
+	}
+
+	if (!PyObject_CheckBuffer(sequence))
+		return 1;
+	if (PyObject_GetBuffer(sequence, &view, PyBUF_C_CONTIGUOUS | PyBUF_FORMAT) < 0) {
+		PyErr_Clear();
+		return 1;
+	}
+	if ((_GapBuffer_NumberKind(_GapBuffer_BufferFormat(&view)) != _GapBuffer_NumberKind(self->itemType)) ||
+	        (view.itemsize != self->itemSize)) {
+		PyBuffer_Release(&view);
+		return 1;
+	}
+	result = _GapBuffer_insertarray(self, position * self->itemSize, view.buf, view.len);
+	PyBuffer_Release(&view);
+	return result;
+}
+
+// Insert the numbers from an iterable, packing them in batches after making
+// room for as many as it says it has
+static int
+_GapBuffer_insertiter(GapBuffer* self, Py_ssize_t position, PyObject *sequence) {
+	PyObject *value;
+	PyObject *iter;
+	char items[4096];
+	Py_ssize_t batch = 0;
+	Py_ssize_t hint;
+	int copied = _GapBuffer_insertbuffer(self, position, sequence);
+	if (copied <= 0)
+		return (copied < 0) ? 1 : 0;
+
+	iter = PyObject_GetIter(sequence);
+	if (iter == NULL) {
+		PyErr_SetString(PyExc_TypeError, "GapBuffer: argument not iterable");
+		return 1;
+	}
+#if PY_VERSION_HEX >= 0x03040000
+	hint = PyObject_LengthHint(sequence, 0);
+#else
+	hint = _PyObject_LengthHint(sequence, 0);
+#endif
+	if (hint < 0) {
+		Py_DECREF(iter);
+		return 1;
+	}
+	if ((hint > 0) && (hint < PY_SSIZE_T_MAX / self->itemSize / 2) &&
+	        (_GapBuffer_RoomForEdits(self, hint * self->itemSize, 1) < 0)) {
+		Py_DECREF(iter);
+		return 1;
+	}
+	for (;;) {
+		value = PyIter_Next(iter);
+		if (value != NULL) {
+			int result = _GapBuffer_PackNumber(self->itemType, self->itemSize, value, items + batch);
+			Py_DECREF(value);
+			if (result < 0)
+				break;
+			batch += self->itemSize;
+		}
+		if ((batch > 0) && ((value == NULL) || (batch + self->itemSize > (Py_ssize_t)sizeof(items)))) {
+			if (_GapBuffer_insertarray(self, position * self->itemSize, items, batch) < 0)
+				break;
+			position += batch / self->itemSize;
+			batch = 0;
+		}
+		if (value == NULL)
+			break;
+	}
+	Py_DECREF(iter);
+	return PyErr_Occurred() ? 1 : 0;
+}
+
+static int
+GapBuffer_init(GapBuffer *self, PyObject *args, PyObject *kwds) {
+	PyObject *value = NULL;
+	const char *backend = "gap";
+	int compact = 0;
+	const char *typecode = NULL;
+	char itemType;
+	static char *kwlist[] = {"data", "backend", "compact", "typecode", NULL};
+
+	_GapBuffer_Wait(self, 1);
+	Py_CLEAR(self->lines);
+	_GapBuffer_StylesFree(self);
+	_GapBuffer_UndoFree(self);
+	PyMem_Free(self->stats);
+	_GapBuffer_DetachSnapshots(self);
+	_GapBuffer_FreeChunks(self);
+	_GapBuffer_InitFields(self);
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "|Osiz:GapBuffer", kwlist, &value, &backend, &compact, &typecode)) {
+		return -1;
+	}
+	if (strcmp(backend, "chunked") == 0) {
+		self->chunked = 1;
+	} else if (strcmp(backend, "gap") != 0) {
+		PyErr_SetString(PyExc_ValueError, "GapBuffer: backend must be 'gap' or 'chunked'");
+		return -1;
+	}
+
+	if (typecode == NULL) {
+		// The type follows the data, with integers for iterables
+		if (compact || (value && PyUnicode_Check(value)))
+			itemType = 'u';
+		else if (!value || PyBytes_Check(value))
+			itemType = 'c';
+		else
+			itemType = 'i';
+	} else if ((strlen(typecode) == 1) && (GAPBUFFER_TEXT(typecode[0]) ||
+	        strchr(GAPBUFFER_NUMBER_TYPES, typecode[0]))) {
+		itemType = typecode[0];
+	} else {
+		PyErr_SetString(PyExc_ValueError,
+		        "GapBuffer: typecode must be one of c, u, b, B, h, H, i, I, l, L, q, Q, f or d");
+		return -1;
+	}
+
+	if (compact && ((itemType != 'u') || (value && !PyUnicode_Check(value)))) {
+		PyErr_SetString(PyExc_ValueError, "GapBuffer: compact storage is only for unicode text");
+		return -1;
+	}
+	if (value && (((itemType == 'u') && !PyUnicode_Check(value)) ||
+	        ((itemType == 'c') && !PyBytes_Check(value)))) {
+		PyErr_SetString(PyExc_TypeError, "GapBuffer: argument wrong type");
+		return -1;
+	}
+
+	if (itemType == 'u') {
+		self->itemType = 'u';
+		// Compact buffers start with single byte items and widen as text is added
+		self->itemSize = compact ? 1 : sizeof(Py_UNICODE);
+		self->compact = compact ? 1 : 0;
+		if (value) {
+			const char *text;
+			Py_ssize_t length;
+			char *owned;
+			int result;
+			if (_GapBuffer_UnicodeItems(self, value, 1, &text, &length, &owned) < 0)
+				return -1;
+			result = _GapBuffer_insertarray(self, 0, text, length * self->itemSize);
+			PyMem_Free(owned);
+			if (result < 0)
+				return -1;
+		}
+	} else if (itemType == 'c') {
+		self->itemType = 'c';
+		self->itemSize = 1;
+		if (value) {
+			if (_GapBuffer_insertarray(self, 0, PyBytes_AS_STRING(value),
+			        PyBytes_GET_SIZE(value)) < 0) {
+				return -1;
+			}
+		}
+	} else {
+		// Numbers from any iterable
+		self->itemType = itemType;
+		self->itemSize = _GapBuffer_NumberSize(itemType);
+		if (value && (0 != _GapBuffer_insertiter(self, 0, value))) {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+// TODO stop exposing these - they are only for debugging
+static PyMemberDef GapBuffer_members[] = {
+            {"size", T_PYSSIZET, offsetof(GapBuffer, size), READONLY, "Allocated size"},
+            {"part1Length", T_PYSSIZET, offsetof(GapBuffer, part1Length), READONLY, "Length before gap"},
+            {"gapLength", T_PYSSIZET, offsetof(GapBuffer, gapLength), READONLY, "Length of gap"},
+            {"growSize", T_PYSSIZET, offsetof(GapBuffer, growSize), READONLY, "Size to grow"},
+            {"growthFactor", T_DOUBLE, offsetof(GapBuffer, growthFactor), READONLY, "Multiplier for geometric growth"},
+            {"reallocations", T_PYSSIZET, offsetof(GapBuffer, reallocations), READONLY, "Number of times the body was reallocated"},
+            {"mapped", T_INT, offsetof(GapBuffer, bodyMapped), READONLY, "Whether the body is memory mapped"},
+            {"itemsize", T_INT, offsetof(GapBuffer, itemSize), READONLY, "Size of each item"},
+            {"typecode", T_CHAR, offsetof(GapBuffer, itemType), READONLY, "Type code of each item"},
+            {"bufferAppearence", T_INT, offsetof(GapBuffer, bufferAppearence), 0, "Single or multiple segments"},
+            {"partitioned", T_INT, offsetof(GapBuffer, partitioned), READONLY, "Whether suffix increments are deferred"},
+            {"stepStart", T_PYSSIZET, offsetof(GapBuffer, stepStart), READONLY, "First item with a pending step"},
+            {"stepLength", T_PYSSIZET, offsetof(GapBuffer, stepLength), READONLY, "Pending step"},
+            {"chunked", T_INT, offsetof(GapBuffer, chunked), READONLY, "Whether items are kept in a tree of chunks"},
+            {"compact", T_INT, offsetof(GapBuffer, compact), READONLY, "Whether text is stored in the narrowest item size"},
+            {"styles", T_OBJECT, offsetof(GapBuffer, styles), READONLY, "RunStyles following the items or None"},
+            {NULL}  /* Sentinel */
+        };
+
+static PyObject *
+GapBuffer_insert(GapBuffer* self, PyObject *args) {
+	const char *data;
+	char *owned = NULL;
+	Py_ssize_t positionToInsert;
+	Py_ssize_t insertLength;
+	PyObject *sequence = NULL;
+	PyObject *text = NULL;
+	int result;
+
+	if (self->lock) {
+		PyErr_SetString(PyExc_BufferError, "Object is locked.");
+		return NULL;
+	}
+
+	if (self->itemType == 'c') {
+		if (!PyArg_ParseTuple(args, "ns#:insert", &positionToInsert, &data, &insertLength)) {
+			return NULL;
+		}
+	} else if (self->itemType == 'u') {
+		if (!PyArg_ParseTuple(args, "nU:insert", &positionToInsert, &text)) {
+			return NULL;
+		}
+	} else {    // numbers
+		if (!PyArg_ParseTuple(args, "nO:insert", &positionToInsert, &sequence)) {
+			return NULL;
+		}
+	}
+
+	_GapBuffer_Wait(self, 1);
+	if ((positionToInsert < 0) || (positionToInsert > self->lengthBody / self->itemSize)) {
+		PyErr_SetString(PyExc_IndexError, "GapBuffer.insert(position, text): out of range");
+		return NULL;
+	}
+
+	if (sequence) {
+		if (0 != _GapBuffer_insertiter(self, positionToInsert, sequence)) {
+			return NULL;
+		}
+	} else {
+		if (text && (_GapBuffer_UnicodeItems(self, text, 1, &data, &insertLength, &owned) < 0)) {
+			return NULL;
+		}
+		result = _GapBuffer_insertarray(self, positionToInsert * self->itemSize, data, insertLength * self->itemSize);
+		PyMem_Free(owned);
+		if (result < 0) {
+			return NULL;
+		}
+	}
+
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
+static PyObject *
+GapBuffer_extend(GapBuffer* self, PyObject *args) {
+	const char *data;
+	char *owned = NULL;
+	Py_ssize_t insertLength;
+	PyObject *sequence = NULL;
+	PyObject *text = NULL;
+	int result;
+
+	if (self->lock) {
+		PyErr_SetString(PyExc_BufferError, "Object is locked.");
+		return NULL;
+	}
+
+	if (self->itemType == 'c') {
+		if (!PyArg_ParseTuple(args, "s#:extend", &data, &insertLength)) {
+			return NULL;
+		}
+	} else if (self->itemType == 'u') {
+		if (!PyArg_ParseTuple(args, "U:extend", &text)) {
+			return NULL;
+		}
+	} else {    // numbers
+		if (!PyArg_ParseTuple(args, "O:extend", &sequence)) {
+			return NULL;
+		}
+	}
+
+	_GapBuffer_Wait(self, 1);
+	if (sequence) {
+		if (0 != _GapBuffer_insertiter(self, self->lengthBody / self->itemSize, sequence)) {
+			return NULL;
+		}
+	} else {
+		if (text && (_GapBuffer_UnicodeItems(self, text, 1, &data, &insertLength, &owned) < 0)) {
+			return NULL;
+		}
+		result = _GapBuffer_insertarray(self, self->lengthBody, data, insertLength * self->itemSize);
+		PyMem_Free(owned);
+		if (result < 0) {
+			return NULL;
+		}
+	}
+
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
+// Element kernels used by increment, saturating_increment, multiply_add, fill and sum.
+// Scalar versions are always available and SSE2 / AVX2 versions are chosen at
+// module initialization when the processor supports them.
+
+static void
+memincr1(char *p, Py_ssize_t length, int v) {
+	while (length-- > 0) {
+		*p++ += v;
+	}
+}
+
+static void
+memincr2(short *p, Py_ssize_t length, int v) {
+	while (length-- > 0) {
+		*p++ += v;
+	}
+}
+
+static void
+memincr4(int *p, Py_ssize_t length, int v) {
+	while (length-- > 0) {
+		*p++ += v;
+	}
+}
+
+static void
+memincr8(PY_LONG_LONG *p, Py_ssize_t length, PY_LONG_LONG v) {
+	while (length-- > 0) {
+		*p++ += v;
+	}
+}
+
+// Saturating additions clamp unsigned items to [0, max] and signed items to [min, max]
+static void
+memsat1(unsigned char *p, Py_ssize_t length, int v) {
+	while (length-- > 0) {
+		PY_LONG_LONG r = (PY_LONG_LONG)*p + v;
+		*p++ = (unsigned char)((r < 0) ? 0 : ((r > 0xFF) ? 0xFF : r));
+	}
+}
+
+static void
+memsat2(unsigned short *p, Py_ssize_t length, int v) {
+	while (length-- > 0) {
+		PY_LONG_LONG r = (PY_LONG_LONG)*p + v;
+		*p++ = (unsigned short)((r < 0) ? 0 : ((r > 0xFFFF) ? 0xFFFF : r));
+	}
+}
+
+static void
+memsat4(unsigned int *p, Py_ssize_t length, int v) {
+	while (length-- > 0) {
+		PY_LONG_LONG r = (PY_LONG_LONG)*p + v;
+		*p++ = (unsigned int)((r < 0) ? 0 : ((r > 0xFFFFFFFFLL) ? 0xFFFFFFFFLL : r));
+	}
+}
+
+static void
+memsatsigned4(int *p, Py_ssize_t length, int v) {
+	while (length-- > 0) {
+		PY_LONG_LONG r = (PY_LONG_LONG)*p + v;
+		*p++ = (int)((r < INT_MIN) ? INT_MIN : ((r > INT_MAX) ? INT_MAX : r));
+	}
+}
+
+// Multiply-add wraps like the plain addition
+static void
+memmuladd1(unsigned char *p, Py_ssize_t length, int m, int v) {
+	while (length-- > 0) {
+		*p = (unsigned char)(*p * (unsigned int)m + (unsigned int)v);
+		p++;
+	}
+}
+
+static void
+memmuladd2(unsigned short *p, Py_ssize_t length, int m, int v) {
+	while (length-- > 0) {
+		*p = (unsigned short)(*p * (unsigned int)m + (unsigned int)v);
+		p++;
+	}
+}
+
+static void
+memmuladd4(unsigned int *p, Py_ssize_t length, int m, int v) {
+	while (length-- > 0) {
+		*p = *p * (unsigned int)m + (unsigned int)v;
+		p++;
+	}
+}
+
+// Find the first item equal to v, returning its index or length when absent.
+// Single byte items use memchr which the C library already vectorizes.
+static Py_ssize_t
+memfind2(const unsigned short *p, Py_ssize_t length, unsigned int v) {
+	Py_ssize_t i;
+	for (i = 0; i < length; i++) {
+		if (p[i] == v)
+			return i;
+	}
+	return length;
+}
+
+static Py_ssize_t
+memfind4(const unsigned int *p, Py_ssize_t length, unsigned int v) {
+	Py_ssize_t i;
+	for (i = 0; i < length; i++) {
+		if (p[i] == v)
+			return i;
+	}
+	return length;
+}
+
+// Widen the leading run of ASCII bytes into 2 or 4 byte items, returning the
+// number of bytes converted.
+static Py_ssize_t
+memascii2(const unsigned char *p, Py_ssize_t length, unsigned short *out) {
+	Py_ssize_t i;
+	for (i = 0; (i < length) && (p[i] < 0x80); i++)
+		out[i] = p[i];
+	return i;
+}
+
+static Py_ssize_t
+memascii4(const unsigned char *p, Py_ssize_t length, unsigned int *out) {
+	Py_ssize_t i;
+	for (i = 0; (i < length) && (p[i] < 0x80); i++)
+		out[i] = p[i];
+	return i;
+}
+
+// Kernels for the other item types of number buffers
+
+static void
+memsatsigned1(signed char *p, Py_ssize_t length, int v) {
+	while (length-- > 0) {
+		PY_LONG_LONG r = (PY_LONG_LONG)*p + v;
+		*p++ = (signed char)((r < SCHAR_MIN) ? SCHAR_MIN : ((r > SCHAR_MAX) ? SCHAR_MAX : r));
+	}
+}
+
+static void
+memsatsigned2(short *p, Py_ssize_t length, int v) {
+	while (length-- > 0) {
+		PY_LONG_LONG r = (PY_LONG_LONG)*p + v;
+		*p++ = (short)((r < SHRT_MIN) ? SHRT_MIN : ((r > SHRT_MAX) ? SHRT_MAX : r));
+	}
+}
+
+// 64-bit items check for overflow before adding. There are no vector
+// versions of these or of the 64-bit multiply-add.
+static void
+memsat8(unsigned PY_LONG_LONG *p, Py_ssize_t length, PY_LONG_LONG v) {
+	unsigned PY_LONG_LONG magnitude = (v < 0) ?
+	        (unsigned PY_LONG_LONG)0 - (unsigned PY_LONG_LONG)v : (unsigned PY_LONG_LONG)v;
+	while (length-- > 0) {
+		if (v < 0)
+			*p = (*p < magnitude) ? 0 : *p - magnitude;
+		else
+			*p = (*p > PY_ULLONG_MAX - magnitude) ? PY_ULLONG_MAX : *p + magnitude;
+		p++;
+	}
+}
+
+static void
+memsatsigned8(PY_LONG_LONG *p, Py_ssize_t length, PY_LONG_LONG v) {
+	while (length-- > 0) {
+		if ((v > 0) && (*p > PY_LLONG_MAX - v))
+			*p = PY_LLONG_MAX;
+		else if ((v < 0) && (*p < PY_LLONG_MIN - v))
+			*p = PY_LLONG_MIN;
+		else
+			*p += v;
+		p++;
+	}
+}
+
+static void
+memmuladd8(unsigned PY_LONG_LONG *p, Py_ssize_t length, PY_LONG_LONG m, PY_LONG_LONG v) {
+	while (length-- > 0) {
+		*p = *p * (unsigned PY_LONG_LONG)m + (unsigned PY_LONG_LONG)v;
+		p++;
+	}
+}
+
+// Floating point items are computed in their own precision
+static void
+memmuladdfloat(float *p, Py_ssize_t length, float m, float v) {
+	while (length-- > 0) {
+		*p = *p * m + v;
+		p++;
+	}
+}
+
+static void
+memmuladddouble(double *p, Py_ssize_t length, double m, double v) {
+	while (length-- > 0) {
+		*p = *p * m + v;
+		p++;
+	}
+}
+
+static void
+memfill2(unsigned short *p, Py_ssize_t length, unsigned short v) {
+	while (length-- > 0)
+		*p++ = v;
+}
+
+static void
+memfill4(unsigned int *p, Py_ssize_t length, unsigned int v) {
+	while (length-- > 0)
+		*p++ = v;
+}
+
+static void
+memfill8(unsigned PY_LONG_LONG *p, Py_ssize_t length, unsigned PY_LONG_LONG v) {
+	while (length-- > 0)
+		*p++ = v;
+}
+
+static Py_ssize_t
+memfind8(const unsigned PY_LONG_LONG *p, Py_ssize_t length, unsigned PY_LONG_LONG v) {
+	Py_ssize_t i;
+	for (i = 0; i < length; i++) {
+		if (p[i] == v)
+			return i;
+	}
+	return length;
+}
+
+// Sums of items narrower than 8 bytes. The caller limits length so that the
+// total can not overflow.
+static PY_LONG_LONG
+memsum1(const unsigned char *p, Py_ssize_t length) {
+	PY_LONG_LONG total = 0;
+	while (length-- > 0)
+		total += *p++;
+	return total;
+}
+
+static PY_LONG_LONG
+memsumsigned1(const signed char *p, Py_ssize_t length) {
+	PY_LONG_LONG total = 0;
+	while (length-- > 0)
+		total += *p++;
+	return total;
+}
+
+static PY_LONG_LONG
+memsum2(const unsigned short *p, Py_ssize_t length) {
+	PY_LONG_LONG total = 0;
+	while (length-- > 0)
+		total += *p++;
+	return total;
+}
+
+static PY_LONG_LONG
+memsumsigned2(const short *p, Py_ssize_t length) {
+	PY_LONG_LONG total = 0;
+	while (length-- > 0)
+		total += *p++;
+	return total;
+}
+
+static PY_LONG_LONG
+memsum4(const unsigned int *p, Py_ssize_t length) {
+	PY_LONG_LONG total = 0;
+	while (length-- > 0)
+		total += *p++;
+	return total;
+}
+
+static PY_LONG_LONG
+memsumsigned4(const int *p, Py_ssize_t length) {
+	PY_LONG_LONG total = 0;
+	while (length-- > 0)
+		total += *p++;
+	return total;
+}
+
+typedef struct {
+	const char *name;
+	void (*add1)(char *p, Py_ssize_t length, int v);
+	void (*add2)(short *p, Py_ssize_t length, int v);
+	void (*add4)(int *p, Py_ssize_t length, int v);
+	void (*add8)(PY_LONG_LONG *p, Py_ssize_t length, PY_LONG_LONG v);
+	void (*saturate1)(unsigned char *p, Py_ssize_t length, int v);
+	void (*saturate2)(unsigned short *p, Py_ssize_t length, int v);
+	void (*saturate4)(unsigned int *p, Py_ssize_t length, int v);
+	void (*saturateSigned4)(int *p, Py_ssize_t length, int v);
+	void (*multiplyAdd1)(unsigned char *p, Py_ssize_t length, int m, int v);
+	void (*multiplyAdd2)(unsigned short *p, Py_ssize_t length, int m, int v);
+	void (*multiplyAdd4)(unsigned int *p, Py_ssize_t length, int m, int v);
+	Py_ssize_t (*find2)(const unsigned short *p, Py_ssize_t length, unsigned int v);
+	Py_ssize_t (*find4)(const unsigned int *p, Py_ssize_t length, unsigned int v);
+	Py_ssize_t (*ascii2)(const unsigned char *p, Py_ssize_t length, unsigned short *out);
+	Py_ssize_t (*ascii4)(const unsigned char *p, Py_ssize_t length, unsigned int *out);
+	void (*saturateSigned1)(signed char *p, Py_ssize_t length, int v);
+	void (*saturateSigned2)(short *p, Py_ssize_t length, int v);
+	void (*multiplyAddFloat)(float *p, Py_ssize_t length, float m, float v);
+	void (*multiplyAddDouble)(double *p, Py_ssize_t length, double m, double v);
+	void (*fill2)(unsigned short *p, Py_ssize_t length, unsigned short v);
+	void (*fill4)(unsigned int *p, Py_ssize_t length, unsigned int v);
+	void (*fill8)(unsigned PY_LONG_LONG *p, Py_ssize_t length, unsigned PY_LONG_LONG v);
+	Py_ssize_t (*find8)(const unsigned PY_LONG_LONG *p, Py_ssize_t length, unsigned PY_LONG_LONG v);
+	PY_LONG_LONG (*sum1)(const unsigned char *p, Py_ssize_t length);
+}
+GapBufferKernels;
+
+static const GapBufferKernels kernelsScalar = {
+	"scalar",
+	memincr1, memincr2, memincr4, memincr8,
+	memsat1, memsat2, memsat4, memsatsigned4,
+	memmuladd1, memmuladd2, memmuladd4,
+	memfind2, memfind4,
+	memascii2, memascii4,
+	memsatsigned1, memsatsigned2,
+	memmuladdfloat, memmuladddouble,
+	memfill2, memfill4, memfill8,
+	memfind8,
+	memsum1,
+};
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#define GAPBUFFER_X86_KERNELS
+#include <immintrin.h>
+
+// SSE2 is part of x86-64 so is always available. Each kernel processes 16 bytes
+// at a time then leaves the remainder to the scalar kernel.
+
+static void
+memincr1_sse2(char *p, Py_ssize_t length, int v) {
+	__m128i vv = _mm_set1_epi8((char)v);
+	for (; length >= 16; length -= 16, p += 16)
+		_mm_storeu_si128((__m128i *)p, _mm_add_epi8(_mm_loadu_si128((__m128i *)p), vv));
+	memincr1(p, length, v);
+}
+
+static void
+memincr2_sse2(short *p, Py_ssize_t length, int v) {
+	__m128i vv = _mm_set1_epi16((short)v);
+	for (; length >= 8; length -= 8, p += 8)
+		_mm_storeu_si128((__m128i *)p, _mm_add_epi16(_mm_loadu_si128((__m128i *)p), vv));
+	memincr2(p, length, v);
+}
+
+static void
+memincr4_sse2(int *p, Py_ssize_t length, int v) {
+	__m128i vv = _mm_set1_epi32(v);
+	for (; length >= 4; length -= 4, p += 4)
+		_mm_storeu_si128((__m128i *)p, _mm_add_epi32(_mm_loadu_si128((__m128i *)p), vv));
+	memincr4(p, length, v);
+}
+
+static void
+memincr8_sse2(PY_LONG_LONG *p, Py_ssize_t length, PY_LONG_LONG v) {
+	__m128i vv = _mm_set1_epi64x(v);
+	for (; length >= 2; length -= 2, p += 2)
+		_mm_storeu_si128((__m128i *)p, _mm_add_epi64(_mm_loadu_si128((__m128i *)p), vv));
+	memincr8(p, length, v);
+}
+
+static void
+memsat1_sse2(unsigned char *p, Py_ssize_t length, int v) {
+	unsigned int magnitude = (v < 0) ? 0u - (unsigned int)v : (unsigned int)v;
+	__m128i vv = _mm_set1_epi8((char)((magnitude > 0xFF) ? 0xFF : magnitude));
+	for (; length >= 16; length -= 16, p += 16) {
+		__m128i x = _mm_loadu_si128((__m128i *)p);
+		x = (v < 0) ? _mm_subs_epu8(x, vv) : _mm_adds_epu8(x, vv);
+		_mm_storeu_si128((__m128i *)p, x);
+	}
+	memsat1(p, length, v);
+}
+
+static void
+memsat2_sse2(unsigned short *p, Py_ssize_t length, int v) {
+	unsigned int magnitude = (v < 0) ? 0u - (unsigned int)v : (unsigned int)v;
+	__m128i vv = _mm_set1_epi16((short)((magnitude > 0xFFFF) ? 0xFFFF : magnitude));
+	for (; length >= 8; length -= 8, p += 8) {
+		__m128i x = _mm_loadu_si128((__m128i *)p);
+		x = (v < 0) ? _mm_subs_epu16(x, vv) : _mm_adds_epu16(x, vv);
+		_mm_storeu_si128((__m128i *)p, x);
+	}
+	memsat2(p, length, v);
+}
+
+// There are no 32-bit saturating instructions so overflow is detected by the
+// result moving in the wrong direction and replaced with the limit.
+static void
+memsat4_sse2(unsigned int *p, Py_ssize_t length, int v) {
+	__m128i vv = _mm_set1_epi32(v);
+	__m128i bias = _mm_set1_epi32((int)0x80000000u);	// Flip sign bits for unsigned compares
+	__m128i limit = _mm_set1_epi32((v < 0) ? 0 : -1);
+	for (; length >= 4; length -= 4, p += 4) {
+		__m128i x = _mm_loadu_si128((__m128i *)p);
+		__m128i r = _mm_add_epi32(x, vv);
+		__m128i wrapped = (v < 0) ?
+		        _mm_cmpgt_epi32(_mm_xor_si128(r, bias), _mm_xor_si128(x, bias)) :
+		        _mm_cmpgt_epi32(_mm_xor_si128(x, bias), _mm_xor_si128(r, bias));
+		r = _mm_or_si128(_mm_and_si128(wrapped, limit), _mm_andnot_si128(wrapped, r));
+		_mm_storeu_si128((__m128i *)p, r);
+	}
+	memsat4(p, length, v);
+}
+
+static void
+memsatsigned4_sse2(int *p, Py_ssize_t length, int v) {
+	__m128i vv = _mm_set1_epi32(v);
+	__m128i limit = _mm_set1_epi32((v < 0) ? INT_MIN : INT_MAX);
+	for (; length >= 4; length -= 4, p += 4) {
+		__m128i x = _mm_loadu_si128((__m128i *)p);
+		__m128i r = _mm_add_epi32(x, vv);
+		__m128i wrapped = (v < 0) ? _mm_cmpgt_epi32(r, x) : _mm_cmpgt_epi32(x, r);
+		r = _mm_or_si128(_mm_and_si128(wrapped, limit), _mm_andnot_si128(wrapped, r));
+		_mm_storeu_si128((__m128i *)p, r);
+	}
+	memsatsigned4(p, length, v);
+}
+
+// There is no 8-bit multiply so even and odd bytes are multiplied as 16-bit lanes
+static void
+memmuladd1_sse2(unsigned char *p, Py_ssize_t length, int m, int v) {
+	__m128i mm = _mm_set1_epi16((short)(m & 0xFF));
+	__m128i vv = _mm_set1_epi8((char)v);
+	__m128i lowBytes = _mm_set1_epi16(0xFF);
+	for (; length >= 16; length -= 16, p += 16) {
+		__m128i x = _mm_loadu_si128((__m128i *)p);
+		__m128i even = _mm_and_si128(_mm_mullo_epi16(x, mm), lowBytes);
+		__m128i odd = _mm_slli_epi16(_mm_mullo_epi16(_mm_srli_epi16(x, 8), mm), 8);
+		_mm_storeu_si128((__m128i *)p, _mm_add_epi8(_mm_or_si128(even, odd), vv));
+	}
+	memmuladd1(p, length, m, v);
+}
+
+static void
+memmuladd2_sse2(unsigned short *p, Py_ssize_t length, int m, int v) {
+	__m128i mm = _mm_set1_epi16((short)m);
+	__m128i vv = _mm_set1_epi16((short)v);
+	for (; length >= 8; length -= 8, p += 8) {
+		__m128i x = _mm_loadu_si128((__m128i *)p);
+		_mm_storeu_si128((__m128i *)p, _mm_add_epi16(_mm_mullo_epi16(x, mm), vv));
+	}
+	memmuladd2(p, length, m, v);
+}
+
+static Py_ssize_t
+memfind2_sse2(const unsigned short *p, Py_ssize_t length, unsigned int v) {
+	__m128i vv = _mm_set1_epi16((short)v);
+	Py_ssize_t i = 0;
+	for (; i + 8 <= length; i += 8) {
+		int mask = _mm_movemask_epi8(_mm_cmpeq_epi16(_mm_loadu_si128((const __m128i *)(p + i)), vv));
+		if (mask)
+			return i + __builtin_ctz(mask) / 2;
+	}
+	return i + memfind2(p + i, length - i, v);
+}
+
+static Py_ssize_t
+memfind4_sse2(const unsigned int *p, Py_ssize_t length, unsigned int v) {
+	__m128i vv = _mm_set1_epi32((int)v);
+	Py_ssize_t i = 0;
+	for (; i + 4 <= length; i += 4) {
+		int mask = _mm_movemask_epi8(_mm_cmpeq_epi32(_mm_loadu_si128((const __m128i *)(p + i)), vv));
+		if (mask)
+			return i + __builtin_ctz(mask) / 4;
+	}
+	return i + memfind4(p + i, length - i, v);
+}
+
+static Py_ssize_t
+memascii2_sse2(const unsigned char *p, Py_ssize_t length, unsigned short *out) {
+	__m128i zero = _mm_setzero_si128();
+	Py_ssize_t i = 0;
+	for (; i + 16 <= length; i += 16) {
+		__m128i x = _mm_loadu_si128((const __m128i *)(p + i));
+		if (_mm_movemask_epi8(x))
+			break;
+		_mm_storeu_si128((__m128i *)(out + i), _mm_unpacklo_epi8(x, zero));
+		_mm_storeu_si128((__m128i *)(out + i + 8), _mm_unpackhi_epi8(x, zero));
+	}
+	return i + memascii2(p + i, length - i, out + i);
+}
+
+static Py_ssize_t
+memascii4_sse2(const unsigned char *p, Py_ssize_t length, unsigned int *out) {
+	__m128i zero = _mm_setzero_si128();
+	Py_ssize_t i = 0;
+	for (; i + 16 <= length; i += 16) {
+		__m128i x = _mm_loadu_si128((const __m128i *)(p + i));
+		__m128i low, high;
+		if (_mm_movemask_epi8(x))
+			break;
+		low = _mm_unpacklo_epi8(x, zero);
+		high = _mm_unpackhi_epi8(x, zero);
+		_mm_storeu_si128((__m128i *)(out + i), _mm_unpacklo_epi16(low, zero));
+		_mm_storeu_si128((__m128i *)(out + i + 4), _mm_unpackhi_epi16(low, zero));
+		_mm_storeu_si128((__m128i *)(out + i + 8), _mm_unpacklo_epi16(high, zero));
+		_mm_storeu_si128((__m128i *)(out + i + 12), _mm_unpackhi_epi16(high, zero));
+	}
+	return i + memascii4(p + i, length - i, out + i);
+}
+
+// Biasing by the sign bit maps signed order onto unsigned order so the
+// unsigned saturating instructions serve for signed items
+static void
+memsatsigned1_sse2(signed char *p, Py_ssize_t length, int v) {
+	unsigned int magnitude = (v < 0) ? 0u - (unsigned int)v : (unsigned int)v;
+	__m128i vv = _mm_set1_epi8((char)((magnitude > 0xFF) ? 0xFF : magnitude));
+	__m128i bias = _mm_set1_epi8((char)0x80);
+	for (; length >= 16; length -= 16, p += 16) {
+		__m128i x = _mm_xor_si128(_mm_loadu_si128((__m128i *)p), bias);
+		x = (v < 0) ? _mm_subs_epu8(x, vv) : _mm_adds_epu8(x, vv);
+		_mm_storeu_si128((__m128i *)p, _mm_xor_si128(x, bias));
+	}
+	memsatsigned1(p, length, v);
+}
+
+static void
+memsatsigned2_sse2(short *p, Py_ssize_t length, int v) {
+	unsigned int magnitude = (v < 0) ? 0u - (unsigned int)v : (unsigned int)v;
+	__m128i vv = _mm_set1_epi16((short)((magnitude > 0xFFFF) ? 0xFFFF : magnitude));
+	__m128i bias = _mm_set1_epi16((short)0x8000);
+	for (; length >= 8; length -= 8, p += 8) {
+		__m128i x = _mm_xor_si128(_mm_loadu_si128((__m128i *)p), bias);
+		x = (v < 0) ? _mm_subs_epu16(x, vv) : _mm_adds_epu16(x, vv);
+		_mm_storeu_si128((__m128i *)p, _mm_xor_si128(x, bias));
+	}
+	memsatsigned2(p, length, v);
+}
+
+static void
+memmuladdfloat_sse2(float *p, Py_ssize_t length, float m, float v) {
+	__m128 mm = _mm_set1_ps(m);
+	__m128 vv = _mm_set1_ps(v);
+	for (; length >= 4; length -= 4, p += 4)
+		_mm_storeu_ps(p, _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(p), mm), vv));
+	memmuladdfloat(p, length, m, v);
+}
+
+static void
+memmuladddouble_sse2(double *p, Py_ssize_t length, double m, double v) {
+	__m128d mm = _mm_set1_pd(m);
+	__m128d vv = _mm_set1_pd(v);
+	for (; length >= 2; length -= 2, p += 2)
+		_mm_storeu_pd(p, _mm_add_pd(_mm_mul_pd(_mm_loadu_pd(p), mm), vv));
+	memmuladddouble(p, length, m, v);
+}
+
+static void
+memfill2_sse2(unsigned short *p, Py_ssize_t length, unsigned short v) {
+	__m128i vv = _mm_set1_epi16((short)v);
+	for (; length >= 8; length -= 8, p += 8)
+		_mm_storeu_si128((__m128i *)p, vv);
+	memfill2(p, length, v);
+}
+
+static void
+memfill4_sse2(unsigned int *p, Py_ssize_t length, unsigned int v) {
+	__m128i vv = _mm_set1_epi32((int)v);
+	for (; length >= 4; length -= 4, p += 4)
+		_mm_storeu_si128((__m128i *)p, vv);
+	memfill4(p, length, v);
+}
+
+static void
+memfill8_sse2(unsigned PY_LONG_LONG *p, Py_ssize_t length, unsigned PY_LONG_LONG v) {
+	__m128i vv = _mm_set1_epi64x((PY_LONG_LONG)v);
+	for (; length >= 2; length -= 2, p += 2)
+		_mm_storeu_si128((__m128i *)p, vv);
+	memfill8(p, length, v);
+}
+
+// SSE2 has no 64-bit compare so both 32-bit halves must match
+static Py_ssize_t
+memfind8_sse2(const unsigned PY_LONG_LONG *p, Py_ssize_t length, unsigned PY_LONG_LONG v) {
+	__m128i vv = _mm_set1_epi64x((PY_LONG_LONG)v);
+	Py_ssize_t i = 0;
+	for (; i + 2 <= length; i += 2) {
+		__m128i halves = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i *)(p + i)), vv);
+		int mask = _mm_movemask_epi8(_mm_and_si128(halves, _mm_shuffle_epi32(halves, _MM_SHUFFLE(2, 3, 0, 1))));
+		if (mask)
+			return i + __builtin_ctz(mask) / 8;
+	}
+	return i + memfind8(p + i, length - i, v);
+}
+
+// Sums of absolute differences from zero add 8 bytes at a time
+static PY_LONG_LONG
+memsum1_sse2(const unsigned char *p, Py_ssize_t length) {
+	__m128i zero = _mm_setzero_si128();
+	__m128i total = zero;
+	Py_ssize_t i = 0;
+	for (; i + 16 <= length; i += 16)
+		total = _mm_add_epi64(total, _mm_sad_epu8(_mm_loadu_si128((const __m128i *)(p + i)), zero));
+	total = _mm_add_epi64(total, _mm_unpackhi_epi64(total, total));
+	return _mm_cvtsi128_si64(total) + memsum1(p + i, length - i);
+}
+
+// SSE2 has no 32-bit low multiply so 32-bit multiply-add uses the scalar kernel
+static const GapBufferKernels kernelsSSE2 = {
+	"sse2",
+	memincr1_sse2, memincr2_sse2, memincr4_sse2, memincr8_sse2,
+	memsat1_sse2, memsat2_sse2, memsat4_sse2, memsatsigned4_sse2,
+	memmuladd1_sse2, memmuladd2_sse2, memmuladd4,
+	memfind2_sse2, memfind4_sse2,
+	memascii2_sse2, memascii4_sse2,
+	memsatsigned1_sse2, memsatsigned2_sse2,
+	memmuladdfloat_sse2, memmuladddouble_sse2,
+	memfill2_sse2, memfill4_sse2, memfill8_sse2,
+	memfind8_sse2,
+	memsum1_sse2,
+};
+
+// AVX2 versions process 32 bytes at a time then finish with the SSE2 kernel
+
+#define GAPBUFFER_AVX2 __attribute__((target("avx2")))
+
+static GAPBUFFER_AVX2 void
+memincr1_avx2(char *p, Py_ssize_t length, int v) {
+	__m256i vv = _mm256_set1_epi8((char)v);
+	for (; length >= 32; length -= 32, p += 32)
+		_mm256_storeu_si256((__m256i *)p, _mm256_add_epi8(_mm256_loadu_si256((__m256i *)p), vv));
+	memincr1_sse2(p, length, v);
+}
+
+static GAPBUFFER_AVX2 void
+memincr2_avx2(short *p, Py_ssize_t length, int v) {
+	__m256i vv = _mm256_set1_epi16((short)v);
+	for (; length >= 16; length -= 16, p += 16)
+		_mm256_storeu_si256((__m256i *)p, _mm256_add_epi16(_mm256_loadu_si256((__m256i *)p), vv));
+	memincr2_sse2(p, length, v);
+}
+
+static GAPBUFFER_AVX2 void
+memincr4_avx2(int *p, Py_ssize_t length, int v) {
+	__m256i vv = _mm256_set1_epi32(v);
+	for (; length >= 8; length -= 8, p += 8)
+		_mm256_storeu_si256((__m256i *)p, _mm256_add_epi32(_mm256_loadu_si256((__m256i *)p), vv));
+	memincr4_sse2(p, length, v);
+}
+
+static GAPBUFFER_AVX2 void
+memincr8_avx2(PY_LONG_LONG *p, Py_ssize_t length, PY_LONG_LONG v) {
+	__m256i vv = _mm256_set1_epi64x(v);
+	for (; length >= 4; length -= 4, p += 4)
+		_mm256_storeu_si256((__m256i *)p, _mm256_add_epi64(_mm256_loadu_si256((__m256i *)p), vv));
+	memincr8_sse2(p, length, v);
+}
+
+static GAPBUFFER_AVX2 void
+memsat1_avx2(unsigned char *p, Py_ssize_t length, int v) {
+	unsigned int magnitude = (v < 0) ? 0u - (unsigned int)v : (unsigned int)v;
+	__m256i vv = _mm256_set1_epi8((char)((magnitude > 0xFF) ? 0xFF : magnitude));
+	for (; length >= 32; length -= 32, p += 32) {
+		__m256i x = _mm256_loadu_si256((__m256i *)p);
+		x = (v < 0) ? _mm256_subs_epu8(x, vv) : _mm256_adds_epu8(x, vv);
+		_mm256_storeu_si256((__m256i *)p, x);
+	}
+	memsat1_sse2(p, length, v);
+}
+
+static GAPBUFFER_AVX2 void
+memsat2_avx2(unsigned short *p, Py_ssize_t length, int v) {
+	unsigned int magnitude = (v < 0) ? 0u - (unsigned int)v : (unsigned int)v;
+	__m256i vv = _mm256_set1_epi16((short)((magnitude > 0xFFFF) ? 0xFFFF : magnitude));
+	for (; length >= 16; length -= 16, p += 16) {
+		__m256i x = _mm256_loadu_si256((__m256i *)p);
+		x = (v < 0) ? _mm256_subs_epu16(x, vv) : _mm256_adds_epu16(x, vv);
+		_mm256_storeu_si256((__m256i *)p, x);
+	}
+	memsat2_sse2(p, length, v);
+}
+
+static GAPBUFFER_AVX2 void
+memsat4_avx2(unsigned int *p, Py_ssize_t length, int v) {
+	__m256i vv = _mm256_set1_epi32(v);
+	__m256i limit = _mm256_set1_epi32((v < 0) ? 0 : -1);
+	for (; length >= 8; length -= 8, p += 8) {
+		__m256i x = _mm256_loadu_si256((__m256i *)p);
+		__m256i r = _mm256_add_epi32(x, vv);
+		// Unsigned r < x (or r > x when subtracting) when max(r, x) differs from the expected side
+		__m256i wrapped = (v < 0) ?
+		        _mm256_xor_si256(_mm256_cmpeq_epi32(_mm256_max_epu32(r, x), x), _mm256_set1_epi32(-1)) :
+		        _mm256_xor_si256(_mm256_cmpeq_epi32(_mm256_max_epu32(r, x), r), _mm256_set1_epi32(-1));
+		_mm256_storeu_si256((__m256i *)p, _mm256_blendv_epi8(r, limit, wrapped));
+	}
+	memsat4_sse2(p, length, v);
+}
+
+static GAPBUFFER_AVX2 void
+memsatsigned4_avx2(int *p, Py_ssize_t length, int v) {
+	__m256i vv = _mm256_set1_epi32(v);
+	__m256i limit = _mm256_set1_epi32((v < 0) ? INT_MIN : INT_MAX);
+	for (; length >= 8; length -= 8, p += 8) {
+		__m256i x = _mm256_loadu_si256((__m256i *)p);
+		__m256i r = _mm256_add_epi32(x, vv);
+		__m256i wrapped = (v < 0) ? _mm256_cmpgt_epi32(r, x) : _mm256_cmpgt_epi32(x, r);
+		_mm256_storeu_si256((__m256i *)p, _mm256_blendv_epi8(r, limit, wrapped));
+	}
+	memsatsigned4_sse2(p, length, v);
+}
+
+static GAPBUFFER_AVX2 void
+memmuladd1_avx2(unsigned char *p, Py_ssize_t length, int m, int v) {
+	__m256i mm = _mm256_set1_epi16((short)(m & 0xFF));
+	__m256i vv = _mm256_set1_epi8((char)v);
+	__m256i lowBytes = _mm256_set1_epi16(0xFF);
+	for (; length >= 32; length -= 32, p += 32) {
+		__m256i x = _mm256_loadu_si256((__m256i *)p);
+		__m256i even = _mm256_and_si256(_mm256_mullo_epi16(x, mm), lowBytes);
+		__m256i odd = _mm256_slli_epi16(_mm256_mullo_epi16(_mm256_srli_epi16(x, 8), mm), 8);
+		_mm256_storeu_si256((__m256i *)p, _mm256_add_epi8(_mm256_or_si256(even, odd), vv));
+	}
+	memmuladd1_sse2(p, length, m, v);
+}
+
+static GAPBUFFER_AVX2 void
+memmuladd2_avx2(unsigned short *p, Py_ssize_t length, int m, int v) {
+	__m256i mm = _mm256_set1_epi16((short)m);
+	__m256i vv = _mm256_set1_epi16((short)v);
+	for (; length >= 16; length -= 16, p += 16) {
+		__m256i x = _mm256_loadu_si256((__m256i *)p);
+		_mm256_storeu_si256((__m256i *)p, _mm256_add_epi16(_mm256_mullo_epi16(x, mm), vv));
+	}
+	memmuladd2_sse2(p, length, m, v);
+}
+
+static GAPBUFFER_AVX2 void
+memmuladd4_avx2(unsigned int *p, Py_ssize_t length, int m, int v) {
+	__m256i mm = _mm256_set1_epi32(m);
+	__m256i vv = _mm256_set1_epi32(v);
+	for (; length >= 8; length -= 8, p += 8) {
+		__m256i x = _mm256_loadu_si256((__m256i *)p);
+		_mm256_storeu_si256((__m256i *)p, _mm256_add_epi32(_mm256_mullo_epi32(x, mm), vv));
+	}
+	memmuladd4(p, length, m, v);
+}
+
+static GAPBUFFER_AVX2 Py_ssize_t
+memfind2_avx2(const unsigned short *p, Py_ssize_t length, unsigned int v) {
+	__m256i vv = _mm256_set1_epi16((short)v);
+	Py_ssize_t i = 0;
+	for (; i + 16 <= length; i += 16) {
+		unsigned int mask = (unsigned int)_mm256_movemask_epi8(
+		        _mm256_cmpeq_epi16(_mm256_loadu_si256((const __m256i *)(p + i)), vv));
+		if (mask)
+			return i + __builtin_ctz(mask) / 2;
+	}
+	return i + memfind2_sse2(p + i, length - i, v);
+}
+
+static GAPBUFFER_AVX2 Py_ssize_t
+memfind4_avx2(const unsigned int *p, Py_ssize_t length, unsigned int v) {
+	__m256i vv = _mm256_set1_epi32((int)v);
+	Py_ssize_t i = 0;
+	for (; i + 8 <= length; i += 8) {
+		unsigned int mask = (unsigned int)_mm256_movemask_epi8(
+		        _mm256_cmpeq_epi32(_mm256_loadu_si256((const __m256i *)(p + i)), vv));
+		if (mask)
+			return i + __builtin_ctz(mask) / 4;
+	}
+	return i + memfind4_sse2(p + i, length - i, v);
+}
+
+static GAPBUFFER_AVX2 Py_ssize_t
+memascii2_avx2(const unsigned char *p, Py_ssize_t length, unsigned short *out) {
+	Py_ssize_t i = 0;
+	for (; i + 32 <= length; i += 32) {
+		if (_mm256_movemask_epi8(_mm256_loadu_si256((const __m256i *)(p + i))))
+			break;
+		_mm256_storeu_si256((__m256i *)(out + i),
+		        _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(p + i))));
+		_mm256_storeu_si256((__m256i *)(out + i + 16),
+		        _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(p + i + 16))));
+	}
+	// Leave the upper halves clear as every short run of text ends here
+	_mm256_zeroupper();
+	return i + memascii2_sse2(p + i, length - i, out + i);
+}
+
+static GAPBUFFER_AVX2 Py_ssize_t
+memascii4_avx2(const unsigned char *p, Py_ssize_t length, unsigned int *out) {
+	Py_ssize_t i = 0;
+	int k;
+	for (; i + 32 <= length; i += 32) {
+		if (_mm256_movemask_epi8(_mm256_loadu_si256((const __m256i *)(p + i))))
+			break;
+		for (k = 0; k < 32; k += 8)
+			_mm256_storeu_si256((__m256i *)(out + i + k),
+			        _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(p + i + k))));
+	}
+	// Leave the upper halves clear as every short run of text ends here
+	_mm256_zeroupper();
+	return i + memascii4_sse2(p + i, length - i, out + i);
+}
+
+static GAPBUFFER_AVX2 void
+memsatsigned1_avx2(signed char *p, Py_ssize_t length, int v) {
+	unsigned int magnitude = (v < 0) ? 0u - (unsigned int)v : (unsigned int)v;
+	__m256i vv = _mm256_set1_epi8((char)((magnitude > 0xFF) ? 0xFF : magnitude));
+	__m256i bias = _mm256_set1_epi8((char)0x80);
+	for (; length >= 32; length -= 32, p += 32) {
+		__m256i x = _mm256_xor_si256(_mm256_loadu_si256((__m256i *)p), bias);
+		x = (v < 0) ? _mm256_subs_epu8(x, vv) : _mm256_adds_epu8(x, vv);
+		_mm256_storeu_si256((__m256i *)p, _mm256_xor_si256(x, bias));
+	}
+	memsatsigned1_sse2(p, length, v);
+}
+
+static GAPBUFFER_AVX2 void
+memsatsigned2_avx2(short *p, Py_ssize_t length, int v) {
+	unsigned int magnitude = (v < 0) ? 0u - (unsigned int)v : (unsigned int)v;
+	__m256i vv = _mm256_set1_epi16((short)((magnitude > 0xFFFF) ? 0xFFFF : magnitude));
+	__m256i bias = _mm256_set1_epi16((short)0x8000);
+	for (; length >= 16; length -= 16, p += 16) {
+		__m256i x = _mm256_xor_si256(_mm256_loadu_si256((__m256i *)p), bias);
+		x = (v < 0) ? _mm256_subs_epu16(x, vv) : _mm256_adds_epu16(x, vv);
+		_mm256_storeu_si256((__m256i *)p, _mm256_xor_si256(x, bias));
+	}
+	memsatsigned2_sse2(p, length, v);
+}
+
+static GAPBUFFER_AVX2 void
+memmuladdfloat_avx2(float *p, Py_ssize_t length, float m, float v) {
+	__m256 mm = _mm256_set1_ps(m);
+	__m256 vv = _mm256_set1_ps(v);
+	for (; length >= 8; length -= 8, p += 8)
+		_mm256_storeu_ps(p, _mm256_add_ps(_mm256_mul_ps(_mm256_loadu_ps(p), mm), vv));
+	memmuladdfloat_sse2(p, length, m, v);
+}
+
+static GAPBUFFER_AVX2 void
+memmuladddouble_avx2(double *p, Py_ssize_t length, double m, double v) {
+	__m256d mm = _mm256_set1_pd(m);
+	__m256d vv = _mm256_set1_pd(v);
+	for (; length >= 4; length -= 4, p += 4)
+		_mm256_storeu_pd(p, _mm256_add_pd(_mm256_mul_pd(_mm256_loadu_pd(p), mm), vv));
+	memmuladddouble_sse2(p, length, m, v);
+}
+
+static GAPBUFFER_AVX2 void
+memfill2_avx2(unsigned short *p, Py_ssize_t length, unsigned short v) {
+	__m256i vv = _mm256_set1_epi16((short)v);
+	for (; length >= 16; length -= 16, p += 16)
+		_mm256_storeu_si256((__m256i *)p, vv);
+	memfill2_sse2(p, length, v);
+}
+
+static GAPBUFFER_AVX2 void
+memfill4_avx2(unsigned int *p, Py_ssize_t length, unsigned int v) {
+	__m256i vv = _mm256_set1_epi32((int)v);
+	for (; length >= 8; length -= 8, p += 8)
+		_mm256_storeu_si256((__m256i *)p, vv);
+	memfill4_sse2(p, length, v);
+}
+
+static GAPBUFFER_AVX2 void
+memfill8_avx2(unsigned PY_LONG_LONG *p, Py_ssize_t length, unsigned PY_LONG_LONG v) {
+	__m256i vv = _mm256_set1_epi64x((PY_LONG_LONG)v);
+	for (; length >= 4; length -= 4, p += 4)
+		_mm256_storeu_si256((__m256i *)p, vv);
+	memfill8_sse2(p, length, v);
+}
+
+static GAPBUFFER_AVX2 Py_ssize_t
+memfind8_avx2(const unsigned PY_LONG_LONG *p, Py_ssize_t length, unsigned PY_LONG_LONG v) {
+	__m256i vv = _mm256_set1_epi64x((PY_LONG_LONG)v);
+	Py_ssize_t i = 0;
+	for (; i + 4 <= length; i += 4) {
+		unsigned int mask = (unsigned int)_mm256_movemask_epi8(
+		        _mm256_cmpeq_epi64(_mm256_loadu_si256((const __m256i *)(p + i)), vv));
+		if (mask)
+			return i + __builtin_ctz(mask) / 8;
+	}
+	return i + memfind8_sse2(p + i, length - i, v);
+}
+
+static GAPBUFFER_AVX2 PY_LONG_LONG
+memsum1_avx2(const unsigned char *p, Py_ssize_t length) {
+	__m256i zero = _mm256_setzero_si256();
+	__m256i total = zero;
+	__m128i half;
+	Py_ssize_t i = 0;
+	for (; i + 32 <= length; i += 32)
+		total = _mm256_add_epi64(total, _mm256_sad_epu8(_mm256_loadu_si256((const __m256i *)(p + i)), zero));
+	half = _mm_add_epi64(_mm256_castsi256_si128(total), _mm256_extracti128_si256(total, 1));
+	half = _mm_add_epi64(half, _mm_unpackhi_epi64(half, half));
+	return _mm_cvtsi128_si64(half) + memsum1_sse2(p + i, length - i);
+}
+
+static const GapBufferKernels kernelsAVX2 = {
+	"avx2",
+	memincr1_avx2, memincr2_avx2, memincr4_avx2, memincr8_avx2,
+	memsat1_avx2, memsat2_avx2, memsat4_avx2, memsatsigned4_avx2,
+	memmuladd1_avx2, memmuladd2_avx2, memmuladd4_avx2,
+	memfind2_avx2, memfind4_avx2,
+	memascii2_avx2, memascii4_avx2,
+	memsatsigned1_avx2, memsatsigned2_avx2,
+	memmuladdfloat_avx2, memmuladddouble_avx2,
+	memfill2_avx2, memfill4_avx2, memfill8_avx2,
+	memfind8_avx2,
+	memsum1_avx2,
+};
+
+#endif
+
+// Kernels chosen by _GapBuffer_ChooseKernels or set_simd
+static const GapBufferKernels *kernels = &kernelsScalar;
+
+// The most capable kernels supported by this processor
+static const GapBufferKernels *
+_GapBuffer_BestKernels(void) {
+#ifdef GAPBUFFER_X86_KERNELS
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		return &kernelsAVX2;
+	return &kernelsSSE2;
+#else
+	return &kernelsScalar;
+#endif
+}
+
+// UTF-8 decoding for feed_utf8
+
+// Decode the sequence at the start of s into *c, returning its length, 0 when
+// length ends part way through a valid sequence or -1 when it is invalid.
+// Overlong forms, surrogates and values beyond 0x10FFFF are invalid.
+static int
+_GapBuffer_Utf8Sequence(const unsigned char *s, Py_ssize_t length, unsigned int *c) {
+	unsigned int lower = 0x80;
+	unsigned int upper = 0xBF;
+	int need;
+	int k;
+	if ((s[0] >= 0xC2) && (s[0] <= 0xDF)) {
+		need = 2;
+		*c = s[0] & 0x1F;
+	} else if ((s[0] >= 0xE0) && (s[0] <= 0xEF)) {
+		need = 3;
+		*c = s[0] & 0x0F;
+		if (s[0] == 0xE0)
+			lower = 0xA0;
+		else if (s[0] == 0xED)
+			upper = 0x9F;
+	} else if ((s[0] >= 0xF0) && (s[0] <= 0xF4)) {
+		need = 4;
+		*c = s[0] & 0x07;
+		if (s[0] == 0xF0)
+			lower = 0x90;
+		else if (s[0] == 0xF4)
+			upper = 0x8F;
+	} else {
+		return -1;
+	}
+	for (k = 1; k < need; k++) {
+		if (k >= length)
+			return 0;
+		if ((s[k] < lower) || (s[k] > upper))
+			return -1;
+		lower = 0x80;
+		upper = 0xBF;
+		*c = (*c << 6) | (s[k] & 0x3F);
+	}
+	return need;
+}
+
+// Decode UTF-8 into items of itemSize bytes, with surrogate pairs for 2 byte
+// items. Single byte items are only used when every character fits.
+// Runs of ASCII go through the widening kernels. Stops before a
+// sequence that is cut off by the end of s. Returns the number of items
+// written with *used set to the bytes decoded, or -1 with *used set to the
+// start of an invalid sequence.
+static Py_ssize_t
+_GapBuffer_DecodeUtf8(const unsigned char *s, Py_ssize_t length, char *out, int itemSize, Py_ssize_t *used) {
+	unsigned char *out1 = (unsigned char *)out;
+	unsigned short *out2 = (unsigned short *)out;
+	unsigned int *out4 = (unsigned int *)out;
+	Py_ssize_t i = 0;
+	Py_ssize_t n = 0;
+	while (i < length) {
+		unsigned int c;
+		int need;
+		if (s[i] < 0x80) {
+			Py_ssize_t run = 1;
+			if (itemSize == 1)
+				out1[n] = s[i];
+			else if (itemSize == 2)
+				run = kernels->ascii2(s + i, length - i, out2 + n);
+			else
+				run = kernels->ascii4(s + i, length - i, out4 + n);
+			i += run;
+			n += run;
+			continue;
+		}
+		need = _GapBuffer_Utf8Sequence(s + i, length - i, &c);
+		if (need == 0)
+			break;
+		if (need < 0) {
+			*used = i;
+			return -1;
+		}
+		if (itemSize == 4) {
+			out4[n++] = c;
+		} else if (itemSize == 1) {
+			out1[n++] = (unsigned char)c;
+		} else if (c >= 0x10000) {
+			out2[n++] = 0xD800 + ((c - 0x10000) >> 10);
+			out2[n++] = 0xDC00 + ((c - 0x10000) & 0x3FF);
+		} else {
+			out2[n++] = c;
+		}
+		i += need;
+	}
+	*used = i;
+	return n;
+}
+
+static PyObject *
+GapBuffer_feed_utf8(GapBuffer* self, PyObject *args) {
+	Py_buffer data;
+	int final = 0;
+	const unsigned char *s;
+	Py_ssize_t length;
+	unsigned char head[8];
+	Py_ssize_t headLength = 0;
+	Py_ssize_t headUsed = 0;
+	Py_ssize_t headItems = 0;
+	Py_ssize_t taken = 0;
+	Py_ssize_t used = 0;
+	Py_ssize_t items;
+	Py_ssize_t position;
+	char *out;
+	char *scratch = NULL;
+	const char *reason = NULL;
+	Py_ssize_t errorAt = 0;
+	PyThreadState *state;
+
+	if (self->lock) {
+		PyErr_SetString(PyExc_BufferError, "Object is locked.");
+		return NULL;
+	}
+	if (self->itemType != 'u') {
+		PyErr_SetString(PyExc_TypeError, "GapBuffer.feed_utf8(data): only for 'u' buffers");
+		return NULL;
+	}
+	if (!PyArg_ParseTuple(args, "s*|i:feed_utf8", &data, &final)) {
+		return NULL;
+	}
+	s = (const unsigned char *)data.buf;
+	length = data.len;
+
+	_GapBuffer_Wait(self, 1);
+	_GapBuffer_Acquire(self, 1);
+	if (self->compact) {
+		// Lead bytes show the widest character that may be decoded
+		unsigned char highest = 0;
+		Py_ssize_t i;
+		for (i = 0; i < self->pendingLength; i++)
+			highest = (self->pendingUtf8[i] > highest) ? self->pendingUtf8[i] : highest;
+		for (i = 0; i < length; i++)
+			highest = (s[i] > highest) ? s[i] : highest;
+		if (_GapBuffer_Widen(self, (highest >= 0xF0) ? 4 : (highest >= 0xC4) ? 2 : 1) < 0)
+			goto fail;
+	}
+	// Every byte decodes to at most one item, as do the bytes held over
+	if (_GapBuffer_RoomForEdits(self, (self->pendingLength + length) * self->itemSize, 1) < 0)
+		goto fail;
+	position = self->lengthBody;
+	if (self->root) {
+		scratch = PyMem_Malloc((self->pendingLength + length) * self->itemSize + 1);
+		if (scratch == NULL) {
+			PyErr_NoMemory();
+			goto fail;
+		}
+		out = scratch;
+	} else {
+		_GapBuffer_GapTo(self, position);
+		if (self->snapshots)
+			_GapBuffer_Touch(self, position, position + (self->pendingLength + length) * self->itemSize);
+		out = self->body + self->part1Length;
+	}
+
+	// Complete a sequence held over from the previous call
+	if (self->pendingLength > 0) {
+		memcpy(head, self->pendingUtf8, self->pendingLength);
+		taken = 4 - self->pendingLength;
+		if (taken > length)
+			taken = length;
+		memcpy(head + self->pendingLength, s, taken);
+		headLength = self->pendingLength + taken;
+		headItems = _GapBuffer_DecodeUtf8(head, headLength, out, self->itemSize, &headUsed);
+		if (headItems < 0) {
+			reason = "invalid utf-8 sequence";
+			if (headUsed > self->pendingLength)
+				errorAt = headUsed - self->pendingLength;
+			goto decodeError;
+		}
+		if (headUsed == 0) {
+			// Still cut off so all of data joins the held over bytes
+			if (final) {
+				reason = "unexpected end of data";
+				errorAt = length;
+				goto decodeError;
+			}
+			memcpy(self->pendingUtf8 + self->pendingLength, s, length);
+			self->pendingLength += length;
+			_GapBuffer_Release(self);
+			PyBuffer_Release(&data);
+			Py_INCREF(Py_None);
+			return Py_None;
+		}
+		taken = headUsed - self->pendingLength;
+	}
+
+	state = _GapBuffer_Unblock(self, (length - taken) * self->itemSize, 1);
+	items = _GapBuffer_DecodeUtf8(s + taken, length - taken, out + headItems * self->itemSize,
+	        self->itemSize, &used);
+	_GapBuffer_Block(state);
+	if (items < 0) {
+		reason = "invalid utf-8 sequence";
+		errorAt = taken + used;
+		goto decodeError;
+	}
+	if (final && (taken + used < length)) {
+		reason = "unexpected end of data";
+		errorAt = taken + used;
+		goto decodeError;
+	}
+	items += headItems;
+
+	if (self->root) {
+		_GapBuffer_Release(self);
+		if (_GapBuffer_insertarray(self, position, scratch, items * self->itemSize) < 0) {
+			PyMem_Free(scratch);
+			PyBuffer_Release(&data);
+			return NULL;
+		}
+		PyMem_Free(scratch);
+	} else {
+		// The items are already in the gap where the line index and undo
+		// history can read them before they become part of the text
+		if (self->lines && (_GapBuffer_LinesInserted(self, position, out, items * self->itemSize) < 0))
+			goto fail;
+		if (self->styles)
+			_GapBuffer_StylesInserted(self, position, items * self->itemSize);
+		if (self->undo)
+			_GapBuffer_UndoRecord(self, UNDO_INSERT, position, out, items * self->itemSize);
+		self->lengthBody += items * self->itemSize;
+		self->part1Length += items * self->itemSize;
+		self->gapLength -= items * self->itemSize;
+		_GapBuffer_Release(self);
+	}
+	self->pendingLength = (int)(length - taken - used);
+	memcpy(self->pendingUtf8, s + taken + used, self->pendingLength);
+	PyBuffer_Release(&data);
+	Py_INCREF(Py_None);
+	return Py_None;
+
+decodeError:
+	{
+		PyObject *error = PyUnicodeDecodeError_Create("utf-8", (const char *)s, length,
+		        errorAt, (errorAt < length) ? errorAt + 1 : length, reason);
+		if (error != NULL) {
+			PyErr_SetObject(PyExc_UnicodeDecodeError, error);
+			Py_DECREF(error);
+		}
+	}
+fail:
+	PyMem_Free(scratch);
+	_GapBuffer_Release(self);
+	PyBuffer_Release(&data);
+	return NULL;
+}
+
+// Operations applied to a range of items
+#define TRANSFORM_ADD 0
+#define TRANSFORM_SATURATE 1
+#define TRANSFORM_MULTIPLY_ADD 2
+#define TRANSFORM_FILL 3
+
+// Integer operands wrap to the width of the items while floating point
+// buffers use the real operands
+typedef struct {
+	int operation;
+	PY_LONG_LONG multiplier;
+	PY_LONG_LONG value;
+	double realMultiplier;
+	double realValue;
+	char item[8];	// Item stored by TRANSFORM_FILL
+}
+GapBufferOperation;
+
+static void
+_GapBuffer_OperationInit(GapBufferOperation *op, int operation, PY_LONG_LONG value) {
+	memset(op, 0, sizeof(*op));
+	op->operation = operation;
+	op->multiplier = 1;
+	op->value = value;
+	op->realMultiplier = 1.0;
+	op->realValue = (double)value;
+}
+
+// Saturating additions of the same sign compose so a value wider than an int
+// is added in parts. Any value beyond 32 bits saturates items of 4 bytes or less.
+static void
+_GapBuffer_saturateItems(GapBuffer* self, char *ptr, Py_ssize_t items, PY_LONG_LONG value) {
+	int isSigned = GAPBUFFER_SIGNED(self->itemType);
+	if (self->itemSize == 8) {
+		if (isSigned)
+			memsatsigned8((PY_LONG_LONG *)ptr, items, value);
+		else
+			memsat8((unsigned PY_LONG_LONG *)ptr, items, value);
+		return;
+	}
+	if (value > 0xFFFFFFFFLL)
+		value = 0xFFFFFFFFLL;
+	else if (value < -0xFFFFFFFFLL)
+		value = -0xFFFFFFFFLL;
+	while (value != 0) {
+		int part = (value > INT_MAX) ? INT_MAX : ((value < -INT_MAX) ? -INT_MAX : (int)value);
+		// Characters are unsigned
+		switch (self->itemSize) {
+		case 1:
+			if (isSigned)
+				kernels->saturateSigned1((signed char *)ptr, items, part);
+			else
+				kernels->saturate1((unsigned char *)ptr, items, part);
+			break;
+		case 2:
+			if (isSigned)
+				kernels->saturateSigned2((short *)ptr, items, part);
+			else
+				kernels->saturate2((unsigned short *)ptr, items, part);
+			break;
+		case 4:
+			if (isSigned)
+				kernels->saturateSigned4((int *)ptr, items, part);
+			else
+				kernels->saturate4((unsigned int *)ptr, items, part);
+			break;
+		}
+		value -= part;
+	}
+}
+
+static void
+_GapBuffer_transformItems(GapBuffer* self, char *ptr, Py_ssize_t items, const GapBufferOperation *op) {
+	if (GAPBUFFER_FLOAT(self->itemType)) {
+		double multiplier = (op->operation == TRANSFORM_MULTIPLY_ADD) ? op->realMultiplier : 1.0;
+		if (op->operation == TRANSFORM_FILL) {
+			if (self->itemSize == sizeof(float))
+				kernels->fill4((unsigned int *)ptr, items, *(const unsigned int *)op->item);
+			else
+				kernels->fill8((unsigned PY_LONG_LONG *)ptr, items, *(const unsigned PY_LONG_LONG *)op->item);
+		} else if (self->itemSize == sizeof(float)) {
+			kernels->multiplyAddFloat((float *)ptr, items, (float)multiplier, (float)op->realValue);
+		} else {
+			kernels->multiplyAddDouble((double *)ptr, items, multiplier, op->realValue);
+		}
+		return;
+	}
+	switch (op->operation) {
+	case TRANSFORM_ADD:
+		// Narrower items wrap so the value is truncated
+		switch (self->itemSize) {
+		case 1:
+			kernels->add1(ptr, items, (int)op->value);
+			break;
+		case 2:
+			kernels->add2((short *)ptr, items, (int)op->value);
+			break;
+		case 4:
+			kernels->add4((int *)ptr, items, (int)op->value);
+			break;
+		case 8:
+			kernels->add8((PY_LONG_LONG *)ptr, items, op->value);
+			break;
+		}
+		break;
+	case TRANSFORM_SATURATE:
+		_GapBuffer_saturateItems(self, ptr, items, op->value);
+		break;
+	case TRANSFORM_MULTIPLY_ADD:
+		switch (self->itemSize) {
+		case 1:
+			kernels->multiplyAdd1((unsigned char *)ptr, items, (int)op->multiplier, (int)op->value);
+			break;
+		case 2:
+			kernels->multiplyAdd2((unsigned short *)ptr, items, (int)op->multiplier, (int)op->value);
+			break;
+		case 4:
+			kernels->multiplyAdd4((unsigned int *)ptr, items, (int)op->multiplier, (int)op->value);
+			break;
+		case 8:
+			memmuladd8((unsigned PY_LONG_LONG *)ptr, items, op->multiplier, op->value);
+			break;
+		}
+		break;
+	case TRANSFORM_FILL:
+		switch (self->itemSize) {
+		case 1:
+			memset(ptr, op->item[0], items);
+			break;
+		case 2:
+			kernels->fill2((unsigned short *)ptr, items, *(const unsigned short *)op->item);
+			break;
+		case 4:
+			kernels->fill4((unsigned int *)ptr, items, *(const unsigned int *)op->item);
+			break;
+		case 8:
+			kernels->fill8((unsigned PY_LONG_LONG *)ptr, items, *(const unsigned PY_LONG_LONG *)op->item);
+			break;
+		}
+		break;
+	}
+}
+
+// Apply an operation to length items starting at item position on both sides of the gap
+static void
+_GapBuffer_transform(GapBuffer* self, Py_ssize_t position, Py_ssize_t length, const GapBufferOperation *op) {
+	position *= self->itemSize;
+	length *= self->itemSize;
+	while (length > 0) {
+		char *ptr;
+		Py_ssize_t run = _GapBuffer_segment(self, position, &ptr);
+		if (run > length)
+			run = length;
+		if (self->snapshots)
+			_GapBuffer_Touch(self, ptr - self->body, ptr - self->body + run);
+		_GapBuffer_transformItems(self, ptr, run / self->itemSize, op);
+		position += run;
+		length -= run;
+	}
+}
+
+// Add the pending step to items before upTo so the step starts at upTo
+static void
+_GapBuffer_ApplyStep(GapBuffer *self, Py_ssize_t upTo) {
+	if (upTo > self->stepStart) {
+		GapBufferOperation op;
+		_GapBuffer_OperationInit(&op, TRANSFORM_ADD, self->stepLength);
+		_GapBuffer_transform(self, self->stepStart, upTo - self->stepStart, &op);
+	}
+	self->stepStart = upTo;
+	if (self->stepStart >= self->lengthBody / self->itemSize)
+		self->stepLength = 0;
+}
+
+// Remove the pending step from items from downTo so the step starts at downTo
+static void
+_GapBuffer_BackStep(GapBuffer *self, Py_ssize_t downTo) {
+	GapBufferOperation op;
+	_GapBuffer_OperationInit(&op, TRANSFORM_ADD, -(PY_LONG_LONG)self->stepLength);
+	_GapBuffer_transform(self, downTo, self->stepStart - downTo, &op);
+	self->stepStart = downTo;
+}
+
+// Fold any pending step into the body so every item holds its real value.
+// Called before the body is read in bulk or exposed.
+static void
+_GapBuffer_Settle(GapBuffer *self) {
+	if (self->stepLength != 0)
+		_GapBuffer_ApplyStep(self, self->lengthBody / self->itemSize);
+}
+
+// Register as a reader once the pending step is settled, as settling writes
+static void
+_GapBuffer_AcquireRead(GapBuffer *self) {
+	for (;;) {
+		_GapBuffer_Acquire(self, 0);
+		if (self->stepLength == 0)
+			return;
+		_GapBuffer_Release(self);
+		_GapBuffer_Wait(self, 1);
+		_GapBuffer_Settle(self);
+	}
+}
+
+// Register as a reader of two buffers once both are settled
+static void
+_GapBuffer_AcquireReadPair(GapBuffer *self, GapBuffer *other) {
+	for (;;) {
+		_GapBuffer_AcquirePair(self, 0, other, 0);
+		if ((self->stepLength == 0) && (other->stepLength == 0))
+			return;
+		_GapBuffer_Release(self);
+		_GapBuffer_Release(other);
+		_GapBuffer_Wait(self, 1);
+		_GapBuffer_Settle(self);
+		_GapBuffer_Wait(other, 1);
+		_GapBuffer_Settle(other);
+	}
+}
+
+// Copy bytes out of a registered buffer, releasing the GIL if there are many
+static void
+_GapBuffer_copyoutBulk(GapBuffer* self, Py_ssize_t position, Py_ssize_t length, char *destination) {
+	PyThreadState *state = _GapBuffer_Unblock(self, length, 0);
+	_GapBuffer_copyout(self, position, length, destination);
+	_GapBuffer_Block(state);
+}
+
+// Add value to every item from position to the end, moving the pending step
+// there so the cost is proportional to the distance the step moves.
+static void
+_GapBuffer_Step(GapBuffer *self, Py_ssize_t position, Py_ssize_t value) {
+	if (self->stepLength == 0) {
+		self->stepStart = position;
+	} else if (position > self->stepStart) {
+		_GapBuffer_ApplyStep(self, position);
+	} else if (position < self->stepStart) {
+		_GapBuffer_BackStep(self, position);
+	}
+	self->stepLength = (Py_ssize_t)((size_t)self->stepLength + (size_t)value);
+	if (self->stepStart >= self->lengthBody / self->itemSize)
+		self->stepLength = 0;
+}
+
+// Line index
+// lines holds the item position of the start of each line so line 0 always
+// starts at 0. Insertions and deletions move the following line starts with
+// a step so edits that stay near one place are cheap.
+
+static void _GapBuffer_delete(GapBuffer *self, Py_ssize_t position, Py_ssize_t size);
+
+// Start of line n from a line index, allowing for its pending step
+static Py_ssize_t
+_GapBuffer_lineStart(GapBuffer *lines, Py_ssize_t line) {
+	Py_ssize_t start = *(Py_ssize_t *)_GapBuffer_at(lines, line * lines->itemSize);
+	if ((lines->stepLength != 0) && (line >= lines->stepStart))
+		start += lines->stepLength;
+	return start;
+}
+
+// The line containing an item position is the last line starting at or before it
+static Py_ssize_t
+_GapBuffer_lineFromPosition(GapBuffer *lines, Py_ssize_t position) {
+	Py_ssize_t lower = 0;
+	Py_ssize_t upper = lines->lengthBody / lines->itemSize - 1;
+	while (lower < upper) {
+		Py_ssize_t middle = lower + (upper - lower + 1) / 2;
+		if (position < _GapBuffer_lineStart(lines, middle))
+			upper = middle - 1;
+		else
+			lower = middle;
+	}
+	return lower;
+}
+
+// Index of the first newline in a run of items or items when there is none
+static Py_ssize_t
+_GapBuffer_findNewline(GapBuffer *self, const char *text, Py_ssize_t items) {
+	const char *newline;
+	switch (self->itemSize) {
+	case 1:
+		newline = memchr(text, '\n', items);
+		return newline ? newline - text : items;
+	case 2:
+		return kernels->find2((const unsigned short *)text, items, '\n');
+	default:
+		return kernels->find4((const unsigned int *)text, items, '\n');
+	}
+}
+
+static Py_ssize_t
+_GapBuffer_countNewlines(GapBuffer *self, const char *text, Py_ssize_t items) {
+	Py_ssize_t count = 0;
+	Py_ssize_t i = 0;
+	while ((i += _GapBuffer_findNewline(self, text + i * self->itemSize, items - i)) < items) {
+		count++;
+		i++;
+	}
+	return count;
+}
+
+// Add a line after line for each newline in text which is at item position.
+// Room for the new lines must already be reserved. Returns the last line added.
+static Py_ssize_t
+_GapBuffer_addLines(GapBuffer *self, GapBuffer *lines, Py_ssize_t line,
+        const char *text, Py_ssize_t items, Py_ssize_t position) {
+	Py_ssize_t i = 0;
+	while ((i += _GapBuffer_findNewline(self, text + i * self->itemSize, items - i)) < items) {
+		Py_ssize_t start = position + ++i;
+		line++;
+		_GapBuffer_insertarray(lines, line * lines->itemSize, (const char *)&start, lines->itemSize);
+	}
+	return line;
+}
+
+// Create the line index by scanning the whole buffer
+static int
+_GapBuffer_LinesBuild(GapBuffer *self) {
+	GapBuffer *lines;
+	Py_ssize_t newlines = 0;
+	Py_ssize_t position = 0;
+	Py_ssize_t line = 0;
+	char *ptr;
+
+	// Growing the index may release the GIL
+	_GapBuffer_Acquire(self, 0);
+	while (position < self->lengthBody) {
+		Py_ssize_t run = _GapBuffer_segment(self, position, &ptr);
+		newlines += _GapBuffer_countNewlines(self, ptr, run / self->itemSize);
+		position += run;
+	}
+
+	lines = (GapBuffer *)GapBuffer_new(&gapbuffer_GapBufferType, NULL, NULL);
+	if (lines == NULL) {
+		_GapBuffer_Release(self);
+		return -1;
+	}
+	lines->itemType = 'n';
+	lines->itemSize = sizeof(Py_ssize_t);
+	lines->partitioned = 1;
+	if ((newlines > PY_SSIZE_T_MAX / lines->itemSize - 1) ||
+	        (_GapBuffer_RoomFor(lines, (newlines + 1) * lines->itemSize) < 0) ||
+	        (_GapBuffer_insertarray(lines, 0, (const char *)&line, lines->itemSize) < 0)) {
+		if (!PyErr_Occurred())
+			PyErr_NoMemory();
+		Py_DECREF(lines);
+		_GapBuffer_Release(self);
+		return -1;
+	}
+
+	position = 0;
+	while (position < self->lengthBody) {
+		Py_ssize_t run = _GapBuffer_segment(self, position, &ptr);
+		line = _GapBuffer_addLines(self, lines, line, ptr, run / self->itemSize, position / self->itemSize);
+		position += run;
+	}
+
+	_GapBuffer_Release(self);
+	Py_XDECREF(self->lines);
+	self->lines = (PyObject *)lines;
+	return 0;
+}
+
+// Update the line index before text is inserted at byte position.
+// Nothing is changed if the index can not grow.
+static int
+_GapBuffer_LinesInserted(GapBuffer *self, Py_ssize_t position, const char *text, Py_ssize_t insertLength) {
+	GapBuffer *lines = (GapBuffer *)self->lines;
+	Py_ssize_t items = insertLength / self->itemSize;
+	Py_ssize_t newlines = _GapBuffer_countNewlines(self, text, items);
+	Py_ssize_t line;
+
+	if ((newlines > 0) && (_GapBuffer_RoomFor(lines, newlines * lines->itemSize) < 0))
+		return -1;
+	position /= self->itemSize;
+	line = _GapBuffer_lineFromPosition(lines, position);
+	_GapBuffer_Step(lines, line + 1, items);
+	_GapBuffer_addLines(self, lines, line, text, items, position);
+	return 0;
+}
+
+// Update the line index for the deletion of size bytes at byte position
+static void
+_GapBuffer_LinesDeleted(GapBuffer *self, Py_ssize_t position, Py_ssize_t size) {
+	GapBuffer *lines = (GapBuffer *)self->lines;
+	Py_ssize_t items = size / self->itemSize;
+	Py_ssize_t first;
+	Py_ssize_t last;
+
+	position /= self->itemSize;
+	first = _GapBuffer_lineFromPosition(lines, position);
+	last = _GapBuffer_lineFromPosition(lines, position + items);
+	if (last > first)
+		_GapBuffer_delete(lines, (first + 1) * lines->itemSize, (last - first) * lines->itemSize);
+	_GapBuffer_Step(lines, first + 1, -items);
+}
+
+// In place changes may add or remove newlines anywhere in the range so rescan
+static int
+_GapBuffer_LinesChanged(GapBuffer *self) {
+	if (self->lines == NULL)
+		return 0;
+	return _GapBuffer_LinesBuild(self);
+}
+
+// Run styles
+// A RunStyles holds a value for each position of a sequence as runs of equal
+// values in the manner of Scintilla's RunStyles class so memory grows with
+// the number of runs rather than the length. starts is a partitioned buffer
+// of the position at which each run starts, followed by the length, and
+// values holds the value of each run. There is always at least one run and
+// only a sequence of length 0 has an empty run.
+
+typedef struct {
+	PyObject_HEAD
+	GapBuffer *starts;
+	GapBuffer *values;
+	int owned;	// Attached to a buffer which alone changes the length
+}
+GapBufferRunStyles;
+
+static PyTypeObject gapbuffer_RunStylesType;
+
+static Py_ssize_t
+_GapBuffer_RunCount(GapBufferRunStyles *runs) {
+	return runs->values->lengthBody / runs->values->itemSize;
+}
+
+#define _GapBuffer_RunStart(runs, run) _GapBuffer_lineStart((runs)->starts, (run))
+
+static Py_ssize_t
+_GapBuffer_RunsLength(GapBufferRunStyles *runs) {
+	return _GapBuffer_RunStart(runs, _GapBuffer_RunCount(runs));
+}
+
+static void
+_GapBuffer_SetRunStart(GapBufferRunStyles *runs, Py_ssize_t run, Py_ssize_t position) {
+	GapBuffer *starts = runs->starts;
+	if ((starts->stepLength != 0) && (run >= starts->stepStart))
+		position -= starts->stepLength;
+	*(Py_ssize_t *)_GapBuffer_at(starts, run * starts->itemSize) = position;
+}
+
+static Py_ssize_t
+_GapBuffer_RunValue(GapBufferRunStyles *runs, Py_ssize_t run) {
+	return *(Py_ssize_t *)_GapBuffer_at(runs->values, run * runs->values->itemSize);
+}
+
+// The run containing a position, which is the last run for the length
+static Py_ssize_t
+_GapBuffer_RunFromPosition(GapBufferRunStyles *runs, Py_ssize_t position) {
+	if (position >= _GapBuffer_RunsLength(runs))
+		return _GapBuffer_RunCount(runs) - 1;
+	return _GapBuffer_lineFromPosition(runs->starts, position);
+}
+
+static void
+_GapBuffer_RemoveRun(GapBufferRunStyles *runs, Py_ssize_t run) {
+	_GapBuffer_delete(runs->starts, run * runs->starts->itemSize, runs->starts->itemSize);
+	_GapBuffer_delete(runs->values, run * runs->values->itemSize, runs->values->itemSize);
+}
+
+static void
+_GapBuffer_RemoveRunIfEmpty(GapBufferRunStyles *runs, Py_ssize_t run) {
+	if ((run < _GapBuffer_RunCount(runs)) && (_GapBuffer_RunCount(runs) > 1) &&
+	        (_GapBuffer_RunStart(runs, run) == _GapBuffer_RunStart(runs, run + 1)))
+		_GapBuffer_RemoveRun(runs, run);
+}
+
+static void
+_GapBuffer_RemoveRunIfSameAsPrevious(GapBufferRunStyles *runs, Py_ssize_t run) {
+	if ((run > 0) && (run < _GapBuffer_RunCount(runs)) &&
+	        (_GapBuffer_RunValue(runs, run - 1) == _GapBuffer_RunValue(runs, run)))
+		_GapBuffer_RemoveRun(runs, run);
+}
+
+// Make a run start at position, returning that run. Room for one more run
+// must already be reserved.
+static Py_ssize_t
+_GapBuffer_SplitRun(GapBufferRunStyles *runs, Py_ssize_t position) {
+	Py_ssize_t run = _GapBuffer_RunFromPosition(runs, position);
+	if (_GapBuffer_RunStart(runs, run) < position) {
+		Py_ssize_t value = _GapBuffer_RunValue(runs, run);
+		run++;
+		_GapBuffer_insertarray(runs->starts, run * runs->starts->itemSize,
+		        (const char *)&position, runs->starts->itemSize);
+		_GapBuffer_insertarray(runs->values, run * runs->values->itemSize,
+		        (const char *)&value, runs->values->itemSize);
+	}
+	return run;
+}
+
+// Text inserted inside a run or at its end lengthens that run so insertion
+// never adds a run and can not fail
+static void
+_GapBuffer_RunsInsert(GapBufferRunStyles *runs, Py_ssize_t position, Py_ssize_t length) {
+	Py_ssize_t run = (position > 0) ? _GapBuffer_RunFromPosition(runs, position - 1) : 0;
+	_GapBuffer_Step(runs->starts, run + 1, length);
+}
+
+// Deletion only shortens and removes runs so can not fail either
+static void
+_GapBuffer_RunsDelete(GapBufferRunStyles *runs, Py_ssize_t position, Py_ssize_t length) {
+	Py_ssize_t end = position + length;
+	Py_ssize_t runStart = _GapBuffer_RunFromPosition(runs, position);
+	Py_ssize_t runEnd = _GapBuffer_RunFromPosition(runs, end);
+
+	if (runStart == runEnd) {
+		_GapBuffer_Step(runs->starts, runStart + 1, -length);
+		_GapBuffer_RemoveRunIfEmpty(runs, runStart);
+		return;
+	}
+	// The run containing end keeps the text after end and the runs between
+	// start and end are wholly deleted
+	_GapBuffer_SetRunStart(runs, runEnd, end);
+	if (runEnd > runStart + 1) {
+		_GapBuffer_delete(runs->starts, (runStart + 1) * runs->starts->itemSize,
+		        (runEnd - runStart - 1) * runs->starts->itemSize);
+		_GapBuffer_delete(runs->values, (runStart + 1) * runs->values->itemSize,
+		        (runEnd - runStart - 1) * runs->values->itemSize);
+	}
+	_GapBuffer_Step(runs->starts, runStart + 1, -length);
+	_GapBuffer_RemoveRunIfEmpty(runs, runStart + 1);
+	_GapBuffer_RemoveRunIfEmpty(runs, runStart);
+	_GapBuffer_RemoveRunIfSameAsPrevious(runs, runStart + 1);
+	_GapBuffer_RemoveRunIfSameAsPrevious(runs, runStart);
+}
+
+// Set the value of length items from position, returning 1 and setting
+// *changedStart and *changedLength to the range whose value changed, 0 if
+// none did or -1 with an exception set.
+static int
+_GapBuffer_RunsFill(GapBufferRunStyles *runs, Py_ssize_t position, Py_ssize_t length, Py_ssize_t value,
+        Py_ssize_t *changedStart, Py_ssize_t *changedLength) {
+	Py_ssize_t end = position + length;
+	Py_ssize_t runStart;
+	Py_ssize_t runEnd;
+
+	if (length <= 0)
+		return 0;
+	// Splitting at both ends adds at most two runs
+	if ((_GapBuffer_RoomFor(runs->starts, 2 * runs->starts->itemSize) < 0) ||
+	        (_GapBuffer_RoomFor(runs->values, 2 * runs->values->itemSize) < 0))
+		return -1;
+	runEnd = _GapBuffer_RunFromPosition(runs, end);
+	if (_GapBuffer_RunValue(runs, runEnd) == value) {
+		// The run at the end already has the value so trim to its start
+		end = _GapBuffer_RunStart(runs, runEnd);
+		if (position >= end)
+			return 0;
+	} else if (end < _GapBuffer_RunsLength(runs)) {
+		runEnd = _GapBuffer_SplitRun(runs, end);
+	} else {
+		runEnd = _GapBuffer_RunCount(runs);
+	}
+	runStart = _GapBuffer_RunFromPosition(runs, position);
+	if (_GapBuffer_RunValue(runs, runStart) == value) {
+		runStart++;
+		position = _GapBuffer_RunStart(runs, runStart);
+	} else if (_GapBuffer_RunStart(runs, runStart) < position) {
+		runStart = _GapBuffer_SplitRun(runs, position);
+		runEnd++;
+	}
+	if (runStart >= runEnd)
+		return 0;
+	*(Py_ssize_t *)_GapBuffer_at(runs->values, runStart * runs->values->itemSize) = value;
+	if (runEnd > runStart + 1) {
+		_GapBuffer_delete(runs->starts, (runStart + 1) * runs->starts->itemSize,
+		        (runEnd - runStart - 1) * runs->starts->itemSize);
+		_GapBuffer_delete(runs->values, (runStart + 1) * runs->values->itemSize,
+		        (runEnd - runStart - 1) * runs->values->itemSize);
+	}
+	_GapBuffer_RemoveRunIfSameAsPrevious(runs, runStart + 1);
+	_GapBuffer_RemoveRunIfSameAsPrevious(runs, runStart);
+	*changedStart = position;
+	*changedLength = end - position;
+	return 1;
+}
+
+// Keep the styles of a buffer the same length as it: called with byte positions
+static void
+_GapBuffer_StylesInserted(GapBuffer *self, Py_ssize_t position, Py_ssize_t insertLength) {
+	_GapBuffer_RunsInsert((GapBufferRunStyles *)self->styles,
+	        position / self->itemSize, insertLength / self->itemSize);
+}
+
+static void
+_GapBuffer_StylesDeleted(GapBuffer *self, Py_ssize_t position, Py_ssize_t size) {
+	_GapBuffer_RunsDelete((GapBufferRunStyles *)self->styles,
+	        position / self->itemSize, size / self->itemSize);
+}
+
+// Detach the styles, which may live on if referenced elsewhere
+static void
+_GapBuffer_StylesFree(GapBuffer *self) {
+	if (self->styles) {
+		((GapBufferRunStyles *)self->styles)->owned = 0;
+		Py_CLEAR(self->styles);
+	}
+}
+
+static GapBuffer *
+_GapBuffer_RunsBuffer(int partitioned, Py_ssize_t value) {
+	GapBuffer *buffer = (GapBuffer *)GapBuffer_new(&gapbuffer_GapBufferType, NULL, NULL);
+	if (buffer == NULL)
+		return NULL;
+	buffer->itemType = 'n';
+	buffer->itemSize = sizeof(Py_ssize_t);
+	buffer->partitioned = partitioned;
+	if (_GapBuffer_insertarray(buffer, 0, (const char *)&value, buffer->itemSize) < 0) {
+		Py_DECREF(buffer);
+		return NULL;
+	}
+	return buffer;
+}
+
+// A single run of value covering length items
+static GapBufferRunStyles *
+_GapBuffer_RunsNew(PyTypeObject *type, Py_ssize_t length, Py_ssize_t value) {
+	GapBufferRunStyles *runs = (GapBufferRunStyles *)type->tp_alloc(type, 0);
+	if (runs == NULL)
+		return NULL;
+	runs->values = _GapBuffer_RunsBuffer(0, value);
+	runs->starts = _GapBuffer_RunsBuffer(1, 0);
+	if ((runs->values == NULL) || (runs->starts == NULL) ||
+	        (_GapBuffer_insertarray(runs->starts, runs->starts->itemSize,
+	                (const char *)&length, runs->starts->itemSize) < 0)) {
+		Py_DECREF(runs);
+		return NULL;
+	}
+	return runs;
+}
+
+static PyObject *
+RunStyles_new(PyTypeObject *type, PyObject *args, PyObject *kwds) {
+	Py_ssize_t length = 0;
+	Py_ssize_t value = 0;
+	static char *kwlist[] = {"length", "value", NULL};
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "|nn:RunStyles", kwlist, &length, &value)) {
+		return NULL;
+	}
+	if (length < 0) {
+		PyErr_SetString(PyExc_ValueError, "RunStyles: length must not be negative");
+		return NULL;
+	}
+	return (PyObject *)_GapBuffer_RunsNew(type, length, value);
+}
+
+static void
+RunStyles_dealloc(GapBufferRunStyles *self) {
+	Py_XDECREF(self->starts);
+	Py_XDECREF(self->values);
+	Py_TYPE(self)->tp_free((PyObject*)self);
+}
+
+static Py_ssize_t
+RunStyles_length(GapBufferRunStyles *self) {
+	Py_ssize_t length = _GapBuffer_RunsLength(self);
+	if (length < 0) {
+		PyErr_SetString(PyExc_SystemError, "RunStyles: run starts are inconsistent");
+		return -1;
+	}
+	return length;
+}
+
+// The length of tracked styles follows their buffer and can not be changed directly
+static int
+_GapBuffer_RunsCheckOwned(GapBufferRunStyles *self, const char *message) {
+	if (self->owned) {
+		PyErr_SetString(PyExc_ValueError, message);
+		return -1;
+	}
+	return 0;
+}
+
+static int
+_GapBuffer_RunsCheckRange(GapBufferRunStyles *self, Py_ssize_t position, Py_ssize_t length, const char *message) {
+	if ((position < 0) || (length < 0) || (position > _GapBuffer_RunsLength(self)) ||
+	        (length > _GapBuffer_RunsLength(self) - position)) {
+		PyErr_SetString(PyExc_IndexError, message);
+		return -1;
+	}
+	return 0;
+}
+
+static PyObject *
+RunStyles_value_at(GapBufferRunStyles *self, PyObject *args) {
+	Py_ssize_t position;
+
+	if (!PyArg_ParseTuple(args, "n:value_at", &position)) {
+		return NULL;
+	}
+	if (_GapBuffer_RunsCheckRange(self, position, 0, "RunStyles.value_at(position): out of range") < 0)
+		return NULL;
+	return PyLong_FromSsize_t(_GapBuffer_RunValue(self, _GapBuffer_RunFromPosition(self, position)));
+}
+
+// The start, end and value of the run containing a position
+static PyObject *
+RunStyles_find_run(GapBufferRunStyles *self, PyObject *args) {
+	Py_ssize_t position;
+	Py_ssize_t run;
+
+	if (!PyArg_ParseTuple(args, "n:find_run", &position)) {
+		return NULL;
+	}
+	if (_GapBuffer_RunsCheckRange(self, position, 0, "RunStyles.find_run(position): out of range") < 0)
+		return NULL;
+	run = _GapBuffer_RunFromPosition(self, position);
+	return Py_BuildValue("nnn", _GapBuffer_RunStart(self, run), _GapBuffer_RunStart(self, run + 1),
+	        _GapBuffer_RunValue(self, run));
+}
+
+// Set a range to a value, returning the start and length of the part that
+// changed or None
+static PyObject *
+RunStyles_fill_range(GapBufferRunStyles *self, PyObject *args) {
+	Py_ssize_t position;
+	Py_ssize_t length;
+	Py_ssize_t value;
+	int result;
+
+	if (!PyArg_ParseTuple(args, "nnn:fill_range", &position, &length, &value)) {
+		return NULL;
+	}
+	if (_GapBuffer_RunsCheckRange(self, position, length, "RunStyles.fill_range(start, length, value): out of range") < 0)
+		return NULL;
+	result = _GapBuffer_RunsFill(self, position, length, value, &position, &length);
+	if (result < 0)
+		return NULL;
+	if (result == 0) {
+		Py_INCREF(Py_None);
+		return Py_None;
+	}
+	return Py_BuildValue("nn", position, length);
+}
+
+static PyObject *
+RunStyles_insert_space(GapBufferRunStyles *self, PyObject *args) {
+	Py_ssize_t position;
+	Py_ssize_t length;
+
+	if (!PyArg_ParseTuple(args, "nn:insert_space", &position, &length)) {
+		return NULL;
+	}
+	if (_GapBuffer_RunsCheckOwned(self, "RunStyles.insert_space: styles tracked by a GapBuffer change with it") < 0)
+		return NULL;
+	if ((position < 0) || (position > _GapBuffer_RunsLength(self)) || (length < 0) ||
+	        (length > PY_SSIZE_T_MAX - _GapBuffer_RunsLength(self))) {
+		PyErr_SetString(PyExc_IndexError, "RunStyles.insert_space(position, length): out of range");
+		return NULL;
+	}
+	if (length > 0)
+		_GapBuffer_RunsInsert(self, position, length);
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
+static PyObject *
+RunStyles_delete_range(GapBufferRunStyles *self, PyObject *args) {
+	Py_ssize_t position;
+	Py_ssize_t length;
+
+	if (!PyArg_ParseTuple(args, "nn:delete_range", &position, &length)) {
+		return NULL;
+	}
+	if (_GapBuffer_RunsCheckOwned(self, "RunStyles.delete_range: styles tracked by a GapBuffer change with it") < 0)
+		return NULL;
+	if (_GapBuffer_RunsCheckRange(self, position, length, "RunStyles.delete_range(position, length): out of range") < 0)
+		return NULL;
+	if (length > 0)
+		_GapBuffer_RunsDelete(self, position, length);
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
+static PyObject *
+RunStyles_runs(GapBufferRunStyles *self, void *closure) {
+	return PyLong_FromSsize_t(_GapBuffer_RunCount(self));
+}
+
+static PyMethodDef RunStyles_methods[] = {
+            {"value_at", (PyCFunction)RunStyles_value_at, METH_VARARGS, "Value at a position" },
+            {"find_run", (PyCFunction)RunStyles_find_run, METH_VARARGS, "Start, end and value of the run containing a position" },
+            {"fill_range", (PyCFunction)RunStyles_fill_range, METH_VARARGS, "Set a range to a value" },
+            {"insert_space", (PyCFunction)RunStyles_insert_space, METH_VARARGS, "Lengthen the run at a position" },
+            {"delete_range", (PyCFunction)RunStyles_delete_range, METH_VARARGS, "Remove a range" },
+            {NULL}  /* Sentinel */
+        };
+
+static PyGetSetDef RunStyles_getset[] = {
+            {"runs", (getter)RunStyles_runs, NULL, "Number of runs", NULL},
+            {NULL}  /* Sentinel */
+        };
+
+static PySequenceMethods RunStyles_as_sequence = {
+            (lenfunc)RunStyles_length,		       /*sq_length*/
+        };
+
+static PyTypeObject gapbuffer_RunStylesType = {
+            PyVarObject_HEAD_INIT(NULL, 0)
+            "gapbuffer.RunStyles",             /*tp_name*/
+            sizeof(GapBufferRunStyles), /*tp_basicsize*/
+            0,                         /*tp_itemsize*/
+            (destructor)RunStyles_dealloc,                         /*tp_dealloc*/
+            0,                         /*tp_print*/
+            0,                         /*tp_getattr*/
+            0,                         /*tp_setattr*/
+            0,                         /* was tp_compare*/
+            0,                         /*tp_repr*/
+            0,                         /*tp_as_number*/
+            &RunStyles_as_sequence,                         /*tp_as_sequence*/
+            0,                         /*tp_as_mapping*/
+            0,                         /*tp_hash */
+            0,                         /*tp_call*/
+            0,                         /*tp_str*/
+            0,                         /*tp_getattro*/
+            0,                         /*tp_setattro*/
+            0,                         /*tp_as_buffer*/
+            Py_TPFLAGS_DEFAULT,        /*tp_flags*/
+            "Run length encoded values for each position of a sequence",           /* tp_doc */
+            0,		               /* tp_traverse */
+            0,		               /* tp_clear */
+            0,		               /* tp_richcompare */
+            0,		               /* tp_weaklistoffset */
+            0,		               /* tp_iter */
+            0,		               /* tp_iternext */
+            RunStyles_methods,             /* tp_methods */
+            0,                         /* tp_members */
+            RunStyles_getset,  /* tp_getset */
+            0,                         /* tp_base */
+            0,                         /* tp_dict */
+            0,                         /* tp_descr_get */
+            0,                         /* tp_descr_set */
+            0,                         /* tp_dictoffset */
+            0,                         /* tp_init */
+            0,                         /* tp_alloc */
+            RunStyles_new,             /* tp_new */
+        };
+
+// Undo history
+
+// Forget every action, used when recording can not allocate so the history
+// never disagrees with the buffer
+static void
+_GapBuffer_UndoClear(GapBufferUndo *undo) {
+	undo->count = 0;
+	undo->current = 0;
+	undo->arenaLength = 0;
+	undo->groupStart = 1;
+	undo->coalesce = 0;
+}
+
+static Py_ssize_t
+_GapBuffer_UndoMemory(GapBufferUndo *undo) {
+	return undo->arenaLength + undo->count * (Py_ssize_t)sizeof(GapBufferAction);
+}
+
+// Discard the oldest performed groups until memory use is at most three
+// quarters of the limit so the cost of trimming is spread over many actions
+static void
+_GapBuffer_UndoTrim(GapBufferUndo *undo) {
+	Py_ssize_t excess;
+	Py_ssize_t dropped = 0;
+	Py_ssize_t first = 0;
+	Py_ssize_t textStart;
+	Py_ssize_t i;
+
+	if ((undo->limit < 0) || (_GapBuffer_UndoMemory(undo) <= undo->limit))
+		return;
+	excess = _GapBuffer_UndoMemory(undo) - undo->limit / 4 * 3;
+	for (i = 0; i < undo->current; i++) {
+		dropped += undo->actions[i].length + sizeof(GapBufferAction);
+		if ((i + 1 == undo->count) || undo->actions[i + 1].startsGroup) {
+			first = i + 1;
+			if (dropped >= excess)
+				break;
+		}
+	}
+	if (first == 0)
+		return;
+
+	textStart = (first < undo->count) ? undo->actions[first].text : undo->arenaLength;
+	memmove(undo->arena, undo->arena + textStart, undo->arenaLength - textStart);
+	undo->arenaLength -= textStart;
+	memmove(undo->actions, undo->actions + first, (undo->count - first) * sizeof(GapBufferAction));
+	undo->count -= first;
+	undo->current -= first;
+	for (i = 0; i < undo->count; i++)
+		undo->actions[i].text -= textStart;
+}
+
+// Make room for one more action and length more bytes of text
+static int
+_GapBuffer_UndoRoomFor(GapBufferUndo *undo, Py_ssize_t length) {
+	if (undo->count == undo->allocated) {
+		Py_ssize_t allocated = undo->allocated ? undo->allocated * 2 : 64;
+		GapBufferAction *actions = (allocated > PY_SSIZE_T_MAX / (Py_ssize_t)sizeof(GapBufferAction)) ? NULL :
+		        (GapBufferAction *)PyMem_Realloc(undo->actions, allocated * sizeof(GapBufferAction));
+		if (actions == NULL)
+			return -1;
+		undo->actions = actions;
+		undo->allocated = allocated;
+	}
+	if (length > undo->arenaAllocated - undo->arenaLength) {
+		Py_ssize_t allocated;
+		char *arena;
+		if (length > PY_SSIZE_T_MAX / 2 - undo->arenaLength)
+			return -1;
+		allocated = undo->arenaAllocated * 2;
+		if (allocated < undo->arenaLength + length)
+			allocated = undo->arenaLength + length + 1024;
+		arena = (char *)PyMem_Realloc(undo->arena, allocated);
+		if (arena == NULL)
+			return -1;
+		undo->arena = arena;
+		undo->arenaAllocated = allocated;
+	}
+	return 0;
+}
+
+// Record an action whose text is copied from text or, when text is NULL,
+// from the buffer at position. Single items typed or deleted next to the
+// previous action are merged into it.
+static void
+_GapBuffer_UndoRecord(GapBuffer *self, int type, Py_ssize_t position, const char *text, Py_ssize_t length) {
+	GapBufferUndo *undo = self->undo;
+	GapBufferAction *last;
+	char *destination;
+
+	if (undo->applying || (length == 0))
+		return;
+
+	// A new action means the undone actions can no longer be redone
+	undo->count = undo->current;
+	undo->arenaLength = (undo->current > 0) ?
+	        undo->actions[undo->current - 1].text + undo->actions[undo->current - 1].length : 0;
+	if (_GapBuffer_UndoRoomFor(undo, length) < 0) {
+		_GapBuffer_UndoClear(undo);
+		return;
+	}
+
+	last = (undo->current > 0) ? &undo->actions[undo->current - 1] : NULL;
+	if (last && undo->coalesce && last->mayCoalesce && (last->type == type) && (length == self->itemSize)) {
+		destination = NULL;
+		if ((type == UNDO_INSERT) && (position == last->position + last->length)) {
+			destination = undo->arena + undo->arenaLength;	// Typing
+		} else if ((type == UNDO_DELETE) && (position == last->position)) {
+			destination = undo->arena + undo->arenaLength;	// Delete key
+		} else if ((type == UNDO_DELETE) && (position + length == last->position)) {
+			// Backspace so the text goes before the text already deleted
+			destination = undo->arena + last->text;
+			memmove(destination + length, destination, last->length);
+			last->position = position;
+		}
+		if (destination != NULL) {
+			if (text)
+				memcpy(destination, text, length);
+			else
+				_GapBuffer_copyout(self, position, length, destination);
+			last->length += length;
+			undo->arenaLength += length;
+			return;
+		}
+	}
+
+	last = &undo->actions[undo->count];
+	last->position = position;
+	last->length = length;
+	last->text = undo->arenaLength;
+	last->type = (char)type;
+	last->startsGroup = (char)((undo->groupDepth == 0) || undo->groupStart || (undo->current == 0));
+	last->mayCoalesce = (char)((undo->groupDepth == 0) && (length == self->itemSize));
+	if (text)
+		memcpy(undo->arena + undo->arenaLength, text, length);
+	else
+		_GapBuffer_copyout(self, position, length, undo->arena + undo->arenaLength);
+	undo->arenaLength += length;
+	undo->count++;
+	undo->current++;
+	undo->groupStart = 0;
+	undo->coalesce = 1;
+	_GapBuffer_UndoTrim(undo);
+}
+
+// Actions recorded between begin and end are undone as one step
+static void
+_GapBuffer_UndoBeginGroup(GapBuffer *self) {
+	if (self->undo) {
+		if (self->undo->groupDepth++ == 0)
+			self->undo->groupStart = 1;
+		self->undo->coalesce = 0;
+	}
+}
+
+static void
+_GapBuffer_UndoEndGroup(GapBuffer *self) {
+	if (self->undo && (self->undo->groupDepth > 0)) {
+		self->undo->groupDepth--;
+		self->undo->coalesce = 0;
+	}
+}
+
+// Undo one step, returning 1 if anything was undone, 0 if there was nothing
+// to undo or -1 with an exception set
+static int
+_GapBuffer_Undo(GapBuffer *self) {
+	GapBufferUndo *undo = self->undo;
+	int result = 0;
+
+	undo->applying = 1;
+	while (undo->current > 0) {
+		GapBufferAction *action = &undo->actions[undo->current - 1];
+		if (action->type == UNDO_INSERT) {
+			_GapBuffer_delete(self, action->position, action->length);
+		} else if (_GapBuffer_insertarray(self, action->position, undo->arena + action->text, action->length) < 0) {
+			result = -1;
+			break;
+		}
+		undo->current--;
+		result = 1;
+		if (action->startsGroup)
+			break;
+	}
+	undo->applying = 0;
+	undo->coalesce = 0;
+	undo->groupStart = 1;
+	return result;
+}
+
+static int
+_GapBuffer_Redo(GapBuffer *self) {
+	GapBufferUndo *undo = self->undo;
+	int result = 0;
+
+	undo->applying = 1;
+	while (undo->current < undo->count) {
+		GapBufferAction *action = &undo->actions[undo->current];
+		if (action->type == UNDO_DELETE) {
+			_GapBuffer_delete(self, action->position, action->length);
+		} else if (_GapBuffer_insertarray(self, action->position, undo->arena + action->text, action->length) < 0) {
+			result = -1;
+			break;
+		}
+		undo->current++;
+		result = 1;
+		if ((undo->current == undo->count) || undo->actions[undo->current].startsGroup)
+			break;
+	}
+	undo->applying = 0;
+	undo->coalesce = 0;
+	undo->groupStart = 1;
+	return result;
+}
+
+// In place changes are recorded as deleting the old text then inserting the new
+static void
+_GapBuffer_UndoChangeStart(GapBuffer *self, Py_ssize_t position, Py_ssize_t length) {
+	if (self->undo) {
+		_GapBuffer_UndoBeginGroup(self);
+		_GapBuffer_UndoRecord(self, UNDO_DELETE, position * self->itemSize, NULL, length * self->itemSize);
+	}
+}
+
+static void
+_GapBuffer_UndoChangeEnd(GapBuffer *self, Py_ssize_t position, Py_ssize_t length) {
+	if (self->undo) {
+		_GapBuffer_UndoRecord(self, UNDO_INSERT, position * self->itemSize, NULL, length * self->itemSize);
+		_GapBuffer_UndoEndGroup(self);
+	}
+}
+
+static int
+_GapBuffer_checkRange(GapBuffer* self, Py_ssize_t position, Py_ssize_t length, const char *message) {
+	if ((position < 0) || (length < 0) || (length > self->lengthBody / self->itemSize - position)) {
+		PyErr_SetString(PyExc_IndexError, message);
+		return -1;
+	}
+	return 0;
+}
+
+// Read an operand of the arithmetic methods into value, or into real for
+// floating point buffers. Integers wrap to 64 bits when wrap is set and
+// otherwise must fit in 64 bits.
+static int
+_GapBuffer_Operand(GapBuffer* self, PyObject *o, int wrap, PY_LONG_LONG *value, double *real) {
+	PyObject *number;
+	PyObject *integer;
+	if (GAPBUFFER_FLOAT(self->itemType)) {
+		*real = PyFloat_AsDouble(o);
+		*value = 0;
+		return ((*real == -1.0) && PyErr_Occurred()) ? -1 : 0;
+	}
+	number = PyNumber_Index(o);
+	if (number == NULL)
+		return -1;
+	integer = PyNumber_Long(number);
+	Py_DECREF(number);
+	if (integer == NULL)
+		return -1;
+	if (wrap) {
+		*value = (PY_LONG_LONG)PyLong_AsUnsignedLongLongMask(integer);
+	} else {
+		*value = PyLong_AsLongLong(integer);
+		if ((*value == -1) && PyErr_Occurred() && PyErr_ExceptionMatches(PyExc_OverflowError))
+			PyErr_SetString(PyExc_OverflowError, "GapBuffer: value out of range");
+	}
+	Py_DECREF(integer);
+	if ((*value == -1) && PyErr_Occurred())
+		return -1;
+	*real = (double)*value;
+	return 0;
+}
+
+static PyObject *
+GapBuffer_increment(GapBuffer* self, PyObject *args) {
+	Py_ssize_t position;
+	Py_ssize_t length;
+	PyObject *operand;
+	GapBufferOperation op;
+
+	if (!PyArg_ParseTuple(args, "nnO:increment", &position, &length, &operand)) {
+		return NULL;
+	}
+	_GapBuffer_OperationInit(&op, TRANSFORM_ADD, 0);
+	if (_GapBuffer_Operand(self, operand, 1, &op.value, &op.realValue) < 0)
+		return NULL;
+
+	_GapBuffer_Wait(self, 1);
+	if (_GapBuffer_checkRange(self, position, length,
+	        "GapBuffer.increment(position, length, value): out of range") < 0) {
+		return NULL;
+	}
+	// Results may not fit narrower items
+	if (self->compact && (_GapBuffer_Widen(self, 4) < 0))
+		return NULL;
+
+	if (self->partitioned && !self->lock && (length > 0) &&
+	        (position + length == self->lengthBody / self->itemSize) &&
+	        (op.value == (Py_ssize_t)op.value)) {
+		_GapBuffer_Step(self, position, (Py_ssize_t)op.value);
+	} else {
+		// Additions commute with the pending step so it need not be settled
+		_GapBuffer_UndoChangeStart(self, position, length);
+		_GapBuffer_transform(self, position, length, &op);
+		_GapBuffer_UndoChangeEnd(self, position, length);
+	}
+	if (_GapBuffer_LinesChanged(self) < 0)
+		return NULL;
+
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
+static PyObject *
+GapBuffer_saturating_increment(GapBuffer* self, PyObject *args) {
+	Py_ssize_t position;
+	Py_ssize_t length;
+	PyObject *operand;
+	GapBufferOperation op;
+
+	if (!PyArg_ParseTuple(args, "nnO:saturating_increment", &position, &length, &operand)) {
+		return NULL;
+	}
+	if (GAPBUFFER_FLOAT(self->itemType)) {
+		PyErr_SetString(PyExc_TypeError, "GapBuffer.saturating_increment: floating point items do not saturate");
+		return NULL;
+	}
+	_GapBuffer_OperationInit(&op, TRANSFORM_SATURATE, 0);
+	if (_GapBuffer_Operand(self, operand, 0, &op.value, &op.realValue) < 0)
+		return NULL;
+
+	_GapBuffer_Wait(self, 1);
+	if (_GapBuffer_checkRange(self, position, length,
+	        "GapBuffer.saturating_increment(position, length, value): out of range") < 0) {
+		return NULL;
+	}
+	if (self->compact && (_GapBuffer_Widen(self, 4) < 0))
+		return NULL;
+
+	_GapBuffer_Settle(self);
+	_GapBuffer_UndoChangeStart(self, position, length);
+	_GapBuffer_transform(self, position, length, &op);
+	_GapBuffer_UndoChangeEnd(self, position, length);
+	if (_GapBuffer_LinesChanged(self) < 0)
+		return NULL;
+
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
+static PyObject *
+GapBuffer_multiply_add(GapBuffer* self, PyObject *args) {
+	Py_ssize_t position;
+	Py_ssize_t length;
+	PyObject *multiplier;
+	PyObject *operand;
+	GapBufferOperation op;
+
+	if (!PyArg_ParseTuple(args, "nnOO:multiply_add", &position, &length, &multiplier, &operand)) {
+		return NULL;
+	}
+	_GapBuffer_OperationInit(&op, TRANSFORM_MULTIPLY_ADD, 0);
+	if ((_GapBuffer_Operand(self, multiplier, 1, &op.multiplier, &op.realMultiplier) < 0) ||
+	        (_GapBuffer_Operand(self, operand, 1, &op.value, &op.realValue) < 0))
+		return NULL;
+
+	_GapBuffer_Wait(self, 1);
+	if (_GapBuffer_checkRange(self, position, length,
+	        "GapBuffer.multiply_add(position, length, multiplier, value): out of range") < 0) {
+		return NULL;
+	}
+	if (self->compact && (_GapBuffer_Widen(self, 4) < 0))
+		return NULL;
+
+	_GapBuffer_Settle(self);
+	_GapBuffer_UndoChangeStart(self, position, length);
+	_GapBuffer_transform(self, position, length, &op);
+	_GapBuffer_UndoChangeEnd(self, position, length);
+	if (_GapBuffer_LinesChanged(self) < 0)
+		return NULL;
+
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
+static int
+_GapBuffer_needle(GapBuffer* self, PyObject *sub, int widen, const char **data, Py_ssize_t *length, char **owned);
+
+// Set a range of items to one value
+static PyObject *
+GapBuffer_fill(GapBuffer* self, PyObject *args) {
+	Py_ssize_t position;
+	Py_ssize_t length;
+	PyObject *value;
+	GapBufferOperation op;
+
+	if (!PyArg_ParseTuple(args, "nnO:fill", &position, &length, &value)) {
+		return NULL;
+	}
+	_GapBuffer_OperationInit(&op, TRANSFORM_FILL, 0);
+	if (GAPBUFFER_TEXT(self->itemType)) {
+		const char *data;
+		char *owned;
+		Py_ssize_t dataLength;
+		// Characters too wide for a compact buffer widen it
+		if (_GapBuffer_needle(self, value, 1, &data, &dataLength, &owned) < 0)
+			return NULL;
+		if (dataLength != self->itemSize) {
+			PyMem_Free(owned);
+			PyErr_SetString(PyExc_ValueError, "GapBuffer.fill: value must be a single item");
+			return NULL;
+		}
+		memcpy(op.item, data, dataLength);
+		PyMem_Free(owned);
+	} else if (_GapBuffer_PackNumber(self->itemType, self->itemSize, value, op.item) < 0) {
+		return NULL;
+	}
+
+	_GapBuffer_Wait(self, 1);
+	if (_GapBuffer_checkRange(self, position, length,
+	        "GapBuffer.fill(position, length, value): out of range") < 0) {
+		return NULL;
+	}
+
+	_GapBuffer_Settle(self);
+	_GapBuffer_UndoChangeStart(self, position, length);
+	_GapBuffer_transform(self, position, length, &op);
+	_GapBuffer_UndoChangeEnd(self, position, length);
+	if (_GapBuffer_LinesChanged(self) < 0)
+		return NULL;
+
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
+// Add a signed value to a 128-bit total held as two halves
+static void
+_GapBuffer_Accumulate(unsigned PY_LONG_LONG *low, PY_LONG_LONG *high, PY_LONG_LONG value) {
+	unsigned PY_LONG_LONG before = *low;
+	*low += (unsigned PY_LONG_LONG)value;
+	*high += (*low < before) - (value < 0);
+}
+
+// Sum of a run of integer items. Items of 4 bytes or less are summed by the
+// kernels in blocks small enough that a block's total can not overflow.
+static void
+_GapBuffer_sumItems(GapBuffer* self, const char *ptr, Py_ssize_t items,
+        unsigned PY_LONG_LONG *low, PY_LONG_LONG *high) {
+	int isSigned = GAPBUFFER_SIGNED(self->itemType);
+	if (self->itemSize == 8) {
+		const PY_LONG_LONG *p = (const PY_LONG_LONG *)ptr;
+		Py_ssize_t i;
+		for (i = 0; i < items; i++) {
+			if (isSigned) {
+				_GapBuffer_Accumulate(low, high, p[i]);
+			} else {
+				unsigned PY_LONG_LONG before = *low;
+				*low += (unsigned PY_LONG_LONG)p[i];
+				*high += (*low < before);
+			}
+		}
+		return;
+	}
+	while (items > 0) {
+		Py_ssize_t block = (items > (1 << 24)) ? (1 << 24) : items;
+		PY_LONG_LONG total;
+		switch (self->itemSize) {
+		case 1:
+			total = isSigned ? memsumsigned1((const signed char *)ptr, block) :
+			        kernels->sum1((const unsigned char *)ptr, block);
+			break;
+		case 2:
+			total = isSigned ? memsumsigned2((const short *)ptr, block) :
+			        memsum2((const unsigned short *)ptr, block);
+			break;
+		default:
+			total = isSigned ? memsumsigned4((const int *)ptr, block) :
+			        memsum4((const unsigned int *)ptr, block);
+			break;
+		}
+		_GapBuffer_Accumulate(low, high, total);
+		ptr += block * self->itemSize;
+		items -= block;
+	}
+}
+
+static PyObject *
+GapBuffer_sum(GapBuffer* self, PyObject *args) {
+	Py_ssize_t position = 0;
+	Py_ssize_t length = -1;
+	Py_ssize_t start;
+	Py_ssize_t end;
+	PyThreadState *state;
+	unsigned PY_LONG_LONG low = 0;
+	PY_LONG_LONG high = 0;
+	double real = 0.0;
+	PyObject *upper;
+	PyObject *shift;
+	PyObject *shifted;
+	PyObject *lower;
+	PyObject *result;
+
+	if (!PyArg_ParseTuple(args, "|nn:sum", &position, &length)) {
+		return NULL;
+	}
+	if (GAPBUFFER_TEXT(self->itemType)) {
+		PyErr_SetString(PyExc_TypeError, "GapBuffer.sum: only number buffers can be summed");
+		return NULL;
+	}
+
+	_GapBuffer_AcquireRead(self);
+	if (length == -1)
+		length = self->lengthBody / self->itemSize - position;
+	if (_GapBuffer_checkRange(self, position, length,
+	        "GapBuffer.sum([position[, length]]): out of range") < 0) {
+		_GapBuffer_Release(self);
+		return NULL;
+	}
+	start = position * self->itemSize;
+	end = start + length * self->itemSize;
+	state = _GapBuffer_Unblock(self, end - start, 0);
+	while (start < end) {
+		char *ptr;
+		Py_ssize_t run = _GapBuffer_segment(self, start, &ptr);
+		Py_ssize_t items;
+		if (run > end - start)
+			run = end - start;
+		items = run / self->itemSize;
+		if (self->itemType == 'f') {
+			const float *p = (const float *)ptr;
+			while (items-- > 0)
+				real += *p++;
+		} else if (self->itemType == 'd') {
+			const double *p = (const double *)ptr;
+			while (items-- > 0)
+				real += *p++;
+		} else {
+			_GapBuffer_sumItems(self, ptr, items, &low, &high);
+		}
+		start += run;
+	}
+	_GapBuffer_Block(state);
+	_GapBuffer_Release(self);
+
+	if (GAPBUFFER_FLOAT(self->itemType))
+		return PyFloat_FromDouble(real);
+	if ((high == 0) || ((high == -1) && (low >> 63)))
+		return (high == 0) ? PyLong_FromUnsignedLongLong(low) : PyLong_FromLongLong((PY_LONG_LONG)low);
+	// Totals beyond 64 bits are high * 2 ** 64 + low
+	upper = PyLong_FromLongLong(high);
+	shift = PyLong_FromLong(64);
+	shifted = (upper && shift) ? PyNumber_Lshift(upper, shift) : NULL;
+	Py_XDECREF(upper);
+	Py_XDECREF(shift);
+	if (shifted == NULL)
+		return NULL;
+	lower = PyLong_FromUnsignedLongLong(low);
+	result = lower ? PyNumber_Add(shifted, lower) : NULL;
+	Py_XDECREF(lower);
+	Py_DECREF(shifted);
+	return result;
+}
+
+static PyObject *
+_GapBuffer_retrieve(GapBuffer* self, Py_ssize_t positionToRetrieve, Py_ssize_t retrieveLength) {
+	PyObject* retrievedString = NULL;
+	char *retStrPtr = NULL;
+
+	_GapBuffer_AcquireRead(self);
+	if ((positionToRetrieve < 0) || (retrieveLength < 0) ||
+	        (retrieveLength > self->lengthBody / self->itemSize - positionToRetrieve)) {
+		_GapBuffer_Release(self);
+		PyErr_SetString(PyExc_IndexError, "GapBuffer.retrieve(position, length): out of range");
+		return NULL;
+	}
+
+	if (self->itemType == 'c') {
+		retrievedString = PyBytes_FromStringAndSize(NULL, retrieveLength);
+		if (retrievedString != NULL)
+			retStrPtr = (char *)PyBytes_AsString(retrievedString);
+	} else if ((self->itemType == 'u') && (self->itemSize != sizeof(Py_UNICODE))) {
+		// Compact items are gathered then converted
+		char *items = PyMem_Malloc(retrieveLength * self->itemSize + 1);
+		if (items == NULL) {
+			_GapBuffer_Release(self);
+			return PyErr_NoMemory();
+		}
+		_GapBuffer_copyoutBulk(self, positionToRetrieve * self->itemSize, retrieveLength * self->itemSize, items);
+		_GapBuffer_Release(self);
+		retrievedString = _GapBuffer_UnicodeFromItems(items, retrieveLength, self->itemSize);
+		PyMem_Free(items);
+		return retrievedString;
+	} else if (self->itemType == 'u') {
+		retrievedString = PyUnicode_FromUnicode(NULL, retrieveLength);
+		if (retrievedString != NULL)
+			retStrPtr = (char *)PyUnicode_AS_UNICODE(retrievedString);
+	} else {    // numbers
+		PyErr_SetString(PyExc_TypeError, "GapBuffer.retrieve(position, length): wrong type");
+	}
+
+	if (retStrPtr != NULL)
+		_GapBuffer_copyoutBulk(self, positionToRetrieve * self->itemSize, retrieveLength * self->itemSize, retStrPtr);
+	_GapBuffer_Release(self);
+	return retrievedString;
+}
+
+static PyObject *
+GapBuffer_retrieve(GapBuffer* self, PyObject *args) {
+	Py_ssize_t positionToRetrieve = 0;
+	Py_ssize_t retrieveLength = 0;
+
+	if (!PyArg_ParseTuple(args, "nn:retrieve", &positionToRetrieve, &retrieveLength)) {
+		return NULL;
+	}
+
+	return _GapBuffer_retrieve(self, positionToRetrieve, retrieveLength);
+}
+
+// Searching
+
+// Convert the argument of a search method into item data. The data is either
+// borrowed from sub or, when *owned is set, allocated and to be freed with PyMem_Free.
+// Text too wide for a compact buffer widens it when widen is set or else
+// returns 1 as it can not be found, as do numbers out of range of the items.
+static int
+_GapBuffer_needle(GapBuffer* self, PyObject *sub, int widen, const char **data, Py_ssize_t *length, char **owned) {
+	*owned = NULL;
+	if (self->itemType == 'c') {
+		if (!PyBytes_Check(sub)) {
+			PyErr_SetString(PyExc_TypeError, "GapBuffer: argument must be bytes");
+			return -1;
+		}
+		*data = PyBytes_AS_STRING(sub);
+		*length = PyBytes_GET_SIZE(sub);
+	} else if (self->itemType == 'u') {
+		if (!PyUnicode_Check(sub)) {
+			PyErr_SetString(PyExc_TypeError, "GapBuffer: argument must be a unicode string");
+			return -1;
+		}
+		int result = _GapBuffer_UnicodeItems(self, sub, widen, data, length, owned);
+		*length *= self->itemSize;
+		return result;
+	} else {    // numbers
+		PyObject *sequence;
+		Py_ssize_t i;
+		char *items;
+		if (PyIndex_Check(sub) || PyFloat_Check(sub)) {
+			sequence = PyTuple_Pack(1, sub);
+		} else {
+			sequence = PySequence_Fast(sub, "GapBuffer: argument must be a number or a sequence of numbers");
+		}
+		if (sequence == NULL)
+			return -1;
+		items = PyMem_Malloc(PySequence_Fast_GET_SIZE(sequence) * self->itemSize + 1);
+		if (items == NULL) {
+			Py_DECREF(sequence);
+			PyErr_NoMemory();
+			return -1;
+		}
+		for (i = 0; i < PySequence_Fast_GET_SIZE(sequence); i++) {
+			if (_GapBuffer_PackNumber(self->itemType, self->itemSize,
+			        PySequence_Fast_GET_ITEM(sequence, i), items + i * self->itemSize) < 0) {
+				PyMem_Free(items);
+				Py_DECREF(sequence);
+				// A value that does not fit the items can not be found
+				if (!widen && PyErr_ExceptionMatches(PyExc_OverflowError)) {
+					PyErr_Clear();
+					*data = "";
+					*length = 0;
+					return 1;
+				}
+				return -1;
+			}
+		}
+		*data = *owned = items;
+		*length = PySequence_Fast_GET_SIZE(sequence) * self->itemSize;
+		Py_DECREF(sequence);
+	}
+	return 0;
+}
+
+#ifdef __GLIBC__
+#define _GapBuffer_memrchr memrchr
+#else
+static void *
+_GapBuffer_memrchr(const void *s, int c, size_t n) {
+	const unsigned char *p = (const unsigned char *)s + n;
+	while (p > (const unsigned char *)s) {
+		if (*--p == (unsigned char)c)
+			return (void *)p;
+	}
+	return NULL;
+}
+#endif
+
+// Search contiguous memory for the first item aligned occurrence of needle.
+// memchr is vectorized by the C library so looks for the first byte before comparing.
+static Py_ssize_t
+_GapBuffer_memsearch(const char *haystack, Py_ssize_t haystackLength,
+        const char *needle, Py_ssize_t needleLength, int itemSize) {
+	const char *p = haystack;
+	const char *last = haystack + haystackLength - needleLength;
+	if ((needleLength == itemSize) && (itemSize > 1)) {
+		// Wide items are compared whole rather than looking for their first byte
+		Py_ssize_t items = haystackLength / itemSize;
+		Py_ssize_t found;
+		if (itemSize == 2) {
+			unsigned short v;
+			memcpy(&v, needle, sizeof(v));
+			found = kernels->find2((const unsigned short *)haystack, items, v);
+		} else if (itemSize == 4) {
+			unsigned int v;
+			memcpy(&v, needle, sizeof(v));
+			found = kernels->find4((const unsigned int *)haystack, items, v);
+		} else {
+			unsigned PY_LONG_LONG v;
+			memcpy(&v, needle, sizeof(v));
+			found = kernels->find8((const unsigned PY_LONG_LONG *)haystack, items, v);
+		}
+		return (found < items) ? found * itemSize : -1;
+	}
+	while (p <= last) {
+		p = memchr(p, (unsigned char)needle[0], last - p + 1);
+		if (p == NULL)
+			return -1;
+		if ((((p - haystack) % itemSize) == 0) && (memcmp(p + 1, needle + 1, needleLength - 1) == 0))
+			return p - haystack;
+		p++;
+	}
+	return -1;
+}
+
+// Search contiguous memory for the last item aligned occurrence of needle
+static Py_ssize_t
+_GapBuffer_memrsearch(const char *haystack, Py_ssize_t haystackLength,
+        const char *needle, Py_ssize_t needleLength, int itemSize) {
+	const char *p;
+	Py_ssize_t remaining = haystackLength - needleLength + 1;
+	while (remaining > 0) {
+		p = _GapBuffer_memrchr(haystack, (unsigned char)needle[0], remaining);
+		if (p == NULL)
+			return -1;
+		if ((((p - haystack) % itemSize) == 0) && (memcmp(p + 1, needle + 1, needleLength - 1) == 0))
+			return p - haystack;
+		remaining = p - haystack;
+	}
+	return -1;
+}
+
+// Search the matches that straddle the segment boundary at position: they start in
+// [start, position) and lie within [start, end). The window of bytes around the
+// boundary is copied out so a match may span any number of segments.
+static Py_ssize_t
+_GapBuffer_searchBoundary(GapBuffer* self, const char *needle, Py_ssize_t needleLength,
+        Py_ssize_t start, Py_ssize_t end, Py_ssize_t position, int reverse) {
+	Py_ssize_t windowStart = position - (needleLength - self->itemSize);
+	Py_ssize_t windowEnd = position + (needleLength - self->itemSize);
+	Py_ssize_t found;
+	char *window;
+	if (windowStart < start)
+		windowStart = start;
+	if (windowEnd > end)
+		windowEnd = end;
+	if (windowEnd - windowStart < needleLength)
+		return -1;
+	window = PyMem_Malloc(windowEnd - windowStart);
+	if (window == NULL) {
+		PyErr_NoMemory();
+		return -2;
+	}
+	_GapBuffer_copyout(self, windowStart, windowEnd - windowStart, window);
+	if (reverse)
+		found = _GapBuffer_memrsearch(window, windowEnd - windowStart, needle, needleLength, self->itemSize);
+	else
+		found = _GapBuffer_memsearch(window, windowEnd - windowStart, needle, needleLength, self->itemSize);
+	PyMem_Free(window);
+	return (found < 0) ? -1 : windowStart + found;
+}
+
+// Find the first occurrence of needle starting in the byte range [start, end) without
+// moving the gap. Returns the byte position, -1 if not found or -2 with an exception set.
+static Py_ssize_t
+_GapBuffer_search(GapBuffer* self, const char *needle, Py_ssize_t needleLength,
+        Py_ssize_t start, Py_ssize_t end) {
+	Py_ssize_t position = start;
+	if (needleLength == 0)
+		return start;
+	while (end - position >= needleLength) {
+		char *ptr;
+		Py_ssize_t found;
+		Py_ssize_t run = _GapBuffer_segment(self, position, &ptr);
+		if (run > end - position)
+			run = end - position;
+		if (run >= needleLength) {
+			PyThreadState *state = _GapBuffer_Unblock(self, run, 0);
+			found = _GapBuffer_memsearch(ptr, run, needle, needleLength, self->itemSize);
+			_GapBuffer_Block(state);
+			if (found >= 0)
+				return position + found;
+		}
+		position += run;
+		if (position < end) {
+			found = _GapBuffer_searchBoundary(self, needle, needleLength, start, end, position, 0);
+			if (found != -1)
+				return found;
+		}
+	}
+	return -1;
+}
+
+// Find the last occurrence of needle in the byte range [start, end)
+static Py_ssize_t
+_GapBuffer_rsearch(GapBuffer* self, const char *needle, Py_ssize_t needleLength,
+        Py_ssize_t start, Py_ssize_t end) {
+	Py_ssize_t position = end;
+	if (needleLength == 0)
+		return end;
+	while (position - start >= needleLength) {
+		char *ptr;
+		Py_ssize_t found;
+		Py_ssize_t run = _GapBuffer_segmentBefore(self, position, &ptr);
+		if (run > position - start) {
+			ptr += run - (position - start);
+			run = position - start;
+		}
+		if (run >= needleLength) {
+			PyThreadState *state = _GapBuffer_Unblock(self, run, 0);
+			found = _GapBuffer_memrsearch(ptr, run, needle, needleLength, self->itemSize);
+			_GapBuffer_Block(state);
+			if (found >= 0)
+				return position - run + found;
+		}
+		position -= run;
+		if (position > start) {
+			found = _GapBuffer_searchBoundary(self, needle, needleLength, start, end, position, 1);
+			if (found != -1)
+				return found;
+		}
+	}
+	return -1;
+}
+
+// Parse the (sub[, start[, end]]) arguments shared by the search methods into a needle
+// and a byte range, adjusting start and end like str.find. On success the thread is
+// registered as a reader and the caller must call _GapBuffer_Release.
+static int
+_GapBuffer_searchArgs(GapBuffer* self, PyObject *args, const char *format,
+        const char **needle, Py_ssize_t *needleLength, char **owned, Py_ssize_t *start, Py_ssize_t *end) {
+	PyObject *sub;
+	Py_ssize_t length;
+	int absent;
+	*start = 0;
+	*end = PY_SSIZE_T_MAX;
+	*owned = NULL;
+	if (!PyArg_ParseTuple(args, format, &sub, start, end) ||
+	        ((absent = _GapBuffer_needle(self, sub, 0, needle, needleLength, owned)) < 0))
+		return -1;
+	_GapBuffer_AcquireRead(self);
+	length = self->lengthBody / self->itemSize;
+	if (*end > length)
+		*end = length;
+	else if (*end < 0) {
+		*end += length;
+		if (*end < 0)
+			*end = 0;
+	}
+	if (*start < 0) {
+		*start += length;
+		if (*start < 0)
+			*start = 0;
+	}
+	if ((*start > *end) || absent)
+		*start = *end + 1;	// Nothing can match, not even an empty needle
+	*start *= self->itemSize;
+	*end *= self->itemSize;
+	return 0;
+}
+
+static PyObject *
+GapBuffer_find(GapBuffer* self, PyObject *args) {
+	const char *needle;
+	Py_ssize_t needleLength;
+	char *owned;
+	Py_ssize_t start;
+	Py_ssize_t end;
+	Py_ssize_t found;
+
+	if (_GapBuffer_searchArgs(self, args, "O|nn:find", &needle, &needleLength, &owned, &start, &end) < 0)
+		return NULL;
+	found = (start > end) ? -1 : _GapBuffer_search(self, needle, needleLength, start, end);
+	_GapBuffer_Release(self);
+	PyMem_Free(owned);
+	if (found == -2)
+		return NULL;
+	return PyLong_FromSsize_t((found < 0) ? -1 : found / self->itemSize);
+}
+
+static PyObject *
+GapBuffer_rfind(GapBuffer* self, PyObject *args) {
+	const char *needle;
+	Py_ssize_t needleLength;
+	char *owned;
+	Py_ssize_t start;
+	Py_ssize_t end;
+	Py_ssize_t found;
+
+	if (_GapBuffer_searchArgs(self, args, "O|nn:rfind", &needle, &needleLength, &owned, &start, &end) < 0)
+		return NULL;
+	found = (start > end) ? -1 : _GapBuffer_rsearch(self, needle, needleLength, start, end);
+	_GapBuffer_Release(self);
+	PyMem_Free(owned);
+	if (found == -2)
+		return NULL;
+	return PyLong_FromSsize_t((found < 0) ? -1 : found / self->itemSize);
+}
+
+// Find the non-overlapping occurrences of needle, appending their item positions to
+// positions if it is not NULL. Returns the number found or -1 with an exception set.
+static Py_ssize_t
+_GapBuffer_searchAll(GapBuffer* self, const char *needle, Py_ssize_t needleLength,
+        Py_ssize_t start, Py_ssize_t end, PyObject *positions) {
+	Py_ssize_t count = 0;
+	while (start <= end) {
+		Py_ssize_t found = _GapBuffer_search(self, needle, needleLength, start, end);
+		if (found == -2)
+			return -1;
+		if (found < 0)
+			break;
+		if (positions) {
+			PyObject *position = PyLong_FromSsize_t(found / self->itemSize);
+			if ((position == NULL) || (PyList_Append(positions, position) < 0)) {
+				Py_XDECREF(position);
+				return -1;
+			}
+			Py_DECREF(position);
+		}
+		count++;
+		// An empty needle matches at every position
+		start = found + ((needleLength > 0) ? needleLength : self->itemSize);
+	}
+	return count;
+}
+
+static PyObject *
+GapBuffer_count(GapBuffer* self, PyObject *args) {
+	const char *needle;
+	Py_ssize_t needleLength;
+	char *owned;
+	Py_ssize_t start;
+	Py_ssize_t end;
+	Py_ssize_t count;
+
+	if (_GapBuffer_searchArgs(self, args, "O|nn:count", &needle, &needleLength, &owned, &start, &end) < 0)
+		return NULL;
+	count = _GapBuffer_searchAll(self, needle, needleLength, start, end, NULL);
+	_GapBuffer_Release(self);
+	PyMem_Free(owned);
+	if (count < 0)
+		return NULL;
+	return PyLong_FromSsize_t(count);
+}
+
+static PyObject *
+GapBuffer_find_all(GapBuffer* self, PyObject *args) {
+	const char *needle;
+	Py_ssize_t needleLength;
+	char *owned;
+	Py_ssize_t start;
+	Py_ssize_t end;
+	PyObject *positions;
+
+	if (_GapBuffer_searchArgs(self, args, "O|nn:find_all", &needle, &needleLength, &owned, &start, &end) < 0)
+		return NULL;
+	positions = PyList_New(0);
+	if ((positions != NULL) && (_GapBuffer_searchAll(self, needle, needleLength, start, end, positions) < 0)) {
+		Py_CLEAR(positions);
+	}
+	_GapBuffer_Release(self);
+	PyMem_Free(owned);
+	return positions;
+}
+
+// Batch editing
+// Edits are given in positions of the unmodified buffer then sorted so the
+// gap sweeps forward once, with room for all insertions reserved up front.
+
+typedef struct {
+	Py_ssize_t position;	// items
+	Py_ssize_t deleteLength;	// items
+	const char *text;
+	Py_ssize_t textLength;	// bytes
+	char *owned;	// text allocated by _GapBuffer_needle
+	Py_ssize_t order;	// keeps insertions at one position in their given order
+}
+GapBufferEdit;
+
+static int
+_GapBuffer_compareEdits(const void *a, const void *b) {
+	const GapBufferEdit *ea = (const GapBufferEdit *)a;
+	const GapBufferEdit *eb = (const GapBufferEdit *)b;
+	if (ea->position != eb->position)
+		return (ea->position < eb->position) ? -1 : 1;
+	return (ea->order < eb->order) ? -1 : (ea->order > eb->order);
+}
+
+// Apply count edits, either all or, after an error, none
+static int
+_GapBuffer_applyEdits(GapBuffer *self, GapBufferEdit *edits, Py_ssize_t count) {
+	Py_ssize_t lengthItems = self->lengthBody / self->itemSize;
+	Py_ssize_t insertLength = 0;
+	Py_ssize_t newlines = 0;
+	Py_ssize_t offset = 0;
+	Py_ssize_t i;
+
+	if (self->lock) {
+		PyErr_SetString(PyExc_BufferError, "Object is locked.");
+		return -1;
+	}
+
+	qsort(edits, count, sizeof(GapBufferEdit), _GapBuffer_compareEdits);
+	for (i = 0; i < count; i++) {
+		if ((edits[i].position < 0) || (edits[i].deleteLength < 0) ||
+		        (edits[i].deleteLength > lengthItems - edits[i].position)) {
+			PyErr_SetString(PyExc_IndexError, "GapBuffer.apply_edits: out of range");
+			return -1;
+		}
+		if ((i > 0) && (edits[i].position < edits[i - 1].position + edits[i - 1].deleteLength)) {
+			PyErr_SetString(PyExc_ValueError, "GapBuffer.apply_edits: edits overlap");
+			return -1;
+		}
+		if (edits[i].textLength > PY_SSIZE_T_MAX - insertLength) {
+			PyErr_SetString(PyExc_OverflowError, "GapBuffer.apply_edits: result too long");
+			return -1;
+		}
+		insertLength += edits[i].textLength;
+		if (self->lines)
+			newlines += _GapBuffer_countNewlines(self, edits[i].text, edits[i].textLength / self->itemSize);
+	}
+
+	// Deletions only widen the gap or free chunks so reserving every
+	// insertion means nothing can fail once the buffer starts changing
+	if ((count > 0) && (_GapBuffer_RoomForEdits(self, insertLength, count) < 0))
+		return -1;
+	if ((newlines > 0) && (_GapBuffer_RoomFor((GapBuffer *)self->lines,
+	        newlines * ((GapBuffer *)self->lines)->itemSize) < 0))
+		return -1;
+
+	_GapBuffer_UndoBeginGroup(self);
+	for (i = 0; i < count; i++) {
+		Py_ssize_t position = (edits[i].position + offset) * self->itemSize;
+		if (edits[i].deleteLength > 0)
+			_GapBuffer_delete(self, position, edits[i].deleteLength * self->itemSize);
+		if (edits[i].textLength > 0)
+			_GapBuffer_insertarray(self, position, edits[i].text, edits[i].textLength);
+		offset += edits[i].textLength / self->itemSize - edits[i].deleteLength;
+	}
+	_GapBuffer_UndoEndGroup(self);
+	_GapBuffer_FreeSpares(&self->spareChunks, &self->spareChunkCount, CHUNK_SPARES);
+	_GapBuffer_FreeSpares(&self->spareNodes, &self->spareNodeCount, CHUNK_SPARES);
+	return 0;
+}
+
+// Write the items from start to end of source, with each of count matches of
+// a text beforeLength long replaced by after, to destination from position
+// first. Working forwards lets the result overlap the source when it starts
+// no later than the source. Bytes already in place are not moved.
+static void
+_GapBuffer_replaceForwards(char *destination, const char *source, const Py_ssize_t *matches,
+        Py_ssize_t count, Py_ssize_t start, Py_ssize_t end, Py_ssize_t first,
+        Py_ssize_t beforeLength, const char *after, Py_ssize_t afterLength) {
+	Py_ssize_t i;
+	for (i = 0; i <= count; i++) {
+		Py_ssize_t next = (i < count) ? matches[i] : end;
+		if (destination + first != source + start)
+			memmove(destination + first, source + start, next - start);
+		first += next - start;
+		if (i < count) {
+			memcpy(destination + first, after, afterLength);
+			first += afterLength;
+			start = next + beforeLength;
+		}
+	}
+}
+
+// As _GapBuffer_replaceForwards but the result ends at position last and is
+// written backwards so it can overlap the source when it ends no earlier
+static void
+_GapBuffer_replaceBackwards(char *destination, const char *source, const Py_ssize_t *matches,
+        Py_ssize_t count, Py_ssize_t start, Py_ssize_t end, Py_ssize_t last,
+        Py_ssize_t beforeLength, const char *after, Py_ssize_t afterLength) {
+	Py_ssize_t i;
+	for (i = count; i >= 0; i--) {
+		Py_ssize_t previous = (i > 0) ? matches[i - 1] + beforeLength : start;
+		last -= end - previous;
+		if (destination + last != source + previous)
+			memmove(destination + last, source + previous, end - previous);
+		if (i > 0) {
+			last -= afterLength;
+			memcpy(destination + last, after, afterLength);
+			end = matches[i - 1];
+		}
+	}
+}
+
+// Replace each match in chunked storage as a deletion and an insertion so
+// only the chunks holding matches change. Everything the edits need is
+// reserved first so they can not fail part way.
+static Py_ssize_t
+_GapBuffer_replaceChunks(GapBuffer *self, const Py_ssize_t *matches, Py_ssize_t count,
+        Py_ssize_t beforeLength, const char *after, Py_ssize_t afterLength) {
+	Py_ssize_t newlines = 0;
+	Py_ssize_t i;
+
+	if (self->lines)
+		newlines = _GapBuffer_countNewlines(self, after, afterLength / self->itemSize);
+	if ((_GapBuffer_RoomForEdits(self, count * afterLength, count) < 0) ||
+	        ((newlines > 0) && (_GapBuffer_RoomFor((GapBuffer *)self->lines,
+	                count * newlines * ((GapBuffer *)self->lines)->itemSize) < 0)))
+		return -1;
+
+	_GapBuffer_UndoBeginGroup(self);
+	for (i = 0; i < count; i++) {
+		Py_ssize_t position = matches[i] + i * (afterLength - beforeLength);
+		if (beforeLength > 0)
+			_GapBuffer_delete(self, position, beforeLength);
+		if (afterLength > 0)
+			_GapBuffer_insertarray(self, position, after, afterLength);
+	}
+	_GapBuffer_UndoEndGroup(self);
+	_GapBuffer_FreeSpares(&self->spareChunks, &self->spareChunkCount, CHUNK_SPARES);
+	_GapBuffer_FreeSpares(&self->spareNodes, &self->spareNodeCount, CHUNK_SPARES);
+	return count;
+}
+
+// Replace up to maxCount non-overlapping occurrences of before with after,
+// returning the number replaced or -1 on error. All matches are found first
+// so the result length is known, then the body is grown at most once and
+// each byte is moved at most once. Text before the gap stays anchored at the
+// start and text after it at the end, so bytes before the first match and
+// after the last do not move and the gap ends up between the two sides.
+static Py_ssize_t
+_GapBuffer_replace(GapBuffer *self, const char *before, Py_ssize_t beforeLength,
+        const char *after, Py_ssize_t afterLength, Py_ssize_t maxCount) {
+	Py_ssize_t *matches = NULL;
+	Py_ssize_t allocated = 0;
+	Py_ssize_t count = 0;
+	Py_ssize_t start = 0;
+	Py_ssize_t resultLength;
+	Py_ssize_t split;
+	Py_ssize_t leftLength;
+	Py_ssize_t gapLength;
+	char *right;
+	char *rightResult;
+	Py_ssize_t i;
+
+	if (self->lock) {
+		PyErr_SetString(PyExc_BufferError, "Object is locked.");
+		return -1;
+	}
+	_GapBuffer_Settle(self);
+
+	while ((start <= self->lengthBody) && ((maxCount < 0) || (count < maxCount))) {
+		Py_ssize_t found = _GapBuffer_search(self, before, beforeLength, start, self->lengthBody);
+		if (found == -2) {
+			PyMem_Free(matches);
+			return -1;
+		}
+		if (found < 0)
+			break;
+		if (count == allocated) {
+			Py_ssize_t *grown;
+			allocated = allocated ? allocated * 2 : 64;
+			grown = (allocated > PY_SSIZE_T_MAX / (Py_ssize_t)sizeof(Py_ssize_t)) ? NULL :
+			        (Py_ssize_t *)PyMem_Realloc(matches, allocated * sizeof(Py_ssize_t));
+			if (grown == NULL) {
+				PyMem_Free(matches);
+				PyErr_NoMemory();
+				return -1;
+			}
+			matches = grown;
+		}
+		matches[count++] = found;
+		// An empty needle matches at every position
+		start = found + ((beforeLength > 0) ? beforeLength : self->itemSize);
+	}
+	if (count == 0)
+		return 0;
+
+	if ((afterLength > beforeLength) &&
+	        (count > (PY_SSIZE_T_MAX - self->lengthBody) / (afterLength - beforeLength))) {
+		PyMem_Free(matches);
+		PyErr_SetString(PyExc_OverflowError, "GapBuffer.replace: result too long");
+		return -1;
+	}
+	resultLength = self->lengthBody + count * (afterLength - beforeLength);
+	if (self->root) {
+		count = _GapBuffer_replaceChunks(self, matches, count, beforeLength, after, afterLength);
+		PyMem_Free(matches);
+		return count;
+	}
+	if ((resultLength > self->lengthBody) &&
+	        (_GapBuffer_RoomFor(self, resultLength - self->lengthBody) < 0)) {
+		PyMem_Free(matches);
+		return -1;
+	}
+	// Each side of the gap is compacted in place. A match across the gap
+	// would belong to both so the gap moves back to its start, which moves
+	// fewer bytes than the match is long.
+	for (split = 0; (split < count) && (matches[split] < self->part1Length); split++)
+		;
+	if ((split > 0) && (matches[split - 1] + beforeLength > self->part1Length))
+		_GapBuffer_GapTo(self, matches[--split]);
+	leftLength = self->part1Length + split * (afterLength - beforeLength);
+	gapLength = self->size - resultLength;
+	right = self->body + self->gapLength;
+	rightResult = self->body + gapLength;
+	if (self->snapshots) {
+		if (split > 0)
+			_GapBuffer_Touch(self, matches[0],
+			        (leftLength > self->part1Length) ? leftLength : self->part1Length);
+		if (split < count)
+			_GapBuffer_Touch(self, (rightResult < right) ? leftLength + gapLength : self->part1Length + self->gapLength,
+			        matches[count - 1] + beforeLength + self->gapLength);
+	}
+
+	if (self->undo) {
+		_GapBuffer_UndoBeginGroup(self);
+		for (i = 0; i < count; i++) {
+			Py_ssize_t position = matches[i] + i * (afterLength - beforeLength);
+			_GapBuffer_UndoRecord(self, UNDO_DELETE, position, before, beforeLength);
+			_GapBuffer_UndoRecord(self, UNDO_INSERT, position, after, afterLength);
+		}
+		_GapBuffer_UndoEndGroup(self);
+	}
+	if (self->styles) {
+		for (i = 0; i < count; i++) {
+			Py_ssize_t position = matches[i] + i * (afterLength - beforeLength);
+			if (beforeLength > 0)
+				_GapBuffer_StylesDeleted(self, position, beforeLength);
+			if (afterLength > 0)
+				_GapBuffer_StylesInserted(self, position, afterLength);
+		}
+	}
+
+	// Growing text moves away from the start of the buffer on the left and
+	// into the gap on the right, so the right goes first to make room
+	if (afterLength > beforeLength) {
+		_GapBuffer_replaceForwards(rightResult, right, matches + split, count - split,
+		        self->part1Length, self->lengthBody, leftLength, beforeLength, after, afterLength);
+		_GapBuffer_replaceBackwards(self->body, self->body, matches, split,
+		        0, self->part1Length, leftLength, beforeLength, after, afterLength);
+	} else {
+		_GapBuffer_replaceForwards(self->body, self->body, matches, split,
+		        0, self->part1Length, 0, beforeLength, after, afterLength);
+		_GapBuffer_replaceBackwards(rightResult, right, matches + split, count - split,
+		        self->part1Length, self->lengthBody, resultLength, beforeLength, after, afterLength);
+	}
+	PyMem_Free(matches);
+
+	self->lengthBody = resultLength;
+	self->part1Length = leftLength;
+	self->gapLength = gapLength;
+	if (_GapBuffer_LinesChanged(self) < 0)
+		return -1;
+	return count;
+}
+
+static PyObject *
+GapBuffer_replace(GapBuffer *self, PyObject *args) {
+	PyObject *before;
+	PyObject *after;
+	Py_ssize_t maxCount = -1;
+	const char *beforeText;
+	const char *afterText;
+	Py_ssize_t beforeLength;
+	Py_ssize_t afterLength;
+	char *beforeOwned = NULL;
+	char *afterOwned = NULL;
+	Py_ssize_t count = -1;
+	int absent;
+
+	if (!PyArg_ParseTuple(args, "OO|n:replace", &before, &after, &maxCount)) {
+		return NULL;
+	}
+
+	// The replacement may widen a compact buffer so is converted first
+	if ((_GapBuffer_needle(self, after, 1, &afterText, &afterLength, &afterOwned) == 0) &&
+	        ((absent = _GapBuffer_needle(self, before, 0, &beforeText, &beforeLength, &beforeOwned)) >= 0)) {
+		_GapBuffer_Acquire(self, 1);
+		count = absent ? 0 : _GapBuffer_replace(self, beforeText, beforeLength, afterText, afterLength, maxCount);
+		_GapBuffer_Release(self);
+	}
+	PyMem_Free(beforeOwned);
+	PyMem_Free(afterOwned);
+	if (count < 0)
+		return NULL;
+	return PyLong_FromSsize_t(count);
+}
+
+static PyObject *
+GapBuffer_apply_edits(GapBuffer *self, PyObject *args) {
+	PyObject *list;
+	PyObject *sequence;
+	GapBufferEdit *edits;
+	Py_ssize_t count;
+	Py_ssize_t i;
+	int result = -1;
+
+	if (!PyArg_ParseTuple(args, "O:apply_edits", &list)) {
+		return NULL;
+	}
+
+	sequence = PySequence_Fast(list, "GapBuffer.apply_edits: argument must be a sequence of (position, length, text)");
+	if (sequence == NULL)
+		return NULL;
+	count = PySequence_Fast_GET_SIZE(sequence);
+	edits = PyMem_New(GapBufferEdit, count + 1);
+	if (edits == NULL) {
+		Py_DECREF(sequence);
+		return PyErr_NoMemory();
+	}
+
+	for (;;) {
+		int itemSize = self->itemSize;
+		for (i = 0; i < count; i++) {
+			PyObject *text;
+			edits[i].owned = NULL;
+			edits[i].order = i;
+			if (!PyArg_ParseTuple(PySequence_Fast_GET_ITEM(sequence, i), "nnO:apply_edits",
+			        &edits[i].position, &edits[i].deleteLength, &text) ||
+			        (_GapBuffer_needle(self, text, 1, &edits[i].text, &edits[i].textLength, &edits[i].owned) < 0)) {
+				break;
+			}
+		}
+		if ((i < count) || (self->itemSize == itemSize))
+			break;
+		// A compact buffer was widened after converting the earlier texts
+		while (i-- > 0)
+			PyMem_Free(edits[i].owned);
+	}
+	if (i == count) {
+		_GapBuffer_Acquire(self, 1);
+		result = _GapBuffer_applyEdits(self, edits, count);
+		_GapBuffer_Release(self);
+	}
+
+	while (i-- > 0)
+		PyMem_Free(edits[i].owned);
+	PyMem_Free(edits);
+	Py_DECREF(sequence);
+	if (result < 0)
+		return NULL;
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
+// Items compared at a time when they must be converted first
+#define COMPARE_BLOCK 256
+
+// Whether buffers of two item types can be compared: text only with text of
+// the same type, numbers with any numbers
+static int
+_GapBuffer_Comparable(char type, char otherType) {
+	return (type == otherType) ||
+	       (_GapBuffer_NumberKind(type) && _GapBuffer_NumberKind(otherType));
+}
+
+// Relation of two items of the same type: -1, 0, 1 or 2 when floats are unordered
+static int
+_GapBuffer_compareItem(char type, int itemSize, const char *a, const char *b) {
+	if (GAPBUFFER_FLOAT(type)) {
+		double x, y;
+		if (itemSize == sizeof(float)) {
+			float narrowX, narrowY;
+			memcpy(&narrowX, a, sizeof(narrowX));
+			memcpy(&narrowY, b, sizeof(narrowY));
+			x = narrowX;
+			y = narrowY;
+		} else {
+			memcpy(&x, a, sizeof(x));
+			memcpy(&y, b, sizeof(y));
+		}
+		return (x < y) ? -1 : (x > y) ? 1 : (x == y) ? 0 : 2;
+	}
+	if (GAPBUFFER_SIGNED(type)) {
+		PY_LONG_LONG x, y;
+		switch (itemSize) {
+		case 1:
+			x = *(const signed char *)a;
+			y = *(const signed char *)b;
+			break;
+		case 2: {
+				short narrowX, narrowY;
+				memcpy(&narrowX, a, 2);
+				memcpy(&narrowY, b, 2);
+				x = narrowX;
+				y = narrowY;
+				break;
+			}
+		case 4: {
+				int narrowX, narrowY;
+				memcpy(&narrowX, a, 4);
+				memcpy(&narrowY, b, 4);
+				x = narrowX;
+				y = narrowY;
+				break;
+			}
+		default:
+			memcpy(&x, a, 8);
+			memcpy(&y, b, 8);
+		}
+		return (x < y) ? -1 : (x > y);
+	} else {
+		unsigned PY_LONG_LONG x = 0, y = 0;
+		switch (itemSize) {
+		case 1:
+			x = *(const unsigned char *)a;
+			y = *(const unsigned char *)b;
+			break;
+		case 2: {
+				unsigned short narrowX, narrowY;
+				memcpy(&narrowX, a, 2);
+				memcpy(&narrowY, b, 2);
+				x = narrowX;
+				y = narrowY;
+				break;
+			}
+		case 4: {
+				unsigned int narrowX, narrowY;
+				memcpy(&narrowX, a, 4);
+				memcpy(&narrowY, b, 4);
+				x = narrowX;
+				y = narrowY;
+				break;
+			}
+		default:
+			memcpy(&x, a, 8);
+			memcpy(&y, b, 8);
+		}
+		return (x < y) ? -1 : (x > y);
+	}
+}
+
+// Relation of the first pair of items that differ in two runs of n items of
+// the same type. Integers are skipped with memcmp a block at a time and only a
+// block that differs is compared item by item. Floats are always compared by
+// value as a NaN is unequal to itself.
+static int
+_GapBuffer_compareRun(char type, int itemSize, const char *a, const char *b, Py_ssize_t n) {
+	Py_ssize_t block = 4096 / itemSize;
+	if (GAPBUFFER_FLOAT(type)) {
+		Py_ssize_t i;
+		for (i = 0; i < n; i++) {
+			int relation = _GapBuffer_compareItem(type, itemSize, a + i * itemSize, b + i * itemSize);
+			if (relation != 0)
+				return relation;
+		}
+		return 0;
+	}
+	while (n > 0) {
+		Py_ssize_t count = (n < block) ? n : block;
+		int relation = memcmp(a, b, count * itemSize);
+		if (relation != 0) {
+			Py_ssize_t i;
+			// memcmp orders unsigned bytes as the items are ordered
+			if ((itemSize == 1) && !GAPBUFFER_SIGNED(type))
+				return (relation < 0) ? -1 : 1;
+			for (i = 0; i < count; i++) {
+				if (memcmp(a + i * itemSize, b + i * itemSize, itemSize) != 0)
+					return _GapBuffer_compareItem(type, itemSize, a + i * itemSize, b + i * itemSize);
+			}
+		}
+		a += count * itemSize;
+		b += count * itemSize;
+		n -= count;
+	}
+	return 0;
+}
+
+// Value of a number item for comparing items of different types
+static long double
+_GapBuffer_itemValue(char type, int itemSize, const char *item) {
+	if (GAPBUFFER_FLOAT(type)) {
+		if (itemSize == sizeof(float)) {
+			float narrow;
+			memcpy(&narrow, item, sizeof(narrow));
+			return narrow;
+		} else {
+			double real;
+			memcpy(&real, item, sizeof(real));
+			return real;
+		}
+	}
+	switch (itemSize) {
+	case 1:
+		return GAPBUFFER_SIGNED(type) ? (long double)*(const signed char *)item :
+		       (long double)*(const unsigned char *)item;
+	case 2: {
+			unsigned short narrow;
+			memcpy(&narrow, item, 2);
+			return GAPBUFFER_SIGNED(type) ? (long double)(short)narrow : (long double)narrow;
+		}
+	case 4: {
+			unsigned int narrow;
+			memcpy(&narrow, item, 4);
+			return GAPBUFFER_SIGNED(type) ? (long double)(int)narrow : (long double)narrow;
+		}
+	default: {
+			unsigned PY_LONG_LONG wide;
+			memcpy(&wide, item, 8);
+			return GAPBUFFER_SIGNED(type) ? (long double)(PY_LONG_LONG)wide : (long double)wide;
+		}
+	}
+}
+
+// Compare the items of a registered buffer with items of type type and size
+// itemSize that are either in other, also registered, or in data when other
+// is NULL. Items stored the same way are compared in place segment by
+// segment; text of different widths and numbers of different types are
+// converted as they are compared. Returns -1, 0, 1 or 2 when unordered.
+static int
+_GapBuffer_compareWith(GapBuffer *self, GapBuffer *other, const char *data,
+        char type, int itemSize, Py_ssize_t items) {
+	Py_ssize_t selfItems = self->lengthBody / self->itemSize;
+	Py_ssize_t n = (selfItems < items) ? selfItems : items;
+	int same = (itemSize == self->itemSize) && ((type == self->itemType) ||
+	        (_GapBuffer_NumberKind(type) == _GapBuffer_NumberKind(self->itemType)));
+	Py_ssize_t i = 0;
+
+	while (i < n) {
+		char *ptrSelf;
+		char *ptrOther;
+		Py_ssize_t run = _GapBuffer_segment(self, i * self->itemSize, &ptrSelf) / self->itemSize;
+		int relation = 0;
+		if (other != NULL) {
+			Py_ssize_t runOther = _GapBuffer_segment(other, i * itemSize, &ptrOther) / itemSize;
+			if (run > runOther)
+				run = runOther;
+		} else {
+			ptrOther = (char *)data + i * itemSize;
+		}
+		if (run > n - i)
+			run = n - i;
+		if (same) {
+			relation = _GapBuffer_compareRun(type, itemSize, ptrSelf, ptrOther, run);
+		} else if (type == 'u') {
+			char wideSelf[COMPARE_BLOCK * 4];
+			char wideOther[COMPARE_BLOCK * 4];
+			if (run > COMPARE_BLOCK)
+				run = COMPARE_BLOCK;
+			_GapBuffer_ConvertItems(ptrSelf, self->itemSize, wideSelf, 4, run);
+			_GapBuffer_ConvertItems(ptrOther, itemSize, wideOther, 4, run);
+			relation = _GapBuffer_compareRun('u', 4, wideSelf, wideOther, run);
+		} else {
+			Py_ssize_t j;
+			for (j = 0; (j < run) && (relation == 0); j++) {
+				long double x = _GapBuffer_itemValue(self->itemType, self->itemSize, ptrSelf + j * self->itemSize);
+				long double y = _GapBuffer_itemValue(type, itemSize, ptrOther + j * itemSize);
+				relation = (x < y) ? -1 : (x > y) ? 1 : (x == y) ? 0 : 2;
+			}
+		}
+		if (relation != 0)
+			return relation;
+		i += run;
+	}
+	return (selfItems < items) ? -1 : (selfItems > items);
+}
+
+// Compare a buffer with another buffer, a string of its item type or an
+// object exporting items of a compatible type through the buffer protocol,
+// setting *relation. When equality is set only whether the items differ
+// matters, so differing lengths are decided without looking at the items.
+// Returns 1 if the object can not be compared with the buffer.
+static int
+_GapBuffer_compareObject(GapBuffer *self, PyObject *other, int equality, int *relation) {
+	Py_buffer view;
+	int haveView = 0;
+	const char *data;
+	char type;
+	int itemSize;
+	Py_ssize_t items;
+	PyThreadState *state;
+
+	if (PyObject_TypeCheck(other, &gapbuffer_GapBufferType)) {
+		GapBuffer *o = (GapBuffer *)other;
+		if (!_GapBuffer_Comparable(self->itemType, o->itemType))
+			return 1;
+		// Floats are compared even with themselves as a NaN is unequal to itself
+		if ((o == self) && !GAPBUFFER_FLOAT(self->itemType)) {
+			*relation = 0;
+			return 0;
+		}
+		_GapBuffer_AcquireReadPair(self, o);
+		items = o->lengthBody / o->itemSize;
+		if (equality && (self->lengthBody / self->itemSize != items)) {
+			*relation = 1;
+		} else {
+			state = _GapBuffer_Unblock(self, self->lengthBody, 0);
+			*relation = _GapBuffer_compareWith(self, o, NULL, o->itemType, o->itemSize, items);
+			_GapBuffer_Block(state);
+		}
+		_GapBuffer_Release(self);
+		_GapBuffer_Release(o);
+		return 0;
+	}
+
+	if (self->itemType == 'u') {
+		if (!PyUnicode_Check(other))
+			return 1;
+#if PY_MAJOR_VERSION >= 3
+		if (PyUnicode_READY(other) < 0)
+			return -1;
+		data = (const char *)PyUnicode_DATA(other);
+		itemSize = PyUnicode_KIND(other);
+		items = PyUnicode_GET_LENGTH(other);
+#else
+		data = (const char *)PyUnicode_AS_UNICODE(other);
+		itemSize = sizeof(Py_UNICODE);
+		items = PyUnicode_GET_SIZE(other);
+#endif
+		type = 'u';
+	} else {
+		if (!PyObject_CheckBuffer(other))
+			return 1;
+		if (PyObject_GetBuffer(other, &view, PyBUF_C_CONTIGUOUS | PyBUF_FORMAT) < 0) {
+			PyErr_Clear();
+			return 1;
+		}
+		haveView = 1;
+		type = _GapBuffer_BufferFormat(&view);
+		if (self->itemType == 'c') {
+			// Bytes and bytearray export their items as unsigned bytes
+			if ((view.itemsize != 1) || ((type != 'B') && (type != 'c'))) {
+				PyBuffer_Release(&view);
+				return 1;
+			}
+			type = 'c';
+		} else if (!_GapBuffer_NumberKind(type) || (view.itemsize > 8)) {
+			PyBuffer_Release(&view);
+			return 1;
+		}
+		data = (const char *)view.buf;
+		itemSize = (int)view.itemsize;
+		items = view.len / view.itemsize;
+	}
+
+	_GapBuffer_AcquireRead(self);
+	if (equality && (self->lengthBody / self->itemSize != items)) {
+		*relation = 1;
+	} else {
+		state = _GapBuffer_Unblock(self, self->lengthBody, 0);
+		*relation = _GapBuffer_compareWith(self, NULL, data, type, itemSize, items);
+		_GapBuffer_Block(state);
+	}
+	_GapBuffer_Release(self);
+	if (haveView)
+		PyBuffer_Release(&view);
+	return 0;
+}
+
+#if PY_MAJOR_VERSION < 3
+static int
+GapBuffer_compare(GapBuffer* self, PyObject *other) {
+	int relation = 0;
+	int result = _GapBuffer_compareObject(self, other, 0, &relation);
+	if (result < 0)
+		return -1;
+	if ((result > 0) && PyObject_TypeCheck(other, &gapbuffer_GapBufferType)) {
+		// Buffers of incomparable types are ordered by type
+		return (self->itemType > ((GapBuffer *)other)->itemType) ? 1 : -1;
+	} else if (result > 0) {
+		PyErr_SetString(PyExc_TypeError, "GapBuffer compare: wrong type");
+		return -1;
+	}
+	return (relation == 2) ? 1 : relation;
+}
+#endif
+
+static PyObject *
+GapBuffer_richcmp(PyObject *obj1, PyObject *obj2, int op) {
+	int relation = 0;
+	int result;
+	PyObject *ret;
+
+	result = _GapBuffer_compareObject((GapBuffer *)obj1, obj2, (op == Py_EQ) || (op == Py_NE), &relation);
+	if (result < 0)
+		return NULL;
+	if (result > 0) {
+		Py_INCREF(Py_NotImplemented);
+		return Py_NotImplemented;
+	}
+	// Unordered floats are only unequal
+	switch (op) {
+	case Py_LT: result = relation == -1; break;
+	case Py_LE: result = (relation == -1) || (relation == 0); break;
+	case Py_EQ: result = relation == 0; break;
+	case Py_NE: result = relation != 0; break;
+	case Py_GT: result = relation == 1; break;
+	case Py_GE: result = (relation == 1) || (relation == 0); break;
+	}
+	ret = result ? Py_True : Py_False;
+	Py_INCREF(ret);
+	return ret;
+}
+
+// Incremental 64 bit hash of a byte stream that does not depend on how the
+// stream is split, so segments of any length can be added in turn
+typedef struct {
+	unsigned PY_LONG_LONG hash;
+	unsigned PY_LONG_LONG pending;	// Bytes not yet making up a whole word
+	int pendingLength;
+	Py_ssize_t length;
+} GapBufferHash;
+
+#define HASH_MULTIPLIER 0x9E3779B97F4A7C15ULL
+
+static void
+_GapBuffer_HashWord(GapBufferHash *state, unsigned PY_LONG_LONG word) {
+	state->hash = (state->hash ^ word) * HASH_MULTIPLIER;
+	state->hash ^= state->hash >> 29;
+}
+
+static void
+_GapBuffer_HashAdd(GapBufferHash *state, const char *data, Py_ssize_t length) {
+	state->length += length;
+	while ((state->pendingLength > 0) && (length > 0)) {
+		state->pending |= (unsigned PY_LONG_LONG)(unsigned char)*data++ << (state->pendingLength * 8);
+		length--;
+		if (++state->pendingLength == 8) {
+			_GapBuffer_HashWord(state, state->pending);
+			state->pending = 0;
+			state->pendingLength = 0;
+		}
+	}
+	while (length >= 8) {
+		unsigned PY_LONG_LONG word;
+		memcpy(&word, data, 8);
+		_GapBuffer_HashWord(state, word);
+		data += 8;
+		length -= 8;
+	}
+	while (length-- > 0)
+		state->pending |= (unsigned PY_LONG_LONG)(unsigned char)*data++ << (state->pendingLength++ * 8);
+}
+
+static unsigned PY_LONG_LONG
+_GapBuffer_HashFinish(GapBufferHash *state) {
+	unsigned PY_LONG_LONG hash;
+	_GapBuffer_HashWord(state, state->pending ^ ((unsigned PY_LONG_LONG)state->pendingLength << 56));
+	hash = state->hash ^ (unsigned PY_LONG_LONG)state->length;
+	hash ^= hash >> 33;
+	hash *= 0xFF51AFD7ED558CCDULL;
+	hash ^= hash >> 33;
+	hash *= 0xC4CEB9FE1A85EC53ULL;
+	hash ^= hash >> 33;
+	return hash;
+}
+
+// Hash of the items, read a segment at a time without moving the gap. Text
+// is hashed as 4 byte code units so the hash does not depend on the width a
+// compact buffer stores it with.
+static PyObject *
+GapBuffer_content_hash(GapBuffer *self) {
+	GapBufferHash state = { 0, 0, 0, 0 };
+	Py_ssize_t position = 0;
+	PyThreadState *threadState;
+
+	_GapBuffer_AcquireRead(self);
+	threadState = _GapBuffer_Unblock(self, self->lengthBody, 0);
+	while (position < self->lengthBody) {
+		char *ptr;
+		Py_ssize_t run = _GapBuffer_segment(self, position, &ptr);
+		if ((self->itemType == 'u') && (self->itemSize != 4)) {
+			char wide[COMPARE_BLOCK * 4];
+			Py_ssize_t items = run / self->itemSize;
+			if (items > COMPARE_BLOCK)
+				items = COMPARE_BLOCK;
+			_GapBuffer_ConvertItems(ptr, self->itemSize, wide, 4, items);
+			_GapBuffer_HashAdd(&state, wide, items * 4);
+			run = items * self->itemSize;
+		} else {
+			_GapBuffer_HashAdd(&state, ptr, run);
+		}
+		position += run;
+	}
+	_GapBuffer_Block(threadState);
+	_GapBuffer_Release(self);
+	return PyLong_FromUnsignedLongLong(_GapBuffer_HashFinish(&state));
+}
+
+static PyObject *
+GapBuffer_str(GapBuffer* self) {
+	if (self->itemType == 'c') {
+#if PY_MAJOR_VERSION >= 3
+		PyObject *repr;
+		PyObject *pbytes = _GapBuffer_retrieve(self, 0, self->lengthBody);
+		if (pbytes == NULL)
+			return NULL;
+		repr = PyBytes_Repr(pbytes, 0);
+		Py_DECREF(pbytes);
+		return repr;
+#else
+		return _GapBuffer_retrieve(self, 0, self->lengthBody);
+#endif
+	} else if (self->itemType == 'u') {
+		return _GapBuffer_retrieve(self, 0, self->lengthBody / self->itemSize);
+	} else {
+		char buf[1024];
+		char elem[256];
+		Py_ssize_t i;
+		Py_ssize_t elements;
+		Py_ssize_t maxElements = 10;
+		_GapBuffer_Wait(self, 1);
+		_GapBuffer_Settle(self);
+		elements = self->lengthBody / self->itemSize;
+		PyOS_snprintf(buf, sizeof(buf), "GapBuffer('%c') [", self->itemType);
+		for (i = 0; i < maxElements && i < elements; i++) {
+			PyObject *repr;
+			PyObject *number = _GapBuffer_UnpackNumber(self->itemType, self->itemSize,
+			        _GapBuffer_at(self, i * self->itemSize), 0);
+			if (number == NULL)
+				return NULL;
+			repr = PyObject_Repr(number);
+			Py_DECREF(number);
+			if (repr == NULL)
+				return NULL;
+#if PY_MAJOR_VERSION >= 3
+			PyOS_snprintf(elem, sizeof(elem), "%s, ", PyUnicode_AsUTF8(repr));
+#else
+			PyOS_snprintf(elem, sizeof(elem), "%s, ", PyString_AsString(repr));
+#endif
+			Py_DECREF(repr);
+			strcat(buf, elem);
+		}
+		if (elements > maxElements) {
+			strcat(buf, "...]");
+		} else {
+			buf[strlen(buf)-2] = '\0';
+			strcat(buf, "]");
+		}
+#if PY_MAJOR_VERSION >= 3
+		return PyUnicode_FromString(buf);
+#else
+		return PyString_FromString(buf);
+#endif
+	}
+}
+
+// Minimize memory used
+static PyObject *
+GapBuffer_slim(GapBuffer *self) {
+	Py_ssize_t room;
+
+	_GapBuffer_Wait(self, 1);
+	if (self->lock) {
+		PyErr_SetString(PyExc_BufferError, "Object is locked.");
+		return NULL;
+	}
+	// Reduce growSize unless fixed by set_growth
+	while ((self->growthStrategy != GROWTH_FIXED) &&
+	        (self->growSize > 8) && (self->growSize * 3 > self->lengthBody))
+		self->growSize /= 2;
+	// A fixed step may be smaller than the rounding below
+	room = (self->growSize > 8) ? self->growSize : 8;
+	if (self->root) {
+		// Chunks are allocated as needed so only the spares can go
+		_GapBuffer_FreeSpares(&self->spareChunks, &self->spareChunkCount, 0);
+		_GapBuffer_FreeSpares(&self->spareNodes, &self->spareNodeCount, 0);
+	} else if (_GapBuffer_ReAllocate(self, self->lengthBody / 8 * 8 + room) < 0) {
+		return NULL;
+	}
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
+// Choose how the buffer grows when the gap is too small for an insertion
+static PyObject *
+GapBuffer_set_growth(GapBuffer *self, PyObject *args) {
+	const char *strategy;
+	PyObject *amount = NULL;
+
+	if (!PyArg_ParseTuple(args, "s|O:set_growth", &strategy, &amount)) {
+		return NULL;
+	}
+	_GapBuffer_Wait(self, 1);
+
+	if (strcmp(strategy, "default") == 0) {
+		self->growthStrategy = GROWTH_DEFAULT;
+	} else if (strcmp(strategy, "geometric") == 0) {
+		double factor = 2.0;
+		if (amount) {
+			factor = PyFloat_AsDouble(amount);
+			if ((factor == -1.0) && PyErr_Occurred())
+				return NULL;
+		}
+		if (!(factor > 1.0)) {
+			PyErr_SetString(PyExc_ValueError, "GapBuffer.set_growth: factor must be greater than 1");
+			return NULL;
+		}
+		self->growthStrategy = GROWTH_GEOMETRIC;
+		self->growthFactor = factor;
+	} else if (strcmp(strategy, "fixed") == 0) {
+		// Without an amount the current growSize, already in bytes, is kept
+		if (amount) {
+			Py_ssize_t step = PyNumber_AsSsize_t(amount, PyExc_OverflowError);
+			if ((step == -1) && PyErr_Occurred())
+				return NULL;
+			if (step <= 0) {
+				PyErr_SetString(PyExc_ValueError, "GapBuffer.set_growth: step must be positive");
+				return NULL;
+			}
+			if (step > PY_SSIZE_T_MAX / self->itemSize) {
+				PyErr_SetString(PyExc_OverflowError, "GapBuffer.set_growth: step is too large");
+				return NULL;
+			}
+			self->growSize = step * self->itemSize;
+		}
+		self->growthStrategy = GROWTH_FIXED;
+	} else {
+		PyErr_SetString(PyExc_ValueError,
+		        "GapBuffer.set_growth: strategy must be 'default', 'geometric' or 'fixed'");
+		return NULL;
+	}
+
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
+// Defer increments that extend to the end of an integer buffer
+static PyObject *
+GapBuffer_set_partitioned(GapBuffer *self, PyObject *args) {
+	PyObject *flag;
+	int partitioned;
+
+	if (!PyArg_ParseTuple(args, "O:set_partitioned", &flag)) {
+		return NULL;
+	}
+
+	partitioned = PyObject_IsTrue(flag);
+	if (partitioned < 0)
+		return NULL;
+	if (partitioned && (GAPBUFFER_TEXT(self->itemType) || GAPBUFFER_FLOAT(self->itemType))) {
+		PyErr_SetString(PyExc_TypeError, "GapBuffer.set_partitioned: only integer buffers can be partitioned");
+		return NULL;
+	}
+	_GapBuffer_Wait(self, 1);
+	if (!partitioned)
+		_GapBuffer_Settle(self);
+	self->partitioned = partitioned;
+
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
+// Choose how the body is allocated when it is resized
+static PyObject *
+GapBuffer_set_allocator(GapBuffer *self, PyObject *args) {
+	const char *allocator;
+
+	if (!PyArg_ParseTuple(args, "s:set_allocator", &allocator)) {
+		return NULL;
+	}
+	_GapBuffer_Wait(self, 1);
+
+	if (strcmp(allocator, "auto") == 0) {
+		self->allocator = ALLOC_AUTO;
+	} else if (strcmp(allocator, "copy") == 0) {
+		self->allocator = ALLOC_COPY;
+	} else if (strcmp(allocator, "realloc") == 0) {
+		self->allocator = ALLOC_REALLOC;
+#ifdef HAVE_MMAP
+	} else if (strcmp(allocator, "mmap") == 0) {
+		self->allocator = ALLOC_MMAP;
+#endif
+	} else {
+		PyErr_SetString(PyExc_ValueError,
+		        "GapBuffer.set_allocator: allocator must be 'auto', 'copy', 'realloc' or 'mmap'");
+		return NULL;
+	}
+
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
+// Ensure there is room for at least items elements without reallocating
+static PyObject *
+GapBuffer_reserve(GapBuffer *self, PyObject *args) {
+	Py_ssize_t items;
+
+	if (!PyArg_ParseTuple(args, "n:reserve", &items)) {
+		return NULL;
+	}
+	if (items < 0) {
+		PyErr_SetString(PyExc_ValueError, "GapBuffer.reserve(items): must not be negative");
+		return NULL;
+	}
+	_GapBuffer_Wait(self, 1);
+	if (items >= PY_SSIZE_T_MAX / self->itemSize) {
+		PyErr_SetString(PyExc_OverflowError, "GapBuffer: size would overflow");
+		return NULL;
+	}
+	if (self->lock) {
+		PyErr_SetString(PyExc_BufferError, "Object is locked.");
+		return NULL;
+	}
+
+	// _GapBuffer_RoomFor always leaves at least one byte in the gap. Chunked
+	// storage has no single allocation to grow.
+	if ((self->root == NULL) && (items * self->itemSize >= self->size)) {
+		if (_GapBuffer_ReAllocate(self, items * self->itemSize + 1) < 0)
+			return NULL;
+	}
+
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
+#if PY_MAJOR_VERSION >= 3
+
+static char *
+_GapBuffer_Format(GapBuffer *self) {
+	// Number type codes are also struct formats
+	static char formats[][2] = {"b", "B", "h", "H", "i", "I", "l", "L", "q", "Q", "f", "d", "n"};
+	static const char *codes = GAPBUFFER_NUMBER_TYPES "n";
+	if (self->itemType == 'c') {
+		return "c";
+	} else if (self->itemType == 'u') {
+		// Unicode characters are exposed as their code units
+		return (self->itemSize == 1) ? "B" : ((self->itemSize == 2) ? "H" : "I");
+	} else {    // numbers
+		return formats[strchr(codes, self->itemType) - codes];
+	}
+}
+
+// A read-only export of one side of the gap, or of one side of the gap in a
+// chunk for chunked storage. Each exported view locks the owning GapBuffer
+// so the gap can not move until the view is released.
+typedef struct {
+	PyObject_HEAD
+	GapBuffer *owner;
+	Py_ssize_t offset;	// Byte position of the segment in the items
+	Py_ssize_t length;	// Byte length of the segment
+	Py_ssize_t shape[1];
+}
+GapBufferSegment;
+
+static void
+GapBufferSegment_dealloc(GapBufferSegment* self) {
+	Py_XDECREF(self->owner);
+	Py_TYPE(self)->tp_free((PyObject*)self);
+}
+
+static int GapBufferSegment_getbufferproc(GapBufferSegment *self, Py_buffer *view, int flags) {
+	GapBuffer *owner = self->owner;
+	char *ptr = NULL;
+
+	if (flags & PyBUF_WRITABLE) {
+		PyErr_SetString(PyExc_BufferError, "GapBuffer segments are read-only");
+		return -1;
+	}
+	// The items may have moved since the segment was first exported
+	if ((self->offset + self->length > owner->lengthBody) ||
+	        ((self->length > 0) && (_GapBuffer_segment(owner, self->offset, &ptr) < self->length))) {
+		PyErr_SetString(PyExc_BufferError, "GapBuffer segment is no longer contiguous");
+		return -1;
+	}
+
+	Py_INCREF(self);
+	view->obj = (PyObject*)self;
+	view->buf = ptr;
+	view->len = self->length;
+	view->readonly = 1;
+	view->format = (flags & PyBUF_FORMAT) ? _GapBuffer_Format(owner) : "B";
+	view->ndim = 1;
+	self->shape[0] = self->length / owner->itemSize;
+	view->shape = (flags & PyBUF_ND) ? self->shape : NULL;
+	view->strides = NULL;
+	view->suboffsets = NULL;
+	view->itemsize = owner->itemSize;
+	view->internal = 0;
+	owner->lock++;
+	return 0;
+}
+
+static void GapBufferSegment_releasebufferproc(GapBufferSegment *self, Py_buffer *view) {
+	self->owner->lock--;
+}
+
+static PyBufferProcs GapBufferSegment_bufferprocs = {
+            (getbufferproc)GapBufferSegment_getbufferproc,
+            (releasebufferproc)GapBufferSegment_releasebufferproc,
+        };
+
+static PyTypeObject gapbuffer_GapBufferSegmentType = {
+            PyVarObject_HEAD_INIT(NULL, 0)
+            "gapbuffer.GapBufferSegment",             /*tp_name*/
+            sizeof(GapBufferSegment), /*tp_basicsize*/
+            0,                         /*tp_itemsize*/
+            (destructor)GapBufferSegment_dealloc,                         /*tp_dealloc*/
+            0,                         /*tp_print*/
+            0,                         /*tp_getattr*/
+            0,                         /*tp_setattr*/
+            0,                         /* was tp_compare*/
+            0,                         /*tp_repr*/
+            0,                         /*tp_as_number*/
+            0,                         /*tp_as_sequence*/
+            0,                         /*tp_as_mapping*/
+            0,                         /*tp_hash */
+            0,                         /*tp_call*/
+            0,                         /*tp_str*/
+            0,                         /*tp_getattro*/
+            0,                         /*tp_setattro*/
+            &GapBufferSegment_bufferprocs,                         /*tp_as_buffer*/
+            Py_TPFLAGS_DEFAULT,        /*tp_flags*/
+            "One side of the gap in a GapBuffer",           /* tp_doc */
+        };
+
+static PyObject *
+_GapBuffer_SegmentView(GapBuffer *self, Py_ssize_t offset, Py_ssize_t length) {
+	PyObject *view;
+	GapBufferSegment *segment = PyObject_New(GapBufferSegment, &gapbuffer_GapBufferSegmentType);
+	if (segment == NULL)
+		return NULL;
+	Py_INCREF(self);
+	segment->owner = self;
+	segment->offset = offset;
+	segment->length = length;
+	view = PyMemoryView_FromObject((PyObject *)segment);
+	Py_DECREF(segment);
+	return view;
+}
+
+// Views of each contiguous run of chunked storage, in order
+static PyObject *
+_GapBuffer_ChunkSegments(GapBuffer *self) {
+	PyObject *views = PyList_New(0);
+	Py_ssize_t position = 0;
+	PyObject *result;
+
+	if (views == NULL)
+		return NULL;
+	while (position < self->lengthBody) {
+		char *ptr;
+		Py_ssize_t run = _GapBuffer_segment(self, position, &ptr);
+		PyObject *view = _GapBuffer_SegmentView(self, position, run);
+		if ((view == NULL) || (PyList_Append(views, view) < 0)) {
+			Py_XDECREF(view);
+			Py_DECREF(views);
+			return NULL;
+		}
+		Py_DECREF(view);
+		position += run;
+	}
+	result = PyList_AsTuple(views);
+	Py_DECREF(views);
+	return result;
+}
+
+// Return the text before and after the gap as two read-only memoryviews
+// without moving the gap. Chunked storage is not gathered: it returns a view
+// of each side of the gap in each chunk.
+static PyObject *
+GapBuffer_segments(GapBuffer *self) {
+	PyObject *before;
+	PyObject *after;
+
+	_GapBuffer_Wait(self, 1);
+	_GapBuffer_Settle(self);
+	if (self->root)
+		return _GapBuffer_ChunkSegments(self);
+	before = _GapBuffer_SegmentView(self, 0, self->part1Length);
+	if (before == NULL)
+		return NULL;
+	after = _GapBuffer_SegmentView(self, self->part1Length,
+	        self->lengthBody - self->part1Length);
+	if (after == NULL) {
+		Py_DECREF(before);
+		return NULL;
+	}
+	return Py_BuildValue("(NN)", before, after);
+}
+
+#endif
+
+// Snapshots
+
+static void
+GapBufferSnapshot_dealloc(GapBufferSnapshot *self) {
+	_GapBuffer_SnapshotFreeChunks(self);
+	if (self->owner != NULL)
+		_GapBuffer_SnapshotUnlink(self);
+	else
+		PyMem_Free(self->body);
+	PyObject_Del(self);
+}
+
+// Fails with MemoryError if a detached snapshot could not keep its text
+static int
+_GapBuffer_SnapshotCheck(GapBufferSnapshot *self) {
+	if ((self->body == NULL) && (self->lengthBody > 0)) {
+		PyErr_SetString(PyExc_MemoryError, "GapBufferSnapshot: text lost when detaching");
+		return -1;
+	}
+	return 0;
+}
+
+static Py_ssize_t
+GapBufferSnapshot_length(GapBufferSnapshot *self) {
+	return self->lengthBody / self->itemSize;
+}
+
+static PyObject *
+GapBufferSnapshot_item(GapBufferSnapshot *self, Py_ssize_t position) {
+	union {
+		char c;
+		Py_UNICODE u;
+		PY_LONG_LONG q;
+		double d;
+	} value;
+
+	if ((position < 0) || (position >= self->lengthBody / self->itemSize)) {
+		PyErr_SetString(PyExc_IndexError, "GapBufferSnapshot index out of range");
+		return NULL;
+	}
+	if (_GapBuffer_SnapshotCheck(self) < 0)
+		return NULL;
+	_GapBuffer_SnapshotCopyout(self, position * self->itemSize, self->itemSize, (char *)&value);
+	if (self->itemType == 'c') {
+		return PyBytes_FromStringAndSize(&value.c, 1);
+	} else if (self->itemType == 'u') {
+		return _GapBuffer_UnicodeFromItems((const char *)&value, 1, self->itemSize);
+	} else {
+		return _GapBuffer_UnpackNumber(self->itemType, self->itemSize, (const char *)&value, 0);
+	}
+}
+
+static PyObject *
+GapBufferSnapshot_retrieve(GapBufferSnapshot *self, PyObject *args) {
+	Py_ssize_t position = 0;
+	Py_ssize_t length = 0;
+	PyObject *retrieved;
+	char *destination;
+
+	if (!PyArg_ParseTuple(args, "nn:retrieve", &position, &length)) {
+		return NULL;
+	}
+	if ((position < 0) || (length < 0) || (length > self->lengthBody / self->itemSize - position)) {
+		PyErr_SetString(PyExc_IndexError, "GapBufferSnapshot.retrieve(position, length): out of range");
+		return NULL;
+	}
+	if (_GapBuffer_SnapshotCheck(self) < 0)
+		return NULL;
+	if (self->itemType == 'c') {
+		retrieved = PyBytes_FromStringAndSize(NULL, length);
+		if (retrieved == NULL)
 			return NULL;
+		destination = PyBytes_AsString(retrieved);
+	} else if (self->itemType == 'u') {
+		char *items = PyMem_Malloc(length * self->itemSize + 1);
+		if (items == NULL)
+			return PyErr_NoMemory();
+		_GapBuffer_SnapshotCopyout(self, position * self->itemSize, length * self->itemSize, items);
+		retrieved = _GapBuffer_UnicodeFromItems(items, length, self->itemSize);
+		PyMem_Free(items);
+		return retrieved;
+	} else {    // numbers
+		PyErr_SetString(PyExc_TypeError, "GapBufferSnapshot.retrieve(position, length): wrong type");
+		return NULL;
+	}
+	_GapBuffer_SnapshotCopyout(self, position * self->itemSize, length * self->itemSize, destination);
+	return retrieved;
+}
+
+// Return a new GapBuffer holding the text of the snapshot
+static PyObject *
+GapBufferSnapshot_copy(GapBufferSnapshot *self) {
+	GapBuffer *copy;
+
+	if (_GapBuffer_SnapshotCheck(self) < 0)
+		return NULL;
+	copy = (GapBuffer *) GapBuffer_new(&gapbuffer_GapBufferType, NULL, NULL);
+	if (copy == NULL)
+		return NULL;
+	copy->itemType = self->itemType;
+	copy->itemSize = self->itemSize;
+	copy->compact = self->compact;
+	if (_GapBuffer_RoomFor(copy, self->lengthBody) < 0) {
+		Py_DECREF(copy);
+		return NULL;
+	}
+	_GapBuffer_SnapshotCopyout(self, 0, self->lengthBody, copy->body);
+	copy->lengthBody = self->lengthBody;
+	copy->part1Length = self->lengthBody;
+	copy->gapLength = copy->size - self->lengthBody;
+	return (PyObject *)copy;
+}
+
+static PyObject *
+GapBufferSnapshot_detached(GapBufferSnapshot *self, void *closure) {
+	return PyBool_FromLong(self->owner == NULL);
+}
+
+static PyMethodDef GapBufferSnapshot_methods[] = {
+            {"retrieve", (PyCFunction)GapBufferSnapshot_retrieve, METH_VARARGS, "Retrieve a substring" },
+            {"copy", (PyCFunction)GapBufferSnapshot_copy, METH_NOARGS, "A new GapBuffer holding the text of the snapshot" },
+            {NULL}  /* Sentinel */
+        };
+
+static PyGetSetDef GapBufferSnapshot_getset[] = {
+            {"detached", (getter)GapBufferSnapshot_detached, NULL, "True once the snapshot holds a private copy of its text", NULL},
+            {NULL}  /* Sentinel */
+        };
+
+static PySequenceMethods GapBufferSnapshot_as_sequence = {
+            (lenfunc)GapBufferSnapshot_length,		       /*sq_length*/
+            0,	       /*sq_concat*/
+            0,	       /*sq_repeat*/
+            (ssizeargfunc)GapBufferSnapshot_item,		       /*sq_item*/
+        };
+
+static PyTypeObject gapbuffer_GapBufferSnapshotType = {
+            PyVarObject_HEAD_INIT(NULL, 0)
+            "gapbuffer.GapBufferSnapshot",             /*tp_name*/
+            sizeof(GapBufferSnapshot), /*tp_basicsize*/
+            0,                         /*tp_itemsize*/
+            (destructor)GapBufferSnapshot_dealloc,                         /*tp_dealloc*/
+            0,                         /*tp_print*/
+            0,                         /*tp_getattr*/
+            0,                         /*tp_setattr*/
+            0,                         /* was tp_compare*/
+            0,                         /*tp_repr*/
+            0,                         /*tp_as_number*/
+            &GapBufferSnapshot_as_sequence,                         /*tp_as_sequence*/
+            0,                         /*tp_as_mapping*/
+            0,                         /*tp_hash */
+            0,                         /*tp_call*/
+            0,                         /*tp_str*/
+            0,                         /*tp_getattro*/
+            0,                         /*tp_setattro*/
+            0,                         /*tp_as_buffer*/
+            Py_TPFLAGS_DEFAULT,        /*tp_flags*/
+            "Immutable copy-on-write view of a GapBuffer",           /* tp_doc */
+            0,		               /* tp_traverse */
+            0,		               /* tp_clear */
+            0,		               /* tp_richcompare */
+            0,		               /* tp_weaklistoffset */
+            0,		               /* tp_iter */
+            0,		               /* tp_iternext */
+            GapBufferSnapshot_methods,             /* tp_methods */
+            0,                         /* tp_members */
+            GapBufferSnapshot_getset,  /* tp_getset */
+        };
+
+// An immutable view of items [start, stop) that shares the body, saving only
+// the chunks within its range when the buffer writes to them. Chunked storage
+// is not gathered for a view as the next insertion would split it again: the
+// view gets a private copy instead.
+static PyObject *
+_GapBuffer_View(GapBuffer *self, Py_ssize_t start, Py_ssize_t stop) {
+	GapBufferSnapshot *view;
+
+	_GapBuffer_Settle(self);
+	view = PyObject_New(GapBufferSnapshot, &gapbuffer_GapBufferSnapshotType);
+	if (view == NULL)
+		return NULL;
+	view->next = NULL;
+	view->lengthBody = (stop - start) * self->itemSize;
+	view->itemSize = self->itemSize;
+	view->itemType = self->itemType;
+	view->compact = self->compact;
+	view->chunks = NULL;
+	if (self->root != NULL) {
+		view->owner = NULL;
+		view->body = PyMem_New(char, view->lengthBody + 1);
+		if (view->body == NULL) {
+			Py_DECREF(view);
+			return PyErr_NoMemory();
 		}
-	} else {    // self->itemType == 'i'
-		if (!PyArg_ParseTuple(args, "iO:insert", &positionToInsert, &sequence)) {
-			return NULL;
+		_GapBuffer_copyoutBulk(self, start * self->itemSize, view->lengthBody, view->body);
+		view->size = view->lengthBody;
+		view->start = 0;
+		view->part1Length = view->lengthBody;
+		view->gapLength = 0;
+		view->chunkCount = 0;
+		return (PyObject *)view;
+	}
+	Py_INCREF(self);
+	view->owner = self;
+	view->body = self->body;
+	view->size = self->size;
+	view->start = start * self->itemSize;
+	view->part1Length = self->part1Length;
+	view->gapLength = self->gapLength;
+	view->chunkCount = (self->size + SNAPSHOT_CHUNK - 1) / SNAPSHOT_CHUNK;
+	view->next = self->snapshots;
+	self->snapshots = view;
+	return (PyObject *)view;
+}
+
+// Return an immutable view of the current contents. The view shares the body
+// until the buffer writes to it, when only the chunks written are copied.
+static PyObject *
+GapBuffer_snapshot(GapBuffer *self) {
+	_GapBuffer_Wait(self, 1);
+	return _GapBuffer_View(self, 0, self->lengthBody / self->itemSize);
+}
+
+static PyObject *
+GapBuffer_view(GapBuffer *self, PyObject *args) {
+	Py_ssize_t start = 0;
+	Py_ssize_t stop = PY_SSIZE_T_MAX;
+	Py_ssize_t lengthItems;
+
+	if (!PyArg_ParseTuple(args, "|nn:view", &start, &stop)) {
+		return NULL;
+	}
+	_GapBuffer_Wait(self, 1);
+	lengthItems = self->lengthBody / self->itemSize;
+	if (start < 0)
+		start += lengthItems;
+	if (stop < 0)
+		stop += lengthItems;
+	if (start < 0)
+		start = 0;
+	else if (start > lengthItems)
+		start = lengthItems;
+	if (stop < start)
+		stop = start;
+	else if (stop > lengthItems)
+		stop = lengthItems;
+	return _GapBuffer_View(self, start, stop);
+}
+
+// Write all of the buffer to a file descriptor without moving the gap.
+// Returns the number of bytes written or -1 with an exception set.
+static Py_ssize_t
+_GapBuffer_WriteAll(GapBuffer *self, int fd) {
+	Py_ssize_t written = 0;
+	while (written < self->lengthBody) {
+		char *ptr1;
+		char *ptr2 = NULL;
+		Py_ssize_t length1 = _GapBuffer_segment(self, written, &ptr1);
+		Py_ssize_t length2 = 0;
+		Py_ssize_t result;
+		PyThreadState *state;
+		if (written + length1 < self->lengthBody)
+			length2 = _GapBuffer_segment(self, written + length1, &ptr2);
+		state = _GapBuffer_Unblock(self, length1 + length2, 0);
+#ifdef HAVE_WRITEV
+		{
+			struct iovec iov[2];
+			int segments = 0;
+			if (length1 > 0) {
+				iov[segments].iov_base = (void *)ptr1;
+				iov[segments].iov_len = length1;
+				segments++;
+			}
+			if (length2 > 0) {
+				iov[segments].iov_base = (void *)ptr2;
+				iov[segments].iov_len = length2;
+				segments++;
+			}
+			result = writev(fd, iov, segments);
+		}
+#else
+		result = write(fd, ptr1, length1);
+#endif
+		_GapBuffer_Block(state);
+		if (result < 0) {
+			if (errno == EINTR) {
+				if (PyErr_CheckSignals() < 0)
+					return -1;
+				continue;
+			}
+			PyErr_SetFromErrno(PyExc_OSError);
+			return -1;
 		}
+		written += result;
 	}
+	return written;
+}
 
-	positionToInsert *= self->itemSize;
-	if ((positionToInsert < 0) || (positionToInsert > self->lengthBody)) {
-		PyErr_SetString(PyExc_IndexError, "GapBuffer.insert(position, text): out of range");
+// Write the buffer to a file descriptor or object with a fileno method
+static PyObject *
+GapBuffer_write_to(GapBuffer *self, PyObject *args) {
+	PyObject *file;
+	int fd;
+	Py_ssize_t written;
+
+	if (!PyArg_ParseTuple(args, "O:write_to", &file)) {
+		return NULL;
+	}
+	fd = PyObject_AsFileDescriptor(file);
+	if (fd < 0)
+		return NULL;
+
+	_GapBuffer_AcquireRead(self);
+	written = _GapBuffer_WriteAll(self, fd);
+	_GapBuffer_Release(self);
+	if (written < 0)
 		return NULL;
+	return PyLong_FromSsize_t(written);
+}
+
+// Files
+
+#ifdef HAVE_MMAP
+// Map length bytes of a file privately after gap bytes of anonymous memory so
+// that pages of the file are only read when used and only copied when written
+static int
+_GapBuffer_MapFile(GapBuffer *self, int fd, Py_ssize_t length, Py_ssize_t gap) {
+	char *body = mmap(NULL, gap + length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (body == MAP_FAILED)
+		return -1;
+	if (mmap(body + gap, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED) {
+		munmap(body, gap + length);
+		return -1;
 	}
+	self->body = body;
+	self->size = gap + length;
+	self->bodyMapped = 1;
+	self->bodyFile = 1;
+	return 0;
+}
+#endif
 
-	if (sequence) {
-		if (0 != _GapBuffer_insertiter(self, positionToInsert / self->itemSize, sequence)) {
-			return NULL;
+// Read up to length bytes of a file into a new body after gap bytes. Returns
+// the number of bytes read or -1 with an exception set.
+static Py_ssize_t
+_GapBuffer_ReadFile(GapBuffer *self, int fd, Py_ssize_t length, Py_ssize_t gap) {
+	Py_ssize_t done = 0;
+	self->body = PyMem_New(char, gap + length);
+	if (self->body == NULL) {
+		PyErr_NoMemory();
+		return -1;
+	}
+	self->size = gap + length;
+	while (done < length) {
+		Py_ssize_t result;
+		Py_BEGIN_ALLOW_THREADS
+		result = read(fd, self->body + gap + done, length - done);
+		Py_END_ALLOW_THREADS
+		if (result < 0) {
+			if ((errno == EINTR) && (PyErr_CheckSignals() == 0))
+				continue;
+			if (!PyErr_Occurred())
+				PyErr_SetFromErrno(PyExc_OSError);
+			return -1;
 		}
+		if (result == 0)
+			break;	// The file became shorter
+		done += result;
+	}
+	return done;
+}
+
+// Create a character buffer holding the contents of a file with the gap before
+// them. Where possible and unless map is false the file is mapped rather than
+// read. A private mapping still shows later writes to pages of the file not
+// yet changed in the buffer, and reading past the end of a file truncated
+// since raises SIGBUS, so files that other processes change should be read.
+static PyObject *
+GapBuffer_from_file(PyTypeObject *type, PyObject *args, PyObject *kwds) {
+	char *path = NULL;
+	PyObject *mapFlag = Py_True;
+	int map;
+	GapBuffer *self;
+	struct stat status;
+	Py_ssize_t length;
+	Py_ssize_t gap;
+	int fd;
+	static char *kwlist[] = {"path", "map", NULL};
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "et|O:from_file", kwlist,
+	        Py_FileSystemDefaultEncoding, &path, &mapFlag)) {
+		return NULL;
+	}
+	map = PyObject_IsTrue(mapFlag);
+	if (map < 0) {
+		PyMem_Free(path);
+		return NULL;
+	}
+	Py_BEGIN_ALLOW_THREADS
+	fd = open(path, O_RDONLY | O_BINARY);
+	Py_END_ALLOW_THREADS
+	if ((fd < 0) || (fstat(fd, &status) < 0)) {
+		PyErr_SetFromErrnoWithFilename(PyExc_OSError, path);
+		if (fd >= 0)
+			close(fd);
+		PyMem_Free(path);
+		return NULL;
+	}
+	PyMem_Free(path);
+	if (status.st_size > PY_SSIZE_T_MAX / 2) {
+		close(fd);
+		PyErr_SetString(PyExc_OverflowError, "GapBuffer.from_file(path): file too large");
+		return NULL;
+	}
+	length = (Py_ssize_t)status.st_size;
+	gap = length / 8 + GAPBUFFER_FILE_GAP;
+
+	self = (GapBuffer *)GapBuffer_new(type, NULL, NULL);
+	if (self == NULL) {
+		close(fd);
+		return NULL;
+	}
+#ifdef HAVE_MMAP
+	gap = _GapBuffer_PageRound(gap);
+	if (!map || (length == 0) || (_GapBuffer_MapFile(self, fd, length, gap) < 0))
+#endif
+		length = _GapBuffer_ReadFile(self, fd, length, gap);
+	close(fd);
+	if (length < 0) {
+		Py_DECREF(self);
+		return NULL;
+	}
+	self->lengthBody = length;
+	self->part1Length = 0;
+	self->gapLength = self->size - length;
+	return (PyObject *)self;
+}
+
+// Save to a new file that then replaces path so that a file this buffer was
+// loaded from stays intact while it is written
+static PyObject *
+GapBuffer_save(GapBuffer *self, PyObject *args) {
+	char *path = NULL;
+	char *temporary;
+	size_t temporaryLength;
+	struct stat status;
+	int mode = 0666;
+	int fd;
+	int replaced = 1;
+	Py_ssize_t written;
+
+	if (!PyArg_ParseTuple(args, "et:save", Py_FileSystemDefaultEncoding, &path)) {
+		return NULL;
+	}
+	temporaryLength = strlen(path) + 32;
+	temporary = PyMem_Malloc(temporaryLength);
+	if (temporary == NULL) {
+		PyMem_Free(path);
+		return PyErr_NoMemory();
+	}
+#ifdef MS_WINDOWS
+	PyOS_snprintf(temporary, temporaryLength, "%s.%lu.tmp", path, (unsigned long)GetCurrentProcessId());
+#else
+	PyOS_snprintf(temporary, temporaryLength, "%s.%ld.tmp", path, (long)getpid());
+#endif
+	if (stat(path, &status) == 0)
+		mode = status.st_mode & 0777;
+	fd = open(temporary, O_WRONLY | O_CREAT | O_EXCL | O_BINARY, mode);
+	if (fd < 0) {
+		PyErr_SetFromErrnoWithFilename(PyExc_OSError, temporary);
+		PyMem_Free(temporary);
+		PyMem_Free(path);
+		return NULL;
+	}
+
+	_GapBuffer_AcquireRead(self);
+	written = _GapBuffer_WriteAll(self, fd);
+	_GapBuffer_Release(self);
+	Py_BEGIN_ALLOW_THREADS
+#ifdef MS_WINDOWS
+	if ((written >= 0) && (_commit(fd) < 0))
+		written = -2;
+#else
+	if ((written >= 0) && (fsync(fd) < 0))
+		written = -2;
+#endif
+	if ((close(fd) < 0) && (written >= 0))
+		written = -2;
+	if (written >= 0) {
+#ifdef MS_WINDOWS
+		replaced = MoveFileExA(temporary, path, MOVEFILE_REPLACE_EXISTING);
+#else
+		replaced = rename(temporary, path) == 0;
+#endif
+		if (!replaced)
+			written = -2;
+	}
+	Py_END_ALLOW_THREADS
+	if (written == -2) {
+#ifdef MS_WINDOWS
+		if (!replaced)
+			PyErr_SetFromWindowsErrWithFilename(0, path);
+		else
+#endif
+			PyErr_SetFromErrnoWithFilename(PyExc_OSError, path);
+	}
+	if (written < 0)
+		unlink(temporary);
+	PyMem_Free(temporary);
+	PyMem_Free(path);
+	if (written < 0)
+		return NULL;
+	return PyLong_FromSsize_t(written);
+}
+
+// Line index for a text buffer, creating it on first use
+static GapBuffer *
+_GapBuffer_Lines(GapBuffer *self) {
+	_GapBuffer_Wait(self, 0);
+	if (!GAPBUFFER_TEXT(self->itemType)) {
+		PyErr_SetString(PyExc_TypeError, "GapBuffer: number buffers do not have lines");
+		return NULL;
+	}
+	if ((self->lines == NULL) && (_GapBuffer_LinesBuild(self) < 0))
+		return NULL;
+	return (GapBuffer *)self->lines;
+}
+
+// Start maintaining a line index, or stop and free it
+static PyObject *
+GapBuffer_track_lines(GapBuffer *self, PyObject *args) {
+	PyObject *flag = Py_True;
+	int track;
+
+	if (!PyArg_ParseTuple(args, "|O:track_lines", &flag)) {
+		return NULL;
+	}
+
+	track = PyObject_IsTrue(flag);
+	if (track < 0)
+		return NULL;
+	_GapBuffer_Wait(self, 1);
+	if (track) {
+		if (_GapBuffer_Lines(self) == NULL)
+			return NULL;
 	} else {
-		_GapBuffer_insertarray(self, positionToInsert, data, insertLength * self->itemSize);
+		Py_CLEAR(self->lines);
 	}
 
 	Py_INCREF(Py_None);
 	return Py_None;
 }
 
+// Start keeping a RunStyles of value 0 for every item that shifts as items
+// are inserted and deleted, or stop and drop it
 static PyObject *
-GapBuffer_extend(GapBuffer* self, PyObject *args) {
-	char *data;
-	Py_ssize_t insertLength;
-	PyObject *sequence = NULL;
+GapBuffer_track_styles(GapBuffer *self, PyObject *args) {
+	PyObject *flag = Py_True;
+	int track;
 
-	if (self->itemType == 'c') {
-		if (!PyArg_ParseTuple(args, "s#:extend", &data, &insertLength)) {
-			return NULL;
-		}
-	} else if (self->itemType == 'u') {
-		if (!PyArg_ParseTuple(args, "u#:extend", &data, &insertLength)) {
-			return NULL;
-		}
-	} else {    // self->itemType == 'i'
-		if (!PyArg_ParseTuple(args, "O:extend", &sequence)) {
-			return NULL;
-		}
+	if (!PyArg_ParseTuple(args, "|O:track_styles", &flag)) {
+		return NULL;
 	}
 
-	if (sequence) {
-		if (0 != _GapBuffer_insertiter(self, self->lengthBody / self->itemSize, sequence)) {
-			return NULL;
+	track = PyObject_IsTrue(flag);
+	if (track < 0)
+		return NULL;
+	_GapBuffer_Wait(self, 1);
+	if (track) {
+		if (self->styles == NULL) {
+			self->styles = (PyObject *)_GapBuffer_RunsNew(&gapbuffer_RunStylesType,
+			        self->lengthBody / self->itemSize, 0);
+			if (self->styles == NULL)
+				return NULL;
+			((GapBufferRunStyles *)self->styles)->owned = 1;
 		}
 	} else {
-		_GapBuffer_insertarray(self, self->lengthBody, data, insertLength * self->itemSize);
+		_GapBuffer_StylesFree(self);
 	}
 
 	Py_INCREF(Py_None);
 	return Py_None;
 }
 
-static void
-memincr1(char *p, int length, int v) {
-	while (length-- > 0) {
-		*p++ += v;
+static PyObject *
+GapBuffer_line_count(GapBuffer *self) {
+	GapBuffer *lines = _GapBuffer_Lines(self);
+	if (lines == NULL)
+		return NULL;
+	return PyLong_FromSsize_t(lines->lengthBody / lines->itemSize);
+}
+
+static PyObject *
+GapBuffer_line_start(GapBuffer *self, PyObject *args) {
+	Py_ssize_t line;
+	GapBuffer *lines;
+
+	if (!PyArg_ParseTuple(args, "n:line_start", &line)) {
+		return NULL;
+	}
+	lines = _GapBuffer_Lines(self);
+	if (lines == NULL)
+		return NULL;
+	if ((line < 0) || (line >= lines->lengthBody / lines->itemSize)) {
+		PyErr_SetString(PyExc_IndexError, "GapBuffer.line_start(line): out of range");
+		return NULL;
 	}
+	return PyLong_FromSsize_t(_GapBuffer_lineStart(lines, line));
 }
 
-static void
-memincr2(short *p, int length, int v) {
-	while (length-- > 0) {
-		*p++ += v;
+static PyObject *
+GapBuffer_line_from_position(GapBuffer *self, PyObject *args) {
+	Py_ssize_t position;
+	GapBuffer *lines;
+
+	if (!PyArg_ParseTuple(args, "n:line_from_position", &position)) {
+		return NULL;
+	}
+	lines = _GapBuffer_Lines(self);
+	if (lines == NULL)
+		return NULL;
+	if ((position < 0) || (position > self->lengthBody / self->itemSize)) {
+		PyErr_SetString(PyExc_IndexError, "GapBuffer.line_from_position(position): out of range");
+		return NULL;
 	}
+	return PyLong_FromSsize_t(_GapBuffer_lineFromPosition(lines, position));
 }
 
-static void
-memincr4(int *p, int length, int v) {
-	while (length-- > 0) {
-		*p++ += v;
+// Text of a line including its line end
+static PyObject *
+GapBuffer_retrieve_line(GapBuffer *self, PyObject *args) {
+	Py_ssize_t line;
+	Py_ssize_t start;
+	Py_ssize_t end;
+	GapBuffer *lines;
+
+	if (!PyArg_ParseTuple(args, "n:retrieve_line", &line)) {
+		return NULL;
+	}
+	lines = _GapBuffer_Lines(self);
+	if (lines == NULL)
+		return NULL;
+	if ((line < 0) || (line >= lines->lengthBody / lines->itemSize)) {
+		PyErr_SetString(PyExc_IndexError, "GapBuffer.retrieve_line(line): out of range");
+		return NULL;
 	}
+	start = _GapBuffer_lineStart(lines, line);
+	if (line + 1 < lines->lengthBody / lines->itemSize)
+		end = _GapBuffer_lineStart(lines, line + 1);
+	else
+		end = self->lengthBody / self->itemSize;
+	return _GapBuffer_retrieve(self, start, end - start);
 }
 
+// Start counting gap moves, reallocations and exports, or stop and discard
+// the counts
 static PyObject *
-GapBuffer_increment(GapBuffer* self, PyObject *args) {
-	int position;
-	int length;
-	int value;
-	int lengthInPart1;
-	int lengthInPart2;
-	char *positionInPart2;
+GapBuffer_track_stats(GapBuffer *self, PyObject *args) {
+	PyObject *flag = Py_True;
+	int track;
 
-	if (!PyArg_ParseTuple(args, "iii:increment", &position, &length, &value)) {
+	if (!PyArg_ParseTuple(args, "|O:track_stats", &flag)) {
 		return NULL;
 	}
 
-	if ((position < 0) || ((position + length) > self->lengthBody / self->itemSize)) {
-		PyErr_SetString(PyExc_IndexError, "GapBuffer.increment(position, length, value): out of range");
+	track = PyObject_IsTrue(flag);
+	if (track < 0)
 		return NULL;
+	_GapBuffer_Wait(self, 1);
+	if (!track) {
+		PyMem_Free(self->stats);
+		self->stats = NULL;
+	} else if (self->stats == NULL) {
+#if GAPBUFFER_STATS
+		self->stats = PyMem_New(GapBufferStats, 1);
+		if (self->stats == NULL)
+			return PyErr_NoMemory();
+		memset(self->stats, 0, sizeof(GapBufferStats));
+		self->stats->peakSize = self->size;
+#else
+		PyErr_SetString(PyExc_ValueError, "GapBuffer.track_stats: built without GAPBUFFER_STATS");
+		return NULL;
+#endif
 	}
 
-	position *= self->itemSize;
-	length *= self->itemSize;
-	lengthInPart1 = self->part1Length - position;
-	if (lengthInPart1 > length)
-		lengthInPart1 = length;
-	else if (lengthInPart1 < 0)
-		lengthInPart1 = 0;
-	if (lengthInPart1 > 0)
-		positionInPart2 = self->body + self->part1Length + self->gapLength;
-	else
-		positionInPart2 = self->body + self->gapLength + position;
-	lengthInPart2 = (length - lengthInPart1) / self->itemSize;
-	lengthInPart1 /= self->itemSize;
+	Py_INCREF(Py_None);
+	return Py_None;
+}
 
-	switch (self->itemSize) {
-	case 1:
-		memincr1(self->body + position, lengthInPart1, value);
-		memincr1(positionInPart2, lengthInPart2, value);
-		break;
-	case 2:
-		memincr2((short *)(self->body + position), lengthInPart1, value);
-		memincr2((short *)(positionInPart2), lengthInPart2, value);
-		break;
-	case 4:
-		memincr4((int *)(self->body + position), lengthInPart1, value);
-		memincr4((int *)(positionInPart2), lengthInPart2, value);
-		break;
+static int
+_GapBuffer_checkStats(GapBuffer *self) {
+	_GapBuffer_Wait(self, 1);
+	if (self->stats == NULL) {
+		PyErr_SetString(PyExc_ValueError, "GapBuffer: stats are not being tracked");
+		return -1;
+	}
+	return 0;
+}
+
+static PyObject *
+GapBuffer_stats(GapBuffer *self) {
+	GapBufferStats *stats = self->stats;
+
+	if (_GapBuffer_checkStats(self) < 0)
+		return NULL;
+	return Py_BuildValue("{s:n,s:n,s:d,s:n,s:d,s:n,s:n,s:n,s:d}",
+	        "gap_moves", stats->gapMoves,
+	        "gap_bytes", stats->gapBytes,
+	        "gap_time", stats->gapTime,
+	        "reallocations", stats->reallocations,
+	        "reallocation_time", stats->reallocationTime,
+	        "peak_size", (stats->peakSize > self->size) ? stats->peakSize : self->size,
+	        "exports", stats->exports,
+	        "export_collapses", stats->exportCollapses,
+	        "export_time", stats->exportTime);
+}
+
+// Zero the counts, with the peak size starting again from the current size
+static PyObject *
+GapBuffer_reset_stats(GapBuffer *self) {
+	if (_GapBuffer_checkStats(self) < 0)
+		return NULL;
+	memset(self->stats, 0, sizeof(GapBufferStats));
+	self->stats->peakSize = self->size;
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
+// Start recording changes for undo, optionally limited to a number of bytes,
+// or stop and discard the history
+static PyObject *
+GapBuffer_track_undo(GapBuffer *self, PyObject *args) {
+	PyObject *flag = Py_True;
+	Py_ssize_t limit = -1;
+	int track;
+
+	if (!PyArg_ParseTuple(args, "|On:track_undo", &flag, &limit)) {
+		return NULL;
+	}
+
+	track = PyObject_IsTrue(flag);
+	if (track < 0)
+		return NULL;
+	_GapBuffer_Wait(self, 1);
+	if (!track) {
+		_GapBuffer_UndoFree(self);
+		Py_INCREF(Py_None);
+		return Py_None;
+	}
+	if (!GAPBUFFER_TEXT(self->itemType)) {
+		PyErr_SetString(PyExc_TypeError, "GapBuffer.track_undo: only text buffers have undo");
+		return NULL;
+	}
+	if (self->undo == NULL) {
+		self->undo = PyMem_New(GapBufferUndo, 1);
+		if (self->undo == NULL)
+			return PyErr_NoMemory();
+		memset(self->undo, 0, sizeof(GapBufferUndo));
+		_GapBuffer_UndoClear(self->undo);
+	}
+	self->undo->limit = (limit < 0) ? -1 : limit;
+	_GapBuffer_UndoTrim(self->undo);
+
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
+static int
+_GapBuffer_checkUndo(GapBuffer *self) {
+	_GapBuffer_Wait(self, 1);
+	if (self->undo == NULL) {
+		PyErr_SetString(PyExc_ValueError, "GapBuffer: undo is not being tracked");
+		return -1;
+	}
+	if (self->lock) {
+		PyErr_SetString(PyExc_BufferError, "Object is locked.");
+		return -1;
+	}
+	return 0;
+}
+
+static PyObject *
+GapBuffer_undo(GapBuffer *self) {
+	int result;
+	if (_GapBuffer_checkUndo(self) < 0)
+		return NULL;
+	result = _GapBuffer_Undo(self);
+	if (result < 0)
+		return NULL;
+	return PyBool_FromLong(result);
+}
+
+static PyObject *
+GapBuffer_redo(GapBuffer *self) {
+	int result;
+	if (_GapBuffer_checkUndo(self) < 0)
+		return NULL;
+	result = _GapBuffer_Redo(self);
+	if (result < 0)
+		return NULL;
+	return PyBool_FromLong(result);
+}
+
+static PyObject *
+GapBuffer_can_undo(GapBuffer *self) {
+	return PyBool_FromLong(self->undo && (self->undo->current > 0));
+}
+
+static PyObject *
+GapBuffer_can_redo(GapBuffer *self) {
+	return PyBool_FromLong(self->undo && (self->undo->current < self->undo->count));
+}
+
+static PyObject *
+GapBuffer_begin_group(GapBuffer *self) {
+	_GapBuffer_Wait(self, 1);
+	if (self->undo == NULL) {
+		PyErr_SetString(PyExc_ValueError, "GapBuffer: undo is not being tracked");
+		return NULL;
+	}
+	_GapBuffer_UndoBeginGroup(self);
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
+static PyObject *
+GapBuffer_end_group(GapBuffer *self) {
+	_GapBuffer_Wait(self, 1);
+	if ((self->undo == NULL) || (self->undo->groupDepth == 0)) {
+		PyErr_SetString(PyExc_ValueError, "GapBuffer.end_group: no group has begun");
+		return NULL;
+	}
+	_GapBuffer_UndoEndGroup(self);
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
+// Iteration and bulk export
+
+// The item at an item position known to be in range, allowing for a pending step
+static PyObject *
+_GapBuffer_item(GapBuffer *self, Py_ssize_t position) {
+	char *ptr = _GapBuffer_at(self, position * self->itemSize);
+	if (self->itemType == 'c') {
+		return PyBytes_FromStringAndSize(ptr, 1);
+	} else if (self->itemType == 'u') {
+		return _GapBuffer_UnicodeFromItems(ptr, 1, self->itemSize);
+	} else {
+		Py_ssize_t step = 0;
+		if ((self->stepLength != 0) && (position >= self->stepStart))
+			step = self->stepLength;
+		return _GapBuffer_UnpackNumber(self->itemType, self->itemSize, ptr, step);
+	}
+}
+
+// List of the items in a range, converted a segment at a time
+static PyObject *
+_GapBuffer_tolist(GapBuffer *self, Py_ssize_t position, Py_ssize_t length) {
+	PyObject *list = PyList_New(length);
+	Py_ssize_t i = 0;
+	if (list == NULL)
+		return NULL;
+	_GapBuffer_AcquireRead(self);
+	while (i < length) {
+		char *ptr;
+		Py_ssize_t run = _GapBuffer_segment(self, (position + i) * self->itemSize, &ptr) / self->itemSize;
+		if (run > length - i)
+			run = length - i;
+		for (; run > 0; run--, i++, ptr += self->itemSize) {
+			PyObject *item;
+			if (self->itemType == 'c')
+				item = PyBytes_FromStringAndSize(ptr, 1);
+			else if (self->itemType == 'u')
+				item = _GapBuffer_UnicodeFromItems(ptr, 1, self->itemSize);
+			else
+				item = _GapBuffer_UnpackNumber(self->itemType, self->itemSize, ptr, 0);
+			if (item == NULL) {
+				_GapBuffer_Release(self);
+				Py_DECREF(list);
+				return NULL;
+			}
+			PyList_SET_ITEM(list, i, item);
+		}
 	}
+	_GapBuffer_Release(self);
+	return list;
+}
 
-	Py_INCREF(Py_None);
-	return Py_None;
+static PyObject *
+GapBuffer_tolist(GapBuffer *self) {
+	_GapBuffer_Wait(self, 1);
+	return _GapBuffer_tolist(self, 0, self->lengthBody / self->itemSize);
 }
 
+// The raw bytes of every item, copied from each side of the gap
 static PyObject *
-_GapBuffer_retrieve(GapBuffer* self, int positionToRetrieve, int retrieveLength) {
-	PyObject* retrievedString = NULL;
-	char *retStrPtr = NULL;
-	int i = 0;
+GapBuffer_tobytes(GapBuffer *self) {
+	PyObject *bytes;
+	_GapBuffer_AcquireRead(self);
+	bytes = PyBytes_FromStringAndSize(NULL, self->lengthBody);
+	if (bytes != NULL)
+		_GapBuffer_copyoutBulk(self, 0, self->lengthBody, PyBytes_AS_STRING(bytes));
+	_GapBuffer_Release(self);
+	return bytes;
+}
 
-	positionToRetrieve *= self->itemSize;
-	retrieveLength *= self->itemSize;
+// An array.array of the items. Characters become 'B' and Unicode characters
+// their code units. Each segment is appended straight from the body.
+static PyObject *
+GapBuffer_to_array(GapBuffer *self) {
+	PyObject *module;
+	PyObject *array;
+	char code[2] = {0, 0};
 
-	if ((positionToRetrieve < 0) || ((positionToRetrieve + retrieveLength) > self->lengthBody)) {
-		PyErr_SetString(PyExc_IndexError, "GapBuffer.retrieve(position, length): out of range");
-		return NULL;
-	}
+	if (self->itemType == 'c')
+		code[0] = 'B';
+	else if (self->itemType == 'u')
+		code[0] = (self->itemSize == 1) ? 'B' : ((self->itemSize == 2) ? 'H' : 'I');
+	else
+		code[0] = self->itemType;
 
-	if (self->itemType == 'c') {
-		retrievedString = PyBytes_FromStringAndSize(NULL, retrieveLength);
-		if (retrievedString == 0)
-			return 0;
-		retStrPtr = (char *)PyBytes_AsString(retrievedString);
-	} else if (self->itemType == 'u') {
-		retrievedString = PyUnicode_FromUnicode(NULL, retrieveLength / self->itemSize);
-		if (retrievedString == 0)
-			return 0;
-		retStrPtr = (char *)PyUnicode_AS_UNICODE(retrievedString);
-	} else {    // self->itemType == 'i'
-		PyErr_SetString(PyExc_TypeError, "GapBuffer.retrieve(position, length): wrong type");
+	module = PyImport_ImportModule("array");
+	if (module == NULL)
 		return NULL;
+	array = PyObject_CallMethod(module, "array", "s", code);
+	Py_DECREF(module);
+	if (array == NULL)
+		return NULL;
+#if PY_MAJOR_VERSION >= 3
+	{
+		Py_ssize_t position = 0;
+		_GapBuffer_AcquireRead(self);
+		while (position < self->lengthBody) {
+			char *ptr;
+			Py_ssize_t run = _GapBuffer_segment(self, position, &ptr);
+			PyObject *view = PyMemoryView_FromMemory(ptr, run, PyBUF_READ);
+			PyObject *result = view ? PyObject_CallMethod(array, "frombytes", "O", view) : NULL;
+			Py_XDECREF(view);
+			if (result == NULL) {
+				_GapBuffer_Release(self);
+				Py_DECREF(array);
+				return NULL;
+			}
+			Py_DECREF(result);
+			position += run;
+		}
+		_GapBuffer_Release(self);
 	}
-
-	while ((i < retrieveLength) && (positionToRetrieve < self->part1Length)) {
-		retStrPtr[i++] = self->body[positionToRetrieve++];
-	}
-	while (i < retrieveLength) {
-		retStrPtr[i++] = self->body[self->gapLength + positionToRetrieve++];
+#else
+	{
+		PyObject *bytes = GapBuffer_tobytes(self);
+		PyObject *result = bytes ? PyObject_CallMethod(array, "fromstring", "O", bytes) : NULL;
+		Py_XDECREF(bytes);
+		if (result == NULL) {
+			Py_DECREF(array);
+			return NULL;
+		}
+		Py_DECREF(result);
 	}
+#endif
+	return array;
+}
 
-	return retrievedString;
+// Iterators read each item in place so they see changes made while iterating,
+// stopping once they pass the end as list iterators do. Chunked iterators
+// return chunk items at a time as strings for text and lists for numbers.
+typedef struct {
+	PyObject_HEAD
+	GapBuffer *owner;	// NULL once exhausted
+	Py_ssize_t position;	// items
+	Py_ssize_t chunk;	// items in each chunk or 0 for single items
 }
+GapBufferIterator;
 
 static PyObject *
-GapBuffer_retrieve(GapBuffer* self, PyObject *args) {
-	int positionToRetrieve = 0;
-	int retrieveLength = 0;
-
-	if (!PyArg_ParseTuple(args, "ii:retrieve", &positionToRetrieve, &retrieveLength)) {
+_GapBuffer_Iterator(GapBuffer *self, Py_ssize_t chunk) {
+	GapBufferIterator *iterator = PyObject_New(GapBufferIterator, &gapbuffer_GapBufferIteratorType);
+	if (iterator == NULL)
 		return NULL;
-	}
-
-	return _GapBuffer_retrieve(self, positionToRetrieve, retrieveLength);
+	Py_INCREF(self);
+	iterator->owner = self;
+	iterator->position = 0;
+	iterator->chunk = chunk;
+	return (PyObject *)iterator;
 }
 
-static int
-GapBuffer_compare(GapBuffer* self, PyObject *other) {
-	GapBuffer *o;
-	int i;
-
-	if (!PyObject_TypeCheck(other, &gapbuffer_GapBufferType)) {
-		PyErr_SetString(PyExc_TypeError, "GapBuffer compare: wrong type");
-		return -1;
-	}
-	o = (GapBuffer *)other;
-	if (self->itemType != o->itemType) {
-		return (self->itemType > o->itemType) ? 1 : -1;
-	}
-	for (i = 0; i < self->lengthBody; i++) {
-		if (i >= o->lengthBody)
-			return 1;
-		if (*_GapBuffer_at(self, i) != *_GapBuffer_at(o, i)) {
-			return (*_GapBuffer_at(self, i) > *_GapBuffer_at(o, i)) ? 1 : -1;
-		}
-	}
-	//~ printf("} compare %d\n", i); fflush(stdout);
-	if (self->lengthBody < o->lengthBody)
-		return -1;
-	return 0;
+static PyObject *
+GapBuffer_iter(GapBuffer *self) {
+	return _GapBuffer_Iterator(self, 0);
 }
 
 static PyObject *
-GapBuffer_richcmp(PyObject *obj1, PyObject *obj2, int op) {
-	int result = 0;
-	PyObject *ret;
+GapBuffer_iter_chunks(GapBuffer *self, PyObject *args) {
+	Py_ssize_t chunk;
 
-	if (!PyObject_TypeCheck(obj2, &gapbuffer_GapBufferType)) {
-		PyErr_SetString(PyExc_TypeError, "GapBuffer compare: wrong type");
-		if (op == Py_NE)
-			result = 1;
-	} else {
-		int relation = GapBuffer_compare((GapBuffer *)obj1, obj2);
-		switch (op) {
-		case Py_LT: result = relation <  0; break;
-		case Py_LE: result = relation <= 0; break;
-		case Py_EQ: result = relation == 0; break;
-		case Py_NE: result = relation != 0; break;
-		case Py_GT: result = relation >  0; break;
-		case Py_GE: result = relation >= 0; break;
-		}
+	if (!PyArg_ParseTuple(args, "n:iter_chunks", &chunk)) {
+		return NULL;
 	}
-	ret = result ? Py_True : Py_False;
-	Py_INCREF(ret);
-	return ret;
+	if (chunk <= 0) {
+		PyErr_SetString(PyExc_ValueError, "GapBuffer.iter_chunks(length): length must be positive");
+		return NULL;
+	}
+	return _GapBuffer_Iterator(self, chunk);
 }
 
-static PyObject *
-GapBuffer_str(GapBuffer* self) {
-	if (self->itemType == 'c') {
-#if PY_MAJOR_VERSION >= 3
-		PyObject *pbytes = _GapBuffer_retrieve(self, 0, self->lengthBody);
-		PyObject *repr = PyBytes_Repr(pbytes, 0);
-		Py_DECREF(pbytes);
-		return repr;
-#else
-		return _GapBuffer_retrieve(self, 0, self->lengthBody);
-#endif
-	} else if (self->itemType == 'u') {
-		return _GapBuffer_retrieve(self, 0, self->lengthBody / self->itemSize);
-	} else {
-		char buf[1024];
-		char elem[256];
-		int i;
-		int elements = self->lengthBody / self->itemSize;
-		int maxElements = 10;
-		PyOS_snprintf(buf, sizeof(buf), "GapBuffer('%c') [", self->itemType);
-		for (i = 0; i < maxElements && i < elements; i++) {
-			PyOS_snprintf(elem, sizeof(elem), "%d, ", *(int *)_GapBuffer_at(self, i * self->itemSize));
-			strcat(buf, elem);
-		}
-		if (elements > maxElements) {
-			strcat(buf, "...]");
-		} else {
-			buf[strlen(buf)-2] = '\0';
-			strcat(buf, "]");
-		}
-#if PY_MAJOR_VERSION >= 3
-		return PyUnicode_FromString(buf);
-#else
-		return PyString_FromString(buf);
-#endif
-	}
+static void
+GapBufferIterator_dealloc(GapBufferIterator *self) {
+	Py_XDECREF(self->owner);
+	PyObject_Del(self);
 }
 
-// Minimize memory used
 static PyObject *
-GapBuffer_slim(GapBuffer *self) {
-	if (self->lock) {
-		PyErr_SetString(PyExc_BufferError, "Object is locked.");
-		Py_INCREF(Py_None);
-		return Py_None;
+GapBufferIterator_next(GapBufferIterator *self) {
+	GapBuffer *owner = self->owner;
+	Py_ssize_t remaining;
+	PyObject *item;
+
+	if (owner == NULL)
+		return NULL;
+	_GapBuffer_Wait(owner, 0);
+	remaining = owner->lengthBody / owner->itemSize - self->position;
+	if (remaining <= 0) {
+		self->owner = NULL;
+		Py_DECREF(owner);
+		return NULL;
 	}
-	// Reduce growSize
-	while ((self->growSize > 8) && (self->growSize * 3 > self->lengthBody))
-		self->growSize /= 2;
-	_GapBuffer_ReAllocate(self, self->lengthBody / 8 * 8 + self->growSize);
-	Py_INCREF(Py_None);
-	return Py_None;
+	if (self->chunk == 0) {
+		item = _GapBuffer_item(owner, self->position);
+		self->position++;
+		return item;
+	}
+	if (remaining > self->chunk)
+		remaining = self->chunk;
+	if (GAPBUFFER_TEXT(owner->itemType))
+		item = _GapBuffer_retrieve(owner, self->position, remaining);
+	else
+		item = _GapBuffer_tolist(owner, self->position, remaining);
+	self->position += remaining;
+	return item;
 }
 
+static PyTypeObject gapbuffer_GapBufferIteratorType = {
+            PyVarObject_HEAD_INIT(NULL, 0)
+            "gapbuffer.GapBufferIterator",             /*tp_name*/
+            sizeof(GapBufferIterator), /*tp_basicsize*/
+            0,                         /*tp_itemsize*/
+            (destructor)GapBufferIterator_dealloc,                         /*tp_dealloc*/
+            0,                         /*tp_print*/
+            0,                         /*tp_getattr*/
+            0,                         /*tp_setattr*/
+            0,                         /* was tp_compare*/
+            0,                         /*tp_repr*/
+            0,                         /*tp_as_number*/
+            0,                         /*tp_as_sequence*/
+            0,                         /*tp_as_mapping*/
+            0,                         /*tp_hash */
+            0,                         /*tp_call*/
+            0,                         /*tp_str*/
+            0,                         /*tp_getattro*/
+            0,                         /*tp_setattro*/
+            0,                         /*tp_as_buffer*/
+            Py_TPFLAGS_DEFAULT,        /*tp_flags*/
+            "Iterator over the items or chunks of a GapBuffer",           /* tp_doc */
+            0,		               /* tp_traverse */
+            0,		               /* tp_clear */
+            0,		               /* tp_richcompare */
+            0,		               /* tp_weaklistoffset */
+            PyObject_SelfIter,		               /* tp_iter */
+            (iternextfunc)GapBufferIterator_next,		               /* tp_iternext */
+        };
+
 static PyMethodDef GapBuffer_methods[] = {
             {"retrieve", (PyCFunction)GapBuffer_retrieve, METH_VARARGS, "Retrieve a portion as a string"	},
             {"insert", (PyCFunction)GapBuffer_insert, METH_VARARGS, "Insert a string" },
             {"extend", (PyCFunction)GapBuffer_extend, METH_VARARGS, "Extend with a string" },
+            {"feed_utf8", (PyCFunction)GapBuffer_feed_utf8, METH_VARARGS, "Decode UTF-8 bytes onto the end, holding back a split sequence" },
+            {"replace", (PyCFunction)GapBuffer_replace, METH_VARARGS, "Replace occurrences of a string, returning the number replaced" },
+            {"apply_edits", (PyCFunction)GapBuffer_apply_edits, METH_VARARGS, "Apply a list of (position, length, text) edits in one pass" },
             {"increment", (PyCFunction)GapBuffer_increment, METH_VARARGS, "Increment a range of values" },
+            {"saturating_increment", (PyCFunction)GapBuffer_saturating_increment, METH_VARARGS, "Increment a range of values, clamping at the limits of the item type" },
+            {"multiply_add", (PyCFunction)GapBuffer_multiply_add, METH_VARARGS, "Multiply a range of values then add a value" },
+            {"fill", (PyCFunction)GapBuffer_fill, METH_VARARGS, "Set a range of items to a value" },
+            {"sum", (PyCFunction)GapBuffer_sum, METH_VARARGS, "Sum of a range of numbers" },
+            {"content_hash", (PyCFunction)GapBuffer_content_hash, METH_NOARGS, "64 bit hash of the items" },
             {"slim", (PyCFunction)GapBuffer_slim, METH_VARARGS, "Minimize memory used" },
+            {"set_growth", (PyCFunction)GapBuffer_set_growth, METH_VARARGS, "Set growth strategy: 'default', 'geometric' or 'fixed'" },
+            {"reserve", (PyCFunction)GapBuffer_reserve, METH_VARARGS, "Allocate room for a number of items" },
+            {"track_lines", (PyCFunction)GapBuffer_track_lines, METH_VARARGS, "Maintain a line index as the text changes" },
+            {"track_styles", (PyCFunction)GapBuffer_track_styles, METH_VARARGS, "Maintain a RunStyles as the items change" },
+            {"line_count", (PyCFunction)GapBuffer_line_count, METH_NOARGS, "Number of lines" },
+            {"line_start", (PyCFunction)GapBuffer_line_start, METH_VARARGS, "Position of the start of a line" },
+            {"line_from_position", (PyCFunction)GapBuffer_line_from_position, METH_VARARGS, "Line containing a position" },
+            {"retrieve_line", (PyCFunction)GapBuffer_retrieve_line, METH_VARARGS, "Retrieve a line including its line end" },
+            {"track_undo", (PyCFunction)GapBuffer_track_undo, METH_VARARGS, "Record changes so they can be undone, optionally limiting the memory used" },
+            {"track_stats", (PyCFunction)GapBuffer_track_stats, METH_VARARGS, "Count gap moves, reallocations and exports" },
+            {"stats", (PyCFunction)GapBuffer_stats, METH_NOARGS, "Dictionary of the counts since tracking started or was reset" },
+            {"reset_stats", (PyCFunction)GapBuffer_reset_stats, METH_NOARGS, "Zero the counts" },
+            {"snapshot", (PyCFunction)GapBuffer_snapshot, METH_NOARGS, "Immutable copy-on-write view of the contents" },
+            {"view", (PyCFunction)GapBuffer_view, METH_VARARGS, "Immutable copy-on-write view of a range of items" },
+            {"undo", (PyCFunction)GapBuffer_undo, METH_NOARGS, "Undo the last step" },
+            {"redo", (PyCFunction)GapBuffer_redo, METH_NOARGS, "Redo the last undone step" },
+            {"can_undo", (PyCFunction)GapBuffer_can_undo, METH_NOARGS, "Whether there is a step to undo" },
+            {"can_redo", (PyCFunction)GapBuffer_can_redo, METH_NOARGS, "Whether there is a step to redo" },
+            {"begin_group", (PyCFunction)GapBuffer_begin_group, METH_NOARGS, "Start a group of changes undone as one step" },
+            {"end_group", (PyCFunction)GapBuffer_end_group, METH_NOARGS, "Finish a group of changes" },
+            {"set_partitioned", (PyCFunction)GapBuffer_set_partitioned, METH_VARARGS, "Defer increments that extend to the end of an integer buffer" },
+            {"set_allocator", (PyCFunction)GapBuffer_set_allocator, METH_VARARGS, "Set allocator: 'auto', 'copy', 'realloc' or 'mmap'" },
+#if PY_MAJOR_VERSION >= 3
+            {"segments", (PyCFunction)GapBuffer_segments, METH_NOARGS, "Text before and after the gap as read-only memoryviews" },
+#endif
+            {"write_to", (PyCFunction)GapBuffer_write_to, METH_VARARGS, "Write to a file descriptor without moving the gap" },
+            {"from_file", (PyCFunction)GapBuffer_from_file, METH_VARARGS | METH_KEYWORDS | METH_CLASS, "Load a file, mapping it unless map is false. A mapped file shows later writes to it and truncating it raises SIGBUS" },
+            {"save", (PyCFunction)GapBuffer_save, METH_VARARGS, "Write to a file that replaces path" },
+            {"find", (PyCFunction)GapBuffer_find, METH_VARARGS, "Position of the first occurrence or -1" },
+            {"rfind", (PyCFunction)GapBuffer_rfind, METH_VARARGS, "Position of the last occurrence or -1" },
+            {"count", (PyCFunction)GapBuffer_count, METH_VARARGS, "Number of non-overlapping occurrences" },
+            {"find_all", (PyCFunction)GapBuffer_find_all, METH_VARARGS, "List of positions of non-overlapping occurrences" },
+            {"iter_chunks", (PyCFunction)GapBuffer_iter_chunks, METH_VARARGS, "Iterate over the items a number at a time" },
+            {"tolist", (PyCFunction)GapBuffer_tolist, METH_NOARGS, "List of the items" },
+            {"tobytes", (PyCFunction)GapBuffer_tobytes, METH_NOARGS, "Bytes of the items as stored" },
+            {"to_array", (PyCFunction)GapBuffer_to_array, METH_NOARGS, "array.array of the items" },
             {NULL}  /* Sentinel */
         };
 
+// Count an export that started at a time, noting whether it moved the gap
+static void
+_GapBuffer_CountExport(GapBuffer *self, double started, int collapsed) {
+	self->stats->exports++;
+	self->stats->exportCollapses += collapsed;
+	self->stats->exportTime += _GapBuffer_Clock() - started;
+}
+
 #if PY_MAJOR_VERSION >= 3
 
 static int GapBuffer_getbufferproc(GapBuffer *self, Py_buffer *view, int flags) {
+	double started = _GapBuffer_Counting(self) ? _GapBuffer_Clock() : 0.0;
+	int collapsed;
+	_GapBuffer_Wait(self, 1);
+	collapsed = (self->root != NULL) || (self->part1Length != self->lengthBody);
 	// Move gap to end so bytes are contiguous
-	_GapBuffer_GapTo(self, self->lengthBody);
+	if (_GapBuffer_Contiguous(self) < 0)
+		return -1;
+	_GapBuffer_Settle(self);
+	// Writes through the export can not be seen so snapshots take their own copies
+	_GapBuffer_DetachSnapshots(self);
 
 	Py_INCREF(self);
 	view->obj = (PyObject*)self;
 	view->buf = self->body;
 	view->len = self->lengthBody;
 	view->readonly = 0;
-	if (flags & PyBUF_FORMAT) {
-		if (self->itemType == 'c') {
-			view->format = "c";
-		} else if (self->itemType == 'u') {
-			view->format = "s";
-		} else {    // self->itemType == 'i'
-			view->format = "i";
-		}
-	} else {
-		view->format = "B";
-	}
+	view->format = (flags & PyBUF_FORMAT) ? _GapBuffer_Format(self) : "B";
 	view->ndim = 1;
+	// Exports lock the buffer so the length can not change while shared
+	self->exportShape[0] = self->lengthBody / self->itemSize;
+	view->shape = (flags & PyBUF_ND) ? self->exportShape : NULL;
 	view->strides = NULL;
 	view->suboffsets = NULL;
 	view->itemsize = self->itemSize;
 	view->internal = 0;
 	self->lock++;
+	if (_GapBuffer_Counting(self))
+		_GapBuffer_CountExport(self, started, collapsed);
 	return 0;
 }
 
@@ -563,9 +7503,21 @@ static PyBufferProcs GapBuffer_bufferprocs = {
 // Python 2.x buffer procs
 
 // The getreadbufferproc, getwritebufferproc, and getcharbufferproc are mostly the same
-int _GapBuffer_getbufferproc(GapBuffer *self, Py_ssize_t index, const void **ptr) {
+Py_ssize_t _GapBuffer_getbufferproc(GapBuffer *self, Py_ssize_t index, const void **ptr) {
+	double started = _GapBuffer_Counting(self) ? _GapBuffer_Clock() : 0.0;
+	int collapsed;
+	_GapBuffer_Wait(self, 1);
+	collapsed = (self->root != NULL) ||
+	        ((self->bufferAppearence == 0) && (self->part1Length != self->lengthBody));
+	if (_GapBuffer_Flatten(self) < 0)
+		return -1;
+	_GapBuffer_Settle(self);
+	_GapBuffer_DetachSnapshots(self);
+	if (_GapBuffer_Counting(self) && (index == 0))
+		_GapBuffer_CountExport(self, started, collapsed);
 	if (self->bufferAppearence == 0) {
-		_GapBuffer_GapTo(self, self->lengthBody);
+		if (_GapBuffer_Contiguous(self) < 0)
+			return -1;
 		*ptr = self->body;
 		return self->lengthBody;
 	} else {
@@ -584,15 +7536,15 @@ int _GapBuffer_getbufferproc(GapBuffer *self, Py_ssize_t index, const void **ptr
 	}
 }
 
-int GapBuffer_getreadbufferproc(GapBuffer *self, Py_ssize_t index, const void **ptr) {
+Py_ssize_t GapBuffer_getreadbufferproc(GapBuffer *self, Py_ssize_t index, const void **ptr) {
 	return _GapBuffer_getbufferproc(self, index, ptr);
 }
 
-int GapBuffer_getwritebufferproc(GapBuffer *self, Py_ssize_t index, const void **ptr) {
+Py_ssize_t GapBuffer_getwritebufferproc(GapBuffer *self, Py_ssize_t index, const void **ptr) {
 	return _GapBuffer_getbufferproc(self, index, ptr);
 }
 
-int GapBuffer_getsegcountproc(GapBuffer *self, int *lenp) {
+Py_ssize_t GapBuffer_getsegcountproc(GapBuffer *self, Py_ssize_t *lenp) {
 	if ( lenp )
 		*lenp = self->lengthBody;
 	if (self->bufferAppearence == 0) {
@@ -602,7 +7554,7 @@ int GapBuffer_getsegcountproc(GapBuffer *self, int *lenp) {
 	}
 }
 
-int GapBuffer_getcharbufferproc(GapBuffer *self, Py_ssize_t index, const void **ptr) {
+Py_ssize_t GapBuffer_getcharbufferproc(GapBuffer *self, Py_ssize_t index, const void **ptr) {
 	if (self->itemType != 'c') {
 		PyErr_SetString(PyExc_TypeError, "GapBuffer not of char type");
 		return -1;
@@ -626,63 +7578,52 @@ GapBuffer_length(GapBuffer *self) {
 
 static PyObject *
 GapBuffer_item(GapBuffer *self, Py_ssize_t position) {
-	char *ptr;
-
-	position *= self->itemSize;
-
-	if ((position < 0) || ((position + 1) > self->lengthBody)) {
+	_GapBuffer_Wait(self, 0);
+	if ((position < 0) || (position >= self->lengthBody / self->itemSize)) {
 		PyErr_SetString(PyExc_IndexError, "GapBuffer index out of range");
 		return NULL;
 	}
 
-	ptr = _GapBuffer_at(self, position);
-	if (self->itemType == 'c') {
-		return PyBytes_FromStringAndSize(ptr, 1);
-	} else if (self->itemType == 'u') {
-		return PyUnicode_FromUnicode((Py_UNICODE *)(ptr), 1);
-	} else {
-		return PyLong_FromLong((long)*((int *)ptr));
-	}
+	return _GapBuffer_item(self, position);
 }
 
 static PyObject *
 GapBuffer_slice(GapBuffer *self, Py_ssize_t ilow, Py_ssize_t ihigh) {
 	GapBuffer *nsv;
-	int length;
-	int i = 0;
-	int position = 0;
-	
-	ilow *= self->itemSize;
-	if (ihigh > self->lengthBody / self->itemSize)
-		ihigh = self->lengthBody / self->itemSize;
-	ihigh *= self->itemSize;
+	Py_ssize_t length;
+	Py_ssize_t lengthItems;
 
+	_GapBuffer_AcquireRead(self);
+	lengthItems = self->lengthBody / self->itemSize;
 	if (ilow < 0)
 		ilow = 0;
-	else if (ilow > self->lengthBody)
-		ilow = self->lengthBody;
-	if (ihigh < 0)
-		ihigh = 0;
+	else if (ilow > lengthItems)
+		ilow = lengthItems;
 	if (ihigh < ilow)
 		ihigh = ilow;
-	else if (ihigh > self->lengthBody)
-		ihigh = self->lengthBody;
+	else if (ihigh > lengthItems)
+		ihigh = lengthItems;
+	ilow *= self->itemSize;
+	ihigh *= self->itemSize;
+
 	nsv = (GapBuffer *) GapBuffer_new(&gapbuffer_GapBufferType, NULL, NULL);
-	if (nsv == NULL)
+	if (nsv == NULL) {
+		_GapBuffer_Release(self);
 		return NULL;
+	}
 	nsv->itemType = self->itemType;
 	nsv->itemSize = self->itemSize;
+	nsv->compact = self->compact;
 	length = ihigh - ilow;
 
-	_GapBuffer_RoomFor(nsv, length);
-	_GapBuffer_GapTo(nsv, 0);
-	position = ilow;
-	while ((i < length) && (position < self->part1Length)) {
-		nsv->body[i++] = self->body[position++];
-	}
-	while (i < length) {
-		nsv->body[i++] = self->body[self->gapLength + position++];
+	if (_GapBuffer_RoomFor(nsv, length) < 0) {
+		_GapBuffer_Release(self);
+		Py_DECREF(nsv);
+		return NULL;
 	}
+	_GapBuffer_GapTo(nsv, 0);
+	_GapBuffer_copyoutBulk(self, ilow, length, nsv->body);
+	_GapBuffer_Release(self);
 	nsv->lengthBody += length;
 	nsv->part1Length += length;
 	nsv->gapLength -= length;
@@ -694,7 +7635,9 @@ static PyObject *
 GapBuffer_concat(GapBuffer *self, PyObject *other) {
 	GapBuffer *o;
 	GapBuffer *nsv;
-	int lengthTotal;
+	Py_ssize_t lengthSelf;
+	Py_ssize_t lengthTotal;
+	int itemSize;
 	if (!PyObject_TypeCheck(other, &gapbuffer_GapBufferType)) {
 		PyErr_SetString(PyExc_TypeError, "GapBuffer concat: must be GapBuffer");
 		return NULL;
@@ -704,18 +7647,38 @@ GapBuffer_concat(GapBuffer *self, PyObject *other) {
 		PyErr_SetString(PyExc_TypeError, "GapBuffer concat: different types");
 		return NULL;
 	}
+	_GapBuffer_AcquireReadPair(self, o);
+	if (self->lengthBody > PY_SSIZE_T_MAX - o->lengthBody) {
+		_GapBuffer_Release(self);
+		_GapBuffer_Release(o);
+		PyErr_SetString(PyExc_OverflowError, "GapBuffer concat: result too long");
+		return NULL;
+	}
+	// Text stored with different item sizes is widened to the larger
+	itemSize = (o->itemSize > self->itemSize) ? o->itemSize : self->itemSize;
+	lengthSelf = self->lengthBody / self->itemSize * itemSize;
+	lengthTotal = lengthSelf + o->lengthBody / o->itemSize * itemSize;
 	nsv = (GapBuffer *) GapBuffer_new(&gapbuffer_GapBufferType, NULL, NULL);
+	if (nsv != NULL) {
+		nsv->itemType = self->itemType;
+		nsv->itemSize = itemSize;
+		nsv->compact = self->compact;
+		if (_GapBuffer_RoomFor(nsv, lengthTotal) < 0) {
+			Py_CLEAR(nsv);
+		} else {
+			_GapBuffer_GapTo(nsv, 0);
+			_GapBuffer_copyoutBulk(self, 0, self->lengthBody, nsv->body);
+			_GapBuffer_ConvertItems(nsv->body, self->itemSize, nsv->body, itemSize,
+			        self->lengthBody / self->itemSize);
+			_GapBuffer_copyoutBulk(o, 0, o->lengthBody, nsv->body + lengthSelf);
+			_GapBuffer_ConvertItems(nsv->body + lengthSelf, o->itemSize, nsv->body + lengthSelf, itemSize,
+			        o->lengthBody / o->itemSize);
+		}
+	}
+	_GapBuffer_Release(self);
+	_GapBuffer_Release(o);
 	if (nsv == NULL)
 		return NULL;
-	nsv->itemType = self->itemType;
-	nsv->itemSize = self->itemSize;
-	lengthTotal = self->lengthBody + o->lengthBody;
-	_GapBuffer_RoomFor(nsv, lengthTotal);
-	_GapBuffer_GapTo(nsv, 0);
-	_GapBuffer_GapTo(self, self->lengthBody);
-	_GapBuffer_GapTo(o, o->lengthBody);
-	memmove(nsv->body, self->body, self->lengthBody);
-	memmove(nsv->body + self->lengthBody, o->body, o->lengthBody);
 	nsv->lengthBody += lengthTotal;
 	nsv->part1Length += lengthTotal;
 	nsv->gapLength -= lengthTotal;
@@ -725,20 +7688,41 @@ GapBuffer_concat(GapBuffer *self, PyObject *other) {
 static PyObject *
 GapBuffer_repeat(GapBuffer *self, Py_ssize_t n) {
 	GapBuffer *nsv;
-	int lengthTotal;
-	int i;
+	Py_ssize_t lengthTotal;
+	Py_ssize_t i;
+	PyThreadState *state;
+	if (n < 0)
+		n = 0;
+	_GapBuffer_AcquireRead(self);
+	if ((n > 0) && (self->lengthBody > PY_SSIZE_T_MAX / n)) {
+		_GapBuffer_Release(self);
+		PyErr_SetString(PyExc_OverflowError, "GapBuffer repeat: result too long");
+		return NULL;
+	}
 	nsv = (GapBuffer *) GapBuffer_new(&gapbuffer_GapBufferType, NULL, NULL);
-	if (nsv == NULL)
+	if (nsv == NULL) {
+		_GapBuffer_Release(self);
 		return NULL;
+	}
 	nsv->itemType = self->itemType;
 	nsv->itemSize = self->itemSize;
+	nsv->compact = self->compact;
 	lengthTotal = self->lengthBody * n;
-	_GapBuffer_RoomFor(nsv, lengthTotal);
+	if (_GapBuffer_RoomFor(nsv, lengthTotal) < 0) {
+		_GapBuffer_Release(self);
+		Py_DECREF(nsv);
+		return NULL;
+	}
 	_GapBuffer_GapTo(nsv, 0);
-	_GapBuffer_GapTo(self, self->lengthBody);
-	for (i = 0;i < n;i++) {
-		memmove(nsv->body + self->lengthBody * i, self->body, self->lengthBody);
+	// Copy once then repeat that copy, which the source can not change
+	if (n > 0)
+		_GapBuffer_copyoutBulk(self, 0, self->lengthBody, nsv->body);
+	state = _GapBuffer_Unblock(self, lengthTotal, 0);
+	for (i = 1;i < n;i++) {
+		memcpy(nsv->body + self->lengthBody * i, nsv->body, self->lengthBody);
 	}
+	_GapBuffer_Block(state);
+	_GapBuffer_Release(self);
 	nsv->lengthBody += lengthTotal;
 	nsv->part1Length += lengthTotal;
 	nsv->gapLength -= lengthTotal;
@@ -746,49 +7730,113 @@ GapBuffer_repeat(GapBuffer *self, Py_ssize_t n) {
 }
 
 static void
-_GapBuffer_delete(GapBuffer *self, int position, int size) {
-	_GapBuffer_GapTo(self, position);
-	self->lengthBody -= size;
-	self->gapLength += size;
+_GapBuffer_delete(GapBuffer *self, Py_ssize_t position, Py_ssize_t size) {
+	_GapBuffer_Acquire(self, 1);
+	if (self->lines)
+		_GapBuffer_LinesDeleted(self, position, size);
+	if (self->styles)
+		_GapBuffer_StylesDeleted(self, position, size);
+	if (self->undo)
+		_GapBuffer_UndoRecord(self, UNDO_DELETE, position, NULL, size);
+	if (self->root) {
+		_GapBuffer_TreeDelete(self, position, size);
+		self->lengthBody -= size;
+	} else {
+		_GapBuffer_GapTo(self, position);
+		self->lengthBody -= size;
+		self->gapLength += size;
+	}
+	if (self->stepLength != 0) {
+		Py_ssize_t item = position / self->itemSize;
+		Py_ssize_t items = size / self->itemSize;
+		if (self->stepStart >= item + items)
+			self->stepStart -= items;
+		else if (self->stepStart > item)
+			self->stepStart = item;
+		if (self->stepStart >= self->lengthBody / self->itemSize)
+			self->stepLength = 0;
+	}
+	_GapBuffer_Release(self);
 }
 
 static int
-GapBuffer_ass_slice(GapBuffer *self, Py_ssize_t ilow, Py_ssize_t ihigh, PyObject *v) {
-	char *text = NULL;
-	int insertLength = 0;
-	GapBuffer *psv = NULL;
+_GapBuffer_assignSlice(GapBuffer *self, Py_ssize_t ilow, Py_ssize_t ihigh, PyObject *v) {
+	const char *text = NULL;
+	char *owned = NULL;
+	PyObject *converted = NULL;
+	Py_ssize_t insertLength = 0;
+	Py_ssize_t lengthItems;
+	int result;
+
+	// Text stored with a different item size is taken as a string
+	if (v && PyObject_TypeCheck(v, &gapbuffer_GapBufferType) &&
+	        (((GapBuffer *)v)->itemType == 'u') && (self->itemType == 'u') &&
+	        (((GapBuffer *)v)->itemSize != self->itemSize)) {
+		GapBuffer *psv = (GapBuffer *)v;
+		v = converted = _GapBuffer_retrieve(psv, 0, psv->lengthBody / psv->itemSize);
+		if (converted == NULL)
+			return -1;
+		_GapBuffer_Wait(self, 1);
+	}
+
+	// Copy the text of a GapBuffer first so it may be this buffer and so only
+	// one buffer is registered with at a time
+	if (v && PyObject_TypeCheck(v, &gapbuffer_GapBufferType) &&
+	        (((GapBuffer *)v)->itemType == self->itemType)) {
+		GapBuffer *psv = (GapBuffer *)v;
+		_GapBuffer_AcquireRead(psv);
+		owned = PyMem_Malloc(psv->lengthBody + 1);
+		if (owned != NULL) {
+			_GapBuffer_copyoutBulk(psv, 0, psv->lengthBody, owned);
+			insertLength = psv->lengthBody / self->itemSize;
+		}
+		_GapBuffer_Release(psv);
+		if (owned == NULL) {
+			PyErr_NoMemory();
+			return -1;
+		}
+		text = owned;
+		_GapBuffer_Wait(self, 1);
+	}
+
+	// Unicode text is converted before taking positions as it may widen a
+	// compact buffer
+	if (v && (owned == NULL) && (self->itemType == 'u')) {
+		if (!PyUnicode_Check(v)) {
+			PyErr_SetString(PyExc_TypeError, "GapBuffer assign slice: wrong type");
+			return -1;
+		}
+		result = _GapBuffer_UnicodeItems(self, v, 1, &text, &insertLength, &owned);
+		if (result < 0) {
+			Py_XDECREF(converted);
+			return -1;
+		}
+	}
 
 	if (self->lock) {
+		PyMem_Free(owned);
+		Py_XDECREF(converted);
 		PyErr_SetString(PyExc_BufferError, "Object is locked.");
 		return -1;
 	}
-	ilow *= self->itemSize;
-	if (ihigh == -1 || ihigh > (self->lengthBody / self->itemSize)) {
-		ihigh = self->lengthBody;
-	} else {
-		ihigh *= self->itemSize;
+	lengthItems = self->lengthBody / self->itemSize;
+	if (ihigh == -1 || ihigh > lengthItems) {
+		ihigh = lengthItems;
 	}
 
 	if (ilow < 0)
 		ilow = 0;
-	else if (ilow > self->lengthBody)
-		ilow = self->lengthBody;
-	if (ihigh < 0)
-		ihigh = 0;
+	else if (ilow > lengthItems)
+		ilow = lengthItems;
 	if (ihigh < ilow)
 		ihigh = ilow;
-	else if (ihigh > self->lengthBody)
-		ihigh = self->lengthBody;
+	ilow *= self->itemSize;
+	ihigh *= self->itemSize;
+
 	_GapBuffer_delete(self, ilow, ihigh - ilow);
 
-	if (v) {
-		psv = (GapBuffer *)v;
-		if (PyObject_TypeCheck(v, &gapbuffer_GapBufferType) &&
-		        (psv->itemType == self->itemType)) {
-			_GapBuffer_GapTo(psv, psv->lengthBody);
-			text = psv->body;
-			insertLength = psv->lengthBody / self->itemSize;
-		} else if (self->itemType == 'c') {
+	if (v && (text == NULL)) {
+		if (self->itemType == 'c') {
 			if (PyBytes_Check(v)) {
 				text = PyBytes_AsString(v);
 				insertLength = PyBytes_Size(v);
@@ -796,14 +7844,6 @@ GapBuffer_ass_slice(GapBuffer *self, Py_ssize_t ilow, Py_ssize_t ihigh, PyObject
 				PyErr_SetString(PyExc_TypeError, "GapBuffer assign slice: wrong type");
 				return -1;
 			}
-		} else if (self->itemType == 'u') {
-			if (PyUnicode_Check(v)) {
-				text = (char *)PyUnicode_AS_UNICODE(v);
-				insertLength = PyUnicode_GET_SIZE(v);
-			} else {
-				PyErr_SetString(PyExc_TypeError, "GapBuffer assign slice: wrong type");
-				return -1;
-			}
 		} else {
 			if (0 != _GapBuffer_insertiter(self, ilow / self->itemSize, v)) {
 				return -1;
@@ -812,9 +7852,25 @@ GapBuffer_ass_slice(GapBuffer *self, Py_ssize_t ilow, Py_ssize_t ihigh, PyObject
 		}
 	}
 
-	_GapBuffer_insertarray(self, ilow, text, insertLength * self->itemSize);
+	result = _GapBuffer_insertarray(self, ilow, text, insertLength * self->itemSize);
+	PyMem_Free(owned);
+	Py_XDECREF(converted);
+	return result;
+}
 
-	return 0;
+static int
+GapBuffer_ass_slice(GapBuffer *self, Py_ssize_t ilow, Py_ssize_t ihigh, PyObject *v) {
+	int result;
+	// Replacing text is a single undo step but plain insertions and deletions
+	// are left ungrouped so they can be merged with neighbouring typing
+	int group = (v != NULL) && (ihigh != ilow);
+	_GapBuffer_Wait(self, 1);
+	if (group)
+		_GapBuffer_UndoBeginGroup(self);
+	result = _GapBuffer_assignSlice(self, ilow, ihigh, v);
+	if (group)
+		_GapBuffer_UndoEndGroup(self);
+	return result;
 }
 
 static int
@@ -823,19 +7879,30 @@ GapBuffer_ass_item(GapBuffer *self, Py_ssize_t position, PyObject *v) {
 		PyErr_SetString(PyExc_BufferError, "Object is locked.");
 		return -1;
 	}
-	if (self->itemType == 'i') {
+	if (!GAPBUFFER_TEXT(self->itemType)) {
 		char *ptr;
-		position *= self->itemSize;
-		if ((position < 0) || ((position + 1) > self->lengthBody)) {
+		char item[8];
+		if (v && (_GapBuffer_PackNumber(self->itemType, self->itemSize, v, item) < 0))
+			return -1;
+		_GapBuffer_Wait(self, 1);
+		if ((position < 0) || (position >= self->lengthBody / self->itemSize)) {
 			PyErr_SetString(PyExc_IndexError, "GapBuffer index out of range");
 			return -1;
 		}
 		if (v) {
-			ptr = _GapBuffer_at(self, position);
-			*((int *)ptr) = PyLong_AsLong(v);
+			// Store the value less the step that will be added when it is read
+			if ((self->stepLength != 0) && (position >= self->stepStart)) {
+				GapBufferOperation op;
+				_GapBuffer_OperationInit(&op, TRANSFORM_ADD, -(PY_LONG_LONG)self->stepLength);
+				_GapBuffer_transformItems(self, item, 1, &op);
+			}
+			ptr = _GapBuffer_at(self, position * self->itemSize);
+			if (self->snapshots)
+				_GapBuffer_Touch(self, ptr - self->body, ptr - self->body + self->itemSize);
+			memcpy(ptr, item, self->itemSize);
 		} else {
 			// Deleting an item
-			_GapBuffer_delete(self, position, self->itemSize);
+			_GapBuffer_delete(self, position * self->itemSize, self->itemSize);
 		}
 		return 0;
 	} else {
@@ -856,8 +7923,9 @@ static PySequenceMethods GapBuffer_as_sequence = {
 static PyObject *GapBuffer_subscript(GapBuffer *self, PyObject *item) {
 	if (PySlice_Check(item)) {
 		Py_ssize_t start, stop, step, slicelength;
+		// Indices count items, not bytes
 		if (PySlice_GetIndicesEx((PySliceObject*)item, 
-			self->lengthBody, &start, &stop, 
+			GapBuffer_length(self), &start, &stop, 
 			&step, &slicelength) < 0)
 			return NULL;
 
@@ -867,7 +7935,11 @@ static PyObject *GapBuffer_subscript(GapBuffer *self, PyObject *item) {
 		}
 		return GapBuffer_slice(self, start, stop);
 	} else {
-		int index = PyLong_AsLong(item);
+		Py_ssize_t index = PyNumber_AsSsize_t(item, PyExc_IndexError);
+		if ((index == -1) && PyErr_Occurred())
+			return NULL;
+		if (index < 0)
+			index += GapBuffer_length(self);
 		return GapBuffer_item(self, index);
 	}
 }
@@ -879,20 +7951,24 @@ static int GapBuffer_ass_subscript(GapBuffer *self, PyObject *item, PyObject *va
 	}
 	if (PySlice_Check(item)) {
 		Py_ssize_t start, stop, step, slicelength;
+		// Indices count items, not bytes
 		if (PySlice_GetIndicesEx((PySliceObject*)item, 
-			self->lengthBody, &start, &stop, 
+			GapBuffer_length(self), &start, &stop, 
 			&step, &slicelength) < 0)
-			return 0;
+			return -1;
 		if (step != 1) {
 			PyErr_SetString(PyExc_TypeError, "slice steps not supported");
-			return 0;
+			return -1;
 		}
-		GapBuffer_ass_slice(self, start, stop, value);
+		return GapBuffer_ass_slice(self, start, stop, value);
 	} else {
-		int index = PyLong_AsLong(item);
-		GapBuffer_ass_item(self, index, value);
+		Py_ssize_t index = PyNumber_AsSsize_t(item, PyExc_IndexError);
+		if ((index == -1) && PyErr_Occurred())
+			return -1;
+		if (index < 0)
+			index += GapBuffer_length(self);
+		return GapBuffer_ass_item(self, index, value);
 	}
-	return 0;
 }
 
 static PyMappingMethods GapBuffer_as_mapping = {
@@ -938,7 +8014,7 @@ static PyTypeObject gapbuffer_GapBufferType = {
             0,		               /* tp_clear */
             GapBuffer_richcmp,         /* tp_richcompare */
             0,		               /* tp_weaklistoffset */
-            0,		               /* tp_iter */
+            (getiterfunc)GapBuffer_iter,		               /* tp_iter */
             0,		               /* tp_iternext */
             GapBuffer_methods,             /* tp_methods */
             GapBuffer_members,             /* tp_members */
@@ -953,7 +8029,48 @@ static PyTypeObject gapbuffer_GapBufferType = {
             GapBuffer_new,                 /* tp_new */
         };
 
+// Name of the element kernels in use
+static PyObject *
+gapbuffer_simd(PyObject *module) {
+#if PY_MAJOR_VERSION >= 3
+	return PyUnicode_FromString(kernels->name);
+#else
+	return PyString_FromString(kernels->name);
+#endif
+}
+
+// Choose the element kernels, mainly so benchmarks can compare them
+static PyObject *
+gapbuffer_set_simd(PyObject *module, PyObject *args) {
+	const char *name;
+	const GapBufferKernels *best = _GapBuffer_BestKernels();
+
+	if (!PyArg_ParseTuple(args, "s:set_simd", &name)) {
+		return NULL;
+	}
+
+	if (strcmp(name, "scalar") == 0) {
+		kernels = &kernelsScalar;
+#ifdef GAPBUFFER_X86_KERNELS
+	} else if (strcmp(name, "sse2") == 0) {
+		kernels = &kernelsSSE2;
+	} else if ((strcmp(name, "avx2") == 0) && (best == &kernelsAVX2)) {
+		kernels = &kernelsAVX2;
+#endif
+	} else if (strcmp(name, "best") == 0) {
+		kernels = best;
+	} else {
+		PyErr_Format(PyExc_ValueError, "set_simd: '%s' is not supported, the best is '%s'", name, best->name);
+		return NULL;
+	}
+
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
 static PyMethodDef gapbuffer_methods[] = {
+            {"simd", (PyCFunction)gapbuffer_simd, METH_NOARGS, "Name of the element kernels in use" },
+            {"set_simd", (PyCFunction)gapbuffer_set_simd, METH_VARARGS, "Choose element kernels: 'scalar', 'sse2', 'avx2' or 'best'" },
             {NULL}  /* Sentinel */
         };
 
@@ -968,7 +8085,7 @@ static PyModuleDef gapbuffermodule = {
 	"gapbuffer",
 	"Gap buffer extension type.",
 	-1,
-	NULL, NULL, NULL, NULL, NULL
+	gapbuffer_methods, NULL, NULL, NULL, NULL
 };
 
 #endif
@@ -983,7 +8100,15 @@ initgapbuffer(void)
 	PyObject *module = NULL;
 
 	gapbuffer_GapBufferType.tp_new = PyType_GenericNew;
-	if (PyType_Ready(&gapbuffer_GapBufferType) >= 0) {
+	kernels = _GapBuffer_BestKernels();
+#if PY_MAJOR_VERSION >= 3
+	if (PyType_Ready(&gapbuffer_GapBufferSegmentType) < 0)
+		return NULL;
+#endif
+	if ((PyType_Ready(&gapbuffer_GapBufferSnapshotType) >= 0) &&
+	        (PyType_Ready(&gapbuffer_GapBufferIteratorType) >= 0) &&
+	        (PyType_Ready(&gapbuffer_RunStylesType) >= 0) &&
+	        (PyType_Ready(&gapbuffer_GapBufferType) >= 0)) {
 
 //__debugbreak();
 
@@ -997,6 +8122,10 @@ initgapbuffer(void)
 		if (module) {
 			Py_INCREF(&gapbuffer_GapBufferType);
 			PyModule_AddObject(module, "GapBuffer", (PyObject *)&gapbuffer_GapBufferType);
+			Py_INCREF(&gapbuffer_GapBufferSnapshotType);
+			PyModule_AddObject(module, "GapBufferSnapshot", (PyObject *)&gapbuffer_GapBufferSnapshotType);
+			Py_INCREF(&gapbuffer_RunStylesType);
+			PyModule_AddObject(module, "RunStyles", (PyObject *)&gapbuffer_RunStylesType);
 		}
 	}
 #if PY_MAJOR_VERSION >= 3
@@ -0,0 +1,758 @@
+# Benchmarks for the gapbuffer module.
+# Run with a section name, for example:
+#   python gbbench.py stress 4.5
+# "stress" builds and edits a buffer larger than 4 GB so needs plenty of memory.
+# "suite" compares GapBuffer with the standard containers and can save the results as JSON:
+#   python gbbench.py suite 1,16 3 results.json
+
+from __future__ import print_function
+
+import subprocess, sys, threading, time
+
+from gapbuffer import GapBuffer
+
+def stress(gigabytes="4.5"):
+	"""Build a character buffer of more than 4 GB then edit and read it near the start,
+	middle and end, checking that positions beyond 2**32 behave."""
+	block = b"0123456789abcdef" * 65536	# 1 MB
+	target = int(float(gigabytes) * 1024 * 1024 * 1024)
+	gb = GapBuffer(b"")
+
+	start = time.time()
+	while len(gb) < target:
+		gb.extend(block)
+	built = time.time()
+	print("build  %.1f GB in %.2fs, size %d, growSize %d" %
+		(len(gb) / 2.0**30, built - start, gb.size, gb.growSize))
+
+	length = len(gb)
+	# Smaller runs are useful for checking the benchmark itself
+	beyond = min(2**32 + 16, length - 32)
+	for position in (0, length // 2, beyond, length - 10):
+		gb.insert(position, b"<edit>")
+		assert gb.retrieve(position, 6) == b"<edit>"
+		del gb[position:position+6]
+	edited = time.time()
+	print("edit   4 insert/delete pairs in %.2fs" % (edited - built))
+
+	assert len(gb) == length
+	assert gb.retrieve(beyond, 16) == block[beyond % len(block):][:16]
+	gb.insert(beyond, b"!")
+	assert gb[beyond] == b"!"
+	assert gb.part1Length == beyond + 1
+	print("verify %.2fs" % (time.time() - edited))
+
+def export(count="50000000"):
+	"""Read every item of a large integer buffer by iterating, slicing, tolist,
+	iter_chunks, tobytes and to_array, with the gap in the middle."""
+	import array
+	count = int(count)
+	gb = GapBuffer(array.array("i", range(count)))
+	gb.insert(count // 2, [0])
+	del gb[count // 2]
+	for name, operation in (
+		("iterate", lambda: sum(1 for v in gb)),
+		("slice", lambda: list(gb[:])),
+		("tolist", lambda: gb.tolist()),
+		("iter_chunks", lambda: sum(len(chunk) for chunk in gb.iter_chunks(65536))),
+		("tobytes", lambda: gb.tobytes()),
+		("to_array", lambda: gb.to_array())):
+		start = time.time()
+		operation()
+		print("%-11s %.3fs for %d items" % (name, time.time() - start, count))
+
+def files(megabytes="512"):
+	"""Open a large file by reading it and by mapping it, then edit and save it."""
+	import os, tempfile
+	fd, path = tempfile.mkstemp()
+	try:
+		block = b"2007-03-26 12:00:00 something happened\n" * 25000
+		for i in range(int(megabytes) * 1024 * 1024 // len(block)):
+			os.write(fd, block)
+		os.close(fd)
+		start = time.time()
+		with open(path, "rb") as f:
+			gb = GapBuffer(f.read())
+		print("read      %.3fs" % (time.time() - start))
+		del gb
+		start = time.time()
+		gb = GapBuffer.from_file(path)
+		print("from_file %.3fs  mapped=%d" % (time.time() - start, gb.mapped))
+		start = time.time()
+		gb.insert(0, b"edited\n")
+		print("edit      %.3fs" % (time.time() - start))
+		start = time.time()
+		gb.save(path)
+		print("save      %.3fs" % (time.time() - start))
+	finally:
+		os.remove(path)
+
+def growth(iterations="1000000"):
+	"""Append lines with each growth strategy, reporting time and reallocations."""
+	line = b"A first line.\n"
+	iterations = int(iterations)
+	for strategy, amount in (("default", None), ("geometric", 1.5), ("geometric", 2.0),
+		("fixed", 65536), ("reserve", None)):
+		gb = GapBuffer(b"")
+		if strategy == "reserve":
+			gb.reserve(iterations * len(line))
+		elif amount is None:
+			gb.set_growth(strategy)
+		else:
+			gb.set_growth(strategy, amount)
+		start = time.time()
+		for i in range(iterations):
+			gb.extend(line)
+		print("%-10s %-8s %.3fs %5d reallocations, size %d" %
+			(strategy, amount or "", time.time() - start, gb.reallocations, gb.size))
+
+def allocrun(allocator, megabytes):
+	"""Grow one buffer with a particular allocator, reporting the slowest single
+	reallocation, total time and peak RSS. Run in a fresh process by alloc."""
+	import resource
+	block = b"x" * 65536
+	target = int(megabytes) * 1024 * 1024
+	gb = GapBuffer(b"")
+	gb.set_allocator(allocator)
+	# Keep some text after the gap as an editor would
+	gb.extend(b"tail" * 4096)
+	position = 0
+	worst = 0.0
+	start = time.time()
+	while len(gb) < target:
+		reallocations = gb.reallocations
+		before = time.time()
+		gb.insert(position, block)
+		if gb.reallocations != reallocations:
+			worst = max(worst, time.time() - before)
+		position += len(block)
+	total = time.time() - start
+	peak = resource.getrusage(resource.RUSAGE_SELF).ru_maxrss
+	if sys.platform != "darwin":
+		peak *= 1024
+	print("%-8s %.3fs total, worst grow %.1fms, %d reallocations, peak RSS %d MB" %
+		(allocator, total, worst * 1000, gb.reallocations, peak // (1024 * 1024)))
+
+def alloc(megabytes="1024"):
+	"""Compare the allocators, each in its own process so peak RSS is separate."""
+	for allocator in ("copy", "realloc", "mmap", "auto"):
+		subprocess.call([sys.executable, __file__, "allocrun", allocator, megabytes])
+
+def search(megabytes="64"):
+	"""Search a large buffer with the gap in the middle, natively and through re."""
+	import re
+	text = b"The quick brown fox jumps over the lazy dog.\n" * (int(megabytes) * 1024 * 1024 // 45)
+	gb = GapBuffer(text)
+	middle = len(gb) // 2
+	for name, search in (
+		("find", lambda: gb.find(b"lazy cat")),
+		("rfind", lambda: gb.rfind(b"lazy cat")),
+		("count", lambda: gb.count(b"fox")),
+		("bytes.find", lambda: text.find(b"lazy cat")),
+		("re.search", lambda: re.search(b"lazy cat", gb))):
+		gb.insert(middle, b"!")
+		del gb[middle]
+		start = time.time()
+		search()
+		print("%-10s %.3fs" % (name, time.time() - start))
+
+def simd(megabytes="64"):
+	"""Time increment, saturating_increment and multiply_add with each set of kernels
+	over several buffer sizes, with the gap at the start and in the middle."""
+	import gapbuffer
+	levels = []
+	for level in ("scalar", "sse2", "avx2"):
+		try:
+			gapbuffer.set_simd(level)
+			levels.append(level)
+		except ValueError:
+			pass
+	for size in (4096, 1024 * 1024, int(megabytes) * 1024 * 1024):
+		for values in (b"x" * size, [0] * (size // 4)):
+			gb = GapBuffer(values)
+			length = len(gb)
+			repeats = max(1, 64 * 1024 * 1024 // size)
+			for gap in ("start", "middle"):
+				position = 0 if gap == "start" else length // 2
+				gb.insert(position, values[:1])
+				del gb[position]
+				for level in levels:
+					gapbuffer.set_simd(level)
+					for name, operation in (
+						("increment", lambda: gb.increment(0, length, 1)),
+						("saturating", lambda: gb.saturating_increment(0, length, 1)),
+						("multiply_add", lambda: gb.multiply_add(0, length, 3, 1))):
+						start = time.time()
+						for i in range(repeats):
+							operation()
+						elapsed = time.time() - start
+						print("%-5s %9d bytes gap %-6s %-6s %-12s %8.1f MB/s" %
+							(gb.typecode, size, gap, level, name,
+							size * repeats / (elapsed or 1e-9) / (1024 * 1024)))
+	gapbuffer.set_simd("best")
+
+def types(megabytes="64"):
+	"""Time the element kernels for each number type code with each set of kernels,
+	against the same operations through the array module."""
+	import array, gapbuffer
+	levels = []
+	for level in ("scalar", "sse2", "avx2"):
+		try:
+			gapbuffer.set_simd(level)
+			levels.append(level)
+		except ValueError:
+			pass
+	size = int(megabytes) * 1024 * 1024
+	for typecode in "bBhHiIqQfd":
+		values = array.array(typecode, [1]) * (size // array.array(typecode).itemsize)
+		gb = GapBuffer(values, typecode=typecode)
+		length = len(gb)
+		gb.insert(length // 2, [1])
+		del gb[length // 2]
+		for level in levels:
+			gapbuffer.set_simd(level)
+			operations = [
+				("increment", lambda: gb.increment(0, length, 1)),
+				("multiply_add", lambda: gb.multiply_add(0, length, 1, 0)),
+				("fill", lambda: gb.fill(0, length, 1)),
+				("find", lambda: gb.find(2)),
+				("sum", lambda: gb.sum())]
+			if typecode not in "fd":
+				operations.insert(1, ("saturating", lambda: gb.saturating_increment(0, length, -1)))
+			for name, operation in operations:
+				start = time.time()
+				operation()
+				elapsed = time.time() - start
+				print("%s %-6s %-12s %8.1f MB/s" %
+					(typecode, level, name, size / (elapsed or 1e-9) / (1024 * 1024)))
+		start = time.time()
+		sum(values)
+		print("%s array  %-12s %8.1f MB/s" % (typecode, "sum", size / ((time.time() - start) or 1e-9) / (1024 * 1024)))
+	gapbuffer.set_simd("best")
+
+def ingest(count="10000000"):
+	"""Load integers from an array, a memoryview, another GapBuffer, an array of a
+	different type, a list and a generator."""
+	import array
+	count = int(count)
+	values = array.array("i", range(count))
+	for name, source in (
+		("array('i')", lambda: values),
+		("memoryview", lambda: memoryview(values)),
+		("GapBuffer", lambda: GapBuffer(values)),
+		("array('q')", lambda: array.array("q", values)),
+		("list", lambda: values.tolist()),
+		("generator", lambda: (i for i in range(count)))):
+		data = source()
+		start = time.time()
+		gb = GapBuffer(typecode="i")
+		gb.extend(data)
+		print("%-11s %.3fs for %d items" % (name, time.time() - start, len(gb)))
+
+def partition(lines="1000000", edits="100000"):
+	"""Keep line start positions up to date while typing near one spot, with and
+	without deferring the increments."""
+	import random
+	random.seed(0)
+	lines = int(lines)
+	edits = int(edits)
+	for partitioned in (False, True):
+		starts = GapBuffer(range(0, lines * 40, 40))
+		starts.set_partitioned(partitioned)
+		line = lines // 2
+		start = time.time()
+		for i in range(edits):
+			# Wander slowly through the document as an editor does
+			line = min(max(line + random.randint(-3, 3), 1), lines - 1)
+			starts.increment(line, lines - line, 1)
+			starts[line]
+		print("partitioned=%-5s %.3fs for %d edits over %d lines" %
+			(partitioned, time.time() - start, edits, lines))
+
+def lines(count="1000000"):
+	"""Build a line index for a large file then look up lines and edit."""
+	count = int(count)
+	gb = GapBuffer(b"The quick brown fox jumps over the lazy dog.\n" * count)
+	start = time.time()
+	gb.track_lines()
+	print("track_lines          %.3fs" % (time.time() - start))
+	start = time.time()
+	for i in range(count):
+		gb.line_from_position(i * 45)
+	print("line_from_position   %.3fs for %d lookups" % (time.time() - start, count))
+	start = time.time()
+	for i in range(count):
+		gb.line_start(i)
+	print("line_start           %.3fs for %d lookups" % (time.time() - start, count))
+	position = len(gb) // 2
+	start = time.time()
+	for i in range(count // 10):
+		gb.insert(position, b"x\n" if i % 10 == 0 else b"x")
+		position += 1
+	print("insert               %.3fs for %d edits" % (time.time() - start, count // 10))
+
+def backend(megabytes="32", edits="2000"):
+	"""Edit at scattered and at local positions with each storage backend."""
+	import random
+	text = b"abcdefghij" * (int(megabytes) * 1024 * 1024 // 10)
+	edits = int(edits)
+	for kind in ("gap", "chunked"):
+		gb = GapBuffer(text, backend=kind)
+		random.seed(0)
+		start = time.time()
+		for i in range(edits):
+			position = random.randrange(len(gb))
+			gb.insert(position, b"x")
+			del gb[position]
+		scattered = time.time() - start
+		start = time.time()
+		for i in range(edits):
+			gb.insert(len(gb) // 2, b"y")
+		local = time.time() - start
+		start = time.time()
+		gb.retrieve(0, len(gb))
+		print("%-8s scattered %.3fs  local %.3fs  retrieve %.3fs for %d edits" %
+			(kind, scattered, local, time.time() - start, edits))
+
+def compact(path=".", edits="1000"):
+	"""Load the text files of a source tree with each Unicode storage, reporting memory
+	and the time taken to edit at alternate ends of each file."""
+	import os
+	texts = []
+	for directory, names, files in os.walk(path):
+		for name in files:
+			if os.path.splitext(name)[1] in (".c", ".h", ".cpp", ".cxx", ".py", ".txt", ".html", ".rst", ".md"):
+				with open(os.path.join(directory, name), "rb") as f:
+					try:
+						texts.append(f.read().decode("utf-8"))
+					except UnicodeDecodeError:
+						pass
+	edits = int(edits)
+	print("%d files, %d characters" % (len(texts), sum(len(text) for text in texts)))
+	for compact in (False, True):
+		buffers = [GapBuffer(text, compact=compact) for text in texts]
+		size = sum(gb.size for gb in buffers)
+		widths = [0, 0, 0, 0, 0]
+		for gb in buffers:
+			widths[gb.itemsize] += 1
+		start = time.time()
+		for gb in buffers:
+			for i in range(edits // len(buffers) + 1):
+				gb.insert(0, u"x")
+				gb.insert(len(gb), u"y")
+		print("compact=%-5s %9d bytes  1/2/4 byte items %d/%d/%d  edits %.3fs" %
+			(compact, size, widths[1], widths[2], widths[4], time.time() - start))
+
+def edits(matches="100000"):
+	"""Replace every match in a buffer one slice assignment at a time, forwards and
+	backwards, and with a single apply_edits call."""
+	matches = int(matches)
+	text = b"The quick brown fox jumps over the lazy dog.\n" * matches
+	positions = GapBuffer(text).find_all(b"fox")
+	gb = GapBuffer(text)
+	start = time.time()
+	for i, position in enumerate(positions):
+		gb[position + i:position + i + 3] = b"wolf"
+	print("slice forwards    %.3fs for %d edits" % (time.time() - start, len(positions)))
+	gb = GapBuffer(text)
+	start = time.time()
+	for position in reversed(positions):
+		gb[position:position + 3] = b"wolf"
+	print("slice backwards   %.3fs for %d edits" % (time.time() - start, len(positions)))
+	changes = [(position, 3, b"wolf") for position in positions]
+	gb = GapBuffer(text)
+	start = time.time()
+	gb.apply_edits(changes)
+	print("apply_edits       %.3fs for %d edits" % (time.time() - start, len(positions)))
+
+def replace(megabytes="64"):
+	"""Replace every match through re.finditer with one edit per match and with replace."""
+	import re
+	text = b"2024-01-01 user=alice ip=10.0.0.1 action=login\n" * (int(megabytes) * 1024 * 1024 // 48)
+	pattern = re.compile(b"ip=10")
+	gb = GapBuffer(text)
+	start = time.time()
+	diff = 0
+	for match in list(pattern.finditer(gb)):
+		gb[match.start() + diff:match.end() + diff] = b"ip=XXX"
+		diff += 1
+	print("re.finditer  %.3fs" % (time.time() - start))
+	gb = GapBuffer(text)
+	start = time.time()
+	count = gb.replace(b"ip=10", b"ip=XXX")
+	print("replace      %.3fs for %d replacements" % (time.time() - start, count))
+	start = time.time()
+	gb.replace(b"ip=XXX", b"ip=")
+	print("shrinking    %.3fs" % (time.time() - start))
+
+def utf8(megabytes="64", block="65536"):
+	"""Append UTF-8 read in blocks by decoding each block and with feed_utf8."""
+	text = (u"Plain ASCII text with the odd \u00e9 and \u4e2d in it.\n" * 1000).encode("utf-8")
+	data = text * (int(megabytes) * 1024 * 1024 // len(text))
+	block = int(block)
+	gb = GapBuffer(u"")
+	start = time.time()
+	for i in range(0, len(data), block):
+		gb.extend(data[i:i+block].decode("utf-8"))
+	print("decode+extend %.3fs" % (time.time() - start))
+	gb = GapBuffer(u"")
+	start = time.time()
+	for i in range(0, len(data), block):
+		gb.feed_utf8(data[i:i+block])
+	gb.feed_utf8(b"", True)
+	print("feed_utf8     %.3fs" % (time.time() - start))
+
+def undo(actions="1000000"):
+	"""Record typing with and without undo then undo all of it."""
+	actions = int(actions)
+	for track in (False, True):
+		gb = GapBuffer(b"")
+		if track:
+			gb.track_undo()
+		start = time.time()
+		for i in range(actions):
+			# Type words with occasional jumps back to break coalescing
+			if i % 50 == 49:
+				gb.insert(len(gb) // 2, b"x")
+			else:
+				gb.insert(len(gb), b"a")
+		print("track_undo=%-5s %.3fs for %d insertions" % (track, time.time() - start, actions))
+	start = time.time()
+	steps = 0
+	while gb.undo():
+		steps += 1
+	print("undo             %.3fs for %d steps" % (time.time() - start, steps))
+
+def snapshot(megabytes="64", edits="10000"):
+	"""Edit a large buffer while a reader holds a snapshot taken before each edit."""
+	text = b"abcdefghij" * (int(megabytes) * 1024 * 1024 // 10)
+	edits = int(edits)
+	gb = GapBuffer(text)
+	gb.insert(len(gb), b"x" * (edits * 2))
+	start = time.time()
+	snapshots = [gb.snapshot() for i in range(100)]
+	print("snapshot         %.6fs each" % ((time.time() - start) / len(snapshots)))
+	view = None
+	for reading in (False, True):
+		start = time.time()
+		for i in range(edits):
+			if reading:
+				view = gb.snapshot()
+			# Edits stay near one place as when typing
+			position = len(gb) // 2 + (i * 7919) % 4096
+			gb.insert(position, b"y")
+			del gb[position]
+		print("snapshots=%-5s  %.3fs for %d edits" % (reading, time.time() - start, edits))
+	start = time.time()
+	copy = view.copy()
+	print("copy             %.3fs" % (time.time() - start))
+
+def window(megabytes="64", frames="100000", visible="4096"):
+	"""Type into a large buffer, taking the visible window out of it for each frame."""
+	gb = GapBuffer(b"abcdefghij" * (int(megabytes) * 1024 * 1024 // 10))
+	frames = int(frames)
+	visible = int(visible)
+	top = len(gb) // 2
+	for method in ("slice", "view"):
+		start = time.time()
+		for i in range(frames):
+			gb.insert(top + visible // 2, b"y")
+			if method == "slice":
+				shown = gb[top:top + visible]
+			else:
+				shown = gb.view(top, top + visible)
+		print("%-5s  %.3fs  %.1fus per frame" % (method, time.time() - start,
+			(time.time() - start) * 1e6 / frames))
+
+def threads(count="4", megabytes="16", edits="200"):
+	"""Edit separate large buffers from several threads, moving the gap end to end."""
+	size = int(megabytes) * 1024 * 1024
+	edits = int(edits)
+	def work():
+		gb = GapBuffer(b"a" * size)
+		for i in range(edits):
+			gb.insert(0 if i % 2 else len(gb), b"x")
+	for workers in (1, int(count)):
+		pool = [threading.Thread(target=work) for i in range(workers)]
+		start = time.time()
+		for thread in pool:
+			thread.start()
+		for thread in pool:
+			thread.join()
+		elapsed = time.time() - start
+		print("threads=%-3d  %.3fs  %.0f edits/s" % (workers, elapsed, workers * edits / elapsed))
+
+def compare(megabytes="64", checks="20"):
+	"""Check whether an edited buffer still equals its saved text, as after each keystroke."""
+	saved = b"abcdefghij" * (int(megabytes) * 1024 * 1024 // 10)
+	gb = GapBuffer(saved)
+	checks = int(checks)
+	digest = gb.content_hash()
+	for method in ("retrieve", "equal", "hash"):
+		start = time.time()
+		for i in range(checks):
+			# Type and then undo it so the text is the same but the gap has moved
+			position = (i * 7919) % len(gb)
+			gb.insert(position, b"y")
+			del gb[position]
+			if method == "retrieve":
+				same = gb.retrieve(0, len(gb)) == saved
+			elif method == "equal":
+				same = gb == saved
+			else:
+				same = gb.content_hash() == digest
+		print("%-8s  %.3fs  %.1fms per check  same=%s" % (method, time.time() - start,
+			(time.time() - start) * 1e3 / checks, same))
+	gb.insert(0, b"y")
+	start = time.time()
+	for i in range(checks):
+		same = gb == saved
+	print("length    %.6fs per check  same=%s" % ((time.time() - start) / checks, same))
+
+def styles(megabytes="16", edits="20000"):
+	"""Style keywords of a large text with a parallel byte buffer and with RunStyles, then edit."""
+	line = b"\tif (count > limit) return value;\n"
+	text = line * (int(megabytes) * 1024 * 1024 // len(line))
+	edits = int(edits)
+	# Style one keyword every ten lines, as a lexer colouring sparse keywords would
+	keyword = [(i * len(line) + 1, 2) for i in range(0, len(text) // len(line), 10)]
+	for kind in ("bytes", "runs"):
+		gb = GapBuffer(text)
+		start = time.time()
+		if kind == "bytes":
+			styles = GapBuffer(b"\0" * len(text))
+			for position, length in keyword:
+				styles[position:position + length] = b"\1" * length
+			size = styles.size
+		else:
+			gb.track_styles()
+			styles = gb.styles
+			for position, length in keyword:
+				styles.fill_range(position, length, 1)
+			size = styles.runs * 2 * 8
+		print("%-5s  fill %.3fs  %.1fMB" % (kind, time.time() - start, size / 1048576.0))
+		start = time.time()
+		# Type then backspace at a few places in the middle
+		middle = len(gb) // 2
+		for i in range(edits):
+			position = middle + (i // 100) * 7919 + i % 100
+			gb.insert(position, b"x")
+			if kind == "bytes":
+				styles.insert(position, b"\0")
+			if i % 3 == 2:
+				del gb[position]
+				if kind == "bytes":
+					del styles[position]
+		print("%-5s  edit %.3fs for %d edits" % (kind, time.time() - start, edits))
+
+def suite(sizes="1,16", repeat="3", output=""):
+	"""Time the common operations on GapBuffer and on bytearray, io.BytesIO, array and
+	list at each size in megabytes, taking the best of repeat runs. Positions come from a
+	fixed seed so every container and every run does the same work. The results are
+	written as JSON to the output file, or to stdout for "-", to compare releases. The
+	table printed as the suite runs goes to stderr when the JSON goes to stdout."""
+	import array, io, json, platform, random, gapbuffer
+	try:
+		from timeit import default_timer as timer
+	except ImportError:
+		timer = time.time
+	repeat = int(repeat)
+	progress = sys.stderr if output == "-" else sys.stdout
+	line = b"The quick brown fox jumps over the lazy dog.\n"
+	python3 = sys.version_info[0] >= 3
+
+	def stream_insert(stream, position, data):
+		stream.seek(position)
+		rest = stream.read()
+		stream.seek(position)
+		stream.write(data)
+		stream.write(rest)
+
+	def stream_delete(stream, position, length):
+		stream.seek(position + length)
+		rest = stream.read()
+		stream.seek(position)
+		stream.write(rest)
+		stream.truncate()
+
+	def stream_read(stream, position, length):
+		stream.seek(position)
+		return stream.read(length)
+
+	def sequence_delete(sequence, position, length):
+		del sequence[position:position + length]
+
+	def view(target):
+		memoryview(target).release()
+
+	def numbers(kind, count):
+		values = array.array("i", range(count))
+		if kind == "GapBuffer":
+			return GapBuffer(values, typecode="i")
+		return list(values) if kind == "list" else values
+
+	# Each container: make from bytes, convert bytes to items, insert, delete, read a range,
+	# slice, find and export. None marks an operation the container does not offer.
+	containers = [
+		("GapBuffer", GapBuffer, bytes,
+			lambda x, p, d: x.insert(p, d), sequence_delete,
+			lambda x, p, n: x.retrieve(p, n), lambda x, a, b: x[a:b],
+			lambda x, d: x.find(d), view),
+		("bytearray", bytearray, bytes,
+			lambda x, p, d: x.__setitem__(slice(p, p), d), sequence_delete,
+			lambda x, p, n: x[p:p + n], lambda x, a, b: x[a:b],
+			lambda x, d: x.find(d), view),
+		("BytesIO", io.BytesIO, bytes, stream_insert, stream_delete, stream_read,
+			lambda x, a, b: stream_read(x, a, b - a),
+			lambda x, d: x.getvalue().find(d),
+			lambda x: x.getbuffer().release()),
+		("array", lambda d: array.array("B", d), lambda d: array.array("B", d),
+			lambda x, p, d: x.__setitem__(slice(p, p), d), sequence_delete,
+			lambda x, p, n: x[p:p + n], lambda x, a, b: x[a:b],
+			None, view),
+		("list", lambda d: list(bytearray(d)), lambda d: list(bytearray(d)),
+			lambda x, p, d: x.__setitem__(slice(p, p), d), sequence_delete,
+			lambda x, p, n: x[p:p + n], lambda x, a, b: x[a:b],
+			None, None),
+	]
+
+	results = []
+	for megabytes in sizes.split(","):
+		size = int(float(megabytes) * 1024 * 1024)
+		text = line * (size // len(line))
+		size = len(text)
+		middle = size // 2
+		rand = random.Random(size)
+		edits = [(rand.randrange(size - 8), rand.randrange(size - 8)) for i in range(100)]
+		slices = [rand.randrange(size - size // 4) for i in range(20)]
+		for name, make, items, insert, delete, read, cut, find, export in containers:
+			chunk = items(line)
+			piece = items(b"01234567")
+			key = items(b"k")
+
+			def append(x):
+				add = x.write if name == "BytesIO" else x.extend
+				for i in range(size // len(line)):
+					add(chunk)
+
+			def insert_delete(x):
+				for position, other in edits:
+					insert(x, position, piece)
+					delete(x, other, 8)
+
+			def typing(x):
+				position = middle
+				for i in range(1000):
+					if i % 10 == 9:
+						position -= 1
+						delete(x, position, 1)
+					else:
+						insert(x, position, key)
+						position += 1
+
+			def retrieve(x):
+				for i in range(10000):
+					read(x, middle - 32, 64)
+
+			def slice_(x):
+				for start in slices:
+					cut(x, start, start + size // 4)
+
+			def search(x):
+				for i in range(10):
+					find(x, b"lazy cat")
+
+			def edit_export(x):
+				for i in range(100):
+					insert(x, middle, key)
+					delete(x, middle, 1)
+					export(x)
+
+			def increment(x):
+				for i in range(3):
+					if name == "GapBuffer":
+						x.increment(0, len(x), 1)
+					elif name == "list":
+						x[:] = [v + 1 for v in x]
+					else:
+						x[:] = array.array("i", [v + 1 for v in x])
+
+			def fresh():
+				# Leave the gap, or the stream position, in the middle as after an edit
+				x = make(text)
+				insert(x, middle, key)
+				delete(x, middle, 1)
+				return x
+
+			operations = [
+				("append", lambda: make(b""), append),
+				("insert_delete", fresh, insert_delete),
+				("typing", fresh, typing),
+				("retrieve", fresh, retrieve),
+				("slice", fresh, slice_),
+				("search", fresh, search if find else None),
+				# Python 2 can not release a memoryview or export a GapBuffer
+				("export", fresh, edit_export if export and python3 else None),
+				("increment", lambda: numbers(name, size // 4),
+					increment if name in ("GapBuffer", "array", "list") else None),
+			]
+			for operation, setup, run in operations:
+				if run is None:
+					continue
+				best = None
+				for i in range(repeat):
+					x = setup()
+					start = timer()
+					run(x)
+					elapsed = timer() - start
+					best = elapsed if best is None else min(best, elapsed)
+				results.append({"operation": operation, "container": name,
+					"bytes": size, "seconds": best})
+				progress.write("%-13s %-9s %7.1fMB  %9.6fs\n" % (operation, name, size / 1048576.0, best))
+				progress.flush()
+
+	report = {
+		"python": platform.python_version(),
+		"platform": platform.platform(),
+		"simd": gapbuffer.simd(),
+		"repeat": repeat,
+		"results": results,
+	}
+	if output == "-":
+		print(json.dumps(report, indent=1, sort_keys=True))
+	elif output:
+		with open(output, "w") as f:
+			json.dump(report, f, indent=1, sort_keys=True)
+
+sections = {
+	"alloc": alloc,
+	"allocrun": allocrun,
+	"backend": backend,
+	"compact": compact,
+	"compare": compare,
+	"edits": edits,
+	"export": export,
+	"files": files,
+	"growth": growth,
+	"ingest": ingest,
+	"lines": lines,
+	"partition": partition,
+	"replace": replace,
+	"search": search,
+	"simd": simd,
+	"snapshot": snapshot,
+	"stress": stress,
+	"styles": styles,
+	"suite": suite,
+	"threads": threads,
+	"types": types,
+	"undo": undo,
+	"utf8": utf8,
+	"window": window,
+}
+
+if __name__ == "__main__":
+	if len(sys.argv) < 2 or sys.argv[1] not in sections:
+		print("usage: gbbench.py (%s) [args]" % "|".join(sorted(sections)))
+		sys.exit(1)
+	sections[sys.argv[1]](*sys.argv[2:])
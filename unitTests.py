@@ -3,7 +3,7 @@
 # A set of basic unit tests for gap buffers of all three type, string, unicode and integer.
 # Requires Python 2.6 or newer as it uses byte literals
 
-import re, sys, unittest
+import os, re, sys, tempfile, threading, unittest
 
 # Define a function to convert a quoted literal string, which is a byte string on 2.x and
 # and a Unicode string on 3.x into a Unicode string
@@ -18,6 +18,7 @@ else:
 def r(gb):
 	return gb.retrieve(0, len(gb))
 
+import gapbuffer
 from gapbuffer import GapBuffer
 
 class TestString(unittest.TestCase):
@@ -143,6 +144,1149 @@ class TestString(unittest.TestCase):
 		self.x.slim()
 		self.assertEquals(r(self.x), self.testVal)
 
+	def testAppendLines(self):
+		line = b"A first line.\n"
+		end = 0
+		for i in range(100000):
+			self.x[end:end] = line
+			end += len(line)
+		self.assertEquals(r(self.x), line * 100000)
+		del self.x[1:len(self.x) - 1]
+		self.x.slim()
+		self.assertEquals(r(self.x), b"A\n")
+		self.assert_(self.x.size < 1000)
+
+	def testReserve(self):
+		self.x.reserve(1000)
+		reallocations = self.x.reallocations
+		for i in range(100):
+			self.x.extend(b"0123456789")
+		self.assertEquals(self.x.reallocations, reallocations)
+		self.assertEquals(len(self.x), 1000)
+
+	def testGrowthGeometric(self):
+		self.x.set_growth("geometric", 1.5)
+		self.assertEquals(self.x.growthFactor, 1.5)
+		for i in range(10000):
+			self.x.extend(self.testVal)
+		self.assertEquals(len(self.x), 30000)
+		self.assert_(self.x.reallocations < 25)
+
+	def testGrowthFixed(self):
+		self.x.set_growth("fixed", 100)
+		for i in range(100):
+			self.x.extend(self.testVal)
+		self.assertEquals(self.x.growSize, 100)
+		self.x.slim()
+		self.assertEquals(self.x.growSize, 100)
+		# Without an amount the current growSize is kept rather than scaled again
+		x = GapBuffer(u(""))
+		growSize = x.growSize
+		x.set_growth("fixed")
+		self.assertEquals(x.growSize, growSize)
+		self.assertRaises(OverflowError, x.set_growth, "fixed", sys.maxsize // x.itemsize + 1)
+
+	def testSlimFixed(self):
+		# A step of one item is less than slim rounds the length down by
+		x = GapBuffer(b"abcdefghijklmno")
+		x.set_growth("fixed", 1)
+		x.slim()
+		self.assertEquals(r(x), b"abcdefghijklmno")
+		x.insert(3, b"XYZ")
+		self.assertEquals(r(x), b"abcXYZdefghijklmno")
+		y = GapBuffer(list(range(15)), typecode="h")
+		y.set_growth("fixed", 1)
+		y.slim()
+		self.assertEquals(list(y), list(range(15)))
+		y.insert(3, [20, 21, 22])
+		self.assertEquals(list(y), [0, 1, 2, 20, 21, 22] + list(range(3, 15)))
+
+class TestSegments(unittest.TestCase):
+
+	def setUp(self):
+		self.x = GapBuffer(b"hello world")
+		self.x.insert(5, b",")
+
+	@unittest.skipIf(sys.version_info[0] < 3, "segments requires Python 3")
+	def testSegments(self):
+		before, after = self.x.segments()
+		self.assertEquals(before.tobytes(), b"hello,")
+		self.assertEquals(after.tobytes(), b" world")
+		self.assert_(before.readonly)
+		self.assertEquals(self.x.part1Length, 6)
+		# The gap can not move while segments are exported
+		self.assertRaises(BufferError, self.x.insert, 0, b"!")
+		self.assertRaises(BufferError, memoryview, self.x)
+		self.assertRaises(BufferError, self.x.slim)
+		before.release()
+		after.release()
+		self.x.insert(0, b"!")
+		self.assertEquals(r(self.x), b"!hello, world")
+
+	@unittest.skipIf(sys.version_info[0] < 3, "segments requires Python 3")
+	def testUnicodeSegments(self):
+		x = GapBuffer(u("abc"))
+		x.insert(1, u("Z"))
+		before, after = x.segments()
+		self.assertEquals(before.itemsize, x.itemsize)
+		self.assertEquals(len(before), 2)
+		self.assertEquals(len(after), 2)
+
+	def testWriteTo(self):
+		fd, path = tempfile.mkstemp()
+		try:
+			self.assertEquals(self.x.write_to(fd), 12)
+			os.close(fd)
+			with open(path, "rb") as f:
+				self.assertEquals(f.read(), b"hello, world")
+		finally:
+			os.remove(path)
+		self.assertEquals(self.x.part1Length, 6)
+
+class TestSearch(unittest.TestCase):
+
+	def setUp(self):
+		self.x = GapBuffer(b"abcabcabc")
+		# Place the gap inside the second "abc" so matches straddle it
+		self.x.insert(4, b"!")
+		del self.x[4]
+
+	def testFind(self):
+		self.assertEquals(self.x.part1Length, 4)
+		self.assertEquals(self.x.find(b"abc"), 0)
+		self.assertEquals(self.x.find(b"abc", 1), 3)
+		self.assertEquals(self.x.find(b"cab"), 2)
+		self.assertEquals(self.x.find(b"bca", 2, 7), 4)
+		self.assertEquals(self.x.find(b"bca", 2, 6), -1)
+		self.assertEquals(self.x.find(b"x"), -1)
+		self.assertEquals(self.x.find(b""), 0)
+		self.assertEquals(self.x.find(b"abc", -3), 6)
+		self.assertEquals(self.x.part1Length, 4)
+
+	def testRFind(self):
+		self.assertEquals(self.x.rfind(b"abc"), 6)
+		self.assertEquals(self.x.rfind(b"abc", 0, 6), 3)
+		self.assertEquals(self.x.rfind(b"cab", 0, 6), 2)
+		self.assertEquals(self.x.rfind(b"x"), -1)
+		self.assertEquals(self.x.rfind(b""), 9)
+
+	def testCount(self):
+		self.assertEquals(self.x.count(b"abc"), 3)
+		self.assertEquals(self.x.count(b"bcab"), 1)
+		self.assertEquals(self.x.count(b"bc", 2), 2)
+		self.assertEquals(self.x.count(b""), 10)
+		self.assertEquals(self.x.find_all(b"ca"), [2, 5])
+
+	def testUnicode(self):
+		x = GapBuffer(u("Палить из пушки по воробьям"))
+		x.insert(12, u("!"))
+		del x[12]
+		self.assertEquals(x.find(u("пушки")), 10)
+		self.assertEquals(x.rfind(u("о")), 22)
+		self.assertEquals(x.count(u("о")), 3)
+		self.assertEquals(x.find(u("\x1f")), -1)
+
+	def testInteger(self):
+		x = GapBuffer([1, 256, 2, 1, 256, 2])
+		x.insert(4, [0])
+		del x[4]
+		self.assertEquals(x.find([256, 2]), 1)
+		self.assertEquals(x.find(256, 2), 4)
+		self.assertEquals(x.rfind([1, 256]), 3)
+		self.assertEquals(x.count(2), 2)
+		self.assertEquals(x.find_all([2, 1]), [2])
+		# Bytes of misaligned items must not match
+		self.assertEquals(x.find(2 * 256 * 256 * 256), -1)
+
+	def testWrongType(self):
+		self.assertRaises(TypeError, self.x.find, u("abc"))
+		self.assertRaises(TypeError, GapBuffer([1]).find, "a")
+
+class TestAllocators(unittest.TestCase):
+
+	def check(self, allocator):
+		x = GapBuffer(b"")
+		x.set_allocator(allocator)
+		model = b""
+		block = b"0123456789" * 1000
+		for i in range(50):
+			position = (i * 7919) % (len(model) + 1)
+			x.insert(position, block)
+			model = model[:position] + block + model[position:]
+			del x[position // 2:position // 2 + 3000]
+			model = model[:position // 2] + model[position // 2 + 3000:]
+		self.assertEquals(r(x), model)
+		x.insert(len(x) // 3, b"!")
+		model = model[:len(model) // 3] + b"!" + model[len(model) // 3:]
+		x.slim()
+		self.assertEquals(r(x), model)
+		self.assert_(x.size < len(model) + 1000000)
+		return x
+
+	def testAuto(self):
+		self.check("auto")
+
+	def testCopy(self):
+		self.check("copy")
+
+	def testRealloc(self):
+		self.check("realloc")
+
+	def testMap(self):
+		try:
+			x = self.check("mmap")
+		except ValueError:
+			return	# mmap not available on this platform
+		self.assertEquals(x.mapped, 1)
+
+	def testUnknown(self):
+		self.assertRaises(ValueError, GapBuffer(b"").set_allocator, "malloc")
+
+class TestKernels(unittest.TestCase):
+
+	def levels(self):
+		available = []
+		for level in ("scalar", "sse2", "avx2"):
+			try:
+				gapbuffer.set_simd(level)
+				available.append(level)
+			except ValueError:
+				pass
+		return available
+
+	def tearDown(self):
+		gapbuffer.set_simd("best")
+
+	def testBytes(self):
+		values = bytearray(range(256)) * 2
+		for level in self.levels():
+			gapbuffer.set_simd(level)
+			for gap in (0, 5, 37, len(values)):
+				for operation, model in (
+					(lambda x: x.increment(3, 500, 7), lambda v: (v + 7) & 0xFF),
+					(lambda x: x.increment(3, 500, -300), lambda v: (v - 300) & 0xFF),
+					(lambda x: x.saturating_increment(3, 500, 100), lambda v: min(v + 100, 255)),
+					(lambda x: x.saturating_increment(3, 500, -100), lambda v: max(v - 100, 0)),
+					(lambda x: x.saturating_increment(3, 500, 1000), lambda v: 255),
+					(lambda x: x.multiply_add(3, 500, 3, 5), lambda v: (v * 3 + 5) & 0xFF)):
+					x = GapBuffer(bytes(values))
+					x.insert(gap, b"!")
+					del x[gap]
+					operation(x)
+					expected = values[:3] + bytearray([model(v) for v in values[3:503]]) + values[503:]
+					self.assertEquals(bytearray(x[:]), expected, level)
+
+	def testIntegers(self):
+		values = [(i * 2654435761) % 2**32 - 2**31 for i in range(300)]
+		values[10] = 2**31 - 1
+		values[11] = -2**31
+		def wrap(v):
+			return (v + 2**31) % 2**32 - 2**31
+		for level in self.levels():
+			gapbuffer.set_simd(level)
+			for gap in (0, 5, 37, len(values)):
+				for operation, model in (
+					(lambda x: x.increment(3, 290, 7), lambda v: wrap(v + 7)),
+					(lambda x: x.saturating_increment(3, 290, 2**30), lambda v: min(v + 2**30, 2**31 - 1)),
+					(lambda x: x.saturating_increment(3, 290, -2**30), lambda v: max(v - 2**30, -2**31)),
+					(lambda x: x.multiply_add(3, 290, -3, 5), lambda v: wrap(v * -3 + 5))):
+					x = GapBuffer(values)
+					x.insert(gap, [0])
+					del x[gap]
+					operation(x)
+					expected = values[:3] + [model(v) for v in values[3:293]] + values[293:]
+					self.assertEquals(list(x[:]), expected, level)
+
+	def testUnicode(self):
+		text = u("abcdefghij") * 20
+		for level in self.levels():
+			gapbuffer.set_simd(level)
+			x = GapBuffer(text)
+			x.insert(17, u("!"))
+			del x[17]
+			x.saturating_increment(0, 200, -200)
+			self.assertEquals(r(x), u("\0") * 200)
+			x.multiply_add(0, 200, 5, 0x41)
+			self.assertEquals(r(x), u("A") * 200)
+
+	def testSelection(self):
+		self.assert_(gapbuffer.simd() in self.levels())
+		gapbuffer.set_simd("scalar")
+		self.assertEquals(gapbuffer.simd(), "scalar")
+		self.assertRaises(ValueError, gapbuffer.set_simd, "neon")
+
+class TestLines(unittest.TestCase):
+
+	def setUp(self):
+		self.x = GapBuffer(b"one\ntwo\nthree")
+
+	def starts(self):
+		return [self.x.line_start(i) for i in range(self.x.line_count())]
+
+	def testLines(self):
+		self.assertEquals(self.x.line_count(), 3)
+		self.assertEquals(self.starts(), [0, 4, 8])
+		self.assertEquals(self.x.line_from_position(0), 0)
+		self.assertEquals(self.x.line_from_position(4), 1)
+		self.assertEquals(self.x.line_from_position(7), 1)
+		self.assertEquals(self.x.line_from_position(13), 2)
+		self.assertEquals(self.x.retrieve_line(1), b"two\n")
+		self.assertEquals(self.x.retrieve_line(2), b"three")
+
+	def testEdits(self):
+		self.x.track_lines()
+		self.x.insert(5, b"a\nb\n")
+		self.assertEquals(self.starts(), [0, 4, 7, 9, 12])
+		self.assertEquals(self.x.retrieve_line(2), b"b\n")
+		del self.x[2:8]
+		self.assertEquals(r(self.x), b"on\nwo\nthree")
+		self.assertEquals(self.starts(), [0, 3, 6])
+		self.x[:] = b"\n\n"
+		self.assertEquals(self.starts(), [0, 1, 2])
+		self.assertEquals(self.x.retrieve_line(2), b"")
+		del self.x[:]
+		self.assertEquals(self.starts(), [0])
+
+	def testIncrement(self):
+		self.x.track_lines()
+		self.x.increment(3, 1, ord(" ") - ord("\n"))
+		self.assertEquals(self.starts(), [0, 8])
+		self.x.increment(1, 1, ord("\n") - ord("n"))
+		self.assertEquals(self.starts(), [0, 2, 8])
+
+	def testUnicode(self):
+		x = GapBuffer(u("ру\nс\n"))
+		x.insert(1, u("\nс"))
+		self.assertEquals(x.line_count(), 4)
+		self.assertEquals(x.retrieve_line(1), u("су\n"))
+		self.assertEquals(x.line_from_position(len(x)), 3)
+
+	def testStop(self):
+		self.x.track_lines(False)
+		self.x.insert(0, b"\n")
+		self.assertEquals(self.x.line_count(), 4)
+
+	def testErrors(self):
+		self.assertRaises(IndexError, self.x.line_start, 3)
+		self.assertRaises(IndexError, self.x.retrieve_line, -1)
+		self.assertRaises(IndexError, self.x.line_from_position, 14)
+		self.assertRaises(TypeError, GapBuffer([1, 2]).line_count)
+
+class TestEdits(unittest.TestCase):
+
+	def setUp(self):
+		self.x = GapBuffer(b"one two three")
+
+	def testApply(self):
+		self.x.apply_edits([(8, 5, b"3"), (0, 3, b"1"), (4, 0, b"(2) ")])
+		self.assertEquals(r(self.x), b"1 (2) two 3")
+
+	def testSamePosition(self):
+		self.x.apply_edits([(0, 0, b"a"), (0, 0, b"b"), (0, 3, b"c")])
+		self.assertEquals(r(self.x), b"abc two three")
+
+	def testLines(self):
+		self.x.track_lines()
+		self.x.apply_edits([(3, 1, b"\n"), (7, 1, b"\n\n")])
+		self.assertEquals(r(self.x), b"one\ntwo\n\nthree")
+		self.assertEquals(self.x.line_count(), 4)
+		self.assertEquals(self.x.line_start(3), 9)
+
+	def testTypes(self):
+		x = GapBuffer([1, 2, 3])
+		x.apply_edits([(1, 1, [7, 8]), (3, 0, 9)])
+		self.assertEquals(list(x[:]), [1, 7, 8, 3, 9])
+		x = GapBuffer(u("ру"))
+		x.apply_edits([(1, 0, u("с"))])
+		self.assertEquals(r(x), u("рсу"))
+
+	def testReplace(self):
+		self.assertEquals(self.x.replace(b"e", b"E"), 3)
+		self.assertEquals(r(self.x), b"onE two thrEE")
+		self.assertEquals(self.x.replace(b"E", b"", 2), 2)
+		self.assertEquals(r(self.x), b"on two thrE")
+		self.assertEquals(self.x.replace(b"o", b"[o]"), 2)
+		self.assertEquals(r(self.x), b"[o]n tw[o] thrE")
+		self.assertEquals(self.x.replace(b"z", b"zz"), 0)
+		x = GapBuffer(b"ab")
+		x.replace(b"", b"-")
+		self.assertEquals(r(x), b"-a-b-")
+
+	def testReplaceAroundGap(self):
+		for position in range(len(r(self.x)) + 1):
+			for after in (b"", b"E", b"<e>"):
+				x = GapBuffer(b"one two three")
+				x.insert(position, b"!")
+				del x[position]
+				s = x.snapshot()
+				self.assertEquals(x.replace(b"e t", after), 1)
+				x.replace(b"e", after)
+				self.assertEquals(r(x), b"one two three".replace(b"e t", after).replace(b"e", after))
+				self.assertEquals(s.retrieve(0, len(s)), b"one two three")
+
+	def testReplaceUnicode(self):
+		x = GapBuffer(u("русский"))
+		x.insert(3, u("!"))
+		del x[3]
+		self.assertEquals(x.replace(u("с"), u("ss")), 2)
+		self.assertEquals(r(x), u("руssssкий"))
+		self.assertRaises(TypeError, x.replace, b"s", b"t")
+
+	def testReplaceLines(self):
+		self.x.track_lines()
+		self.x.replace(b" ", b"\n")
+		self.assertEquals(self.x.line_count(), 3)
+		self.assertEquals(self.x.line_start(2), 8)
+
+	def testErrors(self):
+		self.assertRaises(ValueError, self.x.apply_edits, [(0, 3, b""), (2, 0, b"x")])
+		self.assertRaises(IndexError, self.x.apply_edits, [(10, 5, b"")])
+		self.assertRaises(TypeError, self.x.apply_edits, [(0, 0, u("x"))])
+		self.assertRaises(TypeError, self.x.apply_edits, [(0, 0)])
+		self.assertEquals(r(self.x), b"one two three")
+
+class TestUndo(unittest.TestCase):
+
+	def setUp(self):
+		self.x = GapBuffer(b"hello")
+		self.x.track_undo()
+
+	def testTyping(self):
+		for c in (b"a", b"b", b"c"):
+			self.x.insert(len(self.x), c)
+		self.x.insert(0, b"Z")
+		del self.x[len(self.x) - 1]
+		del self.x[len(self.x) - 1]
+		self.assertEquals(r(self.x), b"Zhelloa")
+		self.assertEquals(self.x.undo(), True)
+		self.assertEquals(r(self.x), b"Zhelloabc")
+		self.x.undo()
+		self.assertEquals(r(self.x), b"helloabc")
+		self.x.undo()
+		self.assertEquals(r(self.x), b"hello")
+		self.assertEquals(self.x.undo(), False)
+		self.assertEquals(self.x.can_redo(), True)
+		self.x.redo()
+		self.assertEquals(r(self.x), b"helloabc")
+
+	def testGroup(self):
+		self.x.begin_group()
+		self.x.insert(0, b"<")
+		self.x.insert(len(self.x), b">")
+		self.x.end_group()
+		self.x[1:3] = b"J"
+		self.assertEquals(r(self.x), b"<Jllo>")
+		self.x.undo()
+		self.assertEquals(r(self.x), b"<hello>")
+		self.x.undo()
+		self.assertEquals(r(self.x), b"hello")
+		self.x.redo()
+		self.assertEquals(r(self.x), b"<hello>")
+		self.x.insert(0, b"!")
+		self.assertEquals(self.x.can_redo(), False)
+
+	def testReplace(self):
+		self.x.replace(b"l", b"LL")
+		self.x.increment(0, 1, 1)
+		self.x.apply_edits([(0, 1, b"J"), (3, 1, b"")])
+		self.x.undo()
+		self.assertEquals(r(self.x), b"ieLLLLo")
+		self.x.undo()
+		self.x.undo()
+		self.assertEquals(r(self.x), b"hello")
+
+	def testLimit(self):
+		self.x.track_undo(True, 10000)
+		for i in range(5000):
+			self.x.insert(0, b"ab")
+		steps = 0
+		while self.x.undo():
+			steps += 1
+		self.assert_(0 < steps < 5000)
+		self.assertEquals(len(self.x), 5 + 2 * (5000 - steps))
+
+	def testUnicode(self):
+		x = GapBuffer(u("рус"))
+		x.track_undo()
+		del x[2]
+		del x[1]
+		x.insert(1, u("ский"))
+		x.undo()
+		self.assertEquals(r(x), u("р"))
+		x.undo()
+		self.assertEquals(r(x), u("рус"))
+
+	def testErrors(self):
+		self.assertRaises(ValueError, GapBuffer(b"").undo)
+		self.assertRaises(ValueError, self.x.end_group)
+		self.assertRaises(TypeError, GapBuffer([1]).track_undo)
+		self.x.track_undo(False)
+		self.assertEquals(self.x.can_undo(), False)
+
+class TestSnapshot(unittest.TestCase):
+
+	def setUp(self):
+		self.x = GapBuffer(b"hello world")
+
+	def testUnchanged(self):
+		s = self.x.snapshot()
+		self.x.insert(5, b",")
+		del self.x[0]
+		self.x.replace(b"o", b"0")
+		self.x.increment(0, 2, 1)
+		self.assertEquals(r(self.x), b"fml0, w0rld")
+		self.assertEquals(len(s), 11)
+		self.assertEquals(s.retrieve(0, 11), b"hello world")
+		self.assertEquals(s[4], b"o")
+		self.assertEquals(s.detached, False)
+
+	def testLarge(self):
+		text = b"abcdefghij" * 30000
+		x = GapBuffer(text)
+		s = x.snapshot()
+		x.insert(150000, b"X")
+		x.insert(10, b"Y")
+		self.assertEquals(s.retrieve(0, len(s)), text)
+		self.assertEquals(r(s.copy()), text)
+
+	def testDetach(self):
+		s = self.x.snapshot()
+		for i in range(1000):
+			self.x.insert(0, b"grow")
+		self.assertEquals(s.detached, True)
+		self.assertEquals(s.retrieve(0, 5), b"hello")
+
+	@unittest.skipIf(sys.version_info[0] < 3, "memoryview requires Python 3")
+	def testExport(self):
+		s = self.x.snapshot()
+		m = memoryview(self.x).cast("B")
+		m[0] = ord("J")
+		m.release()
+		self.assertEquals(s.detached, True)
+		self.assertEquals(s.retrieve(0, 5), b"hello")
+
+	def testTypes(self):
+		x = GapBuffer(u("рус"))
+		s = x.snapshot()
+		x[0:1] = u("Р")
+		self.assertEquals(s.retrieve(0, 3), u("рус"))
+		x = GapBuffer([1, 2, 3])
+		s = x.snapshot()
+		x[1] = 7
+		self.assertEquals(s[1], 2)
+		self.assertRaises(TypeError, s.retrieve, 0, 1)
+		self.assertRaises(IndexError, s.__getitem__, 3)
+
+	def testView(self):
+		v = self.x.view(6, 11)
+		self.assertEquals(v.retrieve(0, len(v)), b"world")
+		self.x.insert(0, b">> ")
+		self.x[9:14] = b"there"
+		self.assertEquals(r(self.x), b">> hello there")
+		self.assertEquals(v.retrieve(0, 5), b"world")
+		self.assertEquals(self.x.view(-5).retrieve(0, 5), b"there")
+		self.assertEquals(len(self.x.view(5, 2)), 0)
+		x = GapBuffer(b"abcdefghij" * 30000, backend="chunked")
+		v = x.view(10, 20)
+		x.insert(15, b"X")
+		self.assertEquals(v.detached, True)
+		self.assertEquals(v.retrieve(0, 10), b"abcdefghij")
+		self.assertEquals(x.chunked, 1)
+
+	def testNegative(self):
+		x = GapBuffer([1, 2, 3, 4], typecode="i")
+		self.assertEquals(list(x[-2:]), [3, 4])
+		self.assertEquals(x[-1], 4)
+		x[-1] = 7
+		del x[-3:-1]
+		self.assertEquals(list(x), [1, 7])
+		self.assertEquals(r(GapBuffer(u("рус"))[-2:]), u("ус"))
+
+class TestThreads(unittest.TestCase):
+
+	# Large enough that moves and copies run without the GIL
+	pattern = b"abcdefgh" * 65536
+
+	def run_all(self, targets):
+		workers = [threading.Thread(target=target) for target in targets]
+		for worker in workers:
+			worker.start()
+		for worker in workers:
+			worker.join()
+
+	def testSeparate(self):
+		buffers = [GapBuffer(self.pattern) for i in range(4)]
+		def edit(x):
+			for i in range(50):
+				x.insert(0 if i % 2 else len(x), b"x")
+		self.run_all([lambda x=x: edit(x) for x in buffers])
+		for x in buffers:
+			self.assertEquals(len(x), len(self.pattern) + 50)
+			self.assertEquals(r(x), b"x" * 25 + self.pattern + b"x" * 25)
+
+	def testReaders(self):
+		x = GapBuffer(self.pattern)
+		length = len(self.pattern)
+		failures = []
+		def write():
+			for i in range(100):
+				position = 8 if i % 2 else length - 8
+				x.insert(position, b"x")
+				del x[position]
+		def read():
+			for i in range(50):
+				text = x.retrieve(0, length)
+				if not self.pattern.startswith(text.replace(b"x", b"", 1)):
+					failures.append("retrieve")
+				# An x inserted at 8 but not yet deleted moves the first match
+				if x.find(b"habc") not in (7, 16):
+					failures.append("find")
+		self.run_all([write, read, read])
+		self.assertEquals(failures, [])
+		self.assertEquals(r(x), self.pattern)
+
+	def testWriterNotStarved(self):
+		# Readers that always overlap must still let a writer in
+		x = GapBuffer(self.pattern * 16)
+		stop = []
+		def read():
+			while not stop:
+				x.retrieve(0, len(x))
+		readers = [threading.Thread(target=read) for i in range(2)]
+		for reader in readers:
+			reader.start()
+		writer = threading.Thread(target=lambda: x.insert(5, b"x"))
+		writer.start()
+		writer.join(10)
+		finished = not writer.is_alive()
+		stop.append(True)
+		for reader in readers:
+			reader.join()
+		writer.join()
+		self.assert_(finished)
+		self.assertEquals(x[5], b"x")
+
+class TestChunked(unittest.TestCase):
+
+	def setUp(self):
+		self.text = b"".join([("%05d " % i).encode("ascii") for i in range(20000)])
+		self.x = GapBuffer(self.text, backend="chunked")
+
+	def testEdits(self):
+		self.assertEquals(self.x.chunked, 1)
+		self.assertEquals(GapBuffer(b"").chunked, 0)
+		text = self.text
+		for position in (0, 60000, 4095, 100000, 33333):
+			self.x.insert(position, b"inserted" * 1000)
+			text = text[:position] + b"inserted" * 1000 + text[position:]
+			del self.x[position + 10:position + 9000]
+			text = text[:position + 10] + text[position + 9000:]
+		self.assertEquals(len(self.x), len(text))
+		self.assertEquals(r(self.x), text)
+		self.assertEquals(self.x[len(text) - 1], text[-1:])
+		self.assertEquals(self.x.retrieve(5000, 20000), text[5000:25000])
+		del self.x[0:len(self.x)]
+		self.assertEquals(r(self.x), b"")
+		self.x.insert(0, b"again")
+		self.assertEquals(r(self.x), b"again")
+
+	def testSearch(self):
+		# Needles spanning chunk boundaries are found
+		for needle in (b"00681 00682", b"19999 ", b"00000"):
+			self.assertEquals(self.x.find(needle), self.text.find(needle))
+			self.assertEquals(self.x.rfind(needle), self.text.rfind(needle))
+		self.assertEquals(self.x.count(b"0 "), self.text.count(b"0 "))
+
+	def testWhole(self):
+		self.x.insert(50000, b"XYZ")
+		text = self.text[:50000] + b"XYZ" + self.text[50000:]
+		s = self.x.snapshot()
+		self.x.insert(0, b"more")
+		self.assertEquals(s.retrieve(0, len(s)), text)
+		self.assertEquals(self.x.replace(b"XYZ", b"Q"), 1)
+		self.assertEquals(r(self.x), b"more" + text.replace(b"XYZ", b"Q"))
+		# Neither gathers the chunks into a body
+		self.assertEquals(self.x.size, 0)
+
+	@unittest.skipIf(sys.version_info[0] < 3, "segments requires Python 3")
+	def testSegments(self):
+		self.x.insert(50000, b"XYZ")
+		segments = self.x.segments()
+		self.assert_(len(segments) > 2)
+		self.assertEquals(b"".join(bytes(segment) for segment in segments),
+			self.text[:50000] + b"XYZ" + self.text[50000:])
+		self.assertRaises(BufferError, self.x.insert, 0, b"more")
+		for segment in segments:
+			segment.release()
+		self.x.insert(0, b"more")
+		self.assertEquals(self.x.size, 0)
+
+	@unittest.skipIf(sys.version_info[0] < 3, "memoryview requires Python 3")
+	def testExport(self):
+		self.x.insert(50000, b"XYZ")
+		self.assertEquals(bytes(memoryview(self.x)), self.text[:50000] + b"XYZ" + self.text[50000:])
+		self.x.insert(0, b"more")
+		self.assertEquals(self.x.retrieve(0, 8), b"more0000")
+
+	def testTypes(self):
+		x = GapBuffer(list(range(5000)), backend="chunked")
+		x.increment(1000, 4000, 2)
+		del x[0:1000]
+		self.assertEquals(x[0], 1002)
+		self.assertEquals(x[3999], 5001)
+		y = GapBuffer(u("ру") * 5000, backend="chunked")
+		y.insert(5000, u("с"))
+		self.assertEquals(y.retrieve(4999, 3), u("уср"))
+
+	def testBadBackend(self):
+		self.assertRaises(ValueError, GapBuffer, b"", backend="rope")
+
+class TestFiles(unittest.TestCase):
+
+	text = b"one line of a log\n" * 10000
+
+	def setUp(self):
+		fd, self.path = tempfile.mkstemp()
+		os.write(fd, self.text)
+		os.close(fd)
+
+	def tearDown(self):
+		os.remove(self.path)
+
+	def testLoad(self):
+		x = GapBuffer.from_file(self.path)
+		self.assertEquals(x.typecode, "c")
+		self.assertEquals(len(x), len(self.text))
+		self.assertEquals(x.part1Length, 0)
+		self.assertEquals(r(x), self.text)
+		x.insert(0, b"first\n")
+		x.insert(len(x), b"last\n")
+		self.assertEquals(r(x), b"first\n" + self.text + b"last\n")
+
+	def testSave(self):
+		# Saving over the file the buffer was loaded from
+		x = GapBuffer.from_file(self.path)
+		x.insert(4, b"more ")
+		self.assertEquals(x.save(self.path), len(self.text) + 5)
+		self.assertEquals(x.part1Length, 9)
+		expected = b"one more " + self.text[4:]
+		self.assertEquals(r(x), expected)
+		with open(self.path, "rb") as f:
+			self.assertEquals(f.read(), expected)
+		self.assertEquals(os.listdir(os.path.dirname(self.path)).count(
+			os.path.basename(self.path) + ".%d.tmp" % os.getpid()), 0)
+
+	def testRead(self):
+		x = GapBuffer.from_file(self.path, map=False)
+		self.assertEquals(x.mapped, 0)
+		# Later writes to the file do not show through
+		with open(self.path, "r+b") as f:
+			f.write(b"B" * 10)
+			f.truncate(20)
+		self.assertEquals(r(x), self.text)
+
+	def testEmpty(self):
+		with open(self.path, "wb") as f:
+			pass
+		x = GapBuffer.from_file(self.path)
+		self.assertEquals(len(x), 0)
+		x.insert(0, b"a")
+		self.assertEquals(r(x), b"a")
+
+	def testMissing(self):
+		self.assertRaises(OSError, GapBuffer.from_file, self.path + ".missing")
+		self.assertRaises(OSError, GapBuffer(b"a").save, os.path.join(self.path, "child"))
+
+class TestCompact(unittest.TestCase):
+
+	def testWiden(self):
+		x = GapBuffer(u("abc"), compact=True)
+		self.assertEquals(x.compact, 1)
+		self.assertEquals(x.itemsize, 1)
+		x.insert(1, u("é"))
+		self.assertEquals(x.itemsize, 1)
+		x.insert(0, u("Ж"))
+		self.assertEquals(x.itemsize, 2)
+		x[2:3] = u("中")
+		self.assertEquals(r(x), u("Жa中bc"))
+		self.assertEquals(x[2], u("中"))
+		self.assertEquals(x.retrieve(1, 2), u("a中"))
+		self.assertEquals(x.find(u("b")), 3)
+
+	def testSearch(self):
+		# Characters wider than the items can not be present
+		x = GapBuffer(u("abcabc"), compact=True)
+		self.assertEquals(x.find(u("中")), -1)
+		self.assertEquals(x.count(u("中")), 0)
+		self.assertEquals(x.replace(u("中"), u("x")), 0)
+		self.assertEquals(x.itemsize, 1)
+		self.assertEquals(x.replace(u("b"), u("中")), 2)
+		self.assertEquals(x.itemsize, 2)
+		self.assertEquals(r(x), u("a中ca中c"))
+
+	def testUndo(self):
+		x = GapBuffer(u("one"), compact=True)
+		x.track_undo()
+		x.insert(3, u(" two"))
+		view = x.snapshot()
+		x.insert(0, u("中"))
+		self.assertEquals(r(view), u("one two"))
+		x.undo()
+		x.undo()
+		self.assertEquals(r(x), u("one"))
+		x.redo()
+		x.redo()
+		self.assertEquals(r(x), u("中one two"))
+
+	def testMixed(self):
+		x = GapBuffer(u("ab"), compact=True)
+		y = GapBuffer(u("中"))
+		self.assertEquals(r(x + y), u("ab中"))
+		x[1:1] = y
+		self.assertEquals(r(x), u("a中b"))
+		self.assertRaises(ValueError, GapBuffer, b"ab", compact=True)
+		self.assertEquals(GapBuffer(compact=True).typecode, "u")
+
+class TestUtf8(unittest.TestCase):
+
+	text = u("aé中😀 plain ascii text that is long enough for the wide kernels\n") * 50
+
+	def testSplit(self):
+		# Feeding any split of the bytes gives the same text
+		data = self.text.encode("utf-8")
+		for size in (1, 2, 3, 5, 64, len(data)):
+			x = GapBuffer(u(""))
+			for i in range(0, len(data), size):
+				x.feed_utf8(data[i:i+size])
+			x.feed_utf8(b"", True)
+			self.assertEquals(r(x), self.text)
+
+	def testChunked(self):
+		x = GapBuffer(u("start "), backend="chunked")
+		x.feed_utf8(self.text.encode("utf-8"))
+		self.assertEquals(r(x), u("start ") + self.text)
+
+	def testInvalid(self):
+		x = GapBuffer(u("ab"))
+		for data in (b"\xff", b"\xc0\x80", b"\xed\xa0\x80", b"\xf4\x90\x80\x80", b"c\x80"):
+			self.assertRaises(UnicodeDecodeError, x.feed_utf8, data)
+		self.assertEquals(r(x), u("ab"))
+		# A split sequence is held over until the rest arrives
+		x.feed_utf8(b"\xe4\xb8")
+		self.assertEquals(r(x), u("ab"))
+		self.assertRaises(UnicodeDecodeError, x.feed_utf8, b"", True)
+		x.feed_utf8(b"\xad!")
+		self.assertEquals(r(x), u("ab中!"))
+		self.assertRaises(TypeError, GapBuffer(b"").feed_utf8, b"a")
+
+	def testUndo(self):
+		x = GapBuffer(u(""))
+		x.track_undo()
+		x.track_lines()
+		x.feed_utf8(u("one\ntwo\né").encode("utf-8"))
+		self.assertEquals(x.line_count(), 3)
+		x.undo()
+		self.assertEquals(r(x), u(""))
+
+class TestTypes(unittest.TestCase):
+
+	levels = TestKernels.__dict__["levels"]
+
+	def tearDown(self):
+		gapbuffer.set_simd("best")
+
+	def testRange(self):
+		x = GapBuffer([2**40, -2**63, 2**63 - 1], typecode="q")
+		self.assertEquals(list(x[:]), [2**40, -2**63, 2**63 - 1])
+		self.assertEquals(x.itemsize, 8)
+		self.assertEquals(x.sum(), 2**40 - 1)
+		x[0] = 2**62
+		self.assertEquals(x[0], 2**62)
+		self.assertEquals(x.find(2**63 - 1), 2)
+		self.assertEquals(x.find(2**63), -1)
+		self.assertRaises(OverflowError, x.insert, 0, [2**63])
+		self.assertRaises(OverflowError, GapBuffer, [256], typecode="B")
+		self.assertRaises(OverflowError, GapBuffer, [-1], typecode="H")
+		self.assertRaises(TypeError, GapBuffer, [1.5], typecode="i")
+		self.assertRaises(ValueError, GapBuffer, [1], typecode="x")
+		self.assertEquals(GapBuffer([2**64 - 1] * 3, typecode="Q").sum(), 3 * (2**64 - 1))
+		self.assertEquals(GapBuffer(typecode="h").typecode, "h")
+
+	def testKernels(self):
+		for level in self.levels():
+			gapbuffer.set_simd(level)
+			for typecode, low, high in (("b", -2**7, 2**7 - 1), ("B", 0, 2**8 - 1),
+				("h", -2**15, 2**15 - 1), ("H", 0, 2**16 - 1), ("I", 0, 2**32 - 1),
+				("q", -2**63, 2**63 - 1), ("Q", 0, 2**64 - 1)):
+				span = high - low + 1
+				values = [low + (i * 2654435761) % span for i in range(100)]
+				def wrap(v):
+					return low + (v - low) % span
+				x = GapBuffer(values, typecode=typecode)
+				x.insert(37, [0])
+				del x[37]
+				x.increment(3, 90, span + 5)
+				self.assertEquals(list(x[:]), values[:3] + [wrap(v + 5) for v in values[3:93]] + values[93:], typecode)
+				x = GapBuffer(values, typecode=typecode)
+				x.saturating_increment(0, 100, -2**40)
+				self.assertEquals(list(x[:]), [low] * 100, typecode)
+				x.saturating_increment(0, 50, 3)
+				self.assertEquals(x.sum(), 50 * (low + 3) + 50 * low, typecode)
+				x = GapBuffer(values, typecode=typecode)
+				x.multiply_add(0, 100, 3, -1)
+				self.assertEquals(list(x[:]), [wrap(v * 3 - 1) for v in values], typecode)
+				x.fill(0, 10, low)
+				x.fill(10, 80, high)
+				self.assertEquals(x.find(high), 10, typecode)
+				self.assertEquals(x.sum(10, 80), 80 * high, typecode)
+
+	def testFloat(self):
+		for level in self.levels():
+			gapbuffer.set_simd(level)
+			for typecode in ("f", "d"):
+				x = GapBuffer([0.5 * i for i in range(40)], typecode=typecode)
+				x.multiply_add(0, 40, 2, 0.25)
+				self.assertEquals(x[3], 3.25)
+				x.increment(0, 40, 1)
+				self.assertEquals(x.sum(), sum([i + 1.25 for i in range(40)]))
+				x.fill(0, 2, -1.5)
+				self.assertEquals(list(x[:3]), [-1.5, -1.5, 3.25])
+				self.assertEquals(x.find(3.25), 2)
+				self.assertRaises(TypeError, x.saturating_increment, 0, 1, 1)
+				self.assertRaises(TypeError, x.set_partitioned, True)
+
+	@unittest.skipIf(sys.version_info[0] < 3, "memoryview requires Python 3")
+	def testFormat(self):
+		import array, struct
+		for typecode in "bBhHiIlLqQfd":
+			x = GapBuffer([1, 2, 3], typecode=typecode)
+			m = memoryview(x)
+			self.assertEquals(m.format, typecode)
+			self.assertEquals(m.itemsize, struct.calcsize(typecode))
+			self.assertEquals(bytes(m), array.array(typecode, [1, 2, 3]).tobytes())
+			m.release()
+		m = memoryview(GapBuffer(u("ab"), compact=True))
+		self.assertEquals(m.tolist(), [97, 98])
+		m.release()
+
+	def testIngest(self):
+		import array
+		values = array.array("h", [-5, 0, 7, 300])
+		x = GapBuffer(values, typecode="h")
+		x.extend(values)
+		x.insert(1, GapBuffer([1, 2], typecode="h"))
+		self.assertEquals(list(x[:]), [-5, 1, 2, 0, 7, 300, -5, 0, 7, 300])
+		x.extend(x)
+		self.assertEquals(len(x), 20)
+		# Other item types are converted one at a time
+		x = GapBuffer(array.array("d", [1.0, 2.0]), typecode="f")
+		self.assertEquals(list(x[:]), [1.0, 2.0])
+		self.assertRaises(OverflowError, GapBuffer, array.array("i", [1, -1]), typecode="I")
+		x = GapBuffer((i * i for i in range(5)), typecode="B")
+		self.assertEquals(list(x[:]), [0, 1, 4, 9, 16])
+
+	def testPartitioned(self):
+		x = GapBuffer([0, 10, 20, 30], typecode="q")
+		x.set_partitioned(True)
+		x.increment(2, 2, 2**40)
+		self.assertEquals(list(x[:]), [0, 10, 2**40 + 20, 2**40 + 30])
+		x[3] = 7
+		self.assertEquals(x[3], 7)
+		self.assertEquals(x.sum(), 2**40 + 37)
+
+class TestExport(unittest.TestCase):
+
+	def testIter(self):
+		x = GapBuffer([5, 6, 7, 8])
+		x.insert(2, [0])
+		self.assertEquals([v for v in x], [5, 6, 0, 7, 8])
+		x.set_partitioned(True)
+		x.increment(3, 2, 10)
+		self.assertEquals(list(x), [5, 6, 0, 17, 18])
+		self.assertEquals(list(GapBuffer(b"ab")), [b"a", b"b"])
+		self.assertEquals(list(GapBuffer(u("a中"), compact=True)), [u("a"), u("中")])
+		# Items added while iterating are reached
+		seen = []
+		for v in x:
+			seen.append(v)
+			if len(seen) == 1:
+				x.extend([1])
+		self.assertEquals(seen, [5, 6, 0, 17, 18, 1])
+
+	def testChunks(self):
+		x = GapBuffer(u("abcdefg"), backend="chunked")
+		self.assertEquals(list(x.iter_chunks(3)), [u("abc"), u("def"), u("g")])
+		x = GapBuffer(list(range(5)), typecode="q")
+		self.assertEquals(list(x.iter_chunks(2)), [[0, 1], [2, 3], [4]])
+		self.assertRaises(ValueError, x.iter_chunks, 0)
+
+	def testExport(self):
+		import array
+		values = array.array("h", range(-100, 100))
+		x = GapBuffer(values, typecode="h")
+		x.insert(50, [1])
+		del x[50]
+		self.assertEquals(x.tolist(), values.tolist())
+		self.assertEquals(x.to_array(), values)
+		self.assertEquals(x.tobytes(), values.tostring() if sys.version_info[0] < 3 else values.tobytes())
+		self.assertEquals(GapBuffer(b"ab").to_array(), array.array("B", [97, 98]))
+		self.assertEquals(GapBuffer(u("ab")).tolist(), [u("a"), u("b")])
+
+class TestCompare(unittest.TestCase):
+
+	def testObjects(self):
+		x = GapBuffer(b"hello world")
+		x.insert(5, b",")
+		self.assert_(x == b"hello, world")
+		self.assert_(b"hello, world" == x)
+		self.assert_(x != b"hello world")
+		self.assert_(x < b"hello,!")
+		self.assert_(x == bytearray(b"hello, world"))
+		self.assert_(x != None)
+		y = GapBuffer(u("рус"), compact=True)
+		self.assert_(y == u("рус"))
+		self.assert_(y < u("русский"))
+		self.assert_(y > u("ab"))
+		self.assert_(y == GapBuffer(u("рус")))
+		self.assert_(y != x)
+		if sys.version_info[0] >= 3:
+			self.assert_(x != u("hello, world"))
+			self.assertRaises(TypeError, lambda: x < None)
+
+	def testNumbers(self):
+		import array
+		# Ordered by value, not by the bytes of little-endian items
+		self.assert_(GapBuffer([256], typecode="i") > GapBuffer([1], typecode="i"))
+		self.assert_(GapBuffer([-1], typecode="q") < GapBuffer([0], typecode="q"))
+		self.assert_(GapBuffer([1, 2], typecode="b") == GapBuffer([1, 2], typecode="d"))
+		self.assert_(GapBuffer([300], typecode="H") > GapBuffer([-5, 7], typecode="b"))
+		nan = float("nan")
+		x = GapBuffer([1.0, nan], typecode="d")
+		self.assert_(x != x)
+		self.assert_(not (x < x))
+		self.assert_(GapBuffer([0.0], typecode="d") == GapBuffer([-0.0], typecode="d"))
+		if sys.version_info[0] >= 3:
+			self.assert_(GapBuffer([1, 2, 3], typecode="i") == array.array("i", [1, 2, 3]))
+			self.assert_(GapBuffer([1, 2, 3], typecode="i") < array.array("h", [1, 3]))
+
+	def testHash(self):
+		text = b"abcdefghij" * 1000
+		x = GapBuffer(text)
+		h = x.content_hash()
+		x.insert(4321, b"X")
+		self.assertNotEqual(x.content_hash(), h)
+		del x[4321]
+		self.assertEquals(x.content_hash(), h)
+		self.assertEquals(GapBuffer(text, backend="chunked").content_hash(), h)
+		self.assertNotEqual(GapBuffer(text[:-1]).content_hash(), h)
+		self.assertEquals(GapBuffer(u("abc"), compact=True).content_hash(),
+			GapBuffer(u("abc")).content_hash())
+
+class TestRunStyles(unittest.TestCase):
+
+	def values(self, styles):
+		return [styles.value_at(i) for i in range(len(styles))]
+
+	def testFill(self):
+		x = gapbuffer.RunStyles(10)
+		self.assertEquals(x.runs, 1)
+		self.assertEquals(x.fill_range(2, 3, 1), (2, 3))
+		self.assertEquals(x.fill_range(3, 1, 1), None)
+		self.assertEquals(x.find_run(3), (2, 5, 1))
+		self.assertEquals(x.find_run(9), (5, 10, 0))
+		self.assertEquals(x.fill_range(4, 6, 1), (5, 5))
+		self.assertEquals(x.runs, 2)
+		self.assertEquals(self.values(x), [0, 0] + [1] * 8)
+		x.fill_range(0, 10, 2)
+		self.assertEquals(x.runs, 1)
+		self.assertRaises(IndexError, x.fill_range, 5, 6, 1)
+		self.assertRaises(IndexError, x.value_at, 11)
+
+	def testShift(self):
+		x = gapbuffer.RunStyles(6, 7)
+		x.fill_range(2, 2, 1)
+		x.insert_space(4, 3)
+		self.assertEquals(self.values(x), [7, 7, 1, 1, 1, 1, 1, 7, 7])
+		x.insert_space(0, 1)
+		self.assertEquals(x.find_run(0), (0, 3, 7))
+		x.delete_range(2, 6)
+		self.assertEquals(self.values(x), [7, 7, 7, 7])
+		self.assertEquals(x.runs, 1)
+
+	def testTracking(self):
+		x = GapBuffer(b"one two three")
+		x.track_styles()
+		styles = x.styles
+		styles.fill_range(4, 3, 5)
+		x.insert(6, b"oo")
+		self.assertEquals(styles.find_run(4), (4, 9, 5))
+		del x[0:5]
+		self.assertEquals(styles.find_run(0), (0, 4, 5))
+		self.assertEquals(x.replace(b"e", b"EE"), 2)
+		self.assertEquals(len(styles), len(x))
+		self.assertEquals(self.values(styles), [5] * 4 + [0] * 8)
+		self.assertRaises(ValueError, styles.delete_range, 0, len(styles))
+		self.assertRaises(ValueError, styles.insert_space, 0, 1)
+		x.track_styles(False)
+		self.assertEquals(x.styles, None)
+		styles.delete_range(0, 1)
+		self.assertEquals(len(styles), len(x) - 1)
+
+	def testModel(self):
+		import random
+		rand = random.Random(23)
+		x = GapBuffer(u("один два"), backend="chunked")
+		x.track_styles()
+		model = [0] * len(x)
+		for i in range(500):
+			position = rand.randrange(len(x) + 1)
+			length = rand.randrange(len(x) - position + 1)
+			choice = rand.randrange(3)
+			if choice == 0:
+				value = rand.randrange(3)
+				x.styles.fill_range(position, length, value)
+				model[position:position + length] = [value] * length
+			elif choice == 1:
+				value = model[position - 1] if position else x.styles.value_at(0)
+				x.insert(position, u("ab"))
+				model[position:position] = [value] * 2
+			else:
+				del x[position:position + length]
+				del model[position:position + length]
+			self.assertEquals(self.values(x.styles), model)
+
+class TestStats(unittest.TestCase):
+
+	def testCounts(self):
+		x = GapBuffer(b"0123456789" * 1000)
+		self.assertRaises(ValueError, x.stats)
+		x.track_stats()
+		x.insert(10, b"ab")
+		x.insert(20, b"cd")
+		stats = x.stats()
+		self.assertEquals(stats["gap_moves"], 2)
+		self.assertEquals(stats["gap_bytes"], 10000 - 10 + 8)
+		self.assertEquals(stats["peak_size"], x.size)
+		x.reserve(100000)
+		self.assertEquals(x.stats()["reallocations"], 1)
+		self.assert_(x.stats()["peak_size"] >= 100000)
+		x.reset_stats()
+		self.assertEquals(x.stats()["gap_moves"], 0)
+		self.assertEquals(x.stats()["reallocations"], 0)
+		x.track_stats(False)
+		self.assertRaises(ValueError, x.reset_stats)
+
+	@unittest.skipIf(sys.version_info[0] < 3, "memoryview requires Python 3")
+	def testExports(self):
+		x = GapBuffer(b"hello world")
+		x.track_stats()
+		x.insert(5, b",")
+		memoryview(x).release()
+		memoryview(x).release()
+		stats = x.stats()
+		self.assertEquals(stats["exports"], 2)
+		self.assertEquals(stats["export_collapses"], 1)
+
 class TestStringExceptions(unittest.TestCase):
 
 	def setUp(self):
@@ -161,11 +1305,23 @@ class TestStringExceptions(unittest.TestCase):
 		self.x[:] = self.testVal
 		self.assertRaises(TypeError, self.x.insert, 0, 0)
 		self.assertRaises(IndexError, self.x.insert, 100, b"a")
+		self.assertRaises(IndexError, self.x.insert, 2**40, b"a")
 
 	def testIncrement(self):
 		self.x[:] = self.testVal
 		self.assertRaises(TypeError, self.x.increment, 0, 1, b'a')
 		self.assertRaises(IndexError, self.x.increment, 1, 100, 1)
+		self.assertRaises(IndexError, self.x.increment, 1, sys.maxsize, 1)
+
+	def testRepeatOverflow(self):
+		self.x[:] = self.testVal
+		self.assertRaises(OverflowError, lambda: self.x * sys.maxsize)
+
+	def testGrowth(self):
+		self.assertRaises(ValueError, self.x.set_growth, "random")
+		self.assertRaises(ValueError, self.x.set_growth, "geometric", 0.5)
+		self.assertRaises(ValueError, self.x.set_growth, "fixed", 0)
+		self.assertRaises(ValueError, self.x.reserve, -1)
 
 class TestUnicode(unittest.TestCase):
 
@@ -280,6 +1436,20 @@ class TestUnicode(unittest.TestCase):
 		y = r.search(self.x)
 		self.assertEquals(str(y.group(0)), u("bc"))
 
+	def testEditSequence(self):
+		self.x.insert(0, u("lots of tests"))
+		del self.x[5:8]
+		self.assertEquals(self.x.retrieve(2, 6), u("ts tes"))
+		self.assertEquals(str(self.x[2:6]), u("ts t"))
+		self.x[1:3] = u("***")
+		self.assertEquals(r(self.x), u("l***s tests"))
+		removed = self.x[1:4]
+		self.x[1:4] = u("")
+		self.assertEquals(r(self.x), u("ls tests"))
+		self.x[1:1] = removed
+		self.x[2] = u("!")
+		self.assertEquals(r(self.x), u("l*!*s tests"))
+
 	def testRussianRE(self):
 		self.x[:] = u("Палить из пушки по воробьям")
 		rusWord = u("пушки")
@@ -432,6 +1602,60 @@ class TestInteger(unittest.TestCase):
 		self.assertEquals(list(self.x), self.testVal)
 
 
+class TestPartitioned(unittest.TestCase):
+
+	def setUp(self):
+		# Line start positions as an editor would keep them
+		self.x = GapBuffer([0, 10, 20, 30, 40, 50])
+		self.x.set_partitioned(True)
+
+	def testDeferred(self):
+		self.x.increment(3, 3, 5)
+		self.assertEquals(self.x.stepStart, 3)
+		self.assertEquals(self.x.stepLength, 5)
+		self.assertEquals(self.x[2], 20)
+		self.assertEquals(self.x[3], 35)
+		self.x.increment(4, 2, 1)
+		self.assertEquals(self.x.stepStart, 4)
+		self.assertEquals(self.x.stepLength, 6)
+		self.x.increment(1, 5, -2)
+		self.assertEquals(self.x.stepStart, 1)
+		self.assertEquals(self.x.stepLength, 4)
+		self.assertEquals(list(self.x[:]), [0, 8, 18, 33, 44, 54])
+		self.assertEquals(self.x.stepLength, 0)
+
+	def testEdits(self):
+		self.x.increment(2, 4, 100)
+		self.x.insert(4, [1, 2])
+		self.assertEquals(self.x.stepStart, 6)
+		del self.x[0:2]
+		self.assertEquals(self.x.stepStart, 4)
+		self.x[3] = 7
+		self.x[4] = 9
+		self.assertEquals(self.x[4], 9)
+		self.assertEquals(list(self.x[:]), [120, 130, 1, 7, 9, 150])
+
+	def testMiddleIncrement(self):
+		self.x.increment(4, 2, 5)
+		self.x.increment(1, 2, 3)
+		self.assertEquals(self.x.stepStart, 4)
+		self.assertEquals(str(self.x), "GapBuffer('i') [0, 13, 23, 30, 45, 55]")
+
+	def testSettle(self):
+		self.x.increment(2, 4, 1)
+		self.x.set_partitioned(False)
+		self.assertEquals(self.x.stepLength, 0)
+		self.x.increment(2, 4, 1)
+		self.assertEquals(self.x.stepLength, 0)
+		self.assertEquals(list(self.x[:]), [0, 10, 22, 32, 42, 52])
+
+	def testSlice(self):
+		self.x.increment(2, 4, 1)
+		self.assertEquals(self.x[1:4], GapBuffer([10, 21, 31]))
+
+	def testText(self):
+		self.assertRaises(TypeError, GapBuffer(b"abc").set_partitioned, True)
+
 class TestIntegerExceptions(unittest.TestCase):
 
 	def setUp(self):